@@ -4,6 +4,9 @@
 
 #include "puffin/src/include/puffin/brotli_util.h"
 
+#include <algorithm>
+#include <utility>
+
 #include "brotli/decode.h"
 #include "brotli/encode.h"
 #include "puffin/memory_stream.h"
@@ -49,7 +52,7 @@ bool BrotliEncode(const uint8_t* input,
     }
 
     size_t bytes_consumed = kBufferSize - available_out;
-    output_stream->Write(buffer, bytes_consumed);
+    TEST_AND_RETURN_FALSE(output_stream->Write(buffer, bytes_consumed));
   }
 
   return true;
@@ -96,7 +99,7 @@ bool BrotliDecode(const uint8_t* input,
     }
 
     size_t bytes_consumed = kBufferSize - available_out;
-    output_stream->Write(buffer, bytes_consumed);
+    TEST_AND_RETURN_FALSE(output_stream->Write(buffer, bytes_consumed));
   }
   return true;
 }
@@ -108,4 +111,61 @@ bool BrotliDecode(const uint8_t* input,
   return BrotliDecode(input, input_size, MemoryStream::CreateForWrite(output));
 }
 
+bool BrotliDecode(UniqueStreamPtr input_stream,
+                  uint64_t input_size,
+                  UniqueStreamPtr output_stream) {
+  std::unique_ptr<BrotliDecoderState, decltype(&BrotliDecoderDestroyInstance)>
+      decoder(BrotliDecoderCreateInstance(nullptr, nullptr, nullptr),
+              BrotliDecoderDestroyInstance);
+  TEST_AND_RETURN_FALSE(decoder != nullptr);
+
+  uint8_t input[kBufferSize];
+  const uint8_t* next_in = input;
+  size_t available_in = 0;
+  uint64_t bytes_read = 0;
+  while (bytes_read < input_size || available_in != 0 ||
+         !BrotliDecoderIsFinished(decoder.get())) {
+    // Refill the input buffer once the decoder has consumed all of it.
+    if (available_in == 0 && bytes_read < input_size) {
+      auto read_size = std::min(static_cast<uint64_t>(kBufferSize),
+                                input_size - bytes_read);
+      TEST_AND_RETURN_FALSE(input_stream->Read(input, read_size));
+      bytes_read += read_size;
+      next_in = input;
+      available_in = read_size;
+    }
+
+    uint8_t buffer[kBufferSize];
+    uint8_t* next_out = buffer;
+    size_t available_out = kBufferSize;
+
+    BrotliDecoderResult result =
+        BrotliDecoderDecompressStream(decoder.get(), &available_in, &next_in,
+                                      &available_out, &next_out, nullptr);
+    if (result == BROTLI_DECODER_RESULT_ERROR ||
+        (result == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT &&
+         bytes_read == input_size)) {
+      LOG(ERROR) << "Failed to decompress " << input_size
+                 << " bytes with brotli, result " << result;
+      return false;
+    }
+    if (result == BROTLI_DECODER_RESULT_SUCCESS && available_in != 0) {
+      LOG(ERROR) << "Unexpected data after the end of the brotli stream.";
+      return false;
+    }
+
+    size_t bytes_consumed = kBufferSize - available_out;
+    TEST_AND_RETURN_FALSE(output_stream->Write(buffer, bytes_consumed));
+  }
+  return true;
+}
+
+bool BrotliDecode(UniqueStreamPtr input_stream,
+                  uint64_t input_size,
+                  std::vector<uint8_t>* output) {
+  TEST_AND_RETURN_FALSE(output != nullptr);
+  return BrotliDecode(std::move(input_stream), input_size,
+                      MemoryStream::CreateForWrite(output));
+}
+
 }  // namespace puffin
@@ -29,4 +29,35 @@ TEST(BrotliUtilTest, CompressAndDecompressTest) {
   ASSERT_EQ(kTestString, decompressed);
 }
 
+TEST(BrotliUtilTest, DecompressFromStreamTest) {
+  // Pseudo-random data, so the compressed data is larger than the internal
+  // buffers and has to be read in multiple chunks.
+  Buffer input(100 * 1024);
+  uint32_t seed = 1;
+  for (auto& byte : input) {
+    seed = seed * 1103515245 + 12345;
+    byte = seed >> 24;
+  }
+  Buffer compressed;
+  ASSERT_TRUE(BrotliEncode(input.data(), input.size(), &compressed));
+  ASSERT_GT(compressed.size(), 64 * 1024);
+
+  // Put some data around the compressed stream to make sure only the given
+  // range is read.
+  Buffer padded(3, 0xAA);
+  padded.insert(padded.end(), compressed.begin(), compressed.end());
+  padded.insert(padded.end(), 5, 0xBB);
+  auto stream = MemoryStream::CreateForRead(padded);
+  ASSERT_TRUE(stream->Seek(3));
+  Buffer decompressed;
+  ASSERT_TRUE(
+      BrotliDecode(std::move(stream), compressed.size(), &decompressed));
+  ASSERT_EQ(input, decompressed);
+
+  // A truncated stream should fail.
+  decompressed.clear();
+  ASSERT_FALSE(BrotliDecode(MemoryStream::CreateForRead(compressed),
+                            compressed.size() - 1, &decompressed));
+}
+
 }  // namespace puffin
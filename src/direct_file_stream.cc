@@ -0,0 +1,289 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/direct_file_stream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "puffin/src/logging.h"
+
+using std::string;
+using std::unique_lock;
+
+namespace puffin {
+
+namespace {
+
+uint64_t AlignDown(uint64_t value) {
+  return value & ~static_cast<uint64_t>(DirectFileStream::kAlignment - 1);
+}
+
+uint64_t AlignUp(uint64_t value) {
+  return AlignDown(value + DirectFileStream::kAlignment - 1);
+}
+
+}  // namespace
+
+constexpr size_t DirectFileStream::kAlignment;
+constexpr size_t DirectFileStream::kDefaultBufferSize;
+constexpr size_t DirectFileStream::kDefaultQueueDepth;
+
+UniqueStreamPtr DirectFileStream::Open(const string& path,
+                                       size_t buffer_size,
+                                       size_t queue_depth) {
+  TEST_AND_RETURN_VALUE(buffer_size > 0 && queue_depth > 0, nullptr);
+  mode_t mode = 0644;  // -rw-r--r--
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, mode);
+  TEST_AND_RETURN_VALUE(fd >= 0, nullptr);
+
+  int direct_fd = -1;
+#ifdef O_DIRECT
+  direct_fd = open(path.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+  if (direct_fd < 0) {
+    LOG(WARNING) << "Could not open " << path << " with O_DIRECT ("
+                 << strerror(errno) << "), falling back to buffered writes.";
+  }
+#endif  // O_DIRECT
+
+  // This works for both regular files and block devices.
+  auto size = lseek(fd, 0, SEEK_END);
+  if (size < 0) {
+    LOG(ERROR) << "Failed to get the size of " << path;
+    close(fd);
+    if (direct_fd >= 0) {
+      close(direct_fd);
+    }
+    return nullptr;
+  }
+
+  buffer_size = AlignUp(buffer_size);
+  return UniqueStreamPtr(
+      new DirectFileStream(fd, direct_fd, size, buffer_size, queue_depth));
+}
+
+DirectFileStream::DirectFileStream(int fd,
+                                   int direct_fd,
+                                   uint64_t size,
+                                   size_t buffer_size,
+                                   size_t queue_depth)
+    : fd_(fd),
+      direct_fd_(direct_fd),
+      size_(size),
+      offset_(0),
+      buffer_size_(buffer_size),
+      memory_(nullptr, free),
+      has_chunk_(false),
+      failed_(false),
+      closed_(false) {
+  void* memory = nullptr;
+  if (posix_memalign(&memory, kAlignment, buffer_size_ * queue_depth) != 0) {
+    LOG(ERROR) << "Failed to allocate the write buffers.";
+    failed_ = true;
+    return;
+  }
+  memory_.reset(static_cast<uint8_t*>(memory));
+  free_buffers_.reserve(queue_depth);
+  for (size_t idx = 0; idx < queue_depth; idx++) {
+    free_buffers_.push_back(memory_.get() + idx * buffer_size_);
+  }
+  writer_ = std::thread(&DirectFileStream::WriterLoop, this);
+}
+
+DirectFileStream::~DirectFileStream() {
+  if (!closed_ && !Close()) {
+    LOG(ERROR) << "Failed to flush the pending writes.";
+  }
+}
+
+bool DirectFileStream::GetSize(uint64_t* size) const {
+  *size = size_;
+  return true;
+}
+
+bool DirectFileStream::GetOffset(uint64_t* offset) const {
+  *offset = offset_;
+  return true;
+}
+
+bool DirectFileStream::Seek(uint64_t offset) {
+  TEST_AND_RETURN_FALSE(!closed_);
+  if (has_chunk_ && offset != cur_chunk_.file_offset + cur_chunk_.end) {
+    SubmitChunk();
+  }
+  offset_ = offset;
+  return true;
+}
+
+bool DirectFileStream::Read(void* /* buffer */, size_t /* length */) {
+  LOG(ERROR) << "DirectFileStream is write only.";
+  return false;
+}
+
+bool DirectFileStream::Write(const void* buffer, size_t length) {
+  TEST_AND_RETURN_FALSE(!closed_);
+  auto bytes = static_cast<const uint8_t*>(buffer);
+  size_t bytes_wrote = 0;
+  while (bytes_wrote < length) {
+    if (!has_chunk_) {
+      TEST_AND_RETURN_FALSE(AcquireChunk());
+    }
+    auto copy_len =
+        std::min(length - bytes_wrote, buffer_size_ - cur_chunk_.end);
+    memcpy(cur_chunk_.data + cur_chunk_.end, bytes + bytes_wrote, copy_len);
+    cur_chunk_.end += copy_len;
+    bytes_wrote += copy_len;
+    offset_ += copy_len;
+    if (cur_chunk_.end == buffer_size_) {
+      SubmitChunk();
+    }
+  }
+  size_ = std::max(size_, offset_);
+  return true;
+}
+
+bool DirectFileStream::Close() {
+  TEST_AND_RETURN_FALSE(!closed_);
+  SubmitChunk();
+  {
+    unique_lock<std::mutex> lock(mutex_);
+    closed_ = true;
+  }
+  cond_.notify_all();
+  if (writer_.joinable()) {
+    writer_.join();
+  }
+
+  bool success = !failed_;
+  if (direct_fd_ >= 0 && close(direct_fd_) != 0) {
+    success = false;
+  }
+  if (close(fd_) != 0) {
+    success = false;
+  }
+  return success;
+}
+
+bool DirectFileStream::AcquireChunk() {
+  unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this] { return !free_buffers_.empty() || failed_; });
+  TEST_AND_RETURN_FALSE(!failed_);
+  cur_chunk_.data = free_buffers_.back();
+  free_buffers_.pop_back();
+  // Place the data in the buffer so its offset in the buffer and in the file
+  // are equal modulo the alignment. This way full buffers end on aligned
+  // offsets and their aligned parts are aligned in memory too.
+  cur_chunk_.file_offset = AlignDown(offset_);
+  cur_chunk_.begin = offset_ - cur_chunk_.file_offset;
+  cur_chunk_.end = cur_chunk_.begin;
+  has_chunk_ = true;
+  return true;
+}
+
+void DirectFileStream::SubmitChunk() {
+  if (!has_chunk_) {
+    return;
+  }
+  has_chunk_ = false;
+  {
+    unique_lock<std::mutex> lock(mutex_);
+    if (cur_chunk_.begin == cur_chunk_.end) {
+      free_buffers_.push_back(cur_chunk_.data);
+      return;
+    }
+    pending_.push_back(cur_chunk_);
+  }
+  cond_.notify_all();
+}
+
+void DirectFileStream::WriterLoop() {
+  unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cond_.wait(lock, [this] { return !pending_.empty() || closed_; });
+    if (pending_.empty()) {
+      // Closed and nothing left to write.
+      return;
+    }
+    auto chunk = pending_.front();
+    pending_.pop_front();
+    bool failed = failed_;
+
+    // Do not hold the lock while writing, so the producer can keep filling the
+    // other buffers. After a failure the remaining buffers are only recycled.
+    lock.unlock();
+    if (!failed && !WriteChunk(chunk)) {
+      failed = true;
+    }
+    lock.lock();
+
+    failed_ = failed;
+    free_buffers_.push_back(chunk.data);
+    cond_.notify_all();
+  }
+}
+
+bool DirectFileStream::WriteChunk(const Chunk& chunk) {
+  auto start = chunk.file_offset + chunk.begin;
+  auto end = chunk.file_offset + chunk.end;
+  auto aligned_start = AlignUp(start);
+  auto aligned_end = AlignDown(end);
+  if (direct_fd_ < 0 || aligned_start >= aligned_end) {
+    return PWriteAll(fd_, chunk.data + chunk.begin, end - start, start);
+  }
+
+  // The unaligned head and tail are written through the page cache. The writer
+  // is the only thread touching the file, so these never race with the direct
+  // writes of the same blocks.
+  if (start < aligned_start) {
+    TEST_AND_RETURN_FALSE(PWriteAll(fd_, chunk.data + chunk.begin,
+                                    aligned_start - start, start));
+  }
+  auto direct_data = chunk.data + (aligned_start - chunk.file_offset);
+  if (!PWriteAll(direct_fd_, direct_data, aligned_end - aligned_start,
+                 aligned_start)) {
+    // Some file systems accept O_DIRECT at open time, but reject the writes
+    // themselves. Continue with buffered writes.
+    LOG(WARNING) << "Direct write failed (" << strerror(errno)
+                 << "), falling back to buffered writes.";
+    close(direct_fd_);
+    direct_fd_ = -1;
+    TEST_AND_RETURN_FALSE(PWriteAll(fd_, direct_data,
+                                    aligned_end - aligned_start,
+                                    aligned_start));
+  }
+  if (aligned_end < end) {
+    TEST_AND_RETURN_FALSE(
+        PWriteAll(fd_, chunk.data + (aligned_end - chunk.file_offset),
+                  end - aligned_end, aligned_end));
+  }
+  return true;
+}
+
+bool DirectFileStream::PWriteAll(int fd,
+                                 const uint8_t* data,
+                                 size_t length,
+                                 uint64_t offset) {
+  size_t total_bytes_wrote = 0;
+  while (total_bytes_wrote < length) {
+    auto bytes_wrote = pwrite(fd, data + total_bytes_wrote,
+                              length - total_bytes_wrote,
+                              offset + total_bytes_wrote);
+    if (bytes_wrote < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_wrote <= 0) {
+      return false;
+    }
+    total_bytes_wrote += bytes_wrote;
+  }
+  return true;
+}
+
+}  // namespace puffin
@@ -0,0 +1,137 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_DIRECT_FILE_STREAM_H_
+#define SRC_DIRECT_FILE_STREAM_H_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/stream.h"
+
+namespace puffin {
+
+// A write-only stream for destination files and partitions. Instead of issuing
+// one |write()| per call to |Write()|, it aggregates the output into large
+// aligned buffers and hands full buffers to a background writer. At most
+// |queue_depth| buffers are in flight at any time, so a slow device throttles
+// the producer instead of letting the memory grow. If the file can be opened
+// with O_DIRECT, the block aligned part of each buffer bypasses the page cache
+// and only the unaligned head and tail of a run go through a normal buffered
+// file descriptor. If O_DIRECT is not supported (by the platform, file system
+// or device), all writes fall back to buffered writes.
+class DirectFileStream : public StreamInterface {
+ public:
+  // The alignment used for O_DIRECT writes. This is large enough for both 512
+  // byte and 4K logical block sizes.
+  static constexpr size_t kAlignment = 4096;
+  static constexpr size_t kDefaultBufferSize = 1024 * 1024;  // 1MB
+  static constexpr size_t kDefaultQueueDepth = 4;
+
+  ~DirectFileStream() override;
+
+  // Opens (and creates if needed) the file at |path| for writing. |buffer_size|
+  // is rounded up to a multiple of |kAlignment|.
+  static UniqueStreamPtr Open(const std::string& path,
+                              size_t buffer_size = kDefaultBufferSize,
+                              size_t queue_depth = kDefaultQueueDepth);
+
+  bool GetSize(uint64_t* size) const override;
+  bool GetOffset(uint64_t* offset) const override;
+  // Seeking to any offset other than the end of the pending buffer submits the
+  // pending buffer to the writer first.
+  bool Seek(uint64_t offset) override;
+  // This stream is write only; it always returns false.
+  bool Read(void* buffer, size_t length) override;
+  bool Write(const void* buffer, size_t length) override;
+  // Flushes all pending buffers, waits for the writer to finish and closes the
+  // file. Returns false if any of the writes has failed.
+  bool Close() override;
+
+ private:
+  // A buffer that is being filled or is queued for writing. Its first byte
+  // corresponds to |file_offset| in the file which is always aligned, and the
+  // valid data is in [|begin|, |end|).
+  struct Chunk {
+    uint8_t* data;
+    uint64_t file_offset;
+    size_t begin;
+    size_t end;
+  };
+
+  DirectFileStream(int fd,
+                   int direct_fd,
+                   uint64_t size,
+                   size_t buffer_size,
+                   size_t queue_depth);
+
+  // Gets a free buffer for the data starting at |offset_|. Blocks until the
+  // writer returns a buffer if all of them are in flight.
+  bool AcquireChunk();
+
+  // Queues the buffer currently being filled (if any) for writing.
+  void SubmitChunk();
+
+  // The loop run by |writer_|.
+  void WriterLoop();
+
+  // Writes the data of |chunk| into the file. Only called from |writer_|.
+  bool WriteChunk(const Chunk& chunk);
+
+  // Writes |length| bytes from |data| to |offset| using |fd|.
+  static bool PWriteAll(int fd, const uint8_t* data, size_t length,
+                        uint64_t offset);
+
+  // The buffered file descriptor.
+  int fd_;
+
+  // The O_DIRECT file descriptor or -1 if direct writes are not available.
+  // After construction it is only used by |writer_|.
+  int direct_fd_;
+
+  // The size of the file, including the data that has not been written yet.
+  uint64_t size_;
+
+  // The current offset.
+  uint64_t offset_;
+
+  size_t buffer_size_;
+
+  // The memory of all the buffers. Each buffer is |buffer_size_| bytes.
+  std::unique_ptr<uint8_t, void (*)(void*)> memory_;
+
+  // The buffer being filled, valid if |has_chunk_| is true.
+  Chunk cur_chunk_;
+  bool has_chunk_;
+
+  // Protects all the members below.
+  std::mutex mutex_;
+  std::condition_variable cond_;
+
+  // The buffers that can be filled.
+  std::vector<uint8_t*> free_buffers_;
+
+  // The buffers that are waiting to be written in order.
+  std::deque<Chunk> pending_;
+
+  // True if any of the writes has failed.
+  bool failed_;
+
+  // True once |Close()| has been called.
+  bool closed_;
+
+  std::thread writer_;
+
+  DISALLOW_COPY_AND_ASSIGN(DirectFileStream);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_DIRECT_FILE_STREAM_H_
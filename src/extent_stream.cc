@@ -27,10 +27,26 @@ ExtentStream::ExtentStream(UniqueStreamPtr stream,
                            const vector<ByteExtent>& extents,
                            bool is_for_write)
     : stream_(std::move(stream)),
-      extents_(extents),
       cur_extent_offset_(0),
       is_for_write_(is_for_write),
       offset_(0) {
+  // Drop the empty extents and merge the ones that are contiguous on the
+  // underlying stream. Extent lists of fragmented file systems usually consist
+  // of many small consecutive blocks; merging them lets each run be read or
+  // written with a single call into |stream_| instead of one per block.
+  extents_.reserve(extents.size() + 1);
+  for (const auto& extent : extents) {
+    if (extent.length == 0) {
+      continue;
+    }
+    if (!extents_.empty() &&
+        extents_.back().offset + extents_.back().length == extent.offset) {
+      extents_.back().length += extent.length;
+    } else {
+      extents_.push_back(extent);
+    }
+  }
+
   extents_upper_bounds_.reserve(extents_.size() + 1);
   extents_upper_bounds_.emplace_back(0);
   uint64_t total_size = 0;
@@ -13,9 +13,10 @@
 
 namespace puffin {
 
-// A stream object that allows reading and writing into disk extents. This is
-// only used in main.cc for puffin binary to allow puffpatch on a actual rootfs
-// and kernel images.
+// A stream object that allows reading and writing into disk extents. It is
+// used in main.cc for puffin binary to allow puffpatch on a actual rootfs and
+// kernel images, and by |PuffDiff| to leave out the copied deflates of the
+// destination without reading it into memory.
 class ExtentStream : public StreamInterface {
  public:
   // Creates a stream only for writing.
@@ -48,6 +49,7 @@ class ExtentStream : public StreamInterface {
   // The underlying stream to read from and write into.
   UniqueStreamPtr stream_;
 
+  // The non-empty extents with the contiguous ones merged.
   std::vector<ByteExtent> extents_;
 
   // The current |ByteExtent| that is being read from or write into.
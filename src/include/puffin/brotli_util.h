@@ -39,6 +39,17 @@ bool BrotliDecode(const uint8_t* input,
 bool BrotliDecode(const uint8_t* input,
                   size_t input_size,
                   std::vector<uint8_t>* output);
+
+// Decompress |input_size| bytes of data read from the current offset of
+// |input_stream| with brotli, and write the result to |output_stream|. The
+// input is read in small chunks, so it never needs to be in memory as a whole.
+bool BrotliDecode(UniqueStreamPtr input_stream,
+                  uint64_t input_size,
+                  UniqueStreamPtr output_stream);
+// Similar to above function, and writes to a output buffer.
+bool BrotliDecode(UniqueStreamPtr input_stream,
+                  uint64_t input_size,
+                  std::vector<uint8_t>* output);
 }  // namespace puffin
 
 #endif  // SRC_INCLUDE_PUFFIN_BROTLI_UTIL_H_
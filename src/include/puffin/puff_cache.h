@@ -0,0 +1,110 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_INCLUDE_PUFFIN_PUFF_CACHE_H_
+#define SRC_INCLUDE_PUFFIN_PUFF_CACHE_H_
+
+#include <array>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "puffin/common.h"
+
+namespace puffin {
+
+// Counters of the use of a |PuffCache|, either by all its users or by one
+// patch operation.
+struct PuffCacheStats {
+  // The deflates whose puffs were found in the cache, and the size of those
+  // puffs.
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> hit_bytes{0};
+  // The deflates that had to be puffed because their puffs were not cached.
+  std::atomic<uint64_t> misses{0};
+  // The puffs added to the cache and the puffs evicted to make room for them.
+  std::atomic<uint64_t> insertions{0};
+  std::atomic<uint64_t> evictions{0};
+};
+
+// A cache of puffs that can be shared by any number of patch operations
+// running one after the other or at the same time, on any threads. A puff is
+// found by the content of its deflate, so the operations do not have to read
+// the deflates from the same streams or at the same offsets, and identical
+// deflates share one puff. The cached puffs are never changed once they are
+// added. A user gets a reference to a puff, which stays valid as long as it is
+// held, even if the puff is evicted from the cache in the meantime. The least
+// recently used puffs are evicted to keep the cache within its budget.
+class PuffCache {
+ public:
+  // |max_size| is the budget of the cache in bytes, which covers the puffs.
+  explicit PuffCache(uint64_t max_size);
+  ~PuffCache() = default;
+
+  // Returns the puff of a deflate that starts at bit |first_bit| of |deflate|
+  // and is |bit_length| bits long, or nullptr if it is not cached. The bits of
+  // |deflate| that are not in the deflate have to be zero. Any |stats| are
+  // counted in besides the stats of the cache.
+  std::shared_ptr<const Buffer> Find(const Buffer& deflate,
+                                     uint8_t first_bit,
+                                     uint64_t bit_length,
+                                     PuffCacheStats* stats);
+
+  // Adds |puff| as the puff of the deflate given like for |Find|. Returns
+  // false if the puff does not fit in the budget of the cache.
+  bool Insert(const Buffer& deflate,
+              uint8_t first_bit,
+              uint64_t bit_length,
+              std::shared_ptr<const Buffer> puff,
+              PuffCacheStats* stats);
+
+  // The number of bytes in the cache.
+  uint64_t size() const;
+
+  // The stats of all the users of the cache.
+  const PuffCacheStats& stats() const { return stats_; }
+
+ private:
+  // The SHA-256 digest of a deflate given like for |Find|. The puffs are found
+  // by it instead of by a copy of their deflates, so they are not stored twice.
+  using Key = std::array<uint8_t, 32>;
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const;
+  };
+
+  // A cached puff and the key of the deflate it is the puff of.
+  struct Entry {
+    Key key;
+    std::shared_ptr<const Buffer> puff;
+  };
+  using EntryList = std::list<Entry>;
+
+  // Returns the key of the deflate given like for |Find|.
+  static Key GetKey(const Buffer& deflate,
+                    uint8_t first_bit,
+                    uint64_t bit_length);
+
+  const uint64_t max_size_;
+
+  // Protects the members below. It is only held to look up, add and remove
+  // entries, never while puffing or hashing deflates.
+  mutable std::mutex mutex_;
+  // The entries from the most to the least recently used.
+  EntryList entries_;
+  // The entries by their keys.
+  std::unordered_map<Key, EntryList::iterator, KeyHash> index_;
+  // The size of the entries.
+  uint64_t size_;
+
+  PuffCacheStats stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(PuffCache);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_INCLUDE_PUFFIN_PUFF_CACHE_H_
@@ -18,10 +18,15 @@ namespace puffin {
 enum class PatchAlgorithm {
   kBsdiff = 0,
   kZucchini = 1,
+  // bsdiff on independent ranges of the destination, which are diffed and
+  // patched in parallel. Such a patch is of version 2 of the format, which
+  // older versions of |PuffPatch| cannot apply.
+  kSplitBsdiff = 2,
 };
 
 // Performs a diff operation between input deflate streams and creates a patch
-// that is used in the client to recreate the |dst| from |src|.
+// that is used in the client to recreate the |dst| from |src|. The patch is
+// created entirely in memory.
 // |src|          IN   Source deflate stream.
 // |dst|          IN   Destination deflate stream.
 // |src_deflates| IN   Deflate locations in |src|.
@@ -31,10 +36,68 @@ enum class PatchAlgorithm {
 //                     brotli.
 // |patchAlgorithm|    IN   The patchAlgorithm used to create patches between
 //                     uncompressed bytes, e.g. bsdiff, zucchini.
-// |tmp_filepath| IN   A path to a temporary file. The caller has the
-//                     responsibility of unlinking the file after the call to
-//                     |PuffDiff| finishes.
 // |puffin_patch| OUT  The patch that later can be used in |PuffPatch|.
+bool PuffDiff(UniqueStreamPtr src,
+              UniqueStreamPtr dst,
+              const std::vector<BitExtent>& src_deflates,
+              const std::vector<BitExtent>& dst_deflates,
+              const std::vector<bsdiff::CompressorType>& compressors,
+              PatchAlgorithm patchAlgorithm,
+              Buffer* patch);
+
+// Same as the function above. If |copy_deflates| is true, the destination
+// deflates that are bit for bit the same as a source deflate are not diffed,
+// but their compressed bytes are copied from the source when patching, without
+// puffing or huffing them. Such a patch is of version 2 of the format, which
+// older versions of |PuffPatch| cannot apply.
+bool PuffDiff(UniqueStreamPtr src,
+              UniqueStreamPtr dst,
+              const std::vector<BitExtent>& src_deflates,
+              const std::vector<BitExtent>& dst_deflates,
+              const std::vector<bsdiff::CompressorType>& compressors,
+              PatchAlgorithm patchAlgorithm,
+              bool copy_deflates,
+              Buffer* patch);
+
+// Same as the function above. |src_nested| and |dst_nested| are the deflate
+// streams of |src| and |dst| whose uncompressed data has deflates too, as found
+// by |LocateNestedDeflateStreams| up to |max_nested_depth| levels deep. Each of
+// |dst_nested| is made of |dst_deflates|, and is rebuilt when patching from a
+// nested puffin patch against the most similar of |src_nested|, so the
+// deflates in its uncompressed data are diffed puffed too. Such a patch is of
+// version 2 of the format, which older versions of |PuffPatch| cannot apply.
+bool PuffDiff(UniqueStreamPtr src,
+              UniqueStreamPtr dst,
+              const std::vector<BitExtent>& src_deflates,
+              const std::vector<BitExtent>& dst_deflates,
+              const std::vector<BitExtent>& src_nested,
+              const std::vector<BitExtent>& dst_nested,
+              size_t max_nested_depth,
+              const std::vector<bsdiff::CompressorType>& compressors,
+              PatchAlgorithm patchAlgorithm,
+              bool copy_deflates,
+              Buffer* patch);
+
+// Similar to the first function, except that it accepts raw buffer rather than
+// stream and uses bsdiff as the patch algorithm.
+bool PuffDiff(const Buffer& src,
+              const Buffer& dst,
+              const std::vector<BitExtent>& src_deflates,
+              const std::vector<BitExtent>& dst_deflates,
+              const std::vector<bsdiff::CompressorType>& compressors,
+              Buffer* patch);
+
+// The default puffdiff function that uses both bz2 and brotli to compress the
+// patch data.
+bool PuffDiff(const Buffer& src,
+              const Buffer& dst,
+              const std::vector<BitExtent>& src_deflates,
+              const std::vector<BitExtent>& dst_deflates,
+              Buffer* patch);
+
+// Deprecated: the functions below are the same as the ones above and are only
+// kept for compatibility. Patches are created in memory, so |tmp_filepath| is
+// ignored, and a warning says so the first time it is passed.
 bool PuffDiff(UniqueStreamPtr src,
               UniqueStreamPtr dst,
               const std::vector<BitExtent>& src_deflates,
@@ -53,8 +116,6 @@ bool PuffDiff(UniqueStreamPtr src,
               const std::string& tmp_filepath,
               Buffer* patch);
 
-// Similar to the function above, except that it accepts raw buffer rather than
-// stream.
 bool PuffDiff(const Buffer& src,
               const Buffer& dst,
               const std::vector<BitExtent>& src_deflates,
@@ -63,8 +124,6 @@ bool PuffDiff(const Buffer& src,
               const std::string& tmp_filepath,
               Buffer* patch);
 
-// The default puffdiff function that uses both bz2 and brotli to compress the
-// patch data.
 bool PuffDiff(const Buffer& src,
               const Buffer& dst,
               const std::vector<BitExtent>& src_deflates,
@@ -72,6 +131,23 @@ bool PuffDiff(const Buffer& src,
               const std::string& tmp_filepath,
               Buffer* patch);
 
+// Same as the first |PuffDiff|, but for puff streams too large to diff at once.
+// It creates a |PatchAlgorithm::kSplitBsdiff| patch, in which each chunk of
+// the destination is diffed against a window of the source that is found by
+// sampling rolling hashes of both. Neither the deflate streams nor the puff
+// streams are kept in memory entirely: only the sampled hashes of the source
+// are. The windows are as large as diffing one of them within |max_memory|
+// bytes allows (within limits), and as many chunks are diffed in parallel as
+// fit in |max_memory|. The sub-patches follow the destination, so the patch is
+// applied in streaming order.
+bool PuffDiffWindowed(UniqueStreamPtr src,
+                      UniqueStreamPtr dst,
+                      const std::vector<BitExtent>& src_deflates,
+                      const std::vector<BitExtent>& dst_deflates,
+                      const std::vector<bsdiff::CompressorType>& compressors,
+                      uint64_t max_memory,
+                      Buffer* patch);
+
 }  // namespace puffin
 
 #endif  // SRC_INCLUDE_PUFFIN_PUFFDIFF_H_
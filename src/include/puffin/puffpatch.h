@@ -6,6 +6,7 @@
 #define SRC_INCLUDE_PUFFIN_PUFFPATCH_H_
 
 #include "puffin/common.h"
+#include "puffin/puff_cache.h"
 #include "puffin/stream.h"
 
 namespace puffin {
@@ -20,17 +21,73 @@ constexpr size_t kDefaultCacheSize = 64 * 1024;  // Total 64K cache.
 // |PuffPatch| needs to wrap these streams into another ones and we don't want
 // to loose the ownership of the input streams. Optionally one can cache the
 // puff buffers individually if non-zero value is passed |max_cache_size|.
+// Several patch operations on the same source can instead share the puffs in
+// one |PuffCache|. The patch is applied on the calling thread only.
 //
 // |src|           IN  Source deflate stream.
 // |dst|           IN  Destination deflate stream.
 // |patch|         IN  The input patch.
 // |patch_length|  IN  The length of the patch.
 // |max_cache_size|IN  The maximum amount of memory to cache puff buffers.
+// |shared_cache|  IN  If not null, the puff buffers are cached in it instead.
+// |stats|         IN  If not null, the use of |shared_cache| by this operation
+//                     is counted in it.
+// |max_zucchini_memory| IN  If not zero, the most memory a zucchini patch may
+//                     need. zucchini holds the puffed source and destination
+//                     and the decompressed patch in memory at once, so a patch
+//                     that needs more fails before the source is puffed.
 bool PuffPatch(UniqueStreamPtr src,
                UniqueStreamPtr dst,
                const uint8_t* patch,
                size_t patch_length,
-               size_t max_cache_size = kDefaultCacheSize);
+               size_t max_cache_size = kDefaultCacheSize,
+               std::shared_ptr<PuffCache> shared_cache = nullptr,
+               PuffCacheStats* stats = nullptr,
+               uint64_t max_zucchini_memory = 0);
+
+// Similar to the above function, but reads the patch from |patch| instead of
+// requiring the entire patch to be in memory. Only the patch header is read
+// up front. A zucchini patch is decompressed while it is being read; a bsdiff
+// patch is read into memory without the puffin header as bspatch needs it in
+// one piece.
+//
+// |src|           IN  Source deflate stream.
+// |dst|           IN  Destination deflate stream.
+// |patch|         IN  The input patch stream.
+// |max_cache_size|IN  The maximum amount of memory to cache puff buffers.
+// |shared_cache|  IN  If not null, the puff buffers are cached in it instead.
+// |stats|         IN  If not null, the use of |shared_cache| by this operation
+//                     is counted in it.
+// |max_zucchini_memory| IN  If not zero, the most memory a zucchini patch may
+//                     need.
+bool PuffPatch(UniqueStreamPtr src,
+               UniqueStreamPtr dst,
+               UniqueStreamPtr patch,
+               size_t max_cache_size = kDefaultCacheSize,
+               std::shared_ptr<PuffCache> shared_cache = nullptr,
+               PuffCacheStats* stats = nullptr,
+               uint64_t max_zucchini_memory = 0);
+
+// Same as the first |PuffPatch|, but applies a bsdiff patch using up to
+// |num_threads| threads. The output is cut into ranges which are patched and
+// written into |dst| out of order, so |dst| has to support seeking. The threads
+// puff |src| with one cache of |max_cache_size| bytes they share, or with
+// |shared_cache| if it is not null, so the puffs they cache take no more memory
+// than with one thread. Besides the puffs, a bsdiff patch is applied in ranges
+// of 1MB of the output, two for each thread. The sub-patches of a split bsdiff
+// patch are applied in parallel the same way. Zucchini patches, and any patch
+// if |num_threads| is one, are applied the same way as by |PuffPatch|, except
+// that the large destination deflates are huffed using up to |num_threads|
+// threads. |max_zucchini_memory| is the same as for |PuffPatch|.
+bool PuffPatchInParallel(UniqueStreamPtr src,
+                         UniqueStreamPtr dst,
+                         const uint8_t* patch,
+                         size_t patch_length,
+                         size_t num_threads,
+                         size_t max_cache_size = kDefaultCacheSize,
+                         std::shared_ptr<PuffCache> shared_cache = nullptr,
+                         PuffCacheStats* stats = nullptr,
+                         uint64_t max_zucchini_memory = 0);
 
 }  // namespace puffin
 
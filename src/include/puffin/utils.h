@@ -13,6 +13,8 @@
 
 namespace puffin {
 
+class Puffer;
+
 // Converts an array of |ByteExtens| or |BitExtents| to a string. Each extent
 // has format "offset:length" and are comma separated.
 template <typename T>
@@ -39,24 +41,189 @@ bool LocateDeflatesInDeflateStream(const uint8_t* data,
                                    std::vector<BitExtent>* deflates,
                                    uint64_t* compressed_size);
 
+// Same as above, but large deflate streams are split into chunks that are
+// searched in parallel using up to |num_threads| threads. Each chunk guesses
+// where its first block starts by looking for a valid dynamic Huffman block
+// header and decodes the blocks from there. A guess is confirmed when the
+// blocks of the previous chunk reach it; otherwise the chunk is decoded again
+// from where the previous chunk ends. The result is identical to the function
+// above.
+bool LocateDeflatesInDeflateStream(const uint8_t* data,
+                                   uint64_t size,
+                                   uint64_t virtual_offset,
+                                   std::vector<BitExtent>* deflates,
+                                   uint64_t* compressed_size,
+                                   size_t num_threads);
+
 // Locates deflates in a zlib buffer |data| by removing header and footer bytes
 // from the zlib stream.
 bool LocateDeflatesInZlib(const Buffer& data, std::vector<BitExtent>* deflates);
 
+// Same as above, but for the |size| bytes at |data|. The locators below that
+// take a pointer and a size work the same way, so large inputs (e.g. memory
+// mapped partition images) can be searched without copying them into a
+// |Buffer|. The offsets in |deflates| are relative to |data|.
+bool LocateDeflatesInZlib(const uint8_t* data,
+                          uint64_t size,
+                          std::vector<BitExtent>* deflates);
+
 // Uses the function above, to locate deflates (bit addressed) in a given file
 // |file_path| using the list of zlib blocks |zlibs|.
 bool LocateDeflatesInZlibBlocks(const std::string& file_path,
                                 const std::vector<ByteExtent>& zlibs,
                                 std::vector<BitExtent>* deflates);
 
+// Same as above, but parses the zlib blocks in parallel using up to
+// |num_threads| threads. The result is the same as above.
+bool LocateDeflatesInZlibBlocks(const std::string& file_path,
+                                const std::vector<ByteExtent>& zlibs,
+                                std::vector<BitExtent>* deflates,
+                                size_t num_threads);
+
 // Searches for deflate locations in a gzip stream. The results are saved in
 // |deflates|.
 bool LocateDeflatesInGzip(const Buffer& data, std::vector<BitExtent>* deflates);
 
+// Same as above, but parses the gzip members in parallel using up to
+// |num_threads| threads. The result is the same as above. The members of BGZF
+// files are found from the sizes in their headers, without decompressing them
+// first.
+bool LocateDeflatesInGzip(const Buffer& data,
+                          std::vector<BitExtent>* deflates,
+                          size_t num_threads);
+bool LocateDeflatesInGzip(const uint8_t* data,
+                          uint64_t size,
+                          std::vector<BitExtent>* deflates,
+                          size_t num_threads);
+
+// Searches for the deflates in the image data of the PNG file in |data|. The
+// image data is a zlib stream split across the IDAT chunks. Its deflates that
+// cross the boundary of two chunks are not addressable in |data| and are
+// skipped.
+bool LocateDeflatesInPng(const Buffer& data, std::vector<BitExtent>* deflates);
+bool LocateDeflatesInPng(const uint8_t* data,
+                         uint64_t size,
+                         std::vector<BitExtent>* deflates);
+
+// Searches for the deflates in the streams of the PDF document in |data| that
+// are compressed with FlateDecode. The streams are found from their
+// dictionaries, and searched in parallel using up to |num_threads| threads.
+// Streams that fail to decompress (e.g. in encrypted documents) are skipped.
+bool LocateDeflatesInPdf(const Buffer& data,
+                         std::vector<BitExtent>* deflates,
+                         size_t num_threads);
+bool LocateDeflatesInPdf(const uint8_t* data,
+                         uint64_t size,
+                         std::vector<BitExtent>* deflates,
+                         size_t num_threads);
+
+// Searches for the deflates in the compressed sections of the ELF file in
+// |data|. These are the sections with SHF_COMPRESSED and ELFCOMPRESS_ZLIB, and
+// the legacy .zdebug sections. The sections are searched in parallel using up
+// to |num_threads| threads, and the ones that fail to decompress are skipped.
+bool LocateDeflatesInElf(const Buffer& data,
+                         std::vector<BitExtent>* deflates,
+                         size_t num_threads);
+bool LocateDeflatesInElf(const uint8_t* data,
+                         uint64_t size,
+                         std::vector<BitExtent>* deflates,
+                         size_t num_threads);
+
 // Search for the deflates in a zip archive, and put the result in |deflates|.
+// The entries are found using the central directory (including ZIP64 archives).
+// The data of the stored entries is searched for nested zip entries. If the
+// central directory is missing or damaged, the whole archive is searched for
+// local file headers instead.
 bool LocateDeflatesInZipArchive(const Buffer& data,
                                 std::vector<BitExtent>* deflates);
 
+// Same as above, but decompresses the zip entries in parallel using up to
+// |num_threads| threads. The result is the same as above.
+bool LocateDeflatesInZipArchive(const Buffer& data,
+                                std::vector<BitExtent>* deflates,
+                                size_t num_threads);
+
+// Same as above, but the data of the stored (not compressed) entries is also
+// searched for nested zip archives, gzip files, tar archives, PNG images, PDF
+// documents and ELF files, up to |max_depth| levels below |data|. This finds
+// e.g. the deflates of the APKs stored in an OTA package, and of the images
+// stored in the APKs. The content of the compressed entries is not searched,
+// because the deflates in it cannot be addressed in |data|.
+bool LocateDeflatesInZipArchive(const Buffer& data,
+                                std::vector<BitExtent>* deflates,
+                                size_t num_threads,
+                                size_t max_depth);
+bool LocateDeflatesInZipArchive(const uint8_t* data,
+                                uint64_t size,
+                                std::vector<BitExtent>* deflates,
+                                size_t num_threads,
+                                size_t max_depth);
+
+// Searches the files of the tar archive in |data| for zip archives, gzip files,
+// nested tar archives, PNG images, PDF documents and ELF files, up to
+// |max_depth| levels below |data|, and puts their deflates in |deflates|.
+bool LocateDeflatesInTar(const Buffer& data,
+                         std::vector<BitExtent>* deflates,
+                         size_t num_threads,
+                         size_t max_depth);
+bool LocateDeflatesInTar(const uint8_t* data,
+                         uint64_t size,
+                         std::vector<BitExtent>* deflates,
+                         size_t num_threads,
+                         size_t max_depth);
+
+// Searches the |size| bytes at |data| for deflates by its content, which can be
+// a zip archive, a gzip file, a tar archive, a PNG image, a PDF document or an
+// ELF file, and puts them in |deflates|. The nested containers are searched up
+// to |max_depth| levels below |data|. Other data has no deflates.
+bool LocateDeflatesInContainer(const uint8_t* data,
+                               uint64_t size,
+                               std::vector<BitExtent>* deflates,
+                               size_t num_threads,
+                               size_t max_depth);
+
+// Finds the deflate streams made of the |deflates| of the |size| bytes at
+// |data| whose uncompressed data has deflates too (e.g. the deflate stream of a
+// .tar.gz file), and puts them in |streams|. The uncompressed data is one level
+// below |data|, and is searched with |LocateDeflatesInContainer| up to
+// |max_depth| levels below |data|. Only the streams that start at a byte
+// boundary are found. The streams are decompressed in parallel using up to
+// |num_threads| threads.
+bool LocateNestedDeflateStreams(const uint8_t* data,
+                                uint64_t size,
+                                const std::vector<BitExtent>& deflates,
+                                size_t num_threads,
+                                size_t max_depth,
+                                std::vector<BitExtent>* streams);
+
+// Searches raw data with no known structure (e.g. a kernel image, a firmware
+// blob or a file system dump) for embedded gzip members and zlib streams, and
+// puts the deflates of the ones that decode completely in |deflates|. Streams
+// shorter than 64 bytes are ignored, as random data can look like them. The
+// data is split into chunks that are searched in parallel using up to
+// |num_threads| threads, and the result is the same as searching it
+// sequentially.
+bool LocateDeflatesByCarving(const Buffer& data,
+                             std::vector<BitExtent>* deflates,
+                             size_t num_threads);
+bool LocateDeflatesByCarving(const uint8_t* data,
+                             uint64_t size,
+                             std::vector<BitExtent>* deflates,
+                             size_t num_threads);
+
+// Parses the squashfs image in |data| and puts the deflates of its compressed
+// data, fragment and metadata blocks in |deflates|. The blocks are found from
+// the superblock, the inode table and the lookup tables, so the image is not
+// scanned. Only images compressed with gzip are supported. The blocks are
+// searched in parallel using up to |num_threads| threads.
+bool LocateDeflatesInSquashfs(const Buffer& data,
+                              std::vector<BitExtent>* deflates,
+                              size_t num_threads);
+bool LocateDeflatesInSquashfs(const uint8_t* data,
+                              uint64_t size,
+                              std::vector<BitExtent>* deflates,
+                              size_t num_threads);
+
 // Reads the deflates in from |deflates| and returns a list of its subblock
 // locations. Each subblock in practice is a deflate stream by itself.
 // Assumption is that the first subblock in each deflate in |deflates| start in
@@ -65,6 +232,13 @@ bool FindDeflateSubBlocks(const UniqueStreamPtr& src,
                           const std::vector<ByteExtent>& deflates,
                           std::vector<BitExtent>* subblock_deflates);
 
+// Same as above, but the subblocks of large deflates are found using up to
+// |num_threads| threads.
+bool FindDeflateSubBlocks(const UniqueStreamPtr& src,
+                          const std::vector<ByteExtent>& deflates,
+                          std::vector<BitExtent>* subblock_deflates,
+                          size_t num_threads);
+
 // Finds the location of puffs in the deflate stream |src| based on the location
 // of |deflates| and populates the |puffs|. We assume |deflates| are sorted by
 // their offset value. |out_puff_size| will be the size of the puff stream.
@@ -73,6 +247,43 @@ bool FindPuffLocations(const UniqueStreamPtr& src,
                        std::vector<ByteExtent>* puffs,
                        uint64_t* out_puff_size);
 
+// Same as above, but also finds the block index of the deflates: for each
+// deflate block in |deflates| its location is appended to |sub_blocks| and the
+// location of its puff in the puff stream to |sub_puffs|. A block reaches up to
+// the start of the next one, so together the blocks of a deflate cover all of
+// it. The index comes for free from the pass that finds the puff sizes and
+// allows puffing parts of a large deflate in parallel with
+// |PuffDeflateBlocks|.
+bool FindPuffLocations(const UniqueStreamPtr& src,
+                       const std::vector<BitExtent>& deflates,
+                       std::vector<ByteExtent>* puffs,
+                       uint64_t* out_puff_size,
+                       std::vector<BitExtent>* sub_blocks,
+                       std::vector<ByteExtent>* sub_puffs);
+
+// Puffs the consecutive deflate blocks at |blocks| of |data| into |puff|, which
+// must be exactly |puff_size|, the size of their puff. Puffing a block never
+// looks at the blocks before it, so the puff of any run of blocks is the
+// matching part of the puff of the whole deflate.
+bool PuffDeflateBlocks(const Puffer& puffer,
+                       const uint8_t* data,
+                       uint64_t size,
+                       const BitExtent& blocks,
+                       uint8_t* puff,
+                       uint64_t puff_size);
+
+// Puffs the deflate of |data| that spans |sub_blocks| into |puff| using up to
+// |num_threads| threads. |sub_blocks| is the sorted list of the blocks of the
+// deflate, like the one found by |FindDeflateSubBlocks|; stored blocks may be
+// missing from it. The deflate is split at the block starts into ranges which
+// are puffed in parallel, first to find their puff sizes and then into their
+// place in |puff|. The result is identical to puffing the deflate on one
+// thread.
+bool PuffDeflateInParallel(const Buffer& data,
+                           const std::vector<BitExtent>& sub_blocks,
+                           Buffer* puff,
+                           size_t num_threads);
+
 // Removes any BitExtents from both |extents1| and |extents2| if the data it
 // points to is found in both |extents1| and |extents2|. The order of the
 // remaining BitExtents is preserved.
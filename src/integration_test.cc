@@ -62,13 +62,11 @@ TEST_P(PuffinIntegrationTest, PuffinDiffPatchTest) {
   std::vector<BitExtent> dst_deflates;
   ASSERT_TRUE(LocateDeflatesInZipArchive(kTestZipB, &dst_deflates));
 
-  std::string tmp_file;
-  ASSERT_TRUE(MakeTempFile(&tmp_file, nullptr));
   Buffer patch;
   ASSERT_TRUE(PuffDiff(MemoryStream::CreateForRead(kTestZipA),
                        MemoryStream::CreateForRead(kTestZipB), src_deflates,
                        dst_deflates, {bsdiff::CompressorType::kBrotli},
-                       getPatchType(), tmp_file, &patch));
+                       getPatchType(), &patch));
 
   Buffer patched;
   auto src_stream = MemoryStream::CreateForRead(kTestZipA);
@@ -78,11 +76,34 @@ TEST_P(PuffinIntegrationTest, PuffinDiffPatchTest) {
                         patch.size()));
 
   ASSERT_EQ(kTestZipB, patched);
+
+  Buffer patched_from_stream;
+  ASSERT_TRUE(PuffPatch(MemoryStream::CreateForRead(kTestZipA),
+                        MemoryStream::CreateForWrite(&patched_from_stream),
+                        MemoryStream::CreateForRead(patch)));
+  ASSERT_EQ(kTestZipB, patched_from_stream);
+
+  if (getPatchType() == PatchAlgorithm::kZucchini) {
+    // The budget has to fit both puffed images and the patch.
+    Buffer patched_in_budget;
+    ASSERT_TRUE(PuffPatch(MemoryStream::CreateForRead(kTestZipA),
+                          MemoryStream::CreateForWrite(&patched_in_budget),
+                          patch.data(), patch.size(), kDefaultCacheSize,
+                          nullptr, nullptr, 10 * 1024 * 1024));
+    ASSERT_EQ(kTestZipB, patched_in_budget);
+
+    Buffer patched_over_budget;
+    ASSERT_FALSE(PuffPatch(MemoryStream::CreateForRead(kTestZipA),
+                           MemoryStream::CreateForWrite(&patched_over_budget),
+                           patch.data(), patch.size(), kDefaultCacheSize,
+                           nullptr, nullptr, kTestZipA.size()));
+  }
 }
 
 INSTANTIATE_TEST_CASE_P(TestWithPatchType,
                         PuffinIntegrationTest,
                         testing::Values(PatchAlgorithm::kBsdiff,
-                                        PatchAlgorithm::kZucchini));
+                                        PatchAlgorithm::kZucchini,
+                                        PatchAlgorithm::kSplitBsdiff));
 
 }  // namespace puffin
\ No newline at end of file
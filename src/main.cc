@@ -2,9 +2,16 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <sstream>
 
 #ifdef USE_BRILLO
@@ -15,6 +22,7 @@
 
 #include "puffin/file_stream.h"
 #include "puffin/memory_stream.h"
+#include "puffin/src/direct_file_stream.h"
 #include "puffin/src/extent_stream.h"
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/huffer.h"
@@ -23,11 +31,13 @@
 #include "puffin/src/include/puffin/puffpatch.h"
 #include "puffin/src/include/puffin/utils.h"
 #include "puffin/src/logging.h"
+#include "puffin/src/parallel.h"
 #include "puffin/src/puffin_stream.h"
 
 using puffin::BitExtent;
 using puffin::Buffer;
 using puffin::ByteExtent;
+using puffin::DirectFileStream;
 using puffin::ExtentStream;
 using puffin::FileStream;
 using puffin::Huffer;
@@ -63,8 +73,66 @@ vector<T> StringToExtents(const string& str) {
 
 const uint64_t kDefaultPuffCacheSize = 50 * 1024 * 1024;  // 50 MB
 
+// A read-only memory mapping of an entire file. The mapped pages are backed by
+// the file itself, so large files can be accessed as one buffer without
+// allocating the same amount of memory.
+class ScopedMmap {
+ public:
+  ~ScopedMmap() {
+    if (data_ != nullptr) {
+      munmap(data_, size_);
+    }
+  }
+
+  static std::unique_ptr<ScopedMmap> Open(const string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    TEST_AND_RETURN_VALUE(fd >= 0, nullptr);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      return nullptr;
+    }
+    void* data = nullptr;
+    if (st.st_size > 0) {
+      data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    // The mapping remains valid after closing the file.
+    close(fd);
+    if (data == MAP_FAILED) {
+      LOG(ERROR) << "Failed to map " << path;
+      return nullptr;
+    }
+    return std::unique_ptr<ScopedMmap>(
+        new ScopedMmap(data, static_cast<size_t>(st.st_size)));
+  }
+
+  const uint8_t* data() const { return static_cast<const uint8_t*>(data_); }
+  size_t size() const { return size_; }
+
+ private:
+  ScopedMmap(void* data, size_t size) : data_(data), size_(size) {}
+
+  void* data_;
+  size_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedMmap);
+};
+
 // An enum representing the type of compressed files.
-enum class FileType { kDeflate, kZlib, kGzip, kZip, kRaw, kUnknown };
+enum class FileType {
+  kDeflate,
+  kZlib,
+  kGzip,
+  kZip,
+  kTar,
+  kSquashfs,
+  kPng,
+  kPdf,
+  kElf,
+  kCarve,
+  kRaw,
+  kUnknown
+};
 
 // Returns a file type based on the input string |file_type| (normally the final
 // extension of the file).
@@ -80,28 +148,85 @@ FileType StringToFileType(const string& file_type) {
     return FileType::kGzip;
   } else if (file_type == "zip" || file_type == "apk" || file_type == "jar") {
     return FileType::kZip;
+  } else if (file_type == "tar") {
+    return FileType::kTar;
+  } else if (file_type == "squashfs" || file_type == "sqfs") {
+    return FileType::kSquashfs;
+  } else if (file_type == "png") {
+    return FileType::kPng;
+  } else if (file_type == "pdf") {
+    return FileType::kPdf;
+  } else if (file_type == "elf" || file_type == "so" || file_type == "ko" ||
+             file_type == "debug") {
+    return FileType::kElf;
+  } else if (file_type == "carve") {
+    return FileType::kCarve;
+  }
+  return FileType::kUnknown;
+}
+
+// Returns the file type based on the magic bytes at the start of |data|, or
+// |FileType::kUnknown| if none of them match. A raw deflate stream has no magic
+// bytes, so it is never detected.
+FileType GetFileTypeFromContent(const uint8_t* data, uint64_t size) {
+  if (size >= 3 && data[0] == 0x1F && data[1] == 0x8B && data[2] == 8) {
+    return FileType::kGzip;
+  }
+  // A local file header, or the end of central directory record of an empty
+  // archive.
+  if (size >= 4 && data[0] == 'P' && data[1] == 'K' &&
+      ((data[2] == 3 && data[3] == 4) || (data[2] == 5 && data[3] == 6))) {
+    return FileType::kZip;
+  }
+  if (size >= 512 && memcmp(data + 257, "ustar", 5) == 0) {
+    return FileType::kTar;
+  }
+  if (size >= 4 && memcmp(data, "hsqs", 4) == 0) {
+    return FileType::kSquashfs;
+  }
+  if (size >= 8 && memcmp(data, "\x89PNG\r\n\x1A\n", 8) == 0) {
+    return FileType::kPng;
+  }
+  if (size >= 5 && memcmp(data, "%PDF-", 5) == 0) {
+    return FileType::kPdf;
+  }
+  if (size >= 4 && memcmp(data, "\x7F" "ELF", 4) == 0) {
+    return FileType::kElf;
+  }
+  // The zlib header is only a compression method and a check value, so it is
+  // the weakest signature and checked last.
+  if (size >= 2 && (data[0] & 0x0F) == 8 && (data[0] >> 4) <= 7 &&
+      ((data[0] << 8) | data[1]) % 31 == 0) {
+    return FileType::kZlib;
   }
   return FileType::kUnknown;
 }
 
 // Finds the location of deflates in |stream|. If |file_type_to_override| is
 // non-empty, it infers the file type based on that, otherwise, it infers the
-// file type based on the final extension of |file_name|. It returns false if
-// file type cannot be inferred from any of the input arguments. |deflates|
-// is filled with byte-aligned location of deflates.
+// file type based on the final extension of |file_name|, or the content of the
+// file if the extension is not known. It returns false if file type cannot be
+// inferred from any of the input arguments. The containers stored in zip and
+// tar archives are searched up to |max_depth| levels deep. If |stream| is the
+// whole |file_name|, the file is memory mapped instead of being read into
+// memory. |deflates| is filled with byte-aligned location of deflates. If
+// |nested_streams| is not null, it is filled with the deflate streams whose
+// uncompressed data has deflates too, up to |max_depth| levels deep.
 bool LocateDeflatesBasedOnFileType(const UniqueStreamPtr& stream,
                                    const string& file_name,
                                    const string& file_type_to_override,
-                                   vector<BitExtent>* deflates) {
+                                   size_t max_depth,
+                                   bool is_whole_file,
+                                   vector<BitExtent>* deflates,
+                                   vector<BitExtent>* nested_streams) {
   auto file_type = FileType::kUnknown;
 
+  string extension;
   auto last_dot = file_name.find_last_of(".");
-  if (last_dot == string::npos) {
-    // Could not find a dot so we assume there is no extension.
-    return false;
+  if (last_dot != string::npos) {
+    extension = file_name.substr(last_dot + 1);
+    file_type = StringToFileType(extension);
   }
-  auto extension = file_name.substr(last_dot + 1);
-  file_type = StringToFileType(extension);
 
   if (!file_type_to_override.empty()) {
     auto override_file_type = StringToFileType(file_type_to_override);
@@ -123,29 +248,87 @@ bool LocateDeflatesBasedOnFileType(const UniqueStreamPtr& stream,
     return true;
   }
 
-  uint64_t stream_size;
-  TEST_AND_RETURN_FALSE(stream->GetSize(&stream_size));
-  Buffer data(stream_size);
-  TEST_AND_RETURN_FALSE(stream->Read(data.data(), data.size()));
+  uint64_t size;
+  TEST_AND_RETURN_FALSE(stream->GetSize(&size));
+  std::unique_ptr<ScopedMmap> mapped_file;
+  if (is_whole_file) {
+    mapped_file = ScopedMmap::Open(file_name);
+  }
+  Buffer buffer;
+  const uint8_t* data;
+  if (mapped_file && mapped_file->size() == size) {
+    data = mapped_file->data();
+  } else {
+    buffer.resize(size);
+    TEST_AND_RETURN_FALSE(stream->Read(buffer.data(), buffer.size()));
+    data = buffer.data();
+  }
+
+  bool is_detected = false;
+  if (file_type == FileType::kUnknown) {
+    file_type = GetFileTypeFromContent(data, size);
+    is_detected = file_type != FileType::kUnknown;
+  }
+
+  bool success;
   switch (file_type) {
     case FileType::kDeflate:
-      TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInDeflateStream(
-          data.data(), data.size(), 0, deflates, nullptr));
+      success = puffin::LocateDeflatesInDeflateStream(data, size, 0, deflates,
+                                                      nullptr);
       break;
     case FileType::kZlib:
-      TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInZlib(data, deflates));
+      success = puffin::LocateDeflatesInZlib(data, size, deflates);
       break;
     case FileType::kGzip:
-      TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInGzip(data, deflates));
+      success = puffin::LocateDeflatesInGzip(data, size, deflates,
+                                             puffin::GetDefaultNumThreads());
       break;
     case FileType::kZip:
-      TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInZipArchive(data, deflates));
+      success = puffin::LocateDeflatesInZipArchive(
+          data, size, deflates, puffin::GetDefaultNumThreads(), max_depth);
+      break;
+    case FileType::kTar:
+      success = puffin::LocateDeflatesInTar(
+          data, size, deflates, puffin::GetDefaultNumThreads(), max_depth);
+      break;
+    case FileType::kSquashfs:
+      success = puffin::LocateDeflatesInSquashfs(
+          data, size, deflates, puffin::GetDefaultNumThreads());
+      break;
+    case FileType::kPng:
+      success = puffin::LocateDeflatesInPng(data, size, deflates);
+      break;
+    case FileType::kPdf:
+      success = puffin::LocateDeflatesInPdf(data, size, deflates,
+                                            puffin::GetDefaultNumThreads());
+      break;
+    case FileType::kElf:
+      success = puffin::LocateDeflatesInElf(data, size, deflates,
+                                            puffin::GetDefaultNumThreads());
+      break;
+    case FileType::kCarve:
+      success = puffin::LocateDeflatesByCarving(
+          data, size, deflates, puffin::GetDefaultNumThreads());
       break;
     default:
       LOG(ERROR) << "Unknown file type: (" << file_type_to_override << ") nor ("
-                 << extension << ").";
+                 << extension << "), and the content of " << file_name
+                 << " does not have a known signature.";
       return false;
   }
+  if (!success) {
+    // The signatures are short, so a file that only happens to start with one
+    // is treated as a raw file.
+    TEST_AND_RETURN_FALSE(is_detected);
+    LOG(WARNING) << "Failed to locate the deflates in " << file_name
+                 << " based on its content, treating it as a raw file.";
+    deflates->clear();
+  }
+  if (nested_streams != nullptr) {
+    TEST_AND_RETURN_FALSE(puffin::LocateNestedDeflateStreams(
+        data, size, *deflates, puffin::GetDefaultNumThreads(), max_depth,
+        nested_streams));
+  }
   // Return the stream to its zero offset in case we used it.
   TEST_AND_RETURN_FALSE(stream->Seek(0));
 
@@ -182,8 +365,10 @@ bool LocateDeflatesBasedOnFileType(const UniqueStreamPtr& stream,
                 "Type of the operation: puff, huff, puffdiff, puffpatch, "   \
                 "puffhuff");                                                 \
   DEFINE_string(src_file_type, "",                                           \
-                "Type of the input source file: deflate, gzip, "             \
-                "zlib or zip");                                              \
+                "Type of the input source file: deflate, gzip, zlib, zip, "  \
+                "tar, squashfs, png, pdf, elf, raw, or carve to search a "   \
+                "raw image for embedded gzip and zlib streams. Detected "    \
+                "from the file name or content if not set");                 \
   DEFINE_string(dst_file_type, "",                                           \
                 "Same as src_file_type but for the target file");            \
   DEFINE_bool(verbose, false,                                                \
@@ -193,7 +378,35 @@ bool LocateDeflatesBasedOnFileType(const UniqueStreamPtr& stream,
                 "Maximum size to cache the puff stream. Used in puffpatch"); \
   DEFINE_int32(patch_algorithm, 0,                                           \
                "Type of raw diff algorithm to use. The current supported "   \
-               "ones are 0: bsdiff, 1: zucchini.");
+               "ones are 0: bsdiff, 1: zucchini, 2: bsdiff split into "      \
+               "independent sub-patches, which needs a puffpatch that "      \
+               "supports version 2.");                                       \
+  DEFINE_uint64(diff_memory, 0,                                              \
+                "If not 0, puffdiff creates a split bsdiff patch by "        \
+                "diffing windows of the source within about this many "      \
+                "bytes of memory");                                          \
+  DEFINE_bool(copy_deflates, false,                                          \
+              "Makes puffdiff copy the deflates of the target that are in "  \
+              "the source bit for bit instead of diffing them. Patches "     \
+              "using this need a puffpatch that supports version 2");        \
+  DEFINE_bool(direct_io, false,                                              \
+              "Writes the target file of puffpatch in large batches using "  \
+              "O_DIRECT if it is supported");                                \
+  DEFINE_uint64(patch_threads, 1,                                            \
+                "The number of threads to apply a bsdiff patch with in "     \
+                "puffpatch");                                                \
+  DEFINE_uint64(zucchini_memory, 0,                                          \
+                "If not 0, puffpatch fails a zucchini patch that needs "     \
+                "more than this many bytes of memory");                      \
+  DEFINE_uint64(max_nested_depth, 1,                                         \
+                "How many levels of containers (zip, gzip or tar) stored "   \
+                "without compression in zip and tar files, or compressed "   \
+                "with --nested_deflates, are searched for deflates");        \
+  DEFINE_bool(nested_deflates, false,                                        \
+              "Makes puffdiff also diff the deflates in the uncompressed "   \
+              "data of deflate streams, e.g. of the APKs in a .tar.gz file " \
+              "with --max_nested_depth=2. Patches using this need a "        \
+              "puffpatch that supports version 2");
 #ifndef USE_BRILLO
 SETUP_FLAGS;
 #endif
@@ -231,14 +444,16 @@ bool Main(int argc, char** argv) {
 
   if (FLAGS_operation == "puff" || FLAGS_operation == "puffhuff") {
     TEST_AND_RETURN_FALSE(LocateDeflatesBasedOnFileType(
-        src_stream, FLAGS_src_file, FLAGS_src_file_type, &src_deflates_bit));
+        src_stream, FLAGS_src_file, FLAGS_src_file_type, FLAGS_max_nested_depth,
+        src_extents.empty(), &src_deflates_bit, nullptr));
 
     if (src_deflates_bit.empty() && src_deflates_byte.empty()) {
       LOG(WARNING) << "You should pass source deflates, is this intentional?";
     }
     if (src_deflates_bit.empty()) {
-      TEST_AND_RETURN_FALSE(FindDeflateSubBlocks(src_stream, src_deflates_byte,
-                                                 &src_deflates_bit));
+      TEST_AND_RETURN_FALSE(FindDeflateSubBlocks(
+          src_stream, src_deflates_byte, &src_deflates_bit,
+          puffin::GetDefaultNumThreads()));
     }
     TEST_AND_RETURN_FALSE(dst_puffs.empty());
     uint64_t dst_puff_size;
@@ -318,10 +533,16 @@ bool Main(int argc, char** argv) {
     auto dst_stream = FileStream::Open(FLAGS_dst_file, true, false);
     TEST_AND_RETURN_FALSE(dst_stream);
 
+    // The deflate streams with deflates in their uncompressed data.
+    vector<BitExtent> src_nested, dst_nested;
     TEST_AND_RETURN_FALSE(LocateDeflatesBasedOnFileType(
-        src_stream, FLAGS_src_file, FLAGS_src_file_type, &src_deflates_bit));
+        src_stream, FLAGS_src_file, FLAGS_src_file_type, FLAGS_max_nested_depth,
+        src_extents.empty(), &src_deflates_bit,
+        FLAGS_nested_deflates ? &src_nested : nullptr));
     TEST_AND_RETURN_FALSE(LocateDeflatesBasedOnFileType(
-        dst_stream, FLAGS_dst_file, FLAGS_dst_file_type, &dst_deflates_bit));
+        dst_stream, FLAGS_dst_file, FLAGS_dst_file_type, FLAGS_max_nested_depth,
+        true, &dst_deflates_bit,
+        FLAGS_nested_deflates ? &dst_nested : nullptr));
 
     if (src_deflates_bit.empty() && src_deflates_byte.empty()) {
       LOG(WARNING) << "You should pass source deflates, is this intentional?";
@@ -336,28 +557,42 @@ bool Main(int argc, char** argv) {
     }
 
     if (src_deflates_bit.empty()) {
-      TEST_AND_RETURN_FALSE(FindDeflateSubBlocks(src_stream, src_deflates_byte,
-                                                 &src_deflates_bit));
+      TEST_AND_RETURN_FALSE(FindDeflateSubBlocks(
+          src_stream, src_deflates_byte, &src_deflates_bit,
+          puffin::GetDefaultNumThreads()));
     }
 
     if (dst_deflates_bit.empty()) {
-      TEST_AND_RETURN_FALSE(FindDeflateSubBlocks(dst_stream, dst_deflates_byte,
-                                                 &dst_deflates_bit));
+      TEST_AND_RETURN_FALSE(FindDeflateSubBlocks(
+          dst_stream, dst_deflates_byte, &dst_deflates_bit,
+          puffin::GetDefaultNumThreads()));
     }
 
-    if (FLAGS_patch_algorithm != 0 && FLAGS_patch_algorithm != 1) {
-      LOG(ERROR)
-          << "The supported patch algorithms are 0: bsdiff, 1: zucchini.";
+    if (FLAGS_patch_algorithm < 0 || FLAGS_patch_algorithm > 2) {
+      LOG(ERROR) << "The supported patch algorithms are 0: bsdiff, "
+                 << "1: zucchini, 2: split bsdiff.";
       return false;
     }
     // TODO(xunchang) add flags to select the bsdiff compressors.
     Buffer puffdiff_delta;
-    TEST_AND_RETURN_FALSE(puffin::PuffDiff(
-        std::move(src_stream), std::move(dst_stream), src_deflates_bit,
-        dst_deflates_bit,
-        {bsdiff::CompressorType::kBZ2, bsdiff::CompressorType::kBrotli},
-        static_cast<puffin::PatchAlgorithm>(FLAGS_patch_algorithm),
-        "/tmp/patch.tmp", &puffdiff_delta));
+    if (FLAGS_diff_memory > 0) {
+      if (!dst_nested.empty()) {
+        LOG(WARNING) << "The deflates in the uncompressed data of deflate "
+                     << "streams are not diffed with --diff_memory.";
+      }
+      TEST_AND_RETURN_FALSE(puffin::PuffDiffWindowed(
+          std::move(src_stream), std::move(dst_stream), src_deflates_bit,
+          dst_deflates_bit,
+          {bsdiff::CompressorType::kBZ2, bsdiff::CompressorType::kBrotli},
+          FLAGS_diff_memory, &puffdiff_delta));
+    } else {
+      TEST_AND_RETURN_FALSE(puffin::PuffDiff(
+          std::move(src_stream), std::move(dst_stream), src_deflates_bit,
+          dst_deflates_bit, src_nested, dst_nested, FLAGS_max_nested_depth,
+          {bsdiff::CompressorType::kBZ2, bsdiff::CompressorType::kBrotli},
+          static_cast<puffin::PatchAlgorithm>(FLAGS_patch_algorithm),
+          FLAGS_copy_deflates, &puffdiff_delta));
+    }
     if (FLAGS_verbose) {
       LOG(INFO) << "patch_size: " << puffdiff_delta.size();
     }
@@ -366,15 +601,13 @@ bool Main(int argc, char** argv) {
     TEST_AND_RETURN_FALSE(
         patch_stream->Write(puffdiff_delta.data(), puffdiff_delta.size()));
   } else if (FLAGS_operation == "puffpatch") {
-    auto patch_stream = FileStream::Open(FLAGS_patch_file, true, false);
-    TEST_AND_RETURN_FALSE(patch_stream);
-    uint64_t patch_size;
-    TEST_AND_RETURN_FALSE(patch_stream->GetSize(&patch_size));
-
-    Buffer puffdiff_delta(patch_size);
-    TEST_AND_RETURN_FALSE(
-        patch_stream->Read(puffdiff_delta.data(), puffdiff_delta.size()));
-    auto dst_stream = FileStream::Open(FLAGS_dst_file, false, true);
+    // Map the patch instead of reading it, so large patches do not need to be
+    // copied into memory.
+    auto puffdiff_delta = ScopedMmap::Open(FLAGS_patch_file);
+    TEST_AND_RETURN_FALSE(puffdiff_delta);
+    auto dst_stream = FLAGS_direct_io
+                          ? DirectFileStream::Open(FLAGS_dst_file)
+                          : FileStream::Open(FLAGS_dst_file, false, true);
     TEST_AND_RETURN_FALSE(dst_stream);
     if (!dst_extents.empty()) {
       dst_stream =
@@ -383,9 +616,10 @@ bool Main(int argc, char** argv) {
     }
     // Apply the patch. Use 50MB cache, it should be enough for most of the
     // operations.
-    TEST_AND_RETURN_FALSE(puffin::PuffPatch(
-        std::move(src_stream), std::move(dst_stream), puffdiff_delta.data(),
-        puffdiff_delta.size(), FLAGS_cache_size));
+    TEST_AND_RETURN_FALSE(puffin::PuffPatchInParallel(
+        std::move(src_stream), std::move(dst_stream), puffdiff_delta->data(),
+        puffdiff_delta->size(), FLAGS_patch_threads, FLAGS_cache_size,
+        nullptr, nullptr, FLAGS_zucchini_memory));
   }
 
   if (FLAGS_verbose) {
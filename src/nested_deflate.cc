@@ -0,0 +1,235 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/nested_deflate.h"
+
+#include <string.h>
+
+#include <vector>
+
+#include "puffin/src/bit_reader.h"
+#include "puffin/src/bit_writer.h"
+#include "puffin/src/include/puffin/huffer.h"
+#include "puffin/src/include/puffin/puffer.h"
+#include "puffin/src/logging.h"
+#include "puffin/src/puff_data.h"
+#include "puffin/src/puff_reader.h"
+#include "puffin/src/puff_writer.h"
+
+using std::vector;
+
+namespace puffin {
+
+namespace {
+
+// Passes the puff data of a |Puffer| on to |puff_writer| with all the literals
+// set to zero. If |uncompressed| is not null, the uncompressed data of the
+// deflate stream is appended to it.
+class NestedPuffWriter : public PuffWriterInterface {
+ public:
+  NestedPuffWriter(PuffWriterInterface* puff_writer, Buffer* uncompressed)
+      : puff_writer_(puff_writer),
+        uncompressed_(uncompressed),
+        final_block_(false) {}
+  ~NestedPuffWriter() override = default;
+
+  bool Insert(const PuffData& pd) override {
+    switch (pd.type) {
+      case PuffData::Type::kLiteral:
+        if (uncompressed_ != nullptr) {
+          uncompressed_->push_back(pd.byte);
+        }
+        literal_.type = PuffData::Type::kLiteral;
+        literal_.byte = 0;
+        return puff_writer_->Insert(literal_);
+
+      case PuffData::Type::kLiterals:
+        if (uncompressed_ != nullptr) {
+          auto pos = uncompressed_->size();
+          uncompressed_->resize(pos + pd.length);
+          TEST_AND_RETURN_FALSE(
+              pd.read_fn(uncompressed_->data() + pos, pd.length));
+        } else {
+          TEST_AND_RETURN_FALSE(pd.read_fn(nullptr, pd.length));
+        }
+        literal_.type = PuffData::Type::kLiterals;
+        literal_.length = pd.length;
+        literal_.read_fn = [](uint8_t* buffer, size_t count) {
+          if (buffer != nullptr) {
+            memset(buffer, 0, count);
+          }
+          return true;
+        };
+        return puff_writer_->Insert(literal_);
+
+      case PuffData::Type::kLenDist:
+        if (uncompressed_ != nullptr) {
+          TEST_AND_RETURN_FALSE(pd.distance <= uncompressed_->size());
+          // The copies can overlap themselves, so they go byte by byte.
+          for (size_t idx = 0; idx < pd.length; idx++) {
+            uncompressed_->push_back(
+                (*uncompressed_)[uncompressed_->size() - pd.distance]);
+          }
+        }
+        return puff_writer_->Insert(pd);
+
+      case PuffData::Type::kBlockMetadata:
+        final_block_ = (pd.block_metadata[0] & 0x80) != 0;
+        return puff_writer_->Insert(pd);
+
+      default:
+        return puff_writer_->Insert(pd);
+    }
+  }
+
+  bool Flush() override { return puff_writer_->Flush(); }
+  size_t Size() override { return puff_writer_->Size(); }
+
+  // Whether the last block written is the final block of the stream.
+  bool final_block() const { return final_block_; }
+
+ private:
+  PuffWriterInterface* puff_writer_;
+  Buffer* uncompressed_;
+  bool final_block_;
+
+  // The zeroed literals passed on to |puff_writer_|.
+  PuffData literal_;
+
+  DISALLOW_COPY_AND_ASSIGN(NestedPuffWriter);
+};
+
+// Reads the puff of a nested image for a |Huffer|, and fills its literals from
+// the uncompressed data of the image.
+class NestedPuffReader : public PuffReaderInterface {
+ public:
+  NestedPuffReader(const uint8_t* puff,
+                   size_t puff_size,
+                   const uint8_t* uncompressed,
+                   size_t uncompressed_size)
+      : puff_reader_(puff, puff_size),
+        uncompressed_(uncompressed),
+        uncompressed_size_(uncompressed_size),
+        pos_(0) {}
+  ~NestedPuffReader() override = default;
+
+  bool GetNext(PuffData* pd) override {
+    TEST_AND_RETURN_FALSE(puff_reader_.GetNext(pd));
+    if (pd->type == PuffData::Type::kLiterals) {
+      TEST_AND_RETURN_FALSE(pd->length <= uncompressed_size_ - pos_);
+      auto literals = uncompressed_ + pos_;
+      pos_ += pd->length;
+      // The puff reader still has to skip the zeroed literals.
+      auto read_fn = pd->read_fn;
+      pd->read_fn = [read_fn, literals](uint8_t* buffer,
+                                        size_t count) mutable {
+        TEST_AND_RETURN_FALSE(read_fn(buffer, count));
+        memcpy(buffer, literals, count);
+        literals += count;
+        return true;
+      };
+    } else if (pd->type == PuffData::Type::kLenDist) {
+      TEST_AND_RETURN_FALSE(pd->length <= uncompressed_size_ - pos_);
+      pos_ += pd->length;
+    }
+    return true;
+  }
+
+  size_t BytesLeft() const override { return puff_reader_.BytesLeft(); }
+
+  // The number of bytes of the uncompressed data covered so far.
+  size_t pos() const { return pos_; }
+
+ private:
+  BufferPuffReader puff_reader_;
+  const uint8_t* uncompressed_;
+  size_t uncompressed_size_;
+  size_t pos_;
+
+  DISALLOW_COPY_AND_ASSIGN(NestedPuffReader);
+};
+
+// Same as |InflateDeflateStream|, and sets |puff_size| to the size of the
+// puff of the stream.
+bool Inflate(const uint8_t* data,
+             uint64_t size,
+             uint64_t offset,
+             uint64_t* length,
+             Buffer* uncompressed,
+             uint64_t* puff_size) {
+  auto start_byte = offset / 8;
+  TEST_AND_RETURN_FALSE(start_byte < size);
+  BufferBitReader bit_reader(data + start_byte, size - start_byte);
+  uint64_t bits_to_skip = offset % 8;
+  TEST_AND_RETURN_FALSE(bit_reader.CacheBits(bits_to_skip));
+  bit_reader.DropBits(bits_to_skip);
+
+  // With a list of blocks, the puffer stops at the final block.
+  uncompressed->clear();
+  BufferPuffWriter puff_writer(nullptr, 0);
+  NestedPuffWriter nested_writer(&puff_writer, uncompressed);
+  vector<BitExtent> blocks;
+  Puffer puffer;
+  TEST_AND_RETURN_FALSE(
+      puffer.PuffDeflate(&bit_reader, &nested_writer, &blocks));
+  TEST_AND_RETURN_FALSE(nested_writer.final_block());
+  *length = bit_reader.OffsetInBits() - bits_to_skip;
+  *puff_size = puff_writer.Size();
+  return true;
+}
+
+}  // namespace
+
+bool InflateDeflateStream(const uint8_t* data,
+                          uint64_t size,
+                          uint64_t offset,
+                          uint64_t* length,
+                          Buffer* uncompressed) {
+  uint64_t puff_size;
+  return Inflate(data, size, offset, length, uncompressed, &puff_size);
+}
+
+bool CreateNestedImage(const uint8_t* data,
+                       uint64_t size,
+                       uint64_t offset,
+                       uint64_t* length,
+                       Buffer* image,
+                       uint64_t* puff_size) {
+  TEST_AND_RETURN_FALSE(Inflate(data, size, offset, length, image, puff_size));
+  image->insert(image->begin(), *puff_size, 0);
+
+  auto start_byte = offset / 8;
+  auto end_byte = (offset + *length + 7) / 8;
+  BufferBitReader bit_reader(data + start_byte, end_byte - start_byte);
+  uint64_t bits_to_skip = offset % 8;
+  TEST_AND_RETURN_FALSE(bit_reader.CacheBits(bits_to_skip));
+  bit_reader.DropBits(bits_to_skip);
+
+  BufferPuffWriter puff_writer(image->data(), *puff_size);
+  NestedPuffWriter nested_writer(&puff_writer, nullptr);
+  Puffer puffer;
+  TEST_AND_RETURN_FALSE(
+      puffer.PuffDeflate(&bit_reader, &nested_writer, nullptr));
+  TEST_AND_RETURN_FALSE(puff_writer.Size() == *puff_size);
+  return true;
+}
+
+bool HuffNestedImage(const uint8_t* image,
+                     uint64_t image_size,
+                     uint64_t puff_size,
+                     uint64_t length,
+                     Buffer* deflate) {
+  TEST_AND_RETURN_FALSE(puff_size <= image_size);
+  deflate->assign((length + 7) / 8, 0);
+  NestedPuffReader puff_reader(image, puff_size, image + puff_size,
+                               image_size - puff_size);
+  BufferBitWriter bit_writer(deflate->data(), deflate->size());
+  Huffer huffer;
+  TEST_AND_RETURN_FALSE(huffer.HuffDeflate(&puff_reader, &bit_writer));
+  TEST_AND_RETURN_FALSE(bit_writer.Size() == deflate->size());
+  TEST_AND_RETURN_FALSE(puff_reader.pos() == image_size - puff_size);
+  return true;
+}
+
+}  // namespace puffin
@@ -0,0 +1,51 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_NESTED_DEFLATE_H_
+#define SRC_NESTED_DEFLATE_H_
+
+#include <cstdint>
+
+#include "puffin/src/include/puffin/common.h"
+
+namespace puffin {
+
+// A deflate stream whose uncompressed data has deflates too (e.g. the deflate
+// stream of a .tar.gz file, or a zip entry that is a compressed APK) is diffed
+// as its nested image: its puff with all the literals set to zero, followed by
+// its uncompressed data. The deflates in the uncompressed data can then be
+// located and puffed like any others, and the puff part stays small in a
+// patch. The literals are taken back from the uncompressed data to huff it.
+
+// Decompresses the deflate stream that starts at bit |offset| of the |size|
+// bytes at |data| into |uncompressed|. The stream ends at its final block, and
+// |length| is set to its length in bits.
+bool InflateDeflateStream(const uint8_t* data,
+                          uint64_t size,
+                          uint64_t offset,
+                          uint64_t* length,
+                          Buffer* uncompressed);
+
+// Same as above, but creates the nested image of the stream in |image|, of
+// which the puff is the first |puff_size| bytes.
+bool CreateNestedImage(const uint8_t* data,
+                       uint64_t size,
+                       uint64_t offset,
+                       uint64_t* length,
+                       Buffer* image,
+                       uint64_t* puff_size);
+
+// Huffs the nested image of |image_size| bytes at |image|, of which the puff is
+// the first |puff_size| bytes, back into the |length| bits of its deflate
+// stream. The stream starts at the first bit of |deflate|, and the unused bits
+// of its last byte are zero.
+bool HuffNestedImage(const uint8_t* image,
+                     uint64_t image_size,
+                     uint64_t puff_size,
+                     uint64_t length,
+                     Buffer* deflate);
+
+}  // namespace puffin
+
+#endif  // SRC_NESTED_DEFLATE_H_
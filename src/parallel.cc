@@ -0,0 +1,58 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/parallel.h"
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "puffin/src/logging.h"
+
+using std::vector;
+
+namespace puffin {
+
+size_t GetDefaultNumThreads() {
+  return std::max(1U, std::thread::hardware_concurrency());
+}
+
+bool RunInParallel(size_t num_threads,
+                   const std::function<bool(size_t thread_idx)>& worker) {
+  num_threads = std::max<size_t>(num_threads, 1);
+  // |vector<bool>| is not safe for concurrent writes to different elements.
+  vector<uint8_t> results(num_threads, 0);
+  vector<std::thread> threads;
+  threads.reserve(num_threads - 1);
+  for (size_t idx = 1; idx < num_threads; idx++) {
+    threads.emplace_back(
+        [&worker, &results, idx] { results[idx] = worker(idx) ? 1 : 0; });
+  }
+  results[0] = worker(0) ? 1 : 0;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return std::all_of(results.begin(), results.end(),
+                     [](uint8_t result) { return result != 0; });
+}
+
+bool ParallelFor(size_t num_tasks,
+                 size_t num_threads,
+                 const std::function<bool(size_t task_idx)>& task) {
+  TaskQueue queue(num_tasks);
+  num_threads = std::min(num_threads, num_tasks);
+  return RunInParallel(num_threads, [&queue, &task](size_t) {
+    size_t task_idx;
+    while (queue.Next(&task_idx)) {
+      if (!task(task_idx)) {
+        LOG(ERROR) << "Task " << task_idx << " failed.";
+        queue.Cancel();
+        return false;
+      }
+    }
+    return true;
+  });
+}
+
+}  // namespace puffin
@@ -0,0 +1,63 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_PARALLEL_H_
+#define SRC_PARALLEL_H_
+
+#include <atomic>
+#include <functional>
+
+#include "puffin/src/include/puffin/common.h"
+
+namespace puffin {
+
+// Returns the number of threads to use when the caller does not specify it.
+// This is the number of hardware threads and at least one.
+size_t GetDefaultNumThreads();
+
+// Hands out the indices [0, |num_tasks|) one at a time to any number of
+// threads. Threads that finish their tasks early simply take the next one, so
+// tasks of very different sizes are still balanced across the threads.
+class TaskQueue {
+ public:
+  explicit TaskQueue(size_t num_tasks) : num_tasks_(num_tasks), next_(0) {}
+
+  // Returns the next task in |task_idx|, or false if there is none left.
+  bool Next(size_t* task_idx) {
+    auto idx = next_.fetch_add(1, std::memory_order_relaxed);
+    if (idx >= num_tasks_) {
+      return false;
+    }
+    *task_idx = idx;
+    return true;
+  }
+
+  // Drops all the remaining tasks. Used to stop early after a failure.
+  void Cancel() { next_.store(num_tasks_, std::memory_order_relaxed); }
+
+ private:
+  const size_t num_tasks_;
+  std::atomic<size_t> next_;
+
+  DISALLOW_COPY_AND_ASSIGN(TaskQueue);
+};
+
+// Runs |worker| on |num_threads| threads (the calling thread being one of
+// them) and waits for all of them to finish. |worker| receives the index of
+// the thread it runs on, in [0, |num_threads|). Returns false if any of them
+// returned false.
+bool RunInParallel(size_t num_threads,
+                   const std::function<bool(size_t thread_idx)>& worker);
+
+// Runs |task| for all the indices in [0, |num_tasks|) using up to
+// |num_threads| threads. The tasks are distributed through a |TaskQueue|.
+// After the first failing task, no new tasks are started and false is
+// returned.
+bool ParallelFor(size_t num_tasks,
+                 size_t num_threads,
+                 const std::function<bool(size_t task_idx)>& task);
+
+}  // namespace puffin
+
+#endif  // SRC_PARALLEL_H_
@@ -2,17 +2,22 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <endian.h>
+
+#include <array>
 #include <string>
 #include <vector>
 
 #include "gtest/gtest.h"
 
 #include "puffin/memory_stream.h"
+#include "puffin/src/include/puffin/brotli_util.h"
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/puffdiff.h"
 #include "puffin/src/include/puffin/puffpatch.h"
 #include "puffin/src/include/puffin/utils.h"
 #include "puffin/src/logging.h"
+#include "puffin/src/puffin.pb.h"
 #include "puffin/src/puffin_stream.h"
 #include "puffin/src/unittest_common.h"
 
@@ -134,11 +139,8 @@ void TestPatching(const Buffer& src_buf,
                   const vector<BitExtent>& dst_deflates,
                   const Buffer patch) {
   Buffer patch_out;
-  string patch_path;
-  ASSERT_TRUE(MakeTempFile(&patch_path, nullptr));
-  ScopedPathUnlinker scoped_unlinker(patch_path);
   ASSERT_TRUE(PuffDiff(src_buf, dst_buf, src_deflates, dst_deflates,
-                       {bsdiff::CompressorType::kBZ2}, patch_path, &patch_out));
+                       {bsdiff::CompressorType::kBZ2}, &patch_out));
 
 #if PRINT_SAMPLE
   PrintArray("kPatchXXXXX", patch_out);
@@ -152,6 +154,235 @@ void TestPatching(const Buffer& src_buf,
   ASSERT_TRUE(PuffPatch(std::move(src_stream), std::move(dst_stream),
                         patch.data(), patch.size()));
   EXPECT_EQ(dst_buf_out, dst_buf);
+
+  // Same with the patch given as a stream.
+  std::fill(dst_buf_out.begin(), dst_buf_out.end(), 0);
+  ASSERT_TRUE(PuffPatch(MemoryStream::CreateForRead(src_buf),
+                        MemoryStream::CreateForWrite(&dst_buf_out),
+                        MemoryStream::CreateForRead(patch)));
+  EXPECT_EQ(dst_buf_out, dst_buf);
+
+  // Same applied on several threads.
+  std::fill(dst_buf_out.begin(), dst_buf_out.end(), 0);
+  ASSERT_TRUE(PuffPatchInParallel(MemoryStream::CreateForRead(src_buf),
+                                  MemoryStream::CreateForWrite(&dst_buf_out),
+                                  patch.data(), patch.size(), 4));
+  EXPECT_EQ(dst_buf_out, dst_buf);
+
+  // Same with the puffs of the source in a cache shared by two operations.
+  auto shared_cache = std::make_shared<PuffCache>(1024 * 1024);
+  for (size_t num_threads : {1, 4}) {
+    std::fill(dst_buf_out.begin(), dst_buf_out.end(), 0);
+    PuffCacheStats stats;
+    ASSERT_TRUE(PuffPatchInParallel(MemoryStream::CreateForRead(src_buf),
+                                    MemoryStream::CreateForWrite(&dst_buf_out),
+                                    patch.data(), patch.size(), num_threads,
+                                    kDefaultCacheSize, shared_cache, &stats));
+    EXPECT_EQ(dst_buf_out, dst_buf);
+  }
+
+  // Same with the patch split into sub-patches.
+  Buffer split_patch;
+  ASSERT_TRUE(PuffDiff(MemoryStream::CreateForRead(src_buf),
+                       MemoryStream::CreateForRead(dst_buf), src_deflates,
+                       dst_deflates, {bsdiff::CompressorType::kBZ2},
+                       PatchAlgorithm::kSplitBsdiff, &split_patch));
+  std::fill(dst_buf_out.begin(), dst_buf_out.end(), 0);
+  ASSERT_TRUE(PuffPatch(MemoryStream::CreateForRead(src_buf),
+                        MemoryStream::CreateForWrite(&dst_buf_out),
+                        split_patch.data(), split_patch.size()));
+  EXPECT_EQ(dst_buf_out, dst_buf);
+  std::fill(dst_buf_out.begin(), dst_buf_out.end(), 0);
+  ASSERT_TRUE(PuffPatch(MemoryStream::CreateForRead(src_buf),
+                        MemoryStream::CreateForWrite(&dst_buf_out),
+                        MemoryStream::CreateForRead(split_patch)));
+  EXPECT_EQ(dst_buf_out, dst_buf);
+  std::fill(dst_buf_out.begin(), dst_buf_out.end(), 0);
+  ASSERT_TRUE(PuffPatchInParallel(MemoryStream::CreateForRead(src_buf),
+                                  MemoryStream::CreateForWrite(&dst_buf_out),
+                                  split_patch.data(), split_patch.size(), 4));
+  EXPECT_EQ(dst_buf_out, dst_buf);
+
+  // Same with the deflates that are also in the source copied.
+  Buffer copy_patch;
+  ASSERT_TRUE(PuffDiff(MemoryStream::CreateForRead(src_buf),
+                       MemoryStream::CreateForRead(dst_buf), src_deflates,
+                       dst_deflates, {bsdiff::CompressorType::kBZ2},
+                       PatchAlgorithm::kBsdiff, true, &copy_patch));
+  std::fill(dst_buf_out.begin(), dst_buf_out.end(), 0);
+  ASSERT_TRUE(PuffPatch(MemoryStream::CreateForRead(src_buf),
+                        MemoryStream::CreateForWrite(&dst_buf_out),
+                        copy_patch.data(), copy_patch.size()));
+  EXPECT_EQ(dst_buf_out, dst_buf);
+  std::fill(dst_buf_out.begin(), dst_buf_out.end(), 0);
+  ASSERT_TRUE(PuffPatchInParallel(MemoryStream::CreateForRead(src_buf),
+                                  MemoryStream::CreateForWrite(&dst_buf_out),
+                                  copy_patch.data(), copy_patch.size(), 4));
+  EXPECT_EQ(dst_buf_out, dst_buf);
+
+  // Same with the sub-patches diffed against windows of the source.
+  split_patch.clear();
+  ASSERT_TRUE(PuffDiffWindowed(MemoryStream::CreateForRead(src_buf),
+                               MemoryStream::CreateForRead(dst_buf),
+                               src_deflates, dst_deflates,
+                               {bsdiff::CompressorType::kBZ2}, 1 << 20,
+                               &split_patch));
+  std::fill(dst_buf_out.begin(), dst_buf_out.end(), 0);
+  ASSERT_TRUE(PuffPatch(MemoryStream::CreateForRead(src_buf),
+                        MemoryStream::CreateForWrite(&dst_buf_out),
+                        split_patch.data(), split_patch.size()));
+  EXPECT_EQ(dst_buf_out, dst_buf);
+}
+
+// Creates in |data| a deflate stream of a gzip file of |text| after 16 other
+// bytes, and puts its deflates in |deflates|.
+void CreateNestedDeflate(const Buffer& text,
+                         Buffer* data,
+                         vector<BitExtent>* deflates) {
+  Buffer text_deflate, gzip_deflate;
+  ASSERT_TRUE(FixedHuffmanDeflate(text, &text_deflate));
+  Buffer gzip = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 3};
+  gzip.insert(gzip.end(), text_deflate.begin(), text_deflate.end());
+  gzip.resize(gzip.size() + 8);  // The checksum and size are not checked.
+  ASSERT_TRUE(FixedHuffmanDeflate(gzip, &gzip_deflate));
+  data->assign(16, 0);
+  data->insert(data->end(), gzip_deflate.begin(), gzip_deflate.end());
+  ASSERT_TRUE(LocateDeflatesInDeflateStream(
+      gzip_deflate.data(), gzip_deflate.size(), 16, deflates, nullptr));
+}
+
+TEST(PatchingTest, PatchingNestedDeflatesTest) {
+  Buffer src_text, dst_text;
+  for (size_t idx = 0; idx < 4096; idx++) {
+    src_text.push_back('a' + (idx * 7 + idx / 13) % 26);
+  }
+  dst_text = src_text;
+  dst_text[100] = '!';
+  dst_text.insert(dst_text.begin() + 2000, 5, '?');
+  Buffer src_buf, dst_buf;
+  vector<BitExtent> src_deflates, dst_deflates;
+  CreateNestedDeflate(src_text, &src_buf, &src_deflates);
+  CreateNestedDeflate(dst_text, &dst_buf, &dst_deflates);
+
+  // The deflate streams of the gzip files are in the uncompressed data.
+  vector<BitExtent> src_nested, dst_nested;
+  ASSERT_TRUE(LocateNestedDeflateStreams(src_buf.data(), src_buf.size(),
+                                         src_deflates, 1, 1, &src_nested));
+  ASSERT_TRUE(LocateNestedDeflateStreams(dst_buf.data(), dst_buf.size(),
+                                         dst_deflates, 1, 1, &dst_nested));
+  ASSERT_EQ(src_nested, src_deflates);
+  ASSERT_EQ(dst_nested, dst_deflates);
+
+  for (auto algorithm :
+       {PatchAlgorithm::kBsdiff, PatchAlgorithm::kSplitBsdiff}) {
+    Buffer patch;
+    ASSERT_TRUE(PuffDiff(MemoryStream::CreateForRead(src_buf),
+                         MemoryStream::CreateForRead(dst_buf), src_deflates,
+                         dst_deflates, src_nested, dst_nested, 1,
+                         {bsdiff::CompressorType::kBZ2}, algorithm, false,
+                         &patch));
+    Buffer dst_buf_out(dst_buf.size());
+    ASSERT_TRUE(PuffPatch(MemoryStream::CreateForRead(src_buf),
+                          MemoryStream::CreateForWrite(&dst_buf_out),
+                          patch.data(), patch.size()));
+    EXPECT_EQ(dst_buf_out, dst_buf);
+    std::fill(dst_buf_out.begin(), dst_buf_out.end(), 0);
+    ASSERT_TRUE(PuffPatchInParallel(MemoryStream::CreateForRead(src_buf),
+                                    MemoryStream::CreateForWrite(&dst_buf_out),
+                                    patch.data(), patch.size(), 4));
+    EXPECT_EQ(dst_buf_out, dst_buf);
+  }
+}
+
+// Appends |x| to |data| in the sign-magnitude little-endian format of bsdiff.
+void AppendBsdiffInt64(int64_t x, Buffer* data) {
+  uint64_t y = x < 0 ? (1ULL << 63) - x : x;
+  for (int i = 0; i < 8; i++) {
+    data->push_back(y & 0xff);
+    y >>= 8;
+  }
+}
+
+TEST(PatchingTest, PatchingDiffsOutsideOfSourceTest) {
+  const Buffer src_buf = {10, 11, 12, 13, 14, 15, 16, 17};
+  const Buffer dst_buf = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+  // The diff size, extra size and offset increment of each control entry.
+  // The second entry starts two bytes before the source and the third ends two
+  // bytes after it.
+  const vector<std::array<int64_t, 3>> entries = {
+      {4, 0, -6}, {4, 0, 4}, {4, 0, 0}};
+  const vector<int64_t> old_offsets = {0, 1, 2, 3, -2, -1, 0, 1, 6, 7, 8, 9};
+
+  Buffer ctrl, diff, extra;
+  for (const auto& entry : entries) {
+    for (auto x : entry) {
+      AppendBsdiffInt64(x, &ctrl);
+    }
+  }
+  for (size_t idx = 0; idx < dst_buf.size(); idx++) {
+    auto old_offset = old_offsets[idx];
+    bool in_source = old_offset >= 0 &&
+                     old_offset < static_cast<int64_t>(src_buf.size());
+    diff.push_back(dst_buf[idx] - (in_source ? src_buf[old_offset] : 0));
+  }
+  Buffer ctrl_brotli, diff_brotli, extra_brotli;
+  ASSERT_TRUE(BrotliEncode(ctrl.data(), ctrl.size(), &ctrl_brotli));
+  ASSERT_TRUE(BrotliEncode(diff.data(), diff.size(), &diff_brotli));
+  ASSERT_TRUE(BrotliEncode(extra.data(), extra.size(), &extra_brotli));
+
+  // Replace the bsdiff patch of a puffin patch with the one built above.
+  Buffer patch;
+  ASSERT_TRUE(PuffDiff(src_buf, dst_buf, {}, {},
+                       {bsdiff::CompressorType::kBrotli}, &patch));
+  uint32_t header_size;
+  memcpy(&header_size, patch.data() + 4, sizeof(header_size));
+  patch.resize(4 + sizeof(header_size) + be32toh(header_size));
+  patch.insert(patch.end(), {'B', 'S', 'D', 'F', '2', 2, 2, 2});
+  AppendBsdiffInt64(ctrl_brotli.size(), &patch);
+  AppendBsdiffInt64(diff_brotli.size(), &patch);
+  AppendBsdiffInt64(dst_buf.size(), &patch);
+  for (const auto* stream : {&ctrl_brotli, &diff_brotli, &extra_brotli}) {
+    patch.insert(patch.end(), stream->begin(), stream->end());
+  }
+
+  // The diff bytes outside of the source are output as they are, whether the
+  // patch is applied on one thread or on several.
+  for (size_t num_threads : {1, 4}) {
+    Buffer dst_buf_out(dst_buf.size());
+    ASSERT_TRUE(PuffPatchInParallel(MemoryStream::CreateForRead(src_buf),
+                                    MemoryStream::CreateForWrite(&dst_buf_out),
+                                    patch.data(), patch.size(), num_threads));
+    EXPECT_EQ(dst_buf_out, dst_buf);
+  }
+}
+
+TEST(PatchingTest, PatchingZucchiniOversizedHeaderTest) {
+  // The puffed images of the header add up to zero when they wrap around.
+  metadata::PatchHeader header;
+  header.set_version(1);
+  header.set_type(metadata::PatchHeader_PatchType_ZUCCHINI);
+  header.mutable_src()->set_puff_length(1ULL << 63);
+  header.mutable_dst()->set_puff_length(1ULL << 63);
+  string header_data;
+  ASSERT_TRUE(header.SerializeToString(&header_data));
+  Buffer zucchini_patch(1024), raw_patch;
+  ASSERT_TRUE(
+      BrotliEncode(zucchini_patch.data(), zucchini_patch.size(), &raw_patch));
+
+  Buffer patch = {'P', 'U', 'F', '1'};
+  uint32_t header_size = htobe32(header_data.size());
+  auto header_size_data = reinterpret_cast<const uint8_t*>(&header_size);
+  patch.insert(patch.end(), header_size_data,
+               header_size_data + sizeof(header_size));
+  patch.insert(patch.end(), header_data.begin(), header_data.end());
+  patch.insert(patch.end(), raw_patch.begin(), raw_patch.end());
+
+  const Buffer src_buf(16);
+  Buffer dst_buf(16);
+  EXPECT_FALSE(PuffPatch(MemoryStream::CreateForRead(src_buf),
+                         MemoryStream::CreateForWrite(&dst_buf), patch.data(),
+                         patch.size(), kDefaultCacheSize, nullptr, nullptr,
+                         1 << 20));
 }
 
 TEST(PatchingTest, Patching1To2Test) {
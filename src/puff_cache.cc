@@ -0,0 +1,109 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/include/puffin/puff_cache.h"
+
+#include <string.h>
+
+#include <utility>
+
+#include "puffin/src/logging.h"
+#include "puffin/src/sha256.h"
+
+using std::shared_ptr;
+
+namespace puffin {
+
+PuffCache::PuffCache(uint64_t max_size) : max_size_(max_size), size_(0) {}
+
+size_t PuffCache::KeyHash::operator()(const Key& key) const {
+  // The key is a digest already, so any part of it is a good hash.
+  size_t hash;
+  memcpy(&hash, key.data(), sizeof(hash));
+  return hash;
+}
+
+PuffCache::Key PuffCache::GetKey(const Buffer& deflate,
+                                 uint8_t first_bit,
+                                 uint64_t bit_length) {
+  Sha256 sha256;
+  sha256.Update(&first_bit, sizeof(first_bit));
+  sha256.Update(&bit_length, sizeof(bit_length));
+  sha256.Update(deflate.data(), deflate.size());
+  return sha256.Finish();
+}
+
+shared_ptr<const Buffer> PuffCache::Find(const Buffer& deflate,
+                                         uint8_t first_bit,
+                                         uint64_t bit_length,
+                                         PuffCacheStats* stats) {
+  auto key = GetKey(deflate, first_bit, bit_length);
+  shared_ptr<const Buffer> puff;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = index_.find(key);
+    if (iter != index_.end()) {
+      // Make it the most recently used entry.
+      entries_.splice(entries_.begin(), entries_, iter->second);
+      puff = iter->second->puff;
+    }
+  }
+  for (auto counters : {&stats_, stats}) {
+    if (!counters) {
+      continue;
+    }
+    if (puff) {
+      counters->hits++;
+      counters->hit_bytes += puff->size();
+    } else {
+      counters->misses++;
+    }
+  }
+  return puff;
+}
+
+bool PuffCache::Insert(const Buffer& deflate,
+                       uint8_t first_bit,
+                       uint64_t bit_length,
+                       shared_ptr<const Buffer> puff,
+                       PuffCacheStats* stats) {
+  TEST_AND_RETURN_FALSE(puff);
+  uint64_t entry_size = puff->size();
+  if (entry_size > max_size_) {
+    return false;
+  }
+  auto key = GetKey(deflate, first_bit, bit_length);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Another user may have added the same puff in the meantime.
+  if (index_.count(key) > 0) {
+    return true;
+  }
+
+  uint64_t evictions = 0;
+  while (size_ + entry_size > max_size_) {
+    auto last = std::prev(entries_.end());
+    size_ -= last->puff->size();
+    index_.erase(last->key);
+    entries_.erase(last);
+    evictions++;
+  }
+  entries_.push_front(Entry{key, std::move(puff)});
+  index_.emplace(key, entries_.begin());
+  size_ += entry_size;
+  for (auto counters : {&stats_, stats}) {
+    if (counters) {
+      counters->insertions++;
+      counters->evictions += evictions;
+    }
+  }
+  return true;
+}
+
+uint64_t PuffCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return size_;
+}
+
+}  // namespace puffin
@@ -8,25 +8,36 @@
 #include <inttypes.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "bsdiff/bsdiff.h"
-#include "bsdiff/patch_writer_factory.h"
+#include "bsdiff/compressor_interface.h"
+#include "bsdiff/constants.h"
+#include "bsdiff/control_entry.h"
+#include "bsdiff/patch_writer_interface.h"
+#include "bsdiff/suffix_array_index.h"
 #include "zucchini/buffer_view.h"
 #include "zucchini/patch_writer.h"
 #include "zucchini/zucchini.h"
 
-#include "puffin/file_stream.h"
 #include "puffin/memory_stream.h"
 #include "puffin/src/include/puffin/brotli_util.h"
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/puffer.h"
 #include "puffin/src/include/puffin/puffpatch.h"
+#include "puffin/src/extent_stream.h"
 #include "puffin/src/include/puffin/utils.h"
 #include "puffin/src/logging.h"
+#include "puffin/src/nested_deflate.h"
+#include "puffin/src/parallel.h"
 #include "puffin/src/puffin.pb.h"
 #include "puffin/src/puffin_stream.h"
+#include "puffin/src/shared_stream.h"
 
 using std::string;
 using std::vector;
@@ -49,38 +60,121 @@ void CopyVectorToRpf(
   }
 }
 
+// A sub-patch of a |PatchAlgorithm::kSplitBsdiff| patch: the bsdiff patch
+// |patch| creates the |dst| range of the destination puff stream from the
+// |src| range of the source puff stream.
+struct SubPatch {
+  ByteExtent src;
+  ByteExtent dst;
+  Buffer patch;
+};
+
+// A destination deflate that is copied from a bit-identical source deflate
+// instead of being diffed.
+struct CopyDeflate {
+  BitExtent src;
+  BitExtent dst;
+};
+
+// A destination deflate stream that is rebuilt from its nested image, which
+// the nested puffin patch |patch| creates from the nested image of the source
+// stream |src|. The puff of the image is the first |puff_size| bytes of it.
+struct NestedDeflate {
+  BitExtent src;
+  BitExtent dst;
+  uint64_t puff_size;
+  Buffer patch;
+};
+
 // Structure of a puffin patch
 // +-------+------------------+-------------+--------------+
 // |P|U|F|1| PatchHeader Size | PatchHeader | raw patch |
 // +-------+------------------+-------------+--------------+
-bool CreatePatch(const Buffer& raw_patch,
-                 const vector<BitExtent>& src_deflates,
-                 const vector<BitExtent>& dst_deflates,
-                 const vector<ByteExtent>& src_puffs,
-                 const vector<ByteExtent>& dst_puffs,
-                 uint64_t src_puff_size,
-                 uint64_t dst_puff_size,
-                 PatchAlgorithm patchAlgorithm,
-                 Buffer* patch) {
+//
+// Writes everything except the raw patch into |patch|. The raw patch is then
+// appended to |patch| by the caller.
+bool CreatePatchHeader(const vector<BitExtent>& src_deflates,
+                       const vector<BitExtent>& dst_deflates,
+                       const vector<ByteExtent>& src_puffs,
+                       const vector<ByteExtent>& dst_puffs,
+                       uint64_t src_puff_size,
+                       uint64_t dst_puff_size,
+                       const vector<BitExtent>& dst_sub_blocks,
+                       const vector<ByteExtent>& dst_sub_puffs,
+                       const vector<size_t>& src_puff_ids,
+                       const vector<SubPatch>& sub_patches,
+                       const vector<CopyDeflate>& copies,
+                       const vector<NestedDeflate>& nested,
+                       PatchAlgorithm patchAlgorithm,
+                       Buffer* patch) {
   metadata::PatchHeader header;
-  header.set_version(1);
+  // Older versions of |PuffPatch| cannot apply a patch with sub-patches,
+  // copies or nested deflate streams.
+  header.set_version(copies.empty() && nested.empty() &&
+                             patchAlgorithm != PatchAlgorithm::kSplitBsdiff
+                         ? 1
+                         : 2);
 
   CopyVectorToRpf(src_deflates, header.mutable_src()->mutable_deflates(), 1);
   CopyVectorToRpf(dst_deflates, header.mutable_dst()->mutable_deflates(), 1);
   CopyVectorToRpf(src_puffs, header.mutable_src()->mutable_puffs(), 8);
   CopyVectorToRpf(dst_puffs, header.mutable_dst()->mutable_puffs(), 8);
+  CopyVectorToRpf(dst_sub_blocks, header.mutable_dst()->mutable_sub_blocks(),
+                  1);
+  CopyVectorToRpf(dst_sub_puffs, header.mutable_dst()->mutable_sub_puffs(), 8);
+
+  for (size_t idx = 0; idx < src_puff_ids.size(); idx++) {
+    if (src_puff_ids[idx] != idx) {
+      auto duplicate = header.mutable_src()->add_duplicates();
+      duplicate->set_index(idx);
+      duplicate->set_original(src_puff_ids[idx]);
+    }
+  }
 
   header.mutable_src()->set_puff_length(src_puff_size);
   header.mutable_dst()->set_puff_length(dst_puff_size);
   header.set_type(static_cast<metadata::PatchHeader_PatchType>(patchAlgorithm));
 
+  // The sub-patches follow each other in the raw patch.
+  auto set_extent = [](metadata::BitExtent* to, uint64_t offset,
+                       uint64_t length) {
+    to->set_offset(offset * 8);
+    to->set_length(length * 8);
+  };
+  uint64_t sub_patch_offset = 0;
+  for (const auto& sub_patch : sub_patches) {
+    auto info = header.add_sub_patches();
+    set_extent(info->mutable_src(), sub_patch.src.offset,
+               sub_patch.src.length);
+    set_extent(info->mutable_dst(), sub_patch.dst.offset,
+               sub_patch.dst.length);
+    set_extent(info->mutable_patch(), sub_patch_offset,
+               sub_patch.patch.size());
+    sub_patch_offset += sub_patch.patch.size();
+  }
+  for (const auto& copy : copies) {
+    auto info = header.add_copies();
+    info->mutable_src()->set_offset(copy.src.offset);
+    info->mutable_src()->set_length(copy.src.length);
+    info->mutable_dst()->set_offset(copy.dst.offset);
+    info->mutable_dst()->set_length(copy.dst.length);
+  }
+  for (const auto& stream : nested) {
+    auto info = header.add_nested();
+    info->mutable_src()->set_offset(stream.src.offset);
+    info->mutable_src()->set_length(stream.src.length);
+    info->mutable_dst()->set_offset(stream.dst.offset);
+    info->mutable_dst()->set_length(stream.dst.length);
+    info->set_puff_length(stream.puff_size);
+    info->set_patch(stream.patch.data(), stream.patch.size());
+  }
+
   const size_t header_size_long = header.ByteSizeLong();
   TEST_AND_RETURN_FALSE(header_size_long <= UINT32_MAX);
   const uint32_t header_size = header_size_long;
 
   uint64_t offset = 0;
-  patch->resize(kMagicLength + sizeof(header_size) + header_size +
-                raw_patch.size());
+  patch->resize(kMagicLength + sizeof(header_size) + header_size);
 
   memcpy(patch->data() + offset, kMagic, kMagicLength);
   offset += kMagicLength;
@@ -92,16 +186,1178 @@ bool CreatePatch(const Buffer& raw_patch,
 
   TEST_AND_RETURN_FALSE(
       header.SerializeToArray(patch->data() + offset, header_size));
-  offset += header_size;
+  return true;
+}
+
+// Puffing is split into ranges of roughly |kMinPuffTaskSize| bytes of puff or
+// more. A single deflate with a puff larger than |kMinSplitPuffSize| is split
+// at its block boundaries into runs of blocks of about that size, so it is not
+// left to one thread.
+constexpr uint64_t kMinPuffTaskSize = 256 * 1024;        // 256KB
+constexpr uint64_t kMinSplitPuffSize = 4 * 1024 * 1024;  // 4MB
+
+// A deflate stream to be puffed entirely.
+struct PuffImage {
+  // The deflate stream. It is not kept in memory, but read by all the threads
+  // as they need it.
+  std::shared_ptr<SharedStream> deflate_stream;
+  // The location of the deflates in |deflate_stream|.
+  const vector<BitExtent>* deflates;
+  // The location of the puffs in |puff_buffer|.
+  vector<ByteExtent> puffs;
+  // The location of the runs of blocks the large deflates are split into in
+  // |deflate_stream| and of their puffs in |puff_buffer|.
+  vector<BitExtent> sub_blocks;
+  vector<ByteExtent> sub_puffs;
+  // The size of the puffed stream.
+  uint64_t puff_size;
+  // The puffed stream, if it is puffed entirely.
+  Buffer puff_buffer;
+};
+
+// Splits the deflates of |image| with a puff of |kMinSplitPuffSize| bytes or
+// more into runs of their blocks in |blocks|, whose puffs are in |block_puffs|.
+// Each run has roughly |kMinPuffTaskSize| bytes of puff.
+bool SplitLargeDeflates(PuffImage* image,
+                        const vector<BitExtent>& blocks,
+                        const vector<ByteExtent>& block_puffs) {
+  size_t block_idx = 0;
+  for (const auto& puff : image->puffs) {
+    auto end = puff.offset + puff.length;
+    // Skip to the blocks of this deflate.
+    while (block_idx < block_puffs.size() &&
+           block_puffs[block_idx].offset < puff.offset) {
+      block_idx++;
+    }
+    if (puff.length < kMinSplitPuffSize) {
+      continue;
+    }
+    BitExtent run(0, 0);
+    auto run_puff_start = puff.offset;
+    while (block_idx < block_puffs.size() &&
+           block_puffs[block_idx].offset < end) {
+      const auto& block = blocks[block_idx];
+      const auto& block_puff = block_puffs[block_idx];
+      if (run.length == 0) {
+        run.offset = block.offset;
+      }
+      run.length = block.offset + block.length - run.offset;
+      auto block_puff_end = block_puff.offset + block_puff.length;
+      if (block_puff_end - run_puff_start >= kMinPuffTaskSize ||
+          block_puff_end == end) {
+        image->sub_blocks.push_back(run);
+        image->sub_puffs.emplace_back(run_puff_start,
+                                      block_puff_end - run_puff_start);
+        run = BitExtent(0, 0);
+        run_puff_start = block_puff_end;
+      }
+      block_idx++;
+    }
+    TEST_AND_RETURN_FALSE(run_puff_start == end);
+  }
+  return true;
+}
+
+// Finds the puff locations of |stream| for the |image|, which then reads the
+// stream as it is needed.
+bool ReadImage(UniqueStreamPtr stream, PuffImage* image) {
+  vector<BitExtent> blocks;
+  vector<ByteExtent> block_puffs;
+  TEST_AND_RETURN_FALSE(stream->Seek(0));
+  TEST_AND_RETURN_FALSE(FindPuffLocations(stream, *image->deflates,
+                                          &image->puffs, &image->puff_size,
+                                          &blocks, &block_puffs));
+  TEST_AND_RETURN_FALSE(SplitLargeDeflates(image, blocks, block_puffs));
+  image->deflate_stream = std::make_shared<SharedStream>();
+  image->deflate_stream->stream = std::move(stream);
+  return true;
+}
 
-  memcpy(patch->data() + offset, raw_patch.data(), raw_patch.size());
+// Reads the bytes of |stream| that have bits of |deflate| into |data|, in
+// which the deflate is at |local|.
+bool ReadDeflate(StreamInterface* stream,
+                 const BitExtent& deflate,
+                 Buffer* data,
+                 BitExtent* local) {
+  auto start_byte = deflate.offset / 8;
+  data->resize((deflate.offset + deflate.length + 7) / 8 - start_byte);
+  TEST_AND_RETURN_FALSE(stream->Seek(start_byte));
+  TEST_AND_RETURN_FALSE(stream->Read(data->data(), data->size()));
+  *local = BitExtent(deflate.offset % 8, deflate.length);
+  return true;
+}
 
-  if (raw_patch.size() > patch->size()) {
-    LOG(ERROR) << "Puffin patch is invalid";
+// A range of the puff stream of an image that is puffed at once.
+struct PuffTask {
+  size_t image_idx;
+  uint64_t start;
+  uint64_t end;
+  // If not empty, the range is the puff of these deflate blocks. Otherwise,
+  // it is puffed with a |PuffinStream|.
+  BitExtent blocks;
+};
+
+// Splits the puff stream of |image| into ranges that end at the end of a puff
+// and contain roughly |kMinPuffTaskSize| bytes or more, and appends them to
+// |tasks| in order. Since all the deflates are independent, each range can be
+// puffed by its own |PuffinStream|. A single deflate larger than
+// |kMinSplitPuffSize| would still be puffed at once, so each of the runs of
+// blocks it is split into is a range of its own instead. The raw bytes between
+// the deflates are cut into ranges of |kMinSplitPuffSize| bytes too, so no
+// range is larger than twice that and the buffers of a range stay small.
+void SplitPuffTasks(const PuffImage& image,
+                    size_t image_idx,
+                    vector<PuffTask>* tasks) {
+  uint64_t start = 0;
+  size_t run_idx = 0;
+  // Cuts the raw bytes before |gap_end|. Since the range before them is
+  // smaller than |kMinPuffTaskSize|, the cuts are all in the raw bytes.
+  auto cut_gap = [&](uint64_t gap_end) {
+    while (gap_end - start > kMinSplitPuffSize) {
+      tasks->push_back({image_idx, start, start + kMinSplitPuffSize, {0, 0}});
+      start += kMinSplitPuffSize;
+    }
+  };
+  for (const auto& puff : image.puffs) {
+    cut_gap(puff.offset);
+    auto end = puff.offset + puff.length;
+    if (puff.length >= kMinSplitPuffSize) {
+      if (start < puff.offset) {
+        tasks->push_back({image_idx, start, puff.offset, {0, 0}});
+      }
+      for (; run_idx < image.sub_puffs.size() &&
+             image.sub_puffs[run_idx].offset < end;
+           run_idx++) {
+        const auto& run_puff = image.sub_puffs[run_idx];
+        tasks->push_back({image_idx, run_puff.offset,
+                          run_puff.offset + run_puff.length,
+                          image.sub_blocks[run_idx]});
+      }
+      start = end;
+    } else if (end - start >= kMinPuffTaskSize) {
+      tasks->push_back({image_idx, start, end, {0, 0}});
+      start = end;
+    }
+  }
+  cut_gap(image.puff_size);
+  if (start < image.puff_size) {
+    tasks->push_back({image_idx, start, image.puff_size, {0, 0}});
   }
+}
+
+// Puffs |task| of |image| into |puff| with |puffer|. |stream| is the
+// |PuffinStream| of the image used for the ranges not made of deflate blocks,
+// which is created on first use. Only the bytes of the deflate stream the
+// range needs are read.
+bool PuffTaskRange(const PuffImage& image,
+                   const PuffTask& task,
+                   std::shared_ptr<Puffer> puffer,
+                   UniqueStreamPtr* stream,
+                   uint8_t* puff) {
+  if (task.blocks.length > 0) {
+    SharedStreamReader reader(image.deflate_stream);
+    Buffer blocks;
+    BitExtent local(0, 0);
+    TEST_AND_RETURN_FALSE(ReadDeflate(&reader, task.blocks, &blocks, &local));
+    TEST_AND_RETURN_FALSE(PuffDeflateBlocks(*puffer, blocks.data(),
+                                            blocks.size(), local, puff,
+                                            task.end - task.start));
+    return true;
+  }
+  if (!*stream) {
+    *stream = PuffinStream::CreateForPuff(
+        UniqueStreamPtr(new SharedStreamReader(image.deflate_stream)), puffer,
+        image.puff_size, *image.deflates, image.puffs);
+    TEST_AND_RETURN_FALSE(*stream);
+  }
+  TEST_AND_RETURN_FALSE((*stream)->Seek(task.start));
+  TEST_AND_RETURN_FALSE((*stream)->Read(puff, task.end - task.start));
   return true;
 }
 
+// Puffs all the |images| using up to |num_threads| threads. The puff stream of
+// each image is split with |SplitPuffTasks| and each range is puffed directly
+// into its final place in the puff buffer. The ranges of all images are handed
+// out largest first from one queue, so a few huge deflates do not leave the
+// other threads idle at the end. The result is identical to puffing the images
+// sequentially.
+bool PuffImages(vector<PuffImage>* images, size_t num_threads) {
+  vector<PuffTask> tasks;
+  for (size_t image_idx = 0; image_idx < images->size(); image_idx++) {
+    auto& image = (*images)[image_idx];
+    image.puff_buffer.resize(image.puff_size);
+    SplitPuffTasks(image, image_idx, &tasks);
+  }
+  std::stable_sort(tasks.begin(), tasks.end(),
+                   [](const PuffTask& a, const PuffTask& b) {
+                     return a.end - a.start > b.end - b.start;
+                   });
+
+  TaskQueue queue(tasks.size());
+  num_threads = std::min(num_threads, tasks.size());
+  return RunInParallel(num_threads, [&](size_t) {
+    // |Puffer| is not thread safe, and neither is |PuffinStream|. Each thread
+    // creates its own and reuses them for all of its tasks.
+    auto puffer = std::make_shared<Puffer>();
+    vector<UniqueStreamPtr> streams(images->size());
+    size_t task_idx;
+    while (queue.Next(&task_idx)) {
+      const auto& task = tasks[task_idx];
+      auto& image = (*images)[task.image_idx];
+      if (!PuffTaskRange(image, task, puffer, &streams[task.image_idx],
+                         image.puff_buffer.data() + task.start)) {
+        LOG(ERROR) << "Failed to puff range [" << task.start << ", "
+                   << task.end << ") of image " << task.image_idx;
+        queue.Cancel();
+        return false;
+      }
+    }
+    return true;
+  });
+}
+
+// Writes a bsdiff patch in the BSDF2 format directly at the end of a buffer,
+// the same way |bsdiff::CreateBSDF2PatchWriter| writes it into a file. The
+// compressors are bsdiff's own: each of the control, diff and extra streams is
+// compressed with all the given compressors and the smallest result is used.
+class BsdiffPatchBufferWriter : public bsdiff::PatchWriterInterface {
+ public:
+  BsdiffPatchBufferWriter(Buffer* patch,
+                          const vector<bsdiff::CompressorType>& types,
+                          int brotli_quality)
+      : patch_(patch),
+        types_(types),
+        brotli_quality_(brotli_quality),
+        new_size_(0),
+        written_output_(0) {}
+  ~BsdiffPatchBufferWriter() override = default;
+
+  bool Init(size_t new_size) override {
+    TEST_AND_RETURN_FALSE(!types_.empty());
+    new_size_ = new_size;
+    for (auto type : types_) {
+      auto ctrl = bsdiff::CreateCompressor(type, brotli_quality_);
+      auto diff = bsdiff::CreateCompressor(type, brotli_quality_);
+      auto extra = bsdiff::CreateCompressor(type, brotli_quality_);
+      TEST_AND_RETURN_FALSE(ctrl && diff && extra);
+      ctrl_compressors_.push_back(std::move(ctrl));
+      diff_compressors_.push_back(std::move(diff));
+      extra_compressors_.push_back(std::move(extra));
+    }
+    return true;
+  }
+
+  bool WriteDiffStream(const uint8_t* data, size_t size) override {
+    for (const auto& compressor : diff_compressors_) {
+      TEST_AND_RETURN_FALSE(compressor->Write(data, size));
+    }
+    return true;
+  }
+
+  bool WriteExtraStream(const uint8_t* data, size_t size) override {
+    for (const auto& compressor : extra_compressors_) {
+      TEST_AND_RETURN_FALSE(compressor->Write(data, size));
+    }
+    return true;
+  }
+
+  bool AddControlEntry(const ControlEntry& entry) override {
+    uint8_t buf[kControlEntrySize];
+    EncodeInt64(entry.diff_size, buf);
+    EncodeInt64(entry.extra_size, buf + 8);
+    EncodeInt64(entry.offset_increment, buf + 16);
+    for (const auto& compressor : ctrl_compressors_) {
+      TEST_AND_RETURN_FALSE(compressor->Write(buf, sizeof(buf)));
+    }
+    written_output_ += entry.diff_size + entry.extra_size;
+    return true;
+  }
+
+  bool Close() override {
+    if (written_output_ != new_size_) {
+      LOG(ERROR) << "Close() called but not all the output was written.";
+      return false;
+    }
+    bsdiff::CompressorInterface* ctrl;
+    bsdiff::CompressorInterface* diff;
+    bsdiff::CompressorInterface* extra;
+    TEST_AND_RETURN_FALSE(SelectSmallestResult(ctrl_compressors_, &ctrl));
+    TEST_AND_RETURN_FALSE(SelectSmallestResult(diff_compressors_, &diff));
+    TEST_AND_RETURN_FALSE(SelectSmallestResult(extra_compressors_, &extra));
+
+    const auto& ctrl_data = ctrl->GetCompressedData();
+    const auto& diff_data = diff->GetCompressedData();
+    const auto& extra_data = extra->GetCompressedData();
+
+    // The header: the magic, the compressor type of each stream and the sizes
+    // of the compressed control and diff streams and of the new file.
+    auto offset = patch_->size();
+    patch_->resize(offset + kHeaderSize + ctrl_data.size() + diff_data.size() +
+                   extra_data.size());
+    auto data = patch_->data() + offset;
+    memcpy(data, bsdiff::kBSDF2MagicHeader, 5);
+    data[5] = static_cast<uint8_t>(ctrl->Type());
+    data[6] = static_cast<uint8_t>(diff->Type());
+    data[7] = static_cast<uint8_t>(extra->Type());
+    EncodeInt64(ctrl_data.size(), data + 8);
+    EncodeInt64(diff_data.size(), data + 16);
+    EncodeInt64(new_size_, data + 24);
+    data += kHeaderSize;
+
+    std::copy(ctrl_data.begin(), ctrl_data.end(), data);
+    data += ctrl_data.size();
+    std::copy(diff_data.begin(), diff_data.end(), data);
+    data += diff_data.size();
+    std::copy(extra_data.begin(), extra_data.end(), data);
+
+    ctrl_compressors_.clear();
+    diff_compressors_.clear();
+    extra_compressors_.clear();
+    return true;
+  }
+
+ private:
+  static constexpr size_t kHeaderSize = 32;
+  static constexpr size_t kControlEntrySize = 24;
+
+  // Encodes |x| in the sign-magnitude little-endian format used by bsdiff.
+  static void EncodeInt64(int64_t x, uint8_t* buf) {
+    uint64_t y = x < 0 ? (1ULL << 63) - x : x;
+    for (int i = 0; i < 8; i++) {
+      buf[i] = y & 0xff;
+      y >>= 8;
+    }
+  }
+
+  // Finishes all |compressors| and returns the one with the smallest output in
+  // |result|. On a tie the first one wins.
+  static bool SelectSmallestResult(
+      const vector<std::unique_ptr<bsdiff::CompressorInterface>>& compressors,
+      bsdiff::CompressorInterface** result) {
+    *result = nullptr;
+    for (const auto& compressor : compressors) {
+      TEST_AND_RETURN_FALSE(compressor->Finish());
+      if (*result == nullptr || compressor->GetCompressedData().size() <
+                                    (*result)->GetCompressedData().size()) {
+        *result = compressor.get();
+      }
+    }
+    return *result != nullptr;
+  }
+
+  // The buffer the patch is appended to.
+  Buffer* patch_;
+
+  vector<bsdiff::CompressorType> types_;
+  int brotli_quality_;
+
+  vector<std::unique_ptr<bsdiff::CompressorInterface>> ctrl_compressors_;
+  vector<std::unique_ptr<bsdiff::CompressorInterface>> diff_compressors_;
+  vector<std::unique_ptr<bsdiff::CompressorInterface>> extra_compressors_;
+
+  // The size of the new file and the number of bytes of it described by the
+  // control entries so far.
+  uint64_t new_size_;
+  uint64_t written_output_;
+
+  DISALLOW_COPY_AND_ASSIGN(BsdiffPatchBufferWriter);
+};
+
+constexpr size_t BsdiffPatchBufferWriter::kHeaderSize;
+constexpr size_t BsdiffPatchBufferWriter::kControlEntrySize;
+
+// Diffs the |new_size| bytes of |new_buf| against the |old_size| bytes of
+// |old_buf| with bsdiff and appends the BSDF2 patch to |patch|. |sai_cache| is
+// passed on to bsdiff.
+bool BsdiffIntoBuffer(const uint8_t* old_buf,
+                      size_t old_size,
+                      const uint8_t* new_buf,
+                      size_t new_size,
+                      const vector<bsdiff::CompressorType>& compressors,
+                      bsdiff::SuffixArrayIndexInterface** sai_cache,
+                      Buffer* patch) {
+  BsdiffPatchBufferWriter patch_writer(patch, compressors,
+                                       kBrotliCompressionQuality);
+  return 0 == bsdiff::bsdiff(old_buf, old_size, new_buf, new_size,
+                             &patch_writer, sai_cache);
+}
+
+// The destination puff stream of a |PatchAlgorithm::kSplitBsdiff| patch is cut
+// at the boundaries of its puffs, so each deflate and each run of raw bytes
+// between them gets its own sub-patch. Only the ones smaller than
+// |kMinSubPatchSize| bytes are merged with the ones after them, so tiny
+// deflates do not each pay for a bsdiff header and a search of the source.
+// Sub-patches larger than |kMaxSubPatchSize| bytes are cut further, so a large
+// deflate is still patched in parallel and the memory per sub-patch stays
+// small.
+constexpr uint64_t kMinSubPatchSize = 16 * 1024;        // 16KB
+constexpr uint64_t kMaxSubPatchSize = 4 * 1024 * 1024;  // 4MB
+
+// Returns the ranges of the destination puff stream of |puff_size| bytes with
+// |puffs| that each get their own sub-patch.
+vector<ByteExtent> SplitPuffStream(const vector<ByteExtent>& puffs,
+                                   uint64_t puff_size) {
+  vector<ByteExtent> ranges;
+  uint64_t start = 0;
+  auto cut_at = [&](uint64_t end) {
+    while (end - start >= kMinSubPatchSize) {
+      auto length = std::min(end - start, kMaxSubPatchSize);
+      ranges.emplace_back(start, length);
+      start += length;
+    }
+  };
+  for (const auto& puff : puffs) {
+    cut_at(puff.offset);
+    cut_at(puff.offset + puff.length);
+  }
+  cut_at(puff_size);
+  if (start < puff_size) {
+    ranges.emplace_back(start, puff_size - start);
+  }
+  return ranges;
+}
+
+// Each sub-patch is diffed against a window of the source with similar data,
+// which is found by sampling the hashes of the windows of |kHashWindowSize|
+// bytes of the source and of the destination. The sampled
+// windows are the ones whose hash has zero in its top |kHashSampleBits| bits,
+// which depends on the content only, so the same data is sampled wherever it
+// is. Sampled windows do not overlap, which bounds the number of samples of
+// repetitive data.
+constexpr size_t kHashWindowSize = 32;
+constexpr int kHashSampleBits = 8;
+constexpr uint64_t kHashMultiplier = 0x100000001B3;
+// Samples with the same hash that are looked up for one sample of the
+// destination.
+constexpr size_t kMaxHashMatches = 8;
+
+// bsdiff needs the puff of a source window and a suffix array of 32 bit
+// indices of it, and the chunk of the destination along with its patch. The
+// range of a puff stream that is puffed to read a part of it, and the buffers
+// of the |PuffinStream| that puffs it, are at most as large as a chunk too.
+constexpr uint64_t kMemoryPerWindowByte = 5;
+constexpr uint64_t kMemoryPerChunk = 4 * kMaxSubPatchSize;
+// The windows the memory budget of the windowed diff allows are at least twice
+// as large as the largest chunk.
+constexpr uint64_t kMinWindowSize = 2 * kMaxSubPatchSize;  // 8MB
+constexpr uint64_t kMaxWindowSize = 256 * 1024 * 1024;     // 256MB
+// Each chunk is diffed against a window |kWindowSizePerChunkByte| times as
+// large as itself and of at least |kMinChunkWindowSize| bytes, up to the
+// largest window allowed. Building the suffix array of a window takes most of
+// the time of a diff, so a small deflate is not diffed against a huge window.
+constexpr uint64_t kWindowSizePerChunkByte = 16;
+constexpr uint64_t kMinChunkWindowSize = 256 * 1024;  // 256KB
+// The source is sampled in pieces of |kSamplePieceSize| bytes in parallel.
+constexpr uint64_t kSamplePieceSize = 16 * 1024 * 1024;  // 16MB
+
+// A sampled window of a puff stream: its hash and its offset.
+using HashSample = std::pair<uint64_t, uint64_t>;
+
+// Appends the samples of the |size| bytes of |data|, which are at |offset| of
+// their puff stream, to |samples|.
+void SampleHashes(const uint8_t* data,
+                  size_t size,
+                  uint64_t offset,
+                  vector<HashSample>* samples) {
+  if (size < kHashWindowSize) {
+    return;
+  }
+  // The rolling hash of a window is sum(data[i] * kHashMultiplier^(n - 1 - i)),
+  // so the first byte is removed with the multiplier to the (n - 1)th power.
+  uint64_t out_multiplier = 1;
+  for (size_t idx = 1; idx < kHashWindowSize; idx++) {
+    out_multiplier *= kHashMultiplier;
+  }
+  uint64_t hash = 0;
+  for (size_t idx = 0; idx < kHashWindowSize; idx++) {
+    hash = hash * kHashMultiplier + data[idx];
+  }
+  size_t next_sample = 0;
+  for (size_t start = 0;; start++) {
+    if (start >= next_sample && (hash >> (64 - kHashSampleBits)) == 0) {
+      samples->emplace_back(hash, offset + start);
+      next_sample = start + kHashWindowSize;
+    }
+    if (start + kHashWindowSize == size) {
+      break;
+    }
+    hash = (hash - data[start] * out_multiplier) * kHashMultiplier +
+           data[start + kHashWindowSize];
+  }
+}
+
+// Moves the samples of all the |pieces| into |samples| and sorts them.
+void MergeSamples(vector<vector<HashSample>>* pieces,
+                  vector<HashSample>* samples) {
+  size_t size = 0;
+  for (const auto& piece : *pieces) {
+    size += piece.size();
+  }
+  samples->reserve(size);
+  for (auto& piece : *pieces) {
+    samples->insert(samples->end(), piece.begin(), piece.end());
+    vector<HashSample>().swap(piece);
+  }
+  std::sort(samples->begin(), samples->end());
+}
+
+// Returns the size of the window of the source that a chunk of |chunk_size|
+// bytes is diffed against, if windows of up to |max_window_size| bytes are
+// allowed.
+uint64_t ChunkWindowSize(uint64_t chunk_size, uint64_t max_window_size) {
+  return std::min(max_window_size,
+                  std::max(kMinChunkWindowSize,
+                           chunk_size * kWindowSizePerChunkByte));
+}
+
+// Reads |length| bytes at |offset| of the puff stream of |image|, which is
+// split into |tasks|, into |puff|. The ranges at the ends are puffed entirely
+// into |scratch| and only their part in the range is copied.
+bool ReadPuffRange(const PuffImage& image,
+                   const vector<PuffTask>& tasks,
+                   uint64_t offset,
+                   uint64_t length,
+                   std::shared_ptr<Puffer> puffer,
+                   UniqueStreamPtr* stream,
+                   Buffer* scratch,
+                   Buffer* puff) {
+  puff->resize(length);
+  auto end = offset + length;
+  auto task = std::upper_bound(
+      tasks.begin(), tasks.end(), offset,
+      [](uint64_t offset, const PuffTask& task) { return offset < task.end; });
+  for (; task != tasks.end() && task->start < end; task++) {
+    auto start = std::max(task->start, offset);
+    auto stop = std::min(task->end, end);
+    auto out = puff->data() + start - offset;
+    if (start == task->start && stop == task->end) {
+      TEST_AND_RETURN_FALSE(PuffTaskRange(image, *task, puffer, stream, out));
+    } else {
+      scratch->resize(task->end - task->start);
+      TEST_AND_RETURN_FALSE(
+          PuffTaskRange(image, *task, puffer, stream, scratch->data()));
+      std::copy(scratch->begin() + (start - task->start),
+                scratch->begin() + (stop - task->start), out);
+    }
+  }
+  return true;
+}
+
+// Returns the offset of the window of |window_size| bytes in the source puff
+// stream of |src_puff_size| bytes with the most samples in |src_samples|
+// (sorted) that match the samples of |chunk|, which is at |chunk_range| of the
+// destination. Without any match, the window is at the same relative position
+// in the source as |chunk| in the destination of |dst_puff_size| bytes.
+uint64_t FindSourceWindow(const vector<HashSample>& src_samples,
+                          uint64_t src_puff_size,
+                          uint64_t window_size,
+                          const uint8_t* chunk,
+                          const ByteExtent& chunk_range,
+                          uint64_t dst_puff_size) {
+  vector<HashSample> chunk_samples;
+  SampleHashes(chunk, chunk_range.length, 0, &chunk_samples);
+  vector<uint64_t> matches;
+  for (const auto& sample : chunk_samples) {
+    auto match = std::lower_bound(src_samples.begin(), src_samples.end(),
+                                  HashSample(sample.first, 0));
+    for (size_t count = 0; count < kMaxHashMatches &&
+                           match != src_samples.end() &&
+                           match->first == sample.first;
+         count++, match++) {
+      matches.push_back(match->second);
+    }
+  }
+
+  uint64_t center;
+  if (matches.empty()) {
+    center = static_cast<uint64_t>(
+        static_cast<double>(chunk_range.offset + chunk_range.length / 2) *
+        src_puff_size / dst_puff_size);
+  } else {
+    // Find the most matches that fit in a window and center the window on
+    // them.
+    std::sort(matches.begin(), matches.end());
+    size_t best_first = 0, best_last = 0;
+    for (size_t first = 0, last = 0; last < matches.size(); last++) {
+      while (matches[last] + kHashWindowSize - matches[first] > window_size) {
+        first++;
+      }
+      if (last - first > best_last - best_first) {
+        best_first = first;
+        best_last = last;
+      }
+    }
+    center = (matches[best_first] + matches[best_last] + kHashWindowSize) / 2;
+  }
+  return std::min(center - std::min(center, window_size / 2),
+                  src_puff_size - window_size);
+}
+
+// Creates the sub-patches of a |PatchAlgorithm::kSplitBsdiff| patch from
+// |src_puff_buffer| to |dst_puff_buffer|, whose puffs are |dst_puffs|, using up
+// to |num_threads| threads. Each sub-patch is diffed against the window of the
+// source that has the most sampled hashes in common with it. If the source is
+// as small as the smallest window, every sub-patch is diffed against all of it
+// instead, and the suffix array of the source is built for the first sub-patch
+// and then shared by all the others, since searching it does not change it.
+bool CreateSubPatches(const Buffer& src_puff_buffer,
+                      const Buffer& dst_puff_buffer,
+                      const vector<ByteExtent>& dst_puffs,
+                      const vector<bsdiff::CompressorType>& compressors,
+                      size_t num_threads,
+                      vector<SubPatch>* sub_patches) {
+  const uint64_t src_size = src_puff_buffer.size();
+  for (const auto& range :
+       SplitPuffStream(dst_puffs, dst_puff_buffer.size())) {
+    sub_patches->push_back(
+        {ByteExtent(0, ChunkWindowSize(range.length,
+                                       std::min(src_size, kMaxWindowSize))),
+         range, Buffer()});
+  }
+  if (sub_patches->empty()) {
+    return true;
+  }
+
+  vector<HashSample> src_samples;
+  bool whole_source = src_size <= kMinChunkWindowSize;
+  if (!whole_source) {
+    vector<vector<HashSample>> piece_samples(
+        (src_size + kSamplePieceSize - 1) / kSamplePieceSize);
+    TEST_AND_RETURN_FALSE(
+        ParallelFor(piece_samples.size(), num_threads, [&](size_t idx) {
+          auto offset = idx * kSamplePieceSize;
+          SampleHashes(src_puff_buffer.data() + offset,
+                       std::min(kSamplePieceSize, src_size - offset), offset,
+                       &piece_samples[idx]);
+          return true;
+        }));
+    MergeSamples(&piece_samples, &src_samples);
+  }
+
+  bsdiff::SuffixArrayIndexInterface* sai_cache = nullptr;
+  auto diff = [&](size_t idx) {
+    auto& sub_patch = (*sub_patches)[idx];
+    auto chunk = dst_puff_buffer.data() + sub_patch.dst.offset;
+    if (sub_patch.src.length < src_size) {
+      sub_patch.src.offset =
+          FindSourceWindow(src_samples, src_size, sub_patch.src.length, chunk,
+                           sub_patch.dst, dst_puff_buffer.size());
+    }
+    return BsdiffIntoBuffer(src_puff_buffer.data() + sub_patch.src.offset,
+                            sub_patch.src.length, chunk, sub_patch.dst.length,
+                            compressors, whole_source ? &sai_cache : nullptr,
+                            &sub_patch.patch);
+  };
+  if (!whole_source) {
+    return ParallelFor(sub_patches->size(), num_threads, diff);
+  }
+  bool first_success = diff(0);
+  std::unique_ptr<bsdiff::SuffixArrayIndexInterface> sai(sai_cache);
+  TEST_AND_RETURN_FALSE(first_success);
+  return ParallelFor(sub_patches->size() - 1, num_threads,
+                     [&](size_t idx) { return diff(idx + 1); });
+}
+
+// Sets |window_size| to the size of the largest source window of the windowed
+// diff and |num_threads| to the number of chunks diffed in parallel, so that
+// they fit in the |memory| bytes left for them. The source puff stream is
+// |src_puff_size| bytes.
+void GetWindowedDiffLimits(uint64_t memory,
+                           uint64_t src_puff_size,
+                           uint64_t* window_size,
+                           uint64_t* num_threads) {
+  *window_size = (std::max(memory, kMemoryPerChunk) - kMemoryPerChunk) /
+                 kMemoryPerWindowByte;
+  *window_size =
+      std::max(kMinWindowSize, std::min(*window_size, kMaxWindowSize));
+  *window_size = std::min(*window_size, src_puff_size);
+  *num_threads = std::max(
+      static_cast<uint64_t>(1),
+      memory / (*window_size * kMemoryPerWindowByte + kMemoryPerChunk));
+  *num_threads = std::min(*num_threads,
+                          static_cast<uint64_t>(GetDefaultNumThreads()));
+}
+
+// Creates the sub-patches of a |PatchAlgorithm::kSplitBsdiff| patch from the
+// puff stream of |src| to the one of |dst| without puffing either entirely.
+// Each chunk of the destination is diffed against the window of the source
+// that has the most sampled hashes in common with it. The sampled hashes of
+// the source are kept until the end, so the windows are at most as large as
+// what is left of |max_memory| after them allows, and as many chunks are
+// diffed in parallel as fit in it.
+bool CreateWindowedSubPatches(const PuffImage& src,
+                              const PuffImage& dst,
+                              const vector<bsdiff::CompressorType>& compressors,
+                              uint64_t max_memory,
+                              vector<SubPatch>* sub_patches) {
+  // Sampling needs less memory per thread than diffing a chunk.
+  uint64_t window_size, num_threads;
+  GetWindowedDiffLimits(max_memory, src.puff_size, &window_size, &num_threads);
+
+  vector<PuffTask> src_tasks, dst_tasks;
+  SplitPuffTasks(src, 0, &src_tasks);
+  SplitPuffTasks(dst, 1, &dst_tasks);
+
+  // Sample the whole source, unless it fits in the smallest window anyway.
+  vector<HashSample> src_samples;
+  if (kMinChunkWindowSize < src.puff_size) {
+    vector<vector<HashSample>> task_samples(src_tasks.size());
+    TaskQueue queue(src_tasks.size());
+    TEST_AND_RETURN_FALSE(RunInParallel(
+        std::min(static_cast<size_t>(num_threads), src_tasks.size()),
+        [&](size_t) {
+          auto puffer = std::make_shared<Puffer>();
+          UniqueStreamPtr stream;
+          Buffer puff;
+          size_t idx;
+          while (queue.Next(&idx)) {
+            const auto& task = src_tasks[idx];
+            puff.resize(task.end - task.start);
+            if (!PuffTaskRange(src, task, puffer, &stream, puff.data())) {
+              queue.Cancel();
+              return false;
+            }
+            SampleHashes(puff.data(), puff.size(), task.start,
+                         &task_samples[idx]);
+          }
+          return true;
+        }));
+    MergeSamples(&task_samples, &src_samples);
+    auto samples_size = src_samples.size() * sizeof(HashSample);
+    GetWindowedDiffLimits(max_memory - std::min(max_memory, samples_size),
+                          src.puff_size, &window_size, &num_threads);
+  }
+
+  for (const auto& range : SplitPuffStream(dst.puffs, dst.puff_size)) {
+    sub_patches->push_back(
+        {ByteExtent(0, ChunkWindowSize(range.length, window_size)), range,
+         Buffer()});
+  }
+  TaskQueue queue(sub_patches->size());
+  return RunInParallel(
+      std::min(static_cast<size_t>(num_threads), sub_patches->size()),
+      [&](size_t) {
+        auto puffer = std::make_shared<Puffer>();
+        UniqueStreamPtr src_stream, dst_stream;
+        Buffer window, chunk, scratch;
+        size_t idx;
+        while (queue.Next(&idx)) {
+          auto& sub_patch = (*sub_patches)[idx];
+          if (!ReadPuffRange(dst, dst_tasks, sub_patch.dst.offset,
+                             sub_patch.dst.length, puffer, &dst_stream,
+                             &scratch, &chunk)) {
+            queue.Cancel();
+            return false;
+          }
+          if (sub_patch.src.length < src.puff_size) {
+            sub_patch.src.offset = FindSourceWindow(
+                src_samples, src.puff_size, sub_patch.src.length,
+                chunk.data(), sub_patch.dst, dst.puff_size);
+          }
+          if (!ReadPuffRange(src, src_tasks, sub_patch.src.offset,
+                             sub_patch.src.length, puffer, &src_stream,
+                             &scratch, &window) ||
+              !BsdiffIntoBuffer(window.data(), window.size(), chunk.data(),
+                                chunk.size(), compressors, nullptr,
+                                &sub_patch.patch)) {
+            LOG(ERROR) << "Failed to diff the destination at "
+                       << sub_patch.dst.offset;
+            queue.Cancel();
+            return false;
+          }
+        }
+        return true;
+      });
+}
+
+// The bytes of |deflate| that have no bits of the data around it.
+ByteExtent InnerBytes(const BitExtent& deflate) {
+  auto start = (deflate.offset + 7) / 8;
+  auto end = (deflate.offset + deflate.length) / 8;
+  return ByteExtent(start, end > start ? end - start : 0);
+}
+
+// Returns the bits of |deflate| in |data| that are in the bytes it shares with
+// the data around it, with the other bits of those bytes cleared.
+std::pair<uint8_t, uint8_t> EdgeBits(const Buffer& data,
+                                     const BitExtent& deflate) {
+  uint8_t head = 0, tail = 0;
+  if (deflate.offset % 8) {
+    head = data[deflate.offset / 8] & (0xFF << (deflate.offset % 8));
+  }
+  auto end = deflate.offset + deflate.length;
+  if (end % 8) {
+    tail = data[end / 8] & ((1 << (end % 8)) - 1);
+  }
+  return {head, tail};
+}
+
+// Returns a hash of the bits of |deflate| in |data| and of its offset in its
+// first byte.
+uint64_t HashDeflate(const Buffer& data, const BitExtent& deflate) {
+  // FNV-1a.
+  uint64_t hash = 0xCBF29CE484222325;
+  auto add = [&hash](uint64_t value) {
+    hash = (hash ^ value) * 0x100000001B3;
+  };
+  add(deflate.length);
+  add(deflate.offset % 8);
+  auto edges = EdgeBits(data, deflate);
+  add(edges.first);
+  add(edges.second);
+  auto inner = InnerBytes(deflate);
+  for (auto byte = data.begin() + inner.offset;
+       byte != data.begin() + inner.offset + inner.length; byte++) {
+    add(*byte);
+  }
+  return hash;
+}
+
+// Returns whether |deflate1| in |data1| is bit for bit the same as |deflate2|
+// in |data2|, at the same offset in its first byte.
+bool SameDeflates(const Buffer& data1,
+                  const BitExtent& deflate1,
+                  const Buffer& data2,
+                  const BitExtent& deflate2) {
+  auto inner1 = InnerBytes(deflate1);
+  auto inner2 = InnerBytes(deflate2);
+  return deflate1.length == deflate2.length &&
+         deflate1.offset % 8 == deflate2.offset % 8 &&
+         EdgeBits(data1, deflate1) == EdgeBits(data2, deflate2) &&
+         std::equal(data1.begin() + inner1.offset,
+                    data1.begin() + inner1.offset + inner1.length,
+                    data2.begin() + inner2.offset);
+}
+
+// Finds the deflates of |dst_deflates| in |dst| that are bit for bit the same
+// as one of |src_deflates| in |src|, at the same offset in their first byte,
+// so that their inner bytes can be copied from the source. Deflates without
+// inner bytes are not worth copying. Each deflate is read from its stream as
+// it is needed.
+bool FindCopyDeflates(StreamInterface* src,
+                      const vector<BitExtent>& src_deflates,
+                      StreamInterface* dst,
+                      const vector<BitExtent>& dst_deflates,
+                      vector<CopyDeflate>* copies) {
+  Buffer src_data, dst_data;
+  BitExtent src_local(0, 0), dst_local(0, 0);
+  vector<std::pair<uint64_t, size_t>> src_hashes;
+  for (size_t idx = 0; idx < src_deflates.size(); idx++) {
+    if (InnerBytes(src_deflates[idx]).length > 0) {
+      TEST_AND_RETURN_FALSE(
+          ReadDeflate(src, src_deflates[idx], &src_data, &src_local));
+      src_hashes.emplace_back(HashDeflate(src_data, src_local), idx);
+    }
+  }
+  std::sort(src_hashes.begin(), src_hashes.end());
+
+  for (const auto& dst_deflate : dst_deflates) {
+    if (InnerBytes(dst_deflate).length == 0) {
+      continue;
+    }
+    TEST_AND_RETURN_FALSE(
+        ReadDeflate(dst, dst_deflate, &dst_data, &dst_local));
+    auto hash = HashDeflate(dst_data, dst_local);
+    for (auto match = std::lower_bound(src_hashes.begin(), src_hashes.end(),
+                                       std::make_pair(hash, size_t(0)));
+         match != src_hashes.end() && match->first == hash; match++) {
+      const auto& src_deflate = src_deflates[match->second];
+      TEST_AND_RETURN_FALSE(
+          ReadDeflate(src, src_deflate, &src_data, &src_local));
+      if (SameDeflates(src_data, src_local, dst_data, dst_local)) {
+        copies->push_back({src_deflate, dst_deflate});
+        break;
+      }
+    }
+  }
+  return true;
+}
+
+// Sets each of |puff_ids| to the index of the first of |deflates| in |stream|
+// that is bit for bit the same as that deflate, at the same offset in its
+// first byte. The puffs of such deflates are the same too.
+bool FindDuplicateDeflates(StreamInterface* stream,
+                           const vector<BitExtent>& deflates,
+                           vector<size_t>* puff_ids) {
+  std::unordered_multimap<uint64_t, size_t> originals;
+  Buffer data, original_data;
+  BitExtent local(0, 0), original_local(0, 0);
+  puff_ids->resize(deflates.size());
+  for (size_t idx = 0; idx < deflates.size(); idx++) {
+    TEST_AND_RETURN_FALSE(ReadDeflate(stream, deflates[idx], &data, &local));
+    auto hash = HashDeflate(data, local);
+    (*puff_ids)[idx] = idx;
+    auto range = originals.equal_range(hash);
+    for (auto original = range.first; original != range.second; original++) {
+      TEST_AND_RETURN_FALSE(ReadDeflate(stream, deflates[original->second],
+                                        &original_data, &original_local));
+      if (SameDeflates(original_data, original_local, data, local)) {
+        (*puff_ids)[idx] = original->second;
+        break;
+      }
+    }
+    if ((*puff_ids)[idx] == idx) {
+      originals.emplace(hash, idx);
+    }
+  }
+  return true;
+}
+
+// Returns in |remaining_extents| the bytes of the destination of |dst_size|
+// bytes that are left when the inner bytes of |cuts| are cut out of it. |cuts|
+// are the copied deflates and the nested deflate streams of the destination in
+// order. The |dst_deflates| outside of them are moved to their offsets in those
+// bytes in |remaining_deflates|.
+void CutDeflates(uint64_t dst_size,
+                 const vector<BitExtent>& dst_deflates,
+                 const vector<BitExtent>& cuts,
+                 vector<ByteExtent>* remaining_extents,
+                 vector<BitExtent>* remaining_deflates) {
+  uint64_t offset = 0;
+  uint64_t cut = 0;
+  size_t cut_idx = 0;
+  auto cut_next = [&]() {
+    auto inner = InnerBytes(cuts[cut_idx++]);
+    remaining_extents->emplace_back(offset, inner.offset - offset);
+    offset = inner.offset + inner.length;
+    cut += inner.length;
+  };
+  for (const auto& deflate : dst_deflates) {
+    while (cut_idx < cuts.size() &&
+           cuts[cut_idx].offset + cuts[cut_idx].length <= deflate.offset) {
+      cut_next();
+    }
+    if (cut_idx < cuts.size() && cuts[cut_idx].offset <= deflate.offset) {
+      continue;
+    }
+    remaining_deflates->emplace_back(deflate.offset - cut * 8, deflate.length);
+  }
+  while (cut_idx < cuts.size()) {
+    cut_next();
+  }
+  remaining_extents->emplace_back(offset, dst_size - offset);
+}
+
+// Reads the deflate stream |extent| of |stream| and creates its nested image in
+// |image|, of which the puff is the first |puff_size| bytes.
+bool ReadNestedImage(StreamInterface* stream,
+                     const BitExtent& extent,
+                     Buffer* image,
+                     uint64_t* puff_size) {
+  Buffer data;
+  BitExtent local(0, 0);
+  TEST_AND_RETURN_FALSE(ReadDeflate(stream, extent, &data, &local));
+  uint64_t length;
+  TEST_AND_RETURN_FALSE(CreateNestedImage(data.data(), data.size(),
+                                          local.offset, &length, image,
+                                          puff_size));
+  TEST_AND_RETURN_FALSE(length == extent.length);
+  return true;
+}
+
+// Locates the deflates in the uncompressed data of the nested |image|, whose
+// puff is the first |puff_size| bytes, and the nested deflate streams among
+// them, up to |max_depth| levels below the uncompressed data. Their offsets
+// are in the image.
+bool LocateNestedImageDeflates(const Buffer& image,
+                               uint64_t puff_size,
+                               size_t max_depth,
+                               vector<BitExtent>* deflates,
+                               vector<BitExtent>* streams) {
+  auto uncompressed = image.data() + puff_size;
+  auto size = image.size() - puff_size;
+  TEST_AND_RETURN_FALSE(LocateDeflatesInContainer(
+      uncompressed, size, deflates, GetDefaultNumThreads(), max_depth));
+  TEST_AND_RETURN_FALSE(LocateNestedDeflateStreams(uncompressed, size,
+                                                   *deflates,
+                                                   GetDefaultNumThreads(),
+                                                   max_depth, streams));
+  for (auto* extents : {deflates, streams}) {
+    for (auto& extent : *extents) {
+      extent.offset += puff_size * 8;
+    }
+  }
+  return true;
+}
+
+// Returns the sorted hashes of the windows sampled from the uncompressed data
+// of the nested |image|, whose puff is the first |puff_size| bytes.
+vector<uint64_t> SampleNestedImage(const Buffer& image, uint64_t puff_size) {
+  vector<HashSample> samples;
+  SampleHashes(image.data() + puff_size, image.size() - puff_size, 0,
+               &samples);
+  vector<uint64_t> hashes;
+  hashes.reserve(samples.size());
+  for (const auto& sample : samples) {
+    hashes.push_back(sample.first);
+  }
+  std::sort(hashes.begin(), hashes.end());
+  return hashes;
+}
+
+// Returns the number of hashes that the sorted |hashes1| and |hashes2| have in
+// common.
+size_t CountCommonHashes(const vector<uint64_t>& hashes1,
+                         const vector<uint64_t>& hashes2) {
+  size_t count = 0;
+  for (auto hash1 = hashes1.begin(), hash2 = hashes2.begin();
+       hash1 != hashes1.end() && hash2 != hashes2.end();) {
+    if (*hash1 < *hash2) {
+      hash1++;
+    } else if (*hash2 < *hash1) {
+      hash2++;
+    } else {
+      count++;
+      hash1++;
+      hash2++;
+    }
+  }
+  return count;
+}
+
+// Creates in |nested| the nested patches of the |dst_nested| streams of |dst|,
+// each from the nested image of the |src_nested| stream of |src| whose
+// uncompressed data has the most sampled windows in common with its own. The
+// streams that have deflates across their edges, whose deflates are all in
+// |copies|, or that are not rebuilt exactly from their nested image are left
+// out. The |copies| in the other streams are dropped, as their nested patches
+// create them.
+bool CreateNestedPatches(StreamInterface* src,
+                         const vector<BitExtent>& src_nested,
+                         StreamInterface* dst,
+                         const vector<BitExtent>& dst_deflates,
+                         const vector<BitExtent>& dst_nested,
+                         size_t max_depth,
+                         const vector<bsdiff::CompressorType>& compressors,
+                         PatchAlgorithm patchAlgorithm,
+                         bool copy_deflates,
+                         vector<CopyDeflate>* copies,
+                         vector<NestedDeflate>* nested) {
+  if (src_nested.empty() || max_depth == 0) {
+    return true;
+  }
+  // Only the samples of the source streams are kept. The one that is picked
+  // is read again.
+  vector<vector<uint64_t>> src_hashes(src_nested.size());
+  vector<uint64_t> src_sizes(src_nested.size());
+  for (size_t idx = 0; idx < src_nested.size(); idx++) {
+    Buffer image;
+    uint64_t puff_size;
+    TEST_AND_RETURN_FALSE(
+        ReadNestedImage(src, src_nested[idx], &image, &puff_size));
+    src_hashes[idx] = SampleNestedImage(image, puff_size);
+    src_sizes[idx] = image.size() - puff_size;
+  }
+
+  auto end_of = [](const BitExtent& extent) {
+    return extent.offset + extent.length;
+  };
+  auto by_offset = [](const BitExtent& extent, uint64_t offset) {
+    return extent.offset < offset;
+  };
+  for (const auto& stream : dst_nested) {
+    auto first = std::lower_bound(dst_deflates.begin(), dst_deflates.end(),
+                                  stream.offset, by_offset);
+    auto last = std::lower_bound(first, dst_deflates.end(), end_of(stream),
+                                 by_offset);
+    if (stream.offset % 8 != 0 || first == last ||
+        (first != dst_deflates.begin() &&
+         end_of(*(first - 1)) > stream.offset) ||
+        end_of(*(last - 1)) > end_of(stream)) {
+      LOG(WARNING) << "The deflate stream at bit " << stream.offset
+                   << " does not match the deflates around it, diffing it "
+                   << "as it is.";
+      continue;
+    }
+    auto copied = std::count_if(
+        copies->begin(), copies->end(), [&](const CopyDeflate& copy) {
+          return copy.dst.offset >= stream.offset &&
+                 copy.dst.offset < end_of(stream);
+        });
+    if (copied == last - first) {
+      continue;
+    }
+
+    Buffer data, rebuilt, dst_image;
+    BitExtent local(0, 0);
+    uint64_t dst_puff_size;
+    TEST_AND_RETURN_FALSE(ReadDeflate(dst, stream, &data, &local));
+    TEST_AND_RETURN_FALSE(ReadNestedImage(dst, stream, &dst_image,
+                                          &dst_puff_size));
+    if (!HuffNestedImage(dst_image.data(), dst_image.size(), dst_puff_size,
+                         stream.length, &rebuilt) ||
+        !SameDeflates(rebuilt, BitExtent(0, stream.length), data, local)) {
+      LOG(WARNING) << "The deflate stream at bit " << stream.offset
+                   << " is not rebuilt exactly from its nested image, diffing "
+                   << "it as it is.";
+      continue;
+    }
+
+    auto dst_hashes = SampleNestedImage(dst_image, dst_puff_size);
+    auto dst_size = dst_image.size() - dst_puff_size;
+    size_t best = 0, best_common = 0;
+    uint64_t best_distance = UINT64_MAX;
+    for (size_t idx = 0; idx < src_nested.size(); idx++) {
+      auto common = CountCommonHashes(src_hashes[idx], dst_hashes);
+      auto distance = src_sizes[idx] > dst_size ? src_sizes[idx] - dst_size
+                                                : dst_size - src_sizes[idx];
+      if (common > best_common ||
+          (common == best_common && distance < best_distance)) {
+        best = idx;
+        best_common = common;
+        best_distance = distance;
+      }
+    }
+
+    Buffer src_image;
+    uint64_t src_puff_size;
+    TEST_AND_RETURN_FALSE(
+        ReadNestedImage(src, src_nested[best], &src_image, &src_puff_size));
+    vector<BitExtent> src_inner_deflates, src_inner_nested;
+    vector<BitExtent> dst_inner_deflates, dst_inner_nested;
+    TEST_AND_RETURN_FALSE(LocateNestedImageDeflates(
+        src_image, src_puff_size, max_depth - 1, &src_inner_deflates,
+        &src_inner_nested));
+    TEST_AND_RETURN_FALSE(LocateNestedImageDeflates(
+        dst_image, dst_puff_size, max_depth - 1, &dst_inner_deflates,
+        &dst_inner_nested));
+    NestedDeflate nested_deflate{src_nested[best], stream, dst_puff_size, {}};
+    TEST_AND_RETURN_FALSE(PuffDiff(
+        MemoryStream::CreateForRead(src_image),
+        MemoryStream::CreateForRead(dst_image), src_inner_deflates,
+        dst_inner_deflates, src_inner_nested, dst_inner_nested, max_depth - 1,
+        compressors, patchAlgorithm, copy_deflates, &nested_deflate.patch));
+    nested->push_back(std::move(nested_deflate));
+  }
+
+  // The copies in the nested streams are created by their nested patches.
+  vector<CopyDeflate> remaining_copies;
+  size_t nested_idx = 0;
+  for (const auto& copy : *copies) {
+    while (nested_idx < nested->size() &&
+           end_of((*nested)[nested_idx].dst) <= copy.dst.offset) {
+      nested_idx++;
+    }
+    if (nested_idx < nested->size() &&
+        (*nested)[nested_idx].dst.offset <= copy.dst.offset) {
+      continue;
+    }
+    remaining_copies.push_back(copy);
+  }
+  copies->swap(remaining_copies);
+  return true;
+}
+
+// Warns, once per process, that the |tmp_filepath| given to the deprecated
+// |PuffDiff| functions is ignored.
+void WarnTmpFilepathIgnored(const string& tmp_filepath) {
+  static std::once_flag warned;
+  std::call_once(warned, [&tmp_filepath]() {
+    LOG(WARNING) << "PuffDiff creates patches in memory, so the temporary file "
+                 << tmp_filepath << " is not used.";
+  });
+}
+
 }  // namespace
 
 bool PuffDiff(UniqueStreamPtr src,
@@ -110,54 +1366,108 @@ bool PuffDiff(UniqueStreamPtr src,
               const vector<BitExtent>& dst_deflates,
               const vector<bsdiff::CompressorType>& compressors,
               PatchAlgorithm patchAlgorithm,
-              const string& tmp_filepath,
               Buffer* patch) {
-  auto puffer = std::make_shared<Puffer>();
-  auto puff_deflate_stream =
-      [&puffer](UniqueStreamPtr stream, const vector<BitExtent>& deflates,
-                Buffer* puff_buffer, vector<ByteExtent>* puffs) {
-        uint64_t puff_size;
-        TEST_AND_RETURN_FALSE(stream->Seek(0));
-        TEST_AND_RETURN_FALSE(
-            FindPuffLocations(stream, deflates, puffs, &puff_size));
-        TEST_AND_RETURN_FALSE(stream->Seek(0));
-        auto src_puffin_stream = PuffinStream::CreateForPuff(
-            std::move(stream), puffer, puff_size, deflates, *puffs);
-        puff_buffer->resize(puff_size);
-        TEST_AND_RETURN_FALSE(
-            src_puffin_stream->Read(puff_buffer->data(), puff_buffer->size()));
-        return true;
-      };
+  return PuffDiff(std::move(src), std::move(dst), src_deflates, dst_deflates,
+                  compressors, patchAlgorithm, false, patch);
+}
+
+bool PuffDiff(UniqueStreamPtr src,
+              UniqueStreamPtr dst,
+              const vector<BitExtent>& src_deflates,
+              const vector<BitExtent>& dst_deflates,
+              const vector<bsdiff::CompressorType>& compressors,
+              PatchAlgorithm patchAlgorithm,
+              bool copy_deflates,
+              Buffer* patch) {
+  return PuffDiff(std::move(src), std::move(dst), src_deflates, dst_deflates,
+                  {}, {}, 0, compressors, patchAlgorithm, copy_deflates,
+                  patch);
+}
 
-  Buffer src_puff_buffer;
-  Buffer dst_puff_buffer;
-  vector<ByteExtent> src_puffs, dst_puffs;
-  TEST_AND_RETURN_FALSE(puff_deflate_stream(std::move(src), src_deflates,
-                                            &src_puff_buffer, &src_puffs));
-  TEST_AND_RETURN_FALSE(puff_deflate_stream(std::move(dst), dst_deflates,
-                                            &dst_puff_buffer, &dst_puffs));
+bool PuffDiff(UniqueStreamPtr src,
+              UniqueStreamPtr dst,
+              const vector<BitExtent>& src_deflates,
+              const vector<BitExtent>& dst_deflates,
+              const vector<BitExtent>& src_nested,
+              const vector<BitExtent>& dst_nested,
+              size_t max_nested_depth,
+              const vector<bsdiff::CompressorType>& compressors,
+              PatchAlgorithm patchAlgorithm,
+              bool copy_deflates,
+              Buffer* patch) {
+  vector<PuffImage> images(2);
+  images[0].deflates = &src_deflates;
+  images[1].deflates = &dst_deflates;
+  TEST_AND_RETURN_FALSE(ReadImage(std::move(src), &images[0]));
 
-  if (patchAlgorithm == PatchAlgorithm::kBsdiff) {
-    auto bsdiff_patch_writer = bsdiff::CreateBSDF2PatchWriter(
-        tmp_filepath, compressors, kBrotliCompressionQuality);
+  // The copied deflates and the nested deflate streams are cut out of the
+  // destination before it is diffed.
+  vector<CopyDeflate> copies;
+  vector<NestedDeflate> nested;
+  vector<BitExtent> remaining_deflates;
+  if (copy_deflates || !dst_nested.empty()) {
+    SharedStreamReader src_reader(images[0].deflate_stream);
+    if (copy_deflates) {
+      TEST_AND_RETURN_FALSE(FindCopyDeflates(
+          &src_reader, src_deflates, dst.get(), dst_deflates, &copies));
+    }
+    TEST_AND_RETURN_FALSE(CreateNestedPatches(
+        &src_reader, src_nested, dst.get(), dst_deflates, dst_nested,
+        max_nested_depth, compressors, patchAlgorithm, copy_deflates, &copies,
+        &nested));
+    vector<BitExtent> cuts;
+    for (const auto& copy : copies) {
+      cuts.push_back(copy.dst);
+    }
+    for (const auto& stream : nested) {
+      cuts.push_back(stream.dst);
+    }
+    std::sort(cuts.begin(), cuts.end());
+    uint64_t dst_size;
+    TEST_AND_RETURN_FALSE(dst->GetSize(&dst_size));
+    vector<ByteExtent> remaining_extents;
+    CutDeflates(dst_size, dst_deflates, cuts, &remaining_extents,
+                &remaining_deflates);
+    dst = ExtentStream::CreateForRead(std::move(dst), remaining_extents);
+    TEST_AND_RETURN_FALSE(dst);
+    images[1].deflates = &remaining_deflates;
+  }
+  TEST_AND_RETURN_FALSE(ReadImage(std::move(dst), &images[1]));
+  TEST_AND_RETURN_FALSE(PuffImages(&images, GetDefaultNumThreads()));
+  vector<size_t> src_puff_ids;
+  SharedStreamReader src_reader(images[0].deflate_stream);
+  TEST_AND_RETURN_FALSE(
+      FindDuplicateDeflates(&src_reader, src_deflates, &src_puff_ids));
 
-    TEST_AND_RETURN_FALSE(
-        0 == bsdiff::bsdiff(src_puff_buffer.data(), src_puff_buffer.size(),
-                            dst_puff_buffer.data(), dst_puff_buffer.size(),
-                            bsdiff_patch_writer.get(), nullptr));
-
-    auto bsdiff_patch = FileStream::Open(tmp_filepath, true, false);
-    TEST_AND_RETURN_FALSE(bsdiff_patch);
-    uint64_t patch_size;
-    TEST_AND_RETURN_FALSE(bsdiff_patch->GetSize(&patch_size));
-    Buffer bsdiff_patch_buf(patch_size);
-    TEST_AND_RETURN_FALSE(
-        bsdiff_patch->Read(bsdiff_patch_buf.data(), bsdiff_patch_buf.size()));
-    TEST_AND_RETURN_FALSE(bsdiff_patch->Close());
+  const auto& src_puffs = images[0].puffs;
+  const auto& dst_puffs = images[1].puffs;
+  const auto& src_puff_buffer = images[0].puff_buffer;
+  const auto& dst_puff_buffer = images[1].puff_buffer;
 
-    TEST_AND_RETURN_FALSE(CreatePatch(
-        bsdiff_patch_buf, src_deflates, dst_deflates, src_puffs, dst_puffs,
-        src_puff_buffer.size(), dst_puff_buffer.size(), patchAlgorithm, patch));
+  // The index of the sub-patches goes into the header, so they are created
+  // first.
+  vector<SubPatch> sub_patches;
+  if (patchAlgorithm == PatchAlgorithm::kSplitBsdiff) {
+    TEST_AND_RETURN_FALSE(CreateSubPatches(src_puff_buffer, dst_puff_buffer,
+                                           dst_puffs, compressors,
+                                           GetDefaultNumThreads(),
+                                           &sub_patches));
+  }
+
+  // Otherwise the header is known before diffing. Write it first, so the raw
+  // patch can be appended to it in place. The runs of blocks of the large
+  // destination deflates go into it too, so they can be huffed in parallel
+  // when patching.
+  TEST_AND_RETURN_FALSE(CreatePatchHeader(
+      src_deflates, *images[1].deflates, src_puffs, dst_puffs,
+      src_puff_buffer.size(), dst_puff_buffer.size(), images[1].sub_blocks,
+      images[1].sub_puffs, src_puff_ids, sub_patches, copies, nested,
+      patchAlgorithm, patch));
+
+  if (patchAlgorithm == PatchAlgorithm::kBsdiff) {
+    TEST_AND_RETURN_FALSE(BsdiffIntoBuffer(
+        src_puff_buffer.data(), src_puff_buffer.size(), dst_puff_buffer.data(),
+        dst_puff_buffer.size(), compressors, nullptr, patch));
   } else if (patchAlgorithm == PatchAlgorithm::kZucchini) {
     zucchini::ConstBufferView src_bytes(src_puff_buffer.data(),
                                         src_puff_buffer.size());
@@ -174,14 +1484,16 @@ bool PuffDiff(UniqueStreamPtr src,
 
     // Use brotli to compress the zucchini patch.
     // TODO(197361113) respect the CompressorType parameter for zucchini.
-    Buffer compressed_patch;
+    auto patch_stream = MemoryStream::CreateForWrite(patch);
+    TEST_AND_RETURN_FALSE(patch_stream->Seek(patch->size()));
     TEST_AND_RETURN_FALSE(BrotliEncode(zucchini_patch_buf.data(),
                                        zucchini_patch_buf.size(),
-                                       &compressed_patch));
-
-    TEST_AND_RETURN_FALSE(CreatePatch(
-        compressed_patch, src_deflates, dst_deflates, src_puffs, dst_puffs,
-        src_puff_buffer.size(), dst_puff_buffer.size(), patchAlgorithm, patch));
+                                       std::move(patch_stream)));
+  } else if (patchAlgorithm == PatchAlgorithm::kSplitBsdiff) {
+    for (const auto& sub_patch : sub_patches) {
+      patch->insert(patch->end(), sub_patch.patch.begin(),
+                    sub_patch.patch.end());
+    }
   } else {
     LOG(ERROR) << "unsupported type " << static_cast<int>(patchAlgorithm);
     return false;
@@ -190,6 +1502,19 @@ bool PuffDiff(UniqueStreamPtr src,
   return true;
 }
 
+bool PuffDiff(UniqueStreamPtr src,
+              UniqueStreamPtr dst,
+              const vector<BitExtent>& src_deflates,
+              const vector<BitExtent>& dst_deflates,
+              const vector<bsdiff::CompressorType>& compressors,
+              PatchAlgorithm patchAlgorithm,
+              const string& tmp_filepath,
+              Buffer* patch) {
+  WarnTmpFilepathIgnored(tmp_filepath);
+  return PuffDiff(std::move(src), std::move(dst), src_deflates, dst_deflates,
+                  compressors, patchAlgorithm, patch);
+}
+
 bool PuffDiff(UniqueStreamPtr src,
               UniqueStreamPtr dst,
               const std::vector<BitExtent>& src_deflates,
@@ -197,8 +1522,9 @@ bool PuffDiff(UniqueStreamPtr src,
               const std::vector<bsdiff::CompressorType>& compressors,
               const std::string& tmp_filepath,
               Buffer* patch) {
+  WarnTmpFilepathIgnored(tmp_filepath);
   return PuffDiff(std::move(src), std::move(dst), src_deflates, dst_deflates,
-                  compressors, PatchAlgorithm::kBsdiff, tmp_filepath, patch);
+                  compressors, PatchAlgorithm::kBsdiff, patch);
 }
 
 bool PuffDiff(const Buffer& src,
@@ -206,23 +1532,74 @@ bool PuffDiff(const Buffer& src,
               const vector<BitExtent>& src_deflates,
               const vector<BitExtent>& dst_deflates,
               const vector<bsdiff::CompressorType>& compressors,
-              const string& tmp_filepath,
               Buffer* patch) {
   return PuffDiff(MemoryStream::CreateForRead(src),
                   MemoryStream::CreateForRead(dst), src_deflates, dst_deflates,
-                  compressors, PatchAlgorithm::kBsdiff, tmp_filepath, patch);
+                  compressors, PatchAlgorithm::kBsdiff, patch);
 }
 
 bool PuffDiff(const Buffer& src,
               const Buffer& dst,
               const vector<BitExtent>& src_deflates,
               const vector<BitExtent>& dst_deflates,
+              const vector<bsdiff::CompressorType>& compressors,
               const string& tmp_filepath,
               Buffer* patch) {
+  WarnTmpFilepathIgnored(tmp_filepath);
+  return PuffDiff(src, dst, src_deflates, dst_deflates, compressors, patch);
+}
+
+bool PuffDiff(const Buffer& src,
+              const Buffer& dst,
+              const vector<BitExtent>& src_deflates,
+              const vector<BitExtent>& dst_deflates,
+              Buffer* patch) {
   return PuffDiff(
       src, dst, src_deflates, dst_deflates,
-      {bsdiff::CompressorType::kBZ2, bsdiff::CompressorType::kBrotli},
-      tmp_filepath, patch);
+      {bsdiff::CompressorType::kBZ2, bsdiff::CompressorType::kBrotli}, patch);
+}
+
+bool PuffDiff(const Buffer& src,
+              const Buffer& dst,
+              const vector<BitExtent>& src_deflates,
+              const vector<BitExtent>& dst_deflates,
+              const string& tmp_filepath,
+              Buffer* patch) {
+  WarnTmpFilepathIgnored(tmp_filepath);
+  return PuffDiff(src, dst, src_deflates, dst_deflates, patch);
+}
+
+bool PuffDiffWindowed(UniqueStreamPtr src,
+                      UniqueStreamPtr dst,
+                      const vector<BitExtent>& src_deflates,
+                      const vector<BitExtent>& dst_deflates,
+                      const vector<bsdiff::CompressorType>& compressors,
+                      uint64_t max_memory,
+                      Buffer* patch) {
+  vector<PuffImage> images(2);
+  images[0].deflates = &src_deflates;
+  images[1].deflates = &dst_deflates;
+  TEST_AND_RETURN_FALSE(ReadImage(std::move(src), &images[0]));
+  TEST_AND_RETURN_FALSE(ReadImage(std::move(dst), &images[1]));
+
+  vector<SubPatch> sub_patches;
+  TEST_AND_RETURN_FALSE(CreateWindowedSubPatches(
+      images[0], images[1], compressors, max_memory, &sub_patches));
+  vector<size_t> src_puff_ids;
+  SharedStreamReader src_reader(images[0].deflate_stream);
+  TEST_AND_RETURN_FALSE(
+      FindDuplicateDeflates(&src_reader, src_deflates, &src_puff_ids));
+
+  TEST_AND_RETURN_FALSE(CreatePatchHeader(
+      src_deflates, dst_deflates, images[0].puffs, images[1].puffs,
+      images[0].puff_size, images[1].puff_size, images[1].sub_blocks,
+      images[1].sub_puffs, src_puff_ids, sub_patches, {}, {},
+      PatchAlgorithm::kSplitBsdiff, patch));
+  for (const auto& sub_patch : sub_patches) {
+    patch->insert(patch->end(), sub_patch.patch.begin(),
+                  sub_patch.patch.end());
+  }
+  return true;
 }
 
 }  // namespace puffin
@@ -17,6 +17,7 @@
 #include "puffin/src/include/puffin/puffer.h"
 #include "puffin/src/include/puffin/stream.h"
 #include "puffin/src/logging.h"
+#include "puffin/src/parallel.h"
 #include "puffin/src/puff_reader.h"
 #include "puffin/src/puff_writer.h"
 
@@ -52,6 +53,114 @@ bool CheckArgsIntegrity(uint64_t puff_size,
   return true;
 }
 
+// Checks that the runs in |sub_blocks| and |sub_puffs| are in order and that
+// the runs of each deflate in |deflates| cover it and its puff in |puffs|
+// entirely.
+bool CheckSubBlocksIntegrity(const vector<BitExtent>& deflates,
+                             const vector<ByteExtent>& puffs,
+                             const vector<BitExtent>& sub_blocks,
+                             const vector<ByteExtent>& sub_puffs) {
+  TEST_AND_RETURN_FALSE(sub_blocks.size() == sub_puffs.size());
+  size_t run_idx = 0;
+  for (size_t idx = 0; idx < deflates.size(); idx++) {
+    auto bit_end = deflates[idx].offset;
+    auto puff_end = puffs[idx].offset;
+    if (run_idx == sub_blocks.size() ||
+        sub_blocks[run_idx].offset != bit_end) {
+      continue;
+    }
+    while (run_idx < sub_blocks.size() &&
+           sub_blocks[run_idx].offset == bit_end) {
+      TEST_AND_RETURN_FALSE(sub_puffs[run_idx].offset == puff_end);
+      TEST_AND_RETURN_FALSE(sub_blocks[run_idx].length > 0 &&
+                            sub_puffs[run_idx].length > 0);
+      bit_end += sub_blocks[run_idx].length;
+      puff_end += sub_puffs[run_idx].length;
+      run_idx++;
+    }
+    TEST_AND_RETURN_FALSE(bit_end ==
+                          deflates[idx].offset + deflates[idx].length);
+    TEST_AND_RETURN_FALSE(puff_end == puffs[idx].offset + puffs[idx].length);
+  }
+  // All the runs have to belong to a deflate.
+  TEST_AND_RETURN_FALSE(run_idx == sub_blocks.size());
+  return true;
+}
+
+// Checks that each of |puff_ids| is the index of a puff of the same size in
+// |puffs| that has its own index as id.
+bool CheckPuffIdsIntegrity(const vector<ByteExtent>& puffs,
+                           const vector<size_t>& puff_ids) {
+  if (puff_ids.empty()) {
+    return true;
+  }
+  TEST_AND_RETURN_FALSE(puff_ids.size() == puffs.size());
+  for (size_t idx = 0; idx < puff_ids.size(); idx++) {
+    auto id = puff_ids[idx];
+    TEST_AND_RETURN_FALSE(id <= idx && puff_ids[id] == id);
+    TEST_AND_RETURN_FALSE(puffs[id].length == puffs[idx].length);
+  }
+  return true;
+}
+
+// Reads |length| bits of |stream| starting at bit |offset| into |bits|, shifted
+// so that they start at its first bit. The bits after them in the last byte are
+// zero.
+bool ReadBits(StreamInterface* stream,
+              uint64_t offset,
+              uint64_t length,
+              Buffer* bits) {
+  auto start_byte = offset / 8;
+  auto end_byte = (offset + length + 7) / 8;
+  // One more byte, so every output byte can be made of two input bytes.
+  Buffer bytes(end_byte - start_byte + 1, 0);
+  TEST_AND_RETURN_FALSE(stream->Seek(start_byte));
+  TEST_AND_RETURN_FALSE(stream->Read(bytes.data(), end_byte - start_byte));
+  auto shift = offset % 8;
+  bits->resize((length + 7) / 8);
+  for (size_t idx = 0; idx < bits->size(); idx++) {
+    (*bits)[idx] = (bytes[idx] >> shift) | (bytes[idx + 1] << (8 - shift));
+  }
+  if (length % 8 != 0) {
+    bits->back() &= (1 << (length % 8)) - 1;
+  }
+  return true;
+}
+
+// Checks that each deflate in |deflates| of |stream| that shares the puff of an
+// earlier deflate by |puff_ids| has the same bits, and if not, gives it its own
+// id so it is puffed again. A wrong id would otherwise silently produce the
+// wrong puff.
+bool VerifyPuffIds(StreamInterface* stream,
+                   const vector<BitExtent>& deflates,
+                   vector<size_t>* puff_ids) {
+  constexpr uint64_t kChunkBits = 1024 * 1024 * 8;  // 1MB
+  Buffer bits1, bits2;
+  for (size_t idx = 0; idx < puff_ids->size(); idx++) {
+    auto id = (*puff_ids)[idx];
+    if (id == idx) {
+      continue;
+    }
+    const auto& deflate1 = deflates[id];
+    const auto& deflate2 = deflates[idx];
+    bool same = deflate1.length == deflate2.length;
+    for (uint64_t pos = 0; same && pos < deflate1.length; pos += kChunkBits) {
+      auto length = std::min(kChunkBits, deflate1.length - pos);
+      TEST_AND_RETURN_FALSE(
+          ReadBits(stream, deflate1.offset + pos, length, &bits1));
+      TEST_AND_RETURN_FALSE(
+          ReadBits(stream, deflate2.offset + pos, length, &bits2));
+      same = bits1 == bits2;
+    }
+    if (!same) {
+      LOG(WARNING) << "The deflate at index " << idx << " is not the same as "
+                   << "the one at index " << id << ", puffing it again.";
+      (*puff_ids)[idx] = idx;
+    }
+  }
+  return true;
+}
+
 }  // namespace
 
 UniqueStreamPtr PuffinStream::CreateForPuff(UniqueStreamPtr stream,
@@ -59,14 +168,26 @@ UniqueStreamPtr PuffinStream::CreateForPuff(UniqueStreamPtr stream,
                                             uint64_t puff_size,
                                             const vector<BitExtent>& deflates,
                                             const vector<ByteExtent>& puffs,
-                                            size_t max_cache_size) {
+                                            size_t max_cache_size,
+                                            const vector<size_t>& puff_ids,
+                                            shared_ptr<PuffCache> shared_cache,
+                                            PuffCacheStats* stats) {
   TEST_AND_RETURN_VALUE(CheckArgsIntegrity(puff_size, deflates, puffs),
                         nullptr);
+  TEST_AND_RETURN_VALUE(CheckPuffIdsIntegrity(puffs, puff_ids), nullptr);
+  // The ids are only used by the cache of the stream itself. The shared cache
+  // finds the puffs by the bits of their deflates.
+  auto verified_puff_ids = puff_ids;
+  if (max_cache_size > 0 && !shared_cache) {
+    TEST_AND_RETURN_VALUE(
+        VerifyPuffIds(stream.get(), deflates, &verified_puff_ids), nullptr);
+  }
   TEST_AND_RETURN_VALUE(stream->Seek(0), nullptr);
 
-  UniqueStreamPtr puffin_stream(new PuffinStream(std::move(stream), puffer,
-                                                 nullptr, puff_size, deflates,
-                                                 puffs, max_cache_size));
+  UniqueStreamPtr puffin_stream(
+      new PuffinStream(std::move(stream), puffer, nullptr, puff_size, deflates,
+                       puffs, {}, {}, 1, max_cache_size, verified_puff_ids,
+                       std::move(shared_cache), stats));
   TEST_AND_RETURN_VALUE(puffin_stream->Seek(0), nullptr);
   return puffin_stream;
 }
@@ -76,12 +197,31 @@ UniqueStreamPtr PuffinStream::CreateForHuff(UniqueStreamPtr stream,
                                             uint64_t puff_size,
                                             const vector<BitExtent>& deflates,
                                             const vector<ByteExtent>& puffs) {
+  return CreateForHuff(std::move(stream), huffer, puff_size, deflates, puffs,
+                       {}, {}, 1);
+}
+
+UniqueStreamPtr PuffinStream::CreateForHuff(
+    UniqueStreamPtr stream,
+    shared_ptr<Huffer> huffer,
+    uint64_t puff_size,
+    const vector<BitExtent>& deflates,
+    const vector<ByteExtent>& puffs,
+    const vector<BitExtent>& sub_blocks,
+    const vector<ByteExtent>& sub_puffs,
+    size_t num_threads) {
   TEST_AND_RETURN_VALUE(CheckArgsIntegrity(puff_size, deflates, puffs),
                         nullptr);
+  TEST_AND_RETURN_VALUE(
+      CheckSubBlocksIntegrity(deflates, puffs, sub_blocks, sub_puffs),
+      nullptr);
+  TEST_AND_RETURN_VALUE(num_threads > 0, nullptr);
   TEST_AND_RETURN_VALUE(stream->Seek(0), nullptr);
 
-  UniqueStreamPtr puffin_stream(new PuffinStream(
-      std::move(stream), nullptr, huffer, puff_size, deflates, puffs, 0));
+  UniqueStreamPtr puffin_stream(
+      new PuffinStream(std::move(stream), nullptr, huffer, puff_size, deflates,
+                       puffs, sub_blocks, sub_puffs, num_threads, 0, {},
+                       nullptr, nullptr));
   TEST_AND_RETURN_VALUE(puffin_stream->Seek(0), nullptr);
   return puffin_stream;
 }
@@ -92,13 +232,22 @@ PuffinStream::PuffinStream(UniqueStreamPtr stream,
                            uint64_t puff_size,
                            const vector<BitExtent>& deflates,
                            const vector<ByteExtent>& puffs,
-                           size_t max_cache_size)
+                           const vector<BitExtent>& sub_blocks,
+                           const vector<ByteExtent>& sub_puffs,
+                           size_t num_threads,
+                           size_t max_cache_size,
+                           const vector<size_t>& puff_ids,
+                           shared_ptr<PuffCache> shared_cache,
+                           PuffCacheStats* stats)
     : stream_(std::move(stream)),
       puffer_(puffer),
       huffer_(huffer),
       puff_stream_size_(puff_size),
       deflates_(deflates),
       puffs_(puffs),
+      sub_blocks_(sub_blocks),
+      sub_puffs_(sub_puffs),
+      num_threads_(num_threads),
       puff_pos_(0),
       skip_bytes_(0),
       deflate_bit_pos_(0),
@@ -106,8 +255,12 @@ PuffinStream::PuffinStream(UniqueStreamPtr stream,
       extra_byte_(0),
       is_for_puff_(puffer_ ? true : false),
       closed_(false),
+      puff_ids_(puff_ids),
       max_cache_size_(max_cache_size),
-      cur_cache_size_(0) {
+      cur_cache_size_(0),
+      shared_cache_(std::move(shared_cache)),
+      shared_cache_stats_(stats),
+      shared_puff_idx_(0) {
   // Building upper bounds for faster seek.
   upper_bounds_.reserve(puffs.size());
   for (const auto& puff : puffs) {
@@ -128,21 +281,22 @@ PuffinStream::PuffinStream(UniqueStreamPtr stream,
   deflates_.emplace_back(deflate_stream_size * 8, 0);
   puffs_.emplace_back(puff_stream_size_, 0);
 
-  // Look for the largest puff and deflate extents and get proper size buffers.
+  // Look for the largest puff. Huffing needs a buffer for all of it, but
+  // puffing only needs buffers for the deflates that are read, so they grow as
+  // they are needed. The deflate buffer is sized for each deflate anyway.
   uint64_t max_puff_length = 0;
   for (const auto& puff : puffs) {
     max_puff_length = std::max(max_puff_length, puff.length);
   }
-  puff_buffer_.reset(new Buffer(max_puff_length + 1));
+  puff_buffer_.reset(new Buffer(is_for_puff_ ? 0 : max_puff_length + 1));
+  deflate_buffer_.reset(new Buffer());
   if (max_cache_size_ < max_puff_length) {
     max_cache_size_ = 0;  // It means we are not caching puffs.
   }
-
-  uint64_t max_deflate_length = 0;
-  for (const auto& deflate : deflates) {
-    max_deflate_length = std::max(max_deflate_length, deflate.length * 8);
+  // The puffs are not cached here if they are cached in |shared_cache_|.
+  if (shared_cache_) {
+    max_cache_size_ = 0;
   }
-  deflate_buffer_.reset(new Buffer(max_deflate_length + 2));
 }
 
 bool PuffinStream::GetSize(uint64_t* size) const {
@@ -258,48 +412,39 @@ bool PuffinStream::Read(void* buffer, size_t count) {
       // last byte (which may partially include a deflate bit). Here we keep the
       // |puff_pos_| point to the first byte of the puffed stream and
       // |skip_bytes_| shows how many bytes in the puff we have copied till now.
-      auto start_byte = (cur_deflate_->offset / 8);
       auto end_byte = (cur_deflate_->offset + cur_deflate_->length + 7) / 8;
-      auto bytes_to_read = end_byte - start_byte;
       // Puff directly to buffer if it has space.
       bool puff_directly_into_buffer =
-          max_cache_size_ == 0 && (skip_bytes_ == 0) &&
+          max_cache_size_ == 0 && !shared_cache_ && (skip_bytes_ == 0) &&
           (length - bytes_read >= cur_puff_->length);
 
-      auto cur_puff_idx = std::distance(puffs_.begin(), cur_puff_);
-      if (max_cache_size_ == 0 ||
-          !GetPuffCache(cur_puff_idx, cur_puff_->length, &puff_buffer_)) {
+      size_t cur_puff_idx = std::distance(puffs_.begin(), cur_puff_);
+      auto puff_id = cur_puff_idx < puff_ids_.size() ? puff_ids_[cur_puff_idx]
+                                                     : cur_puff_idx;
+      if (shared_cache_) {
+        TEST_AND_RETURN_FALSE(GetSharedPuff(cur_puff_idx));
+      } else if (max_cache_size_ == 0 ||
+                 !GetPuffCache(puff_id, cur_puff_->length, &puff_buffer_)) {
         // Did not find the puff buffer in cache. We have to build it.
-        deflate_buffer_->resize(bytes_to_read);
-        TEST_AND_RETURN_FALSE(stream_->Seek(start_byte));
-        TEST_AND_RETURN_FALSE(
-            stream_->Read(deflate_buffer_->data(), bytes_to_read));
-        BufferBitReader bit_reader(deflate_buffer_->data(), bytes_to_read);
-
-        BufferPuffWriter puff_writer(puff_directly_into_buffer
-                                         ? bytes + bytes_read
-                                         : puff_buffer_->data(),
-                                     cur_puff_->length);
-
-        // Drop the first unused bits.
-        size_t extra_bits_len = cur_deflate_->offset & 7;
-        TEST_AND_RETURN_FALSE(bit_reader.CacheBits(extra_bits_len));
-        bit_reader.DropBits(extra_bits_len);
-
-        TEST_AND_RETURN_FALSE(
-            puffer_->PuffDeflate(&bit_reader, &puff_writer, nullptr));
-        TEST_AND_RETURN_FALSE(bytes_to_read == bit_reader.Offset());
-        TEST_AND_RETURN_FALSE(cur_puff_->length == puff_writer.Size());
+        if (!puff_directly_into_buffer &&
+            puff_buffer_->size() < cur_puff_->length) {
+          puff_buffer_->resize(cur_puff_->length);
+        }
+        TEST_AND_RETURN_FALSE(ReadDeflate());
+        TEST_AND_RETURN_FALSE(PuffDeflate(
+            puff_directly_into_buffer ? bytes + bytes_read
+                                      : puff_buffer_->data()));
       } else {
         // Just seek to proper location.
-        TEST_AND_RETURN_FALSE(stream_->Seek(start_byte + bytes_to_read));
+        TEST_AND_RETURN_FALSE(stream_->Seek(end_byte));
       }
+      const uint8_t* puff_data =
+          shared_cache_ ? shared_puff_->data() : puff_buffer_->data();
       // Copy from puff buffer to output if needed.
       auto bytes_to_copy =
           std::min(length - bytes_read, cur_puff_->length - skip_bytes_);
       if (!puff_directly_into_buffer) {
-        memcpy(bytes + bytes_read, puff_buffer_->data() + skip_bytes_,
-               bytes_to_copy);
+        memcpy(bytes + bytes_read, puff_data + skip_bytes_, bytes_to_copy);
       }
 
       skip_bytes_ += bytes_to_copy;
@@ -374,17 +519,39 @@ bool PuffinStream::Write(const void* buffer, size_t count) {
         auto bytes_to_write = end_byte - start_byte;
 
         deflate_buffer_->resize(bytes_to_write);
-        BufferBitWriter bit_writer(deflate_buffer_->data(), bytes_to_write);
-        BufferPuffReader puff_reader(puff_buffer_->data(), cur_puff_->length);
 
-        // Write last byte if it has any.
-        TEST_AND_RETURN_FALSE(
-            bit_writer.WriteBits(cur_deflate_->offset & 7, last_byte_));
-        last_byte_ = 0;
+        // Find the runs of blocks of the current deflate, if it has any.
+        auto first_run = std::lower_bound(
+            sub_blocks_.begin(), sub_blocks_.end(), cur_deflate_->offset,
+            [](const BitExtent& run, uint64_t offset) {
+              return run.offset < offset;
+            });
+        auto last_run = first_run;
+        while (last_run != sub_blocks_.end() &&
+               last_run->offset <
+                   cur_deflate_->offset + cur_deflate_->length) {
+          last_run++;
+        }
 
-        TEST_AND_RETURN_FALSE(huffer_->HuffDeflate(&puff_reader, &bit_writer));
-        TEST_AND_RETURN_FALSE(bit_writer.Size() == bytes_to_write);
-        TEST_AND_RETURN_FALSE(puff_reader.BytesLeft() == 0);
+        if (num_threads_ > 1 && std::distance(first_run, last_run) > 1) {
+          TEST_AND_RETURN_FALSE(HuffRunsInParallel(
+              std::distance(sub_blocks_.begin(), first_run),
+              std::distance(sub_blocks_.begin(), last_run)));
+        } else {
+          BufferBitWriter bit_writer(deflate_buffer_->data(), bytes_to_write);
+          BufferPuffReader puff_reader(puff_buffer_->data(),
+                                       cur_puff_->length);
+
+          // Write last byte if it has any.
+          TEST_AND_RETURN_FALSE(
+              bit_writer.WriteBits(cur_deflate_->offset & 7, last_byte_));
+
+          TEST_AND_RETURN_FALSE(
+              huffer_->HuffDeflate(&puff_reader, &bit_writer));
+          TEST_AND_RETURN_FALSE(bit_writer.Size() == bytes_to_write);
+          TEST_AND_RETURN_FALSE(puff_reader.BytesLeft() == 0);
+        }
+        last_byte_ = 0;
 
         deflate_bit_pos_ = cur_deflate_->offset + cur_deflate_->length;
         if (extra_byte_ == 1) {
@@ -422,6 +589,61 @@ bool PuffinStream::Write(const void* buffer, size_t count) {
   return true;
 }
 
+bool PuffinStream::HuffRunsInParallel(size_t first_run, size_t last_run) {
+  auto num_runs = last_run - first_run;
+  auto num_threads = std::min(num_threads_, num_runs);
+  if (thread_huffers_.empty()) {
+    thread_huffers_.push_back(huffer_);
+  }
+  while (thread_huffers_.size() < num_threads) {
+    thread_huffers_.push_back(std::make_shared<Huffer>());
+  }
+
+  // Each run is huffed with the same bit alignment it has in the deflate
+  // stream, so the alignment of its stored blocks comes out right and it only
+  // has to be ORed into its place afterwards. The unused bits of its first and
+  // last bytes are left zero by the writer.
+  vector<Buffer> run_buffers(num_runs);
+  TaskQueue queue(num_runs);
+  TEST_AND_RETURN_FALSE(RunInParallel(num_threads, [&](size_t thread_idx) {
+    size_t idx;
+    while (queue.Next(&idx)) {
+      const auto& run = sub_blocks_[first_run + idx];
+      const auto& run_puff = sub_puffs_[first_run + idx];
+      auto& run_buffer = run_buffers[idx];
+      auto shift = run.offset & 7;
+      run_buffer.resize((shift + run.length + 7) / 8);
+      BufferBitWriter bit_writer(run_buffer.data(), run_buffer.size());
+      BufferPuffReader puff_reader(
+          puff_buffer_->data() + (run_puff.offset - cur_puff_->offset),
+          run_puff.length);
+      if (!bit_writer.WriteBits(shift, 0) ||
+          !thread_huffers_[thread_idx]->HuffDeflate(&puff_reader,
+                                                    &bit_writer) ||
+          bit_writer.Size() != run_buffer.size() ||
+          puff_reader.BytesLeft() != 0) {
+        LOG(ERROR) << "Failed to huff the deflate blocks at " << run.offset;
+        queue.Cancel();
+        return false;
+      }
+    }
+    return true;
+  }));
+
+  // Stitch the runs together after the bits of |last_byte_|.
+  auto start_byte = cur_deflate_->offset / 8;
+  std::fill(deflate_buffer_->begin(), deflate_buffer_->end(), 0);
+  (*deflate_buffer_)[0] = last_byte_ & ((1 << (cur_deflate_->offset & 7)) - 1);
+  for (size_t idx = 0; idx < num_runs; idx++) {
+    auto out = deflate_buffer_->data() +
+               (sub_blocks_[first_run + idx].offset / 8 - start_byte);
+    for (auto byte : run_buffers[idx]) {
+      *out++ |= byte;
+    }
+  }
+  return true;
+}
+
 bool PuffinStream::SetExtraByte() {
   TEST_AND_RETURN_FALSE(cur_deflate_ != deflates_.end());
   if ((cur_deflate_ + 1) == deflates_.end()) {
@@ -437,12 +659,71 @@ bool PuffinStream::SetExtraByte() {
   return true;
 }
 
-bool PuffinStream::GetPuffCache(int puff_id,
+bool PuffinStream::ReadDeflate() {
+  auto start_byte = cur_deflate_->offset / 8;
+  auto end_byte = (cur_deflate_->offset + cur_deflate_->length + 7) / 8;
+  deflate_buffer_->resize(end_byte - start_byte);
+  TEST_AND_RETURN_FALSE(stream_->Seek(start_byte));
+  TEST_AND_RETURN_FALSE(
+      stream_->Read(deflate_buffer_->data(), deflate_buffer_->size()));
+  return true;
+}
+
+bool PuffinStream::PuffDeflate(uint8_t* puff) {
+  BufferBitReader bit_reader(deflate_buffer_->data(), deflate_buffer_->size());
+  BufferPuffWriter puff_writer(puff, cur_puff_->length);
+
+  // Drop the first unused bits.
+  size_t extra_bits_len = cur_deflate_->offset & 7;
+  TEST_AND_RETURN_FALSE(bit_reader.CacheBits(extra_bits_len));
+  bit_reader.DropBits(extra_bits_len);
+
+  TEST_AND_RETURN_FALSE(
+      puffer_->PuffDeflate(&bit_reader, &puff_writer, nullptr));
+  TEST_AND_RETURN_FALSE(deflate_buffer_->size() == bit_reader.Offset());
+  TEST_AND_RETURN_FALSE(cur_puff_->length == puff_writer.Size());
+  return true;
+}
+
+bool PuffinStream::GetSharedPuff(size_t puff_idx) {
+  if (shared_puff_ && shared_puff_idx_ == puff_idx) {
+    // Still reading the same puff, just seek past its deflate.
+    auto end_byte = (cur_deflate_->offset + cur_deflate_->length + 7) / 8;
+    TEST_AND_RETURN_FALSE(stream_->Seek(end_byte));
+    return true;
+  }
+
+  // The deflate is looked up by its bits only, so the bits of the data around
+  // it are cleared.
+  TEST_AND_RETURN_FALSE(ReadDeflate());
+  // Reading past the last deflate gets here with no deflate.
+  TEST_AND_RETURN_FALSE(!deflate_buffer_->empty());
+  uint8_t first_bit = cur_deflate_->offset & 7;
+  auto end_bit = (cur_deflate_->offset + cur_deflate_->length) & 7;
+  deflate_buffer_->front() &= 0xFF << first_bit;
+  if (end_bit) {
+    deflate_buffer_->back() &= (1 << end_bit) - 1;
+  }
+
+  shared_puff_ = shared_cache_->Find(*deflate_buffer_, first_bit,
+                                     cur_deflate_->length, shared_cache_stats_);
+  if (!shared_puff_) {
+    auto puff = std::make_shared<Buffer>(cur_puff_->length);
+    TEST_AND_RETURN_FALSE(PuffDeflate(puff->data()));
+    shared_cache_->Insert(*deflate_buffer_, first_bit, cur_deflate_->length,
+                          puff, shared_cache_stats_);
+    shared_puff_ = std::move(puff);
+  }
+  shared_puff_idx_ = puff_idx;
+  return true;
+}
+
+bool PuffinStream::GetPuffCache(size_t puff_id,
                                 uint64_t puff_size,
                                 shared_ptr<Buffer>* buffer) {
   bool found = false;
   // Search for it.
-  std::pair<int, shared_ptr<Buffer>> cache;
+  std::pair<size_t, shared_ptr<Buffer>> cache;
   // TODO(*): Find a faster way of doing this? Maybe change the data structure
   // that supports faster search.
   for (auto iter = caches_.begin(); iter != caches_.end(); ++iter) {
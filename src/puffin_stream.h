@@ -13,6 +13,7 @@
 
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/huffer.h"
+#include "puffin/src/include/puffin/puff_cache.h"
 #include "puffin/src/include/puffin/puffer.h"
 #include "puffin/src/include/puffin/stream.h"
 
@@ -43,12 +44,25 @@ class PuffinStream : public StreamInterface {
   //                      If the mount is smaller than the maximum puff buffer
   //                      size in |puffs|, then its value will be set to zero
   //                      and no puff will be cached.
-  static UniqueStreamPtr CreateForPuff(UniqueStreamPtr stream,
-                                       std::shared_ptr<Puffer> puffer,
-                                       uint64_t puff_size,
-                                       const std::vector<BitExtent>& deflates,
-                                       const std::vector<ByteExtent>& puffs,
-                                       size_t max_cache_size = 0);
+  // |puff_ids|  IN  The ids the puffs are cached by. Puffs with the same id
+  //                 have to be the same, so they share one cached buffer. The
+  //                 id of a puff is the index of the first puff with the same
+  //                 content. If empty, each puff is cached by its own index.
+  //                 The deflates are compared when the stream is created, and
+  //                 the ones that differ from their original are puffed again.
+  // |shared_cache| IN  If not null, the puffs are cached in it instead, where
+  //                    other streams can find them too.
+  // |stats|        IN  If not null, the use of |shared_cache| is counted in it.
+  static UniqueStreamPtr CreateForPuff(
+      UniqueStreamPtr stream,
+      std::shared_ptr<Puffer> puffer,
+      uint64_t puff_size,
+      const std::vector<BitExtent>& deflates,
+      const std::vector<ByteExtent>& puffs,
+      size_t max_cache_size = 0,
+      const std::vector<size_t>& puff_ids = {},
+      std::shared_ptr<PuffCache> shared_cache = nullptr,
+      PuffCacheStats* stats = nullptr);
 
   // Creates a |PuffinStream| for writing puff buffers into a deflate stream.
   // |stream|    IN  The deflate stream.
@@ -63,6 +77,25 @@ class PuffinStream : public StreamInterface {
                                        const std::vector<BitExtent>& deflates,
                                        const std::vector<ByteExtent>& puffs);
 
+  // Same as above, but huffs the deflates that are split into runs of blocks in
+  // parallel. The bit offset of each run is known in advance, so the runs of a
+  // deflate are huffed into separate buffers using up to |num_threads| threads
+  // and then stitched together. Deflates without runs are huffed as usual.
+  // |sub_blocks|  IN  The location of the runs of deflate blocks in |stream|.
+  //                   The runs of a deflate have to cover all of it.
+  // |sub_puffs|   IN  The location of the puffs of |sub_blocks| in the input
+  //                   puff stream.
+  // |num_threads| IN  The maximum number of threads to huff a deflate with.
+  static UniqueStreamPtr CreateForHuff(
+      UniqueStreamPtr stream,
+      std::shared_ptr<Huffer> huffer,
+      uint64_t puff_size,
+      const std::vector<BitExtent>& deflates,
+      const std::vector<ByteExtent>& puffs,
+      const std::vector<BitExtent>& sub_blocks,
+      const std::vector<ByteExtent>& sub_puffs,
+      size_t num_threads);
+
   bool GetSize(uint64_t* size) const override;
 
   // Returns the current offset in the imaginary puff stream.
@@ -93,19 +126,40 @@ class PuffinStream : public StreamInterface {
                uint64_t puff_size,
                const std::vector<BitExtent>& deflates,
                const std::vector<ByteExtent>& puffs,
-               size_t max_cache_size);
+               const std::vector<BitExtent>& sub_blocks,
+               const std::vector<ByteExtent>& sub_puffs,
+               size_t num_threads,
+               size_t max_cache_size,
+               const std::vector<size_t>& puff_ids,
+               std::shared_ptr<PuffCache> shared_cache,
+               PuffCacheStats* stats);
 
  private:
   // See |extra_byte_|.
   bool SetExtraByte();
 
-  // Returns the cache for the |puff_id|th puff. If it does not find it, either
-  // returns the least accessed cached (if cache is full) or creates a new empty
-  // buffer. It returns false if it cannot find the |puff_id|th puff cache.
-  bool GetPuffCache(int puff_id,
+  // Huffs the runs [|first_run|, |last_run|) of |sub_blocks_|, which cover the
+  // current deflate, from |puff_buffer_| into |deflate_buffer_| in parallel.
+  bool HuffRunsInParallel(size_t first_run, size_t last_run);
+
+  // Returns the cache for the puffs with id |puff_id|. If it does not find it,
+  // either returns the least accessed cached (if cache is full) or creates a
+  // new empty buffer. It returns false if it cannot find the |puff_id| cache.
+  bool GetPuffCache(size_t puff_id,
                     uint64_t puff_size,
                     std::shared_ptr<Buffer>* buffer);
 
+  // Sets |shared_puff_| to the puff of the current deflate, which is the
+  // |puff_idx|th one, from |shared_cache_| or by puffing it and adding it to
+  // |shared_cache_|. Moves |stream_| past the deflate either way.
+  bool GetSharedPuff(size_t puff_idx);
+
+  // Reads the current deflate from |stream_| into |deflate_buffer_|.
+  bool ReadDeflate();
+
+  // Puffs the current deflate from |deflate_buffer_| into |puff|.
+  bool PuffDeflate(uint8_t* puff);
+
   UniqueStreamPtr stream_;
 
   std::shared_ptr<Puffer> puffer_;
@@ -124,6 +178,14 @@ class PuffinStream : public StreamInterface {
 
   std::vector<uint64_t> upper_bounds_;
 
+  // The runs of blocks of the deflates that are huffed in parallel and their
+  // puffs.
+  std::vector<BitExtent> sub_blocks_;
+  std::vector<ByteExtent> sub_puffs_;
+  size_t num_threads_;
+  // One |Huffer| for each thread, as a |Huffer| cannot be shared.
+  std::vector<std::shared_ptr<Huffer>> thread_huffers_;
+
   // The current offset in the imaginary puff stream is |puff_pos_| +
   // |skip_bytes_|
   uint64_t puff_pos_;
@@ -154,14 +216,23 @@ class PuffinStream : public StreamInterface {
   std::unique_ptr<Buffer> deflate_buffer_;
   std::shared_ptr<Buffer> puff_buffer_;
 
+  // The id each puff is cached by, see |CreateForPuff|.
+  std::vector<size_t> puff_ids_;
   // The list of puff buffer caches.
-  std::list<std::pair<int, std::shared_ptr<Buffer>>> caches_;
+  std::list<std::pair<size_t, std::shared_ptr<Buffer>>> caches_;
   // The maximum memory (in bytes) kept for caching puff buffers by an object of
   // this class.
   size_t max_cache_size_;
   // The current amount of memory (in bytes) used for caching puff buffers.
   uint64_t cur_cache_size_;
 
+  // The cache shared with other streams, if any, and the stats of its use.
+  std::shared_ptr<PuffCache> shared_cache_;
+  PuffCacheStats* shared_cache_stats_;
+  // The last puff got from |shared_cache_| and the index of the puff it is.
+  std::shared_ptr<const Buffer> shared_puff_;
+  size_t shared_puff_idx_;
+
   DISALLOW_COPY_AND_ASSIGN(PuffinStream);
 };
 
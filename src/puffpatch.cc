@@ -9,11 +9,16 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include "bsdiff/bspatch.h"
+#include "bsdiff/control_entry.h"
 #include "bsdiff/file_interface.h"
+#include "bsdiff/patch_reader.h"
 #include "zucchini/patch_reader.h"
 #include "zucchini/zucchini.h"
 
@@ -24,9 +29,14 @@
 #include "puffin/src/include/puffin/puffer.h"
 #include "puffin/src/include/puffin/stream.h"
 #include "puffin/src/logging.h"
+#include "puffin/src/nested_deflate.h"
+#include "puffin/src/parallel.h"
 #include "puffin/src/puffin.pb.h"
 #include "puffin/src/puffin_stream.h"
+#include "puffin/src/random_access_huff_stream.h"
+#include "puffin/src/shared_stream.h"
 
+using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -96,17 +106,58 @@ class BsdiffStream : public bsdiff::FileInterface {
   DISALLOW_COPY_AND_ASSIGN(BsdiffStream);
 };
 
+// A sub-patch of a SPLIT_BSDIFF patch: the bsdiff patch at |patch| of the raw
+// patch creates the |dst| range of the destination puff stream from the |src|
+// range of the source puff stream.
+struct SubPatch {
+  ByteExtent src;
+  ByteExtent dst;
+  ByteExtent patch;
+};
+
+// A destination deflate that is copied from a bit-identical source deflate.
+struct CopyDeflate {
+  BitExtent src;
+  BitExtent dst;
+};
+
+// A destination deflate stream that is rebuilt from its nested image, which
+// the nested puffin patch |patch| creates from the nested image of the source
+// deflate stream |src|. The puff of the image is the first |puff_size| bytes
+// of it.
+struct NestedDeflate {
+  BitExtent src;
+  BitExtent dst;
+  uint64_t puff_size;
+  string patch;
+};
+
+// A puffin patch decoded by |DecodePatch|.
+struct DecodedPatch {
+  // The location of the raw patch (e.g. bsdiff, zucchini) in the puffin patch.
+  size_t raw_patch_offset;
+  uint64_t raw_patch_size;
+  vector<BitExtent> src_deflates;
+  vector<BitExtent> dst_deflates;
+  vector<ByteExtent> src_puffs;
+  vector<ByteExtent> dst_puffs;
+  uint64_t src_puff_size;
+  uint64_t dst_puff_size;
+  vector<BitExtent> dst_sub_blocks;
+  vector<ByteExtent> dst_sub_puffs;
+  vector<size_t> src_puff_ids;
+  vector<SubPatch> sub_patches;
+  vector<CopyDeflate> copies;
+  vector<NestedDeflate> nested;
+  metadata::PatchHeader_PatchType patch_type;
+};
+
+// Decodes the puffin patch |patch| of |patch_length| bytes, or just its magic,
+// header size and header, into |decoded|. The raw patch is assumed to take the
+// rest of the |patch_length| bytes.
 bool DecodePatch(const uint8_t* patch,
                  size_t patch_length,
-                 size_t* bsdiff_patch_offset,
-                 size_t* bsdiff_patch_size,
-                 vector<BitExtent>* src_deflates,
-                 vector<BitExtent>* dst_deflates,
-                 vector<ByteExtent>* src_puffs,
-                 vector<ByteExtent>* dst_puffs,
-                 uint64_t* src_puff_size,
-                 uint64_t* dst_puff_size,
-                 metadata::PatchHeader_PatchType* patch_type) {
+                 DecodedPatch* decoded) {
   size_t offset = 0;
   uint32_t header_size;
   TEST_AND_RETURN_FALSE(patch_length >= (kMagicLength + sizeof(header_size)));
@@ -127,52 +178,143 @@ bool DecodePatch(const uint8_t* patch,
   metadata::PatchHeader header;
   TEST_AND_RETURN_FALSE(header.ParseFromArray(patch + offset, header_size));
   offset += header_size;
+  if (header.version() > 2) {
+    LOG(ERROR) << "Unsupported patch version " << header.version();
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(header.type() !=
+                            metadata::PatchHeader_PatchType_SPLIT_BSDIFF ||
+                        header.version() >= 2);
 
-  CopyRpfToVector(header.src().deflates(), src_deflates, 1);
-  CopyRpfToVector(header.dst().deflates(), dst_deflates, 1);
-  CopyRpfToVector(header.src().puffs(), src_puffs, 8);
-  CopyRpfToVector(header.dst().puffs(), dst_puffs, 8);
+  CopyRpfToVector(header.src().deflates(), &decoded->src_deflates, 1);
+  CopyRpfToVector(header.dst().deflates(), &decoded->dst_deflates, 1);
+  CopyRpfToVector(header.src().puffs(), &decoded->src_puffs, 8);
+  CopyRpfToVector(header.dst().puffs(), &decoded->dst_puffs, 8);
+  CopyRpfToVector(header.dst().sub_blocks(), &decoded->dst_sub_blocks, 1);
+  CopyRpfToVector(header.dst().sub_puffs(), &decoded->dst_sub_puffs, 8);
+  // Each deflate is its own original unless it is a duplicate.
+  decoded->src_puff_ids.resize(decoded->src_deflates.size());
+  for (size_t idx = 0; idx < decoded->src_puff_ids.size(); idx++) {
+    decoded->src_puff_ids[idx] = idx;
+  }
+  for (const auto& duplicate : header.src().duplicates()) {
+    TEST_AND_RETURN_FALSE(duplicate.index() < decoded->src_puff_ids.size() &&
+                          duplicate.original() < duplicate.index());
+    decoded->src_puff_ids[duplicate.index()] = duplicate.original();
+  }
+  decoded->sub_patches.reserve(header.sub_patches_size());
+  for (const auto& sub_patch : header.sub_patches()) {
+    auto to_extent = [](const metadata::BitExtent& ext) {
+      return ByteExtent(ext.offset() / 8, ext.length() / 8);
+    };
+    decoded->sub_patches.push_back({to_extent(sub_patch.src()),
+                                    to_extent(sub_patch.dst()),
+                                    to_extent(sub_patch.patch())});
+  }
+  decoded->copies.reserve(header.copies_size());
+  for (const auto& copy : header.copies()) {
+    decoded->copies.push_back(
+        {BitExtent(copy.src().offset(), copy.src().length()),
+         BitExtent(copy.dst().offset(), copy.dst().length())});
+  }
+  decoded->nested.reserve(header.nested_size());
+  for (const auto& stream : header.nested()) {
+    decoded->nested.push_back(
+        {BitExtent(stream.src().offset(), stream.src().length()),
+         BitExtent(stream.dst().offset(), stream.dst().length()),
+         stream.puff_length(), stream.patch()});
+  }
 
-  *src_puff_size = header.src().puff_length();
-  *dst_puff_size = header.dst().puff_length();
+  decoded->src_puff_size = header.src().puff_length();
+  decoded->dst_puff_size = header.dst().puff_length();
 
-  *bsdiff_patch_offset = offset;
-  *bsdiff_patch_size = patch_length - offset;
+  decoded->raw_patch_offset = offset;
+  decoded->raw_patch_size = patch_length - offset;
 
-  *patch_type = header.type();
+  decoded->patch_type = header.type();
   return true;
 }
 
+// A stream that appends what is written into it to |buffer|, and fails once
+// more than |max_size| bytes would be written.
+class BoundedBufferWriter : public StreamInterface {
+ public:
+  BoundedBufferWriter(Buffer* buffer, uint64_t max_size)
+      : buffer_(buffer), max_size_(max_size) {}
+  ~BoundedBufferWriter() override = default;
+
+  bool GetSize(uint64_t* size) const override {
+    *size = buffer_->size();
+    return true;
+  }
+  bool GetOffset(uint64_t* offset) const override {
+    *offset = buffer_->size();
+    return true;
+  }
+  bool Seek(uint64_t offset) override { return offset == buffer_->size(); }
+  bool Read(void* /* buffer */, size_t /* length */) override { return false; }
+  bool Write(const void* buffer, size_t length) override {
+    if (length > max_size_ - buffer_->size()) {
+      LOG(ERROR) << "The data does not fit in " << max_size_ << " bytes.";
+      return false;
+    }
+    auto bytes = static_cast<const uint8_t*>(buffer);
+    buffer_->insert(buffer_->end(), bytes, bytes + length);
+    return true;
+  }
+  bool Close() override { return true; }
+
+ private:
+  Buffer* buffer_;
+  uint64_t max_size_;
+
+  DISALLOW_COPY_AND_ASSIGN(BoundedBufferWriter);
+};
+
+// Applies |zucchini_patch| (already decompressed) on the puffed source read
+// from |src_stream| and writes the result into |dst_stream|. zucchini can only
+// apply a patch on the entire old and new images, so those have to be in
+// memory at the same time, together with the patch. Fails without reading the
+// source if they need more than |max_memory| bytes, unless it is zero. To keep
+// the peak memory down the source is read straight into its image buffer, and
+// the source and the patch are released before the result is written (and
+// hence huffed) into |dst_stream|.
 bool ApplyZucchiniPatch(UniqueStreamPtr src_stream,
                         size_t src_size,
-                        const uint8_t* patch_start,
-                        size_t patch_size,
-                        UniqueStreamPtr dst_stream) {
-  // Read the source data
-  Buffer puffed_src(src_size);
-  Buffer buffer(1024 * 1024);
-  uint64_t bytes_wrote = 0;
-  while (bytes_wrote < src_size) {
-    auto write_size =
-        std::min(static_cast<uint64_t>(buffer.size()), src_size - bytes_wrote);
-    TEST_AND_RETURN_FALSE(src_stream->Read(buffer.data(), write_size));
-    std::copy(buffer.data(), buffer.data() + write_size,
-              puffed_src.data() + bytes_wrote);
-    bytes_wrote += write_size;
-  }
-  // Read the patch
-  Buffer zucchini_patch;
-  TEST_AND_RETURN_FALSE(BrotliDecode(patch_start, patch_size, &zucchini_patch));
+                        Buffer zucchini_patch,
+                        UniqueStreamPtr dst_stream,
+                        size_t dst_size,
+                        uint64_t max_memory) {
   auto patch_reader = zucchini::EnsemblePatchReader::Create(
       {zucchini_patch.data(), zucchini_patch.size()});
   if (!patch_reader.has_value()) {
     LOG(ERROR) << "Failed to parse the zucchini patch.";
     return false;
   }
+  // The images must be the puffed source and destination, which the memory
+  // needed has been checked with.
+  TEST_AND_RETURN_FALSE(patch_reader->header().old_size == src_size);
+  TEST_AND_RETURN_FALSE(patch_reader->header().new_size == dst_size);
+  // The sizes come from the patch, so they are compared one at a time to not
+  // wrap around.
+  if (max_memory != 0 &&
+      (src_size > max_memory || dst_size > max_memory - src_size ||
+       zucchini_patch.size() > max_memory - src_size - dst_size)) {
+    LOG(ERROR) << "Applying the zucchini patch needs more than " << max_memory
+               << " bytes of memory.";
+    return false;
+  }
+
+  // Read the source data
+  Buffer puffed_src(src_size);
+  TEST_AND_RETURN_FALSE(src_stream->Read(puffed_src.data(), src_size));
+  src_stream.reset();
 
   // TODO(197361113) Stream the patched result once zucchini supports it. So we
   // can save some memory when applying patch on device.
-  Buffer patched_data(patch_reader->header().new_size);
+  // zucchini has no streaming interface, so the result is only written once
+  // all of it has been patched.
+  Buffer patched_data(dst_size);
   auto status = zucchini::ApplyBuffer(
       {puffed_src.data(), puffed_src.size()}, *patch_reader,
       {patched_data.data(), patched_data.size()});
@@ -180,44 +322,719 @@ bool ApplyZucchiniPatch(UniqueStreamPtr src_stream,
     LOG(ERROR) << "Failed to parse the zucchini patch: " << status;
     return false;
   }
+  patch_reader.reset();
+  Buffer().swap(zucchini_patch);
+  Buffer().swap(puffed_src);
 
   TEST_AND_RETURN_FALSE(
       dst_stream->Write(patched_data.data(), patched_data.size()));
+  TEST_AND_RETURN_FALSE(dst_stream->Close());
   return true;
 }
 
-}  // namespace
+// Rebuilds the inner bytes of the destination deflate stream of |nested| into
+// |data|. They are huffed from its nested image, which its nested patch creates
+// from the nested image of the source deflate stream in |src|. A zucchini patch
+// fails if applying it needs more than |max_zucchini_memory| bytes, unless it
+// is zero.
+bool ApplyNestedPatch(SharedStream* src,
+                      const NestedDeflate& nested,
+                      uint64_t max_zucchini_memory,
+                      Buffer* data) {
+  auto start_byte = nested.src.offset / 8;
+  Buffer src_data((nested.src.offset + nested.src.length + 7) / 8 -
+                  start_byte);
+  {
+    std::lock_guard<std::mutex> lock(src->mutex);
+    TEST_AND_RETURN_FALSE(src->stream->Seek(start_byte));
+    TEST_AND_RETURN_FALSE(src->stream->Read(src_data.data(), src_data.size()));
+  }
+  Buffer src_image;
+  uint64_t src_puff_size, length;
+  TEST_AND_RETURN_FALSE(CreateNestedImage(src_data.data(), src_data.size(),
+                                          nested.src.offset % 8, &length,
+                                          &src_image, &src_puff_size));
+  TEST_AND_RETURN_FALSE(length == nested.src.length);
+  Buffer().swap(src_data);
 
-bool PuffPatch(UniqueStreamPtr src,
-               UniqueStreamPtr dst,
-               const uint8_t* patch,
-               size_t patch_length,
-               size_t max_cache_size) {
-  size_t patch_offset;  // raw patch offset in puffin |patch|.
-  size_t raw_patch_size = 0;
-  vector<BitExtent> src_deflates, dst_deflates;
-  vector<ByteExtent> src_puffs, dst_puffs;
-  uint64_t src_puff_size, dst_puff_size;
+  Buffer dst_image;
+  TEST_AND_RETURN_FALSE(
+      PuffPatch(MemoryStream::CreateForRead(src_image),
+                MemoryStream::CreateForWrite(&dst_image),
+                reinterpret_cast<const uint8_t*>(nested.patch.data()),
+                nested.patch.size(), kDefaultCacheSize, nullptr, nullptr,
+                max_zucchini_memory));
+  Buffer().swap(src_image);
+  TEST_AND_RETURN_FALSE(HuffNestedImage(dst_image.data(), dst_image.size(),
+                                        nested.puff_size, nested.dst.length,
+                                        data));
+  // The last byte has bits of the data after the stream.
+  data->resize(nested.dst.length / 8);
+  return true;
+}
 
-  metadata::PatchHeader_PatchType patch_type;
+// A stream that writes a destination with copied deflates and nested deflate
+// streams. What is written into it is the destination without their inner
+// bytes, and those are copied from the source, or rebuilt from the nested
+// patches, into their place in the underlying stream. Each copy is done as
+// soon as everything before it may have been written, so a destination that
+// is written sequentially is also written sequentially into the underlying
+// stream. Writing out of order needs an underlying stream that supports
+// seeking.
+class CopyDeflatesStream : public StreamInterface {
+ public:
+  ~CopyDeflatesStream() override = default;
 
-  // Decode the patch and get the raw patch (e.g. bsdiff, zucchini).
+  // |nested| must outlive the stream.
+  static UniqueStreamPtr Create(UniqueStreamPtr stream,
+                                shared_ptr<SharedStream> src,
+                                const vector<CopyDeflate>& copies,
+                                const vector<NestedDeflate>& nested,
+                                uint64_t max_zucchini_memory) {
+    TEST_AND_RETURN_VALUE(stream, nullptr);
+    vector<Copy> byte_copies;
+    for (const auto& copy : copies) {
+      // Only bytes with the same bits can be copied.
+      TEST_AND_RETURN_VALUE(copy.src.length == copy.dst.length &&
+                                copy.src.offset % 8 == copy.dst.offset % 8,
+                            nullptr);
+      auto start = (copy.dst.offset + 7) / 8;
+      auto end = (copy.dst.offset + copy.dst.length) / 8;
+      TEST_AND_RETURN_VALUE(start < end, nullptr);
+      byte_copies.push_back(
+          {0, start, (copy.src.offset + 7) / 8, end - start, 0, nullptr});
+    }
+    for (const auto& stream : nested) {
+      TEST_AND_RETURN_VALUE(stream.dst.offset % 8 == 0, nullptr);
+      auto start = stream.dst.offset / 8;
+      auto end = (stream.dst.offset + stream.dst.length) / 8;
+      TEST_AND_RETURN_VALUE(start < end, nullptr);
+      byte_copies.push_back({0, start, 0, end - start, 0, &stream});
+    }
+    std::sort(byte_copies.begin(), byte_copies.end(),
+              [](const Copy& a, const Copy& b) {
+                return a.dst_offset < b.dst_offset;
+              });
+    uint64_t copied = 0;
+    uint64_t prev_end = 0;
+    for (auto& copy : byte_copies) {
+      TEST_AND_RETURN_VALUE(copy.dst_offset >= prev_end, nullptr);
+      copy.offset = copy.dst_offset - copied;
+      copied += copy.length;
+      copy.copied_end = copied;
+      prev_end = copy.dst_offset + copy.length;
+    }
+    return UniqueStreamPtr(
+        new CopyDeflatesStream(std::move(stream), src, std::move(byte_copies),
+                               max_zucchini_memory));
+  }
+
+  bool GetSize(uint64_t* size) const override {
+    TEST_AND_RETURN_FALSE(stream_->GetSize(size));
+    auto copied = copies_.empty() ? 0 : copies_.back().copied_end;
+    *size = *size > copied ? *size - copied : 0;
+    return true;
+  }
+
+  bool GetOffset(uint64_t* offset) const override {
+    *offset = offset_;
+    return true;
+  }
+
+  bool Seek(uint64_t offset) override {
+    offset_ = offset;
+    return true;
+  }
+
+  bool Read(void* /* buffer */, size_t /* length */) override {
+    return false;
+  }
+
+  bool Write(const void* buffer, size_t length) override {
+    auto data = static_cast<const uint8_t*>(buffer);
+    while (true) {
+      // The copies at |offset_| go before the byte written there.
+      TEST_AND_RETURN_FALSE(CopyUpTo(offset_));
+      if (length == 0) {
+        return true;
+      }
+      auto next = std::upper_bound(
+          copies_.begin(), copies_.end(), offset_,
+          [](uint64_t offset, const Copy& copy) {
+            return offset < copy.offset;
+          });
+      auto copied = next == copies_.begin() ? 0 : std::prev(next)->copied_end;
+      auto write_len = length;
+      if (next != copies_.end()) {
+        write_len = std::min(write_len, next->offset - offset_);
+      }
+      TEST_AND_RETURN_FALSE(WriteToStream(offset_ + copied, data, write_len));
+      offset_ += write_len;
+      data += write_len;
+      length -= write_len;
+    }
+  }
+
+  // Does the copies that are left, in case nothing was written after them.
+  bool Close() override {
+    TEST_AND_RETURN_FALSE(CopyUpTo(UINT64_MAX));
+    return stream_->Close();
+  }
+
+ private:
+  struct Copy {
+    // The offset of the copy in what is written into this stream, that is
+    // without any copied bytes.
+    uint64_t offset;
+    // The offsets of the copied bytes in the destination and the source.
+    uint64_t dst_offset;
+    uint64_t src_offset;
+    uint64_t length;
+    // The number of bytes copied up to the end of this copy.
+    uint64_t copied_end;
+    // The nested deflate stream that the bytes are rebuilt from instead, if
+    // any. |src_offset| is not used then.
+    const NestedDeflate* nested;
+  };
+
+  CopyDeflatesStream(UniqueStreamPtr stream,
+                     shared_ptr<SharedStream> src,
+                     vector<Copy> copies,
+                     uint64_t max_zucchini_memory)
+      : stream_(std::move(stream)),
+        src_(src),
+        copies_(std::move(copies)),
+        max_zucchini_memory_(max_zucchini_memory),
+        next_copy_(0),
+        offset_(0),
+        stream_offset_(0) {}
+
+  // Does the copies at or before |offset| that have not been done yet.
+  bool CopyUpTo(uint64_t offset) {
+    constexpr uint64_t kCopyBufferSize = 1024 * 1024;  // 1MB
+    for (; next_copy_ < copies_.size() && copies_[next_copy_].offset <= offset;
+         next_copy_++) {
+      const auto& copy = copies_[next_copy_];
+      if (copy.nested != nullptr) {
+        Buffer data;
+        TEST_AND_RETURN_FALSE(ApplyNestedPatch(src_.get(), *copy.nested,
+                                               max_zucchini_memory_, &data));
+        TEST_AND_RETURN_FALSE(data.size() == copy.length);
+        TEST_AND_RETURN_FALSE(
+            WriteToStream(copy.dst_offset, data.data(), data.size()));
+        continue;
+      }
+      buffer_.resize(std::min(copy.length, kCopyBufferSize));
+      for (uint64_t done = 0; done < copy.length;) {
+        auto len = std::min(copy.length - done, kCopyBufferSize);
+        {
+          std::lock_guard<std::mutex> lock(src_->mutex);
+          TEST_AND_RETURN_FALSE(src_->stream->Seek(copy.src_offset + done));
+          TEST_AND_RETURN_FALSE(src_->stream->Read(buffer_.data(), len));
+        }
+        TEST_AND_RETURN_FALSE(
+            WriteToStream(copy.dst_offset + done, buffer_.data(), len));
+        done += len;
+      }
+    }
+    return true;
+  }
+
+  // Writes into |stream_| at |offset|, seeking only if it is not there yet.
+  bool WriteToStream(uint64_t offset, const uint8_t* data, size_t length) {
+    if (offset != stream_offset_) {
+      TEST_AND_RETURN_FALSE(stream_->Seek(offset));
+    }
+    TEST_AND_RETURN_FALSE(stream_->Write(data, length));
+    stream_offset_ = offset + length;
+    return true;
+  }
+
+  UniqueStreamPtr stream_;
+  shared_ptr<SharedStream> src_;
+  vector<Copy> copies_;
+  uint64_t max_zucchini_memory_;
+  // The first copy that has not been done yet.
+  size_t next_copy_;
+  // The current offset in what is written into this stream.
+  uint64_t offset_;
+  // The current offset of |stream_|.
+  uint64_t stream_offset_;
+  Buffer buffer_;
+
+  DISALLOW_COPY_AND_ASSIGN(CopyDeflatesStream);
+};
+
+// If there are |copies| or |nested| deflate streams, shares |src| between the
+// patch and them, and wraps |dst| in a |CopyDeflatesStream|.
+bool SetUpCopyDeflates(const vector<CopyDeflate>& copies,
+                       const vector<NestedDeflate>& nested,
+                       uint64_t max_zucchini_memory,
+                       UniqueStreamPtr* src,
+                       UniqueStreamPtr* dst) {
+  if (copies.empty() && nested.empty()) {
+    return true;
+  }
+  TEST_AND_RETURN_FALSE(*src);
+  auto shared_src = std::make_shared<SharedStream>();
+  shared_src->stream = std::move(*src);
+  src->reset(new SharedStreamReader(shared_src));
+  *dst = CopyDeflatesStream::Create(std::move(*dst), shared_src, copies,
+                                    nested, max_zucchini_memory);
+  TEST_AND_RETURN_FALSE(*dst);
+  return true;
+}
+
+// Creates |num_threads| |PuffinStream|s in |src_streams| that puff |src| (given
+// by |src_puff_size|, |src_deflates| and |src_puffs|), one for each thread.
+// They all read |src| through a |SharedStream| and each has its own |Puffer|.
+// They cache puffs in |shared_cache|, or if it is null, in one cache of
+// |max_cache_size| bytes they share, so the threads do not need more memory
+// for puffs than a single |PuffinStream| does. A shared cache finds the puffs
+// by the bits of their deflates, so the ids of the duplicate deflates are not
+// needed, and the streams do not each read the source to verify them.
+bool CreateSharedPuffStreams(UniqueStreamPtr src,
+                             uint64_t src_puff_size,
+                             const vector<BitExtent>& src_deflates,
+                             const vector<ByteExtent>& src_puffs,
+                             size_t max_cache_size,
+                             shared_ptr<PuffCache> shared_cache,
+                             PuffCacheStats* stats,
+                             size_t num_threads,
+                             vector<UniqueStreamPtr>* src_streams) {
+  if (!shared_cache && max_cache_size > 0) {
+    shared_cache = std::make_shared<PuffCache>(max_cache_size);
+  }
+  auto shared_src = std::make_shared<SharedStream>();
+  shared_src->stream = std::move(src);
+  src_streams->resize(num_threads);
+  for (auto& src_stream : *src_streams) {
+    src_stream = PuffinStream::CreateForPuff(
+        UniqueStreamPtr(new SharedStreamReader(shared_src)),
+        std::make_shared<Puffer>(), src_puff_size, src_deflates, src_puffs,
+        max_cache_size, {}, shared_cache, stats);
+    TEST_AND_RETURN_FALSE(src_stream);
+  }
+  return true;
+}
+
+// Applies the bsdiff patch |bsdiff_patch| on the puff stream of |src| (given by
+// |src_puff_size|, |src_deflates| and |src_puffs|) and writes the result into
+// |dst| using up to |num_threads| threads. bspatch applies the control entries
+// one after the other, but every byte of the output only depends on its diff or
+// extra byte and, for a diff byte, on one byte of the source. So the control
+// entries are read in order and the output is cut into ranges of
+// |kPatchRangeSize| bytes, each with the diff and extra bytes it needs and the
+// locations of the source bytes to add to its diff bytes. Batches of ranges
+// are then applied in parallel, each thread reading the source through its own
+// |PuffinStream| and writing its ranges into |dst| at their offsets.
+bool ApplyBsdiffPatchInParallel(UniqueStreamPtr src,
+                                uint64_t src_puff_size,
+                                const vector<BitExtent>& src_deflates,
+                                const vector<ByteExtent>& src_puffs,
+                                size_t max_cache_size,
+                                shared_ptr<PuffCache> shared_cache,
+                                PuffCacheStats* stats,
+                                const uint8_t* bsdiff_patch,
+                                size_t bsdiff_patch_size,
+                                RandomAccessHuffStream* dst,
+                                size_t num_threads) {
+  constexpr uint64_t kPatchRangeSize = 1024 * 1024;  // 1MB
+  constexpr size_t kRangesPerThread = 2;
+
+  bsdiff::BsdiffPatchReader patch_reader;
+  TEST_AND_RETURN_FALSE(patch_reader.Init(bsdiff_patch, bsdiff_patch_size));
+  uint64_t dst_puff_size;
+  TEST_AND_RETURN_FALSE(dst->GetSize(&dst_puff_size));
+  TEST_AND_RETURN_FALSE(patch_reader.new_file_size() == dst_puff_size);
+
+  vector<UniqueStreamPtr> src_streams;
+  TEST_AND_RETURN_FALSE(CreateSharedPuffStreams(
+      std::move(src), src_puff_size, src_deflates, src_puffs, max_cache_size,
+      shared_cache, stats, num_threads, &src_streams));
+
+  struct PatchRange {
+    // The offset of the range in the output.
+    uint64_t offset;
+    // The diff and extra bytes of the range in the order of the output.
+    Buffer data;
+    // The diff bytes in |data| and the offsets of the source bytes they are
+    // added to.
+    vector<std::pair<ByteExtent, uint64_t>> diffs;
+  };
+  vector<PatchRange> ranges(num_threads * kRangesPerThread);
+
+  uint64_t new_pos = 0;
+  int64_t old_pos = 0;
+  // What is left of the current control entry.
+  uint64_t diff_left = 0;
+  uint64_t extra_left = 0;
+  int64_t offset_increment = 0;
+  while (new_pos < dst_puff_size) {
+    size_t num_ranges = 0;
+    for (; num_ranges < ranges.size() && new_pos < dst_puff_size;
+         num_ranges++) {
+      auto& range = ranges[num_ranges];
+      range.offset = new_pos;
+      range.data.resize(std::min(kPatchRangeSize, dst_puff_size - new_pos));
+      range.diffs.clear();
+      uint64_t filled = 0;
+      while (filled < range.data.size()) {
+        auto len = range.data.size() - filled;
+        if (diff_left > 0) {
+          len = std::min(len, diff_left);
+          TEST_AND_RETURN_FALSE(
+              patch_reader.ReadDiffStream(range.data.data() + filled, len));
+          // Like bspatch, only the part of the run within the source gets
+          // source bytes added. The diff bytes before or after the source are
+          // output as they are.
+          uint64_t skip = 0;
+          if (old_pos < 0) {
+            skip = std::min(len, -static_cast<uint64_t>(old_pos));
+          }
+          auto start = static_cast<uint64_t>(old_pos) + skip;
+          if (skip < len && start < src_puff_size) {
+            range.diffs.emplace_back(
+                ByteExtent(filled + skip,
+                           std::min(len - skip, src_puff_size - start)),
+                start);
+          }
+          old_pos += len;
+          diff_left -= len;
+        } else if (extra_left > 0) {
+          len = std::min(len, extra_left);
+          TEST_AND_RETURN_FALSE(
+              patch_reader.ReadExtraStream(range.data.data() + filled, len));
+          extra_left -= len;
+        } else {
+          // Move to the next control entry.
+          old_pos += offset_increment;
+          ControlEntry entry(0, 0, 0);
+          TEST_AND_RETURN_FALSE(patch_reader.ParseControlEntry(&entry));
+          diff_left = entry.diff_size;
+          extra_left = entry.extra_size;
+          offset_increment = entry.offset_increment;
+          continue;
+        }
+        filled += len;
+      }
+      new_pos += range.data.size();
+    }
+
+    TaskQueue queue(num_ranges);
+    TEST_AND_RETURN_FALSE(RunInParallel(
+        std::min(num_threads, num_ranges), [&](size_t thread_idx) {
+          Buffer old_data;
+          size_t range_idx;
+          while (queue.Next(&range_idx)) {
+            auto& range = ranges[range_idx];
+            bool success = true;
+            for (const auto& diff : range.diffs) {
+              old_data.resize(diff.first.length);
+              if (!src_streams[thread_idx]->Seek(diff.second) ||
+                  !src_streams[thread_idx]->Read(old_data.data(),
+                                                 old_data.size())) {
+                success = false;
+                break;
+              }
+              auto data = range.data.data() + diff.first.offset;
+              for (size_t idx = 0; idx < old_data.size(); idx++) {
+                data[idx] += old_data[idx];
+              }
+            }
+            if (!success || !dst->WriteAt(range.offset, range.data.data(),
+                                          range.data.size())) {
+              LOG(ERROR) << "Failed to patch the output at " << range.offset;
+              queue.Cancel();
+              return false;
+            }
+          }
+          return true;
+        }));
+  }
+  // The control entries cannot write past the end of the output.
+  TEST_AND_RETURN_FALSE(diff_left == 0 && extra_left == 0);
+  TEST_AND_RETURN_FALSE(patch_reader.Finish());
+  return true;
+}
+
+// A read only view of |range| of |stream|, which is owned by the caller.
+// bspatch applies each sub-patch on such a view of the source.
+class StreamRangeReader : public StreamInterface {
+ public:
+  StreamRangeReader(StreamInterface* stream, const ByteExtent& range)
+      : stream_(stream), range_(range), offset_(0) {}
+  ~StreamRangeReader() override = default;
+
+  bool GetSize(uint64_t* size) const override {
+    *size = range_.length;
+    return true;
+  }
+
+  bool GetOffset(uint64_t* offset) const override {
+    *offset = offset_;
+    return true;
+  }
+
+  bool Seek(uint64_t offset) override {
+    TEST_AND_RETURN_FALSE(offset <= range_.length);
+    offset_ = offset;
+    return true;
+  }
+
+  bool Read(void* buffer, size_t length) override {
+    TEST_AND_RETURN_FALSE(length <= range_.length - offset_);
+    TEST_AND_RETURN_FALSE(stream_->Seek(range_.offset + offset_));
+    TEST_AND_RETURN_FALSE(stream_->Read(buffer, length));
+    offset_ += length;
+    return true;
+  }
+
+  bool Write(const void* /* buffer */, size_t /* length */) override {
+    return false;
+  }
+
+  // |stream_| is closed by its owner.
+  bool Close() override { return true; }
+
+ private:
+  StreamInterface* stream_;
+  ByteExtent range_;
+  uint64_t offset_;
+
+  DISALLOW_COPY_AND_ASSIGN(StreamRangeReader);
+};
+
+// The function a |SubPatchWriter| writes with. It gets the offset of the data
+// in the destination range of the sub-patch.
+using WriteFunction =
+    std::function<bool(uint64_t offset, const void* buffer, size_t length)>;
+
+// Receives the |size| bytes bspatch creates for a sub-patch, in order, and
+// passes them on to |write|.
+class SubPatchWriter : public StreamInterface {
+ public:
+  SubPatchWriter(uint64_t size, WriteFunction write)
+      : size_(size), write_(std::move(write)), offset_(0) {}
+  ~SubPatchWriter() override = default;
+
+  bool GetSize(uint64_t* size) const override {
+    *size = size_;
+    return true;
+  }
+
+  bool GetOffset(uint64_t* offset) const override {
+    *offset = offset_;
+    return true;
+  }
+
+  // The output is only written sequentially.
+  bool Seek(uint64_t offset) override { return offset == offset_; }
+
+  bool Read(void* /* buffer */, size_t /* length */) override {
+    return false;
+  }
+
+  bool Write(const void* buffer, size_t length) override {
+    TEST_AND_RETURN_FALSE(length <= size_ - offset_);
+    TEST_AND_RETURN_FALSE(write_(offset_, buffer, length));
+    offset_ += length;
+    return true;
+  }
+
+  // Fails if the sub-patch did not create its whole range.
+  bool Close() override { return offset_ == size_; }
+
+ private:
+  uint64_t size_;
+  WriteFunction write_;
+  uint64_t offset_;
+
+  DISALLOW_COPY_AND_ASSIGN(SubPatchWriter);
+};
+
+// Checks that the destination ranges of |sub_patches| follow each other and
+// cover the destination puff stream of |dst_puff_size| bytes, and that their
+// source ranges and patches are within the source puff stream of
+// |src_puff_size| bytes and the raw patch of |raw_patch_size| bytes.
+bool CheckSubPatches(const vector<SubPatch>& sub_patches,
+                     uint64_t src_puff_size,
+                     uint64_t dst_puff_size,
+                     uint64_t raw_patch_size) {
+  uint64_t dst_offset = 0;
+  for (const auto& sub_patch : sub_patches) {
+    TEST_AND_RETURN_FALSE(sub_patch.dst.offset == dst_offset);
+    dst_offset += sub_patch.dst.length;
+    TEST_AND_RETURN_FALSE(sub_patch.src.offset <= src_puff_size &&
+                          sub_patch.src.length <=
+                              src_puff_size - sub_patch.src.offset);
+    TEST_AND_RETURN_FALSE(sub_patch.patch.offset <= raw_patch_size &&
+                          sub_patch.patch.length <=
+                              raw_patch_size - sub_patch.patch.offset);
+  }
+  TEST_AND_RETURN_FALSE(dst_offset == dst_puff_size);
+  return true;
+}
+
+// Applies |sub_patch|, whose bsdiff patch is |data|, on |src_stream|, the puff
+// stream of the source, and writes its result with |write|.
+bool ApplySubPatch(StreamInterface* src_stream,
+                   const SubPatch& sub_patch,
+                   const uint8_t* data,
+                   WriteFunction write) {
+  auto reader = BsdiffStream::Create(
+      UniqueStreamPtr(new StreamRangeReader(src_stream, sub_patch.src)));
+  TEST_AND_RETURN_FALSE(reader);
+  auto writer = BsdiffStream::Create(UniqueStreamPtr(
+      new SubPatchWriter(sub_patch.dst.length, std::move(write))));
+  TEST_AND_RETURN_FALSE(writer);
   TEST_AND_RETURN_FALSE(
-      DecodePatch(patch, patch_length, &patch_offset, &raw_patch_size,
-                  &src_deflates, &dst_deflates, &src_puffs, &dst_puffs,
-                  &src_puff_size, &dst_puff_size, &patch_type));
+      0 == bspatch(reader, writer, data, sub_patch.patch.length));
+  TEST_AND_RETURN_FALSE(writer->Close());
+  return true;
+}
+
+// Applies the |sub_patches| of the raw patch |raw_patch| on the puff stream of
+// |src| and writes their results into |dst| using up to |num_threads|
+// threads. Each thread reads the source through its own |PuffinStream|.
+bool ApplySubPatchesInParallel(UniqueStreamPtr src,
+                               uint64_t src_puff_size,
+                               const vector<BitExtent>& src_deflates,
+                               const vector<ByteExtent>& src_puffs,
+                               size_t max_cache_size,
+                               shared_ptr<PuffCache> shared_cache,
+                               PuffCacheStats* stats,
+                               const uint8_t* raw_patch,
+                               const vector<SubPatch>& sub_patches,
+                               RandomAccessHuffStream* dst,
+                               size_t num_threads) {
+  num_threads = std::min(num_threads, sub_patches.size());
+  if (num_threads == 0) {
+    return true;
+  }
+  vector<UniqueStreamPtr> src_streams;
+  TEST_AND_RETURN_FALSE(CreateSharedPuffStreams(
+      std::move(src), src_puff_size, src_deflates, src_puffs, max_cache_size,
+      shared_cache, stats, num_threads, &src_streams));
+
+  TaskQueue queue(sub_patches.size());
+  return RunInParallel(num_threads, [&](size_t thread_idx) {
+    size_t idx;
+    while (queue.Next(&idx)) {
+      const auto& sub_patch = sub_patches[idx];
+      if (!ApplySubPatch(src_streams[thread_idx].get(), sub_patch,
+                         raw_patch + sub_patch.patch.offset,
+                         [dst, &sub_patch](uint64_t offset, const void* buffer,
+                                           size_t length) {
+                           return dst->WriteAt(sub_patch.dst.offset + offset,
+                                               buffer, length);
+                         })) {
+        LOG(ERROR) << "Failed to apply the sub-patch for the output at "
+                   << sub_patch.dst.offset;
+        queue.Cancel();
+        return false;
+      }
+    }
+    return true;
+  });
+}
+
+// The raw patch of a puffin patch, which is either entirely in memory or read
+// from a stream as it is needed.
+class RawPatch {
+ public:
+  RawPatch(const uint8_t* data, uint64_t size)
+      : data_(data), offset_(0), size_(size) {}
+  RawPatch(UniqueStreamPtr stream, uint64_t offset, uint64_t size)
+      : data_(nullptr),
+        stream_(std::move(stream)),
+        offset_(offset),
+        size_(size) {}
+  ~RawPatch() = default;
+
+  uint64_t size() const { return size_; }
+
+  // Returns the |length| bytes at |offset| of the raw patch, which are read
+  // into |buffer| if the raw patch is not in memory.
+  const uint8_t* Read(uint64_t offset, uint64_t length, Buffer* buffer) {
+    if (data_) {
+      return data_ + offset;
+    }
+    buffer->resize(length);
+    TEST_AND_RETURN_VALUE(stream_->Seek(offset_ + offset), nullptr);
+    TEST_AND_RETURN_VALUE(stream_->Read(buffer->data(), length), nullptr);
+    return buffer->data();
+  }
+
+  // Decompresses the entire raw patch with brotli into |output|. A stream is
+  // decompressed while it is read, so only |output| is kept in memory. Fails
+  // as soon as |output| would grow past |max_size| bytes, unless it is zero.
+  bool BrotliDecode(Buffer* output, uint64_t max_size) {
+    auto output_stream =
+        max_size == 0
+            ? MemoryStream::CreateForWrite(output)
+            : UniqueStreamPtr(new BoundedBufferWriter(output, max_size));
+    if (data_) {
+      return puffin::BrotliDecode(data_, size_, std::move(output_stream));
+    }
+    TEST_AND_RETURN_FALSE(stream_->Seek(offset_));
+    return puffin::BrotliDecode(std::move(stream_), size_,
+                                std::move(output_stream));
+  }
+
+ private:
+  const uint8_t* data_;
+  UniqueStreamPtr stream_;
+  // The offset of the raw patch in |stream_|.
+  uint64_t offset_;
+  uint64_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(RawPatch);
+};
+
+// Applies the puffin patch |decoded| with the raw patch |raw_patch| on |src|
+// and writes the result into |dst|. This is what all of the |PuffPatch|
+// functions do, except for applying bsdiff patches in parallel. Large
+// destination deflates are huffed using up to |num_threads| threads. A zucchini
+// patch fails if applying it needs more than |max_zucchini_memory| bytes,
+// unless it is zero.
+bool ApplyPatch(UniqueStreamPtr src,
+                UniqueStreamPtr dst,
+                const DecodedPatch& decoded,
+                RawPatch* raw_patch,
+                size_t max_cache_size,
+                shared_ptr<PuffCache> shared_cache,
+                PuffCacheStats* stats,
+                size_t num_threads,
+                uint64_t max_zucchini_memory) {
+  TEST_AND_RETURN_FALSE(SetUpCopyDeflates(decoded.copies, decoded.nested,
+                                          max_zucchini_memory, &src, &dst));
   auto puffer = std::make_shared<Puffer>();
   auto huffer = std::make_shared<Huffer>();
 
-  auto src_stream =
-      PuffinStream::CreateForPuff(std::move(src), puffer, src_puff_size,
-                                  src_deflates, src_puffs, max_cache_size);
+  // zucchini reads the source only once and sequentially, so caching its puffs
+  // would only waste memory.
+  if (decoded.patch_type == metadata::PatchHeader_PatchType_ZUCCHINI) {
+    max_cache_size = 0;
+  }
+  auto src_stream = PuffinStream::CreateForPuff(
+      std::move(src), puffer, decoded.src_puff_size, decoded.src_deflates,
+      decoded.src_puffs, max_cache_size, decoded.src_puff_ids, shared_cache,
+      stats);
   TEST_AND_RETURN_FALSE(src_stream);
   auto dst_stream = PuffinStream::CreateForHuff(
-      std::move(dst), huffer, dst_puff_size, dst_deflates, dst_puffs);
+      std::move(dst), huffer, decoded.dst_puff_size, decoded.dst_deflates,
+      decoded.dst_puffs, decoded.dst_sub_blocks, decoded.dst_sub_puffs,
+      num_threads);
   TEST_AND_RETURN_FALSE(dst_stream);
 
-  if (patch_type == metadata::PatchHeader_PatchType_BSDIFF) {
+  if (decoded.patch_type == metadata::PatchHeader_PatchType_BSDIFF) {
+    // bspatch decompresses the control, diff and extra streams of the patch
+    // in place, so it needs the raw patch as one piece of memory.
+    Buffer buffer;
+    auto bsdiff_patch = raw_patch->Read(0, raw_patch->size(), &buffer);
+    TEST_AND_RETURN_FALSE(bsdiff_patch);
+
     // For reading from source.
     auto reader = BsdiffStream::Create(std::move(src_stream));
     TEST_AND_RETURN_FALSE(reader);
@@ -227,16 +1044,158 @@ bool PuffPatch(UniqueStreamPtr src,
 
     // Running bspatch itself.
     TEST_AND_RETURN_FALSE(
-        0 == bspatch(reader, writer, &patch[patch_offset], raw_patch_size));
-  } else if (patch_type == metadata::PatchHeader_PatchType_ZUCCHINI) {
+        0 == bspatch(reader, writer, bsdiff_patch, raw_patch->size()));
+  } else if (decoded.patch_type ==
+             metadata::PatchHeader_PatchType_SPLIT_BSDIFF) {
+    // The destination ranges of the sub-patches follow each other, so applying
+    // them in order writes the destination sequentially. Only one sub-patch is
+    // read into memory at a time.
+    TEST_AND_RETURN_FALSE(CheckSubPatches(
+        decoded.sub_patches, decoded.src_puff_size, decoded.dst_puff_size,
+        raw_patch->size()));
+    Buffer buffer;
+    for (const auto& sub_patch : decoded.sub_patches) {
+      auto data = raw_patch->Read(sub_patch.patch.offset,
+                                  sub_patch.patch.length, &buffer);
+      TEST_AND_RETURN_FALSE(data);
+      TEST_AND_RETURN_FALSE(ApplySubPatch(
+          src_stream.get(), sub_patch, data,
+          [&dst_stream](uint64_t, const void* buffer, size_t length) {
+            return dst_stream->Write(buffer, length);
+          }));
+    }
+    TEST_AND_RETURN_FALSE(dst_stream->Close());
+  } else if (decoded.patch_type == metadata::PatchHeader_PatchType_ZUCCHINI) {
+    // The puffed images are known from the header, so a patch that cannot fit
+    // is rejected before it is even decompressed, and the decompression stops
+    // once the patch takes what is left.
+    if (max_zucchini_memory != 0 &&
+        (decoded.src_puff_size >= max_zucchini_memory ||
+         decoded.dst_puff_size >=
+             max_zucchini_memory - decoded.src_puff_size)) {
+      LOG(ERROR) << "Applying the zucchini patch needs more than "
+                 << max_zucchini_memory << " bytes of memory.";
+      return false;
+    }
+    Buffer zucchini_patch;
+    TEST_AND_RETURN_FALSE(raw_patch->BrotliDecode(
+        &zucchini_patch,
+        max_zucchini_memory == 0 ? 0
+                                 : max_zucchini_memory -
+                                       decoded.src_puff_size -
+                                       decoded.dst_puff_size));
     TEST_AND_RETURN_FALSE(ApplyZucchiniPatch(
-        std::move(src_stream), src_puff_size, patch + patch_offset,
-        raw_patch_size, std::move(dst_stream)));
+        std::move(src_stream), decoded.src_puff_size,
+        std::move(zucchini_patch), std::move(dst_stream),
+        decoded.dst_puff_size, max_zucchini_memory));
   } else {
-    LOG(ERROR) << "Unsupported patch type " << patch_type;
+    LOG(ERROR) << "Unsupported patch type " << decoded.patch_type;
     return false;
   }
   return true;
 }
 
+}  // namespace
+
+bool PuffPatch(UniqueStreamPtr src,
+               UniqueStreamPtr dst,
+               const uint8_t* patch,
+               size_t patch_length,
+               size_t max_cache_size,
+               shared_ptr<PuffCache> shared_cache,
+               PuffCacheStats* stats,
+               uint64_t max_zucchini_memory) {
+  // Decode the patch and get the raw patch (e.g. bsdiff, zucchini).
+  DecodedPatch decoded;
+  TEST_AND_RETURN_FALSE(DecodePatch(patch, patch_length, &decoded));
+  RawPatch raw_patch(patch + decoded.raw_patch_offset, decoded.raw_patch_size);
+  return ApplyPatch(std::move(src), std::move(dst), decoded, &raw_patch,
+                    max_cache_size, shared_cache, stats, 1,
+                    max_zucchini_memory);
+}
+
+bool PuffPatch(UniqueStreamPtr src,
+               UniqueStreamPtr dst,
+               UniqueStreamPtr patch,
+               size_t max_cache_size,
+               shared_ptr<PuffCache> shared_cache,
+               PuffCacheStats* stats,
+               uint64_t max_zucchini_memory) {
+  TEST_AND_RETURN_FALSE(patch);
+  uint64_t patch_length;
+  TEST_AND_RETURN_FALSE(patch->GetSize(&patch_length));
+  TEST_AND_RETURN_FALSE(patch->Seek(0));
+
+  // Only read the magic, the header size and the header itself, and let
+  // |DecodePatch| parse them as if they were the whole patch.
+  uint32_t header_size;
+  Buffer patch_header(kMagicLength + sizeof(header_size));
+  TEST_AND_RETURN_FALSE(patch_length >= patch_header.size());
+  TEST_AND_RETURN_FALSE(patch->Read(patch_header.data(), patch_header.size()));
+  memcpy(&header_size, patch_header.data() + kMagicLength,
+         sizeof(header_size));
+  header_size = be32toh(header_size);
+  TEST_AND_RETURN_FALSE(header_size <= patch_length - patch_header.size());
+  patch_header.resize(patch_header.size() + header_size);
+  TEST_AND_RETURN_FALSE(
+      patch->Read(patch_header.data() + kMagicLength + sizeof(header_size),
+                  header_size));
+
+  DecodedPatch decoded;
+  TEST_AND_RETURN_FALSE(
+      DecodePatch(patch_header.data(), patch_header.size(), &decoded));
+  RawPatch raw_patch(std::move(patch), decoded.raw_patch_offset,
+                     patch_length - decoded.raw_patch_offset);
+  return ApplyPatch(std::move(src), std::move(dst), decoded, &raw_patch,
+                    max_cache_size, shared_cache, stats, 1,
+                    max_zucchini_memory);
+}
+
+bool PuffPatchInParallel(UniqueStreamPtr src,
+                         UniqueStreamPtr dst,
+                         const uint8_t* patch,
+                         size_t patch_length,
+                         size_t num_threads,
+                         size_t max_cache_size,
+                         shared_ptr<PuffCache> shared_cache,
+                         PuffCacheStats* stats,
+                         uint64_t max_zucchini_memory) {
+  DecodedPatch decoded;
+  TEST_AND_RETURN_FALSE(DecodePatch(patch, patch_length, &decoded));
+  auto raw_patch = patch + decoded.raw_patch_offset;
+  if ((decoded.patch_type != metadata::PatchHeader_PatchType_BSDIFF &&
+       decoded.patch_type != metadata::PatchHeader_PatchType_SPLIT_BSDIFF) ||
+      num_threads <= 1) {
+    RawPatch in_memory(raw_patch, decoded.raw_patch_size);
+    return ApplyPatch(std::move(src), std::move(dst), decoded, &in_memory,
+                      max_cache_size, shared_cache, stats,
+                      std::max(num_threads, static_cast<size_t>(1)),
+                      max_zucchini_memory);
+  }
+
+  TEST_AND_RETURN_FALSE(SetUpCopyDeflates(decoded.copies, decoded.nested,
+                                          max_zucchini_memory, &src, &dst));
+  auto dst_stream = RandomAccessHuffStream::Create(
+      std::move(dst), decoded.dst_puff_size, decoded.dst_deflates,
+      decoded.dst_puffs, decoded.dst_sub_blocks, decoded.dst_sub_puffs,
+      num_threads);
+  TEST_AND_RETURN_FALSE(dst_stream);
+  if (decoded.patch_type == metadata::PatchHeader_PatchType_SPLIT_BSDIFF) {
+    TEST_AND_RETURN_FALSE(CheckSubPatches(
+        decoded.sub_patches, decoded.src_puff_size, decoded.dst_puff_size,
+        decoded.raw_patch_size));
+    TEST_AND_RETURN_FALSE(ApplySubPatchesInParallel(
+        std::move(src), decoded.src_puff_size, decoded.src_deflates,
+        decoded.src_puffs, max_cache_size, shared_cache, stats, raw_patch,
+        decoded.sub_patches, dst_stream.get(), num_threads));
+  } else {
+    TEST_AND_RETURN_FALSE(ApplyBsdiffPatchInParallel(
+        std::move(src), decoded.src_puff_size, decoded.src_deflates,
+        decoded.src_puffs, max_cache_size, shared_cache, stats, raw_patch,
+        decoded.raw_patch_size, dst_stream.get(), num_threads));
+  }
+  TEST_AND_RETURN_FALSE(dst_stream->Close());
+  return true;
+}
+
 }  // namespace puffin
@@ -0,0 +1,278 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/random_access_huff_stream.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "puffin/memory_stream.h"
+#include "puffin/src/logging.h"
+#include "puffin/src/puffin_stream.h"
+
+using std::unique_ptr;
+using std::vector;
+
+namespace puffin {
+
+unique_ptr<RandomAccessHuffStream> RandomAccessHuffStream::Create(
+    UniqueStreamPtr stream,
+    uint64_t puff_size,
+    const vector<BitExtent>& deflates,
+    const vector<ByteExtent>& puffs,
+    const vector<BitExtent>& sub_blocks,
+    const vector<ByteExtent>& sub_puffs,
+    size_t num_threads) {
+  TEST_AND_RETURN_VALUE(stream, nullptr);
+  TEST_AND_RETURN_VALUE(deflates.size() == puffs.size(), nullptr);
+  TEST_AND_RETURN_VALUE(sub_blocks.size() == sub_puffs.size(), nullptr);
+
+  // The puff stream can be cut wherever there is a byte of the deflate stream
+  // without any bit of a deflate: in the raw data between two deflates, before
+  // the first one and after the last one. The bytes in the gap after a deflate
+  // map one to one to the bytes of the puff stream after its puff, counting
+  // from the byte the deflate ends in.
+  vector<Segment> segments;
+  auto add_segment = [&segments](uint64_t puff_offset, uint64_t puff_end,
+                                 uint64_t deflate_offset,
+                                 uint64_t deflate_end) {
+    segments.emplace_back(ByteExtent(puff_offset, puff_end - puff_offset),
+                          deflate_offset, deflate_end - deflate_offset);
+    return &segments.back();
+  };
+  uint64_t prev_end_bit = 0;
+  uint64_t prev_puff_end = 0;
+  // The start of the current run of deflates.
+  size_t first_deflate = 0;
+  uint64_t run_puff_offset = 0;
+  uint64_t run_deflate_offset = 0;
+  size_t run_idx = 0;
+  for (size_t idx = 0; idx <= deflates.size(); idx++) {
+    uint64_t gap_start = (prev_end_bit + 7) / 8;
+    uint64_t gap_end;
+    if (idx < deflates.size()) {
+      TEST_AND_RETURN_VALUE(deflates[idx].offset >= prev_end_bit, nullptr);
+      TEST_AND_RETURN_VALUE(puffs[idx].offset >= prev_puff_end, nullptr);
+      gap_end = deflates[idx].offset / 8;
+    } else {
+      TEST_AND_RETURN_VALUE(puff_size >= prev_puff_end, nullptr);
+      gap_end = prev_end_bit / 8 + puff_size - prev_puff_end;
+    }
+    auto gap_puff = [&](uint64_t offset) {
+      return prev_puff_end + offset - prev_end_bit / 8;
+    };
+
+    if (gap_start <= gap_end) {
+      if (idx > first_deflate) {
+        auto segment = add_segment(run_puff_offset, gap_puff(gap_start),
+                                   run_deflate_offset, gap_start);
+        for (size_t deflate_idx = first_deflate; deflate_idx < idx;
+             deflate_idx++) {
+          const auto& deflate = deflates[deflate_idx];
+          const auto& puff = puffs[deflate_idx];
+          segment->deflates.emplace_back(
+              deflate.offset - run_deflate_offset * 8, deflate.length);
+          segment->puffs.emplace_back(puff.offset - run_puff_offset,
+                                      puff.length);
+        }
+        for (; run_idx < sub_blocks.size() &&
+               sub_blocks[run_idx].offset < gap_start * 8;
+             run_idx++) {
+          TEST_AND_RETURN_VALUE(
+              sub_blocks[run_idx].offset >= run_deflate_offset * 8 &&
+                  sub_puffs[run_idx].offset >= run_puff_offset,
+              nullptr);
+          segment->sub_blocks.emplace_back(
+              sub_blocks[run_idx].offset - run_deflate_offset * 8,
+              sub_blocks[run_idx].length);
+          segment->sub_puffs.emplace_back(
+              sub_puffs[run_idx].offset - run_puff_offset,
+              sub_puffs[run_idx].length);
+        }
+      }
+      if (gap_start < gap_end) {
+        add_segment(gap_puff(gap_start), gap_puff(gap_end), gap_start,
+                    gap_end);
+      }
+      if (idx < deflates.size()) {
+        // If the deflate does not start on a byte boundary, the puff stream
+        // has a byte for the raw bits before it.
+        TEST_AND_RETURN_VALUE(
+            gap_puff(gap_end) + ((deflates[idx].offset & 7) ? 1 : 0) ==
+                puffs[idx].offset,
+            nullptr);
+        first_deflate = idx;
+        run_puff_offset = gap_puff(gap_end);
+        run_deflate_offset = gap_end;
+      }
+    } else {
+      // The deflate shares a byte with the previous one, so it has to be
+      // huffed along with it.
+      TEST_AND_RETURN_VALUE(idx < deflates.size(), nullptr);
+    }
+
+    if (idx < deflates.size()) {
+      prev_end_bit = deflates[idx].offset + deflates[idx].length;
+      prev_puff_end = puffs[idx].offset + puffs[idx].length;
+    }
+  }
+  // All the runs of blocks have to be in a deflate.
+  TEST_AND_RETURN_VALUE(run_idx == sub_blocks.size(), nullptr);
+
+  return unique_ptr<RandomAccessHuffStream>(new RandomAccessHuffStream(
+      std::move(stream), puff_size, std::move(segments), num_threads));
+}
+
+RandomAccessHuffStream::RandomAccessHuffStream(UniqueStreamPtr stream,
+                                               uint64_t puff_size,
+                                               vector<Segment> segments,
+                                               size_t num_threads)
+    : stream_(std::move(stream)),
+      puff_size_(puff_size),
+      segments_(std::move(segments)),
+      num_threads_(num_threads),
+      offset_(0) {}
+
+bool RandomAccessHuffStream::GetSize(uint64_t* size) const {
+  *size = puff_size_;
+  return true;
+}
+
+bool RandomAccessHuffStream::GetOffset(uint64_t* offset) const {
+  *offset = offset_;
+  return true;
+}
+
+bool RandomAccessHuffStream::Seek(uint64_t offset) {
+  TEST_AND_RETURN_FALSE(offset <= puff_size_);
+  offset_ = offset;
+  return true;
+}
+
+bool RandomAccessHuffStream::Read(void* /* buffer */, size_t /* length */) {
+  LOG(ERROR) << "RandomAccessHuffStream is write only.";
+  return false;
+}
+
+bool RandomAccessHuffStream::Write(const void* buffer, size_t length) {
+  TEST_AND_RETURN_FALSE(WriteAt(offset_, buffer, length));
+  offset_ += length;
+  return true;
+}
+
+bool RandomAccessHuffStream::WriteAt(uint64_t offset,
+                                     const void* buffer,
+                                     size_t length) {
+  TEST_AND_RETURN_FALSE(offset <= puff_size_ && length <= puff_size_ - offset);
+  auto bytes = static_cast<const uint8_t*>(buffer);
+  // Find the segment which has |offset|.
+  auto segment = std::upper_bound(segments_.begin(), segments_.end(), offset,
+                                  [](uint64_t offset, const Segment& segment) {
+                                    return offset < segment.puff.offset;
+                                  });
+  while (length > 0) {
+    TEST_AND_RETURN_FALSE(segment != segments_.begin());
+    auto& cur_segment = *std::prev(segment);
+    auto segment_offset = offset - cur_segment.puff.offset;
+    auto write_len = std::min(static_cast<uint64_t>(length),
+                              cur_segment.puff.length - segment_offset);
+    TEST_AND_RETURN_FALSE(
+        WriteToSegment(&cur_segment, segment_offset, bytes, write_len));
+    offset += write_len;
+    bytes += write_len;
+    length -= write_len;
+    segment++;
+  }
+  return true;
+}
+
+bool RandomAccessHuffStream::WriteToSegment(Segment* segment,
+                                            uint64_t offset,
+                                            const uint8_t* data,
+                                            size_t length) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    TEST_AND_RETURN_FALSE(length <=
+                          segment->puff.length - segment->bytes_claimed);
+    segment->bytes_claimed += length;
+    if (!segment->deflates.empty() && segment->puff_buffer.empty()) {
+      segment->puff_buffer.resize(segment->puff.length);
+    }
+  }
+
+  if (segment->deflates.empty()) {
+    TEST_AND_RETURN_FALSE(
+        WriteToStream(segment->deflate_offset + offset, data, length));
+  } else {
+    memcpy(segment->puff_buffer.data() + offset, data, length);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    segment->bytes_written += length;
+    if (segment->deflates.empty() ||
+        segment->bytes_written < segment->puff.length) {
+      return true;
+    }
+  }
+  // This thread wrote the last part of the segment, so no other thread
+  // touches it anymore.
+  return HuffSegment(segment);
+}
+
+bool RandomAccessHuffStream::HuffSegment(Segment* segment) {
+  std::shared_ptr<Huffer> huffer;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (huffers_.empty()) {
+      huffer = std::make_shared<Huffer>();
+    } else {
+      huffer = std::move(huffers_.back());
+      huffers_.pop_back();
+    }
+  }
+
+  Buffer deflate_buffer;
+  deflate_buffer.reserve(segment->deflate_size);
+  auto huff_stream = PuffinStream::CreateForHuff(
+      MemoryStream::CreateForWrite(&deflate_buffer), huffer,
+      segment->puff.length, segment->deflates, segment->puffs,
+      segment->sub_blocks, segment->sub_puffs, num_threads_);
+  TEST_AND_RETURN_FALSE(huff_stream);
+  TEST_AND_RETURN_FALSE(huff_stream->Write(segment->puff_buffer.data(),
+                                           segment->puff_buffer.size()));
+  TEST_AND_RETURN_FALSE(deflate_buffer.size() == segment->deflate_size);
+  Buffer().swap(segment->puff_buffer);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    huffers_.push_back(std::move(huffer));
+  }
+  return WriteToStream(segment->deflate_offset, deflate_buffer.data(),
+                       deflate_buffer.size());
+}
+
+bool RandomAccessHuffStream::WriteToStream(uint64_t offset,
+                                           const uint8_t* data,
+                                           size_t length) {
+  std::lock_guard<std::mutex> lock(stream_mutex_);
+  TEST_AND_RETURN_FALSE(stream_->Seek(offset));
+  TEST_AND_RETURN_FALSE(stream_->Write(data, length));
+  return true;
+}
+
+bool RandomAccessHuffStream::Close() {
+  for (const auto& segment : segments_) {
+    if (segment.bytes_written != segment.puff.length) {
+      LOG(ERROR) << "The puff stream at " << segment.puff.offset
+                 << " has not been written completely.";
+      return false;
+    }
+  }
+  return stream_->Close();
+}
+
+}  // namespace puffin
@@ -0,0 +1,140 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_RANDOM_ACCESS_HUFF_STREAM_H_
+#define SRC_RANDOM_ACCESS_HUFF_STREAM_H_
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/huffer.h"
+#include "puffin/src/include/puffin/stream.h"
+
+namespace puffin {
+
+// A stream for huffing a puff stream that is written at any offset, in any
+// order and from several threads at once. The huffing |PuffinStream| needs
+// the puff stream from beginning to end, because a deflate can share its first
+// and last bytes with the data around it. Here the puff stream is split into
+// segments that share no byte with each other: the raw data between the
+// deflates, which is written through right away, and runs of deflates that are
+// buffered until all of their puff has been written. The thread that completes
+// a run of deflates huffs it with its own |PuffinStream| and writes it at its
+// place in the deflate stream.
+//
+// Each byte of the puff stream has to be written exactly once.
+class RandomAccessHuffStream : public StreamInterface {
+ public:
+  ~RandomAccessHuffStream() override = default;
+
+  // Creates a |RandomAccessHuffStream| for writing into the deflate stream
+  // |stream|, which has to support seeking. The other arguments are the same
+  // as for |PuffinStream::CreateForHuff|; |num_threads| is used for huffing the
+  // runs of blocks of one deflate in parallel.
+  static std::unique_ptr<RandomAccessHuffStream> Create(
+      UniqueStreamPtr stream,
+      uint64_t puff_size,
+      const std::vector<BitExtent>& deflates,
+      const std::vector<ByteExtent>& puffs,
+      const std::vector<BitExtent>& sub_blocks,
+      const std::vector<ByteExtent>& sub_puffs,
+      size_t num_threads);
+
+  // Writes |length| bytes from |buffer| at |offset| of the puff stream. This
+  // can be called from several threads at once and does not change the current
+  // offset.
+  bool WriteAt(uint64_t offset, const void* buffer, size_t length);
+
+  bool GetSize(uint64_t* size) const override;
+  bool GetOffset(uint64_t* offset) const override;
+  bool Seek(uint64_t offset) override;
+
+  // Not supported, the stream is write only.
+  bool Read(void* buffer, size_t length) override;
+
+  // Writes at the current offset with |WriteAt| and moves past the written
+  // bytes.
+  bool Write(const void* buffer, size_t length) override;
+
+  // Fails if any part of the puff stream has not been written.
+  bool Close() override;
+
+ private:
+  // A part of the puff stream that is written into the deflate stream
+  // independently of the others.
+  struct Segment {
+    Segment(const ByteExtent& puff,
+            uint64_t deflate_offset,
+            uint64_t deflate_size)
+        : puff(puff),
+          deflate_offset(deflate_offset),
+          deflate_size(deflate_size),
+          bytes_claimed(0),
+          bytes_written(0) {}
+
+    // The location of the segment in the puff stream.
+    ByteExtent puff;
+    // The offset of the segment in the deflate stream.
+    uint64_t deflate_offset;
+    // The size of the segment in the deflate stream.
+    uint64_t deflate_size;
+
+    // The deflates in the segment, their puffs and the runs of their blocks,
+    // relative to the start of the segment. Raw data has no deflates.
+    std::vector<BitExtent> deflates;
+    std::vector<ByteExtent> puffs;
+    std::vector<BitExtent> sub_blocks;
+    std::vector<ByteExtent> sub_puffs;
+
+    // The puff of the deflates, until it is huffed.
+    Buffer puff_buffer;
+    // The number of bytes that have been handed to the segment to write and
+    // that have been written into it.
+    uint64_t bytes_claimed;
+    uint64_t bytes_written;
+  };
+
+  RandomAccessHuffStream(UniqueStreamPtr stream,
+                         uint64_t puff_size,
+                         std::vector<Segment> segments,
+                         size_t num_threads);
+
+  // Writes |length| bytes of |data| at |offset| of |segment|'s puff.
+  bool WriteToSegment(Segment* segment,
+                      uint64_t offset,
+                      const uint8_t* data,
+                      size_t length);
+
+  // Huffs the completely written |segment| into the deflate stream.
+  bool HuffSegment(Segment* segment);
+
+  // Writes |length| bytes of |data| at |offset| of |stream_|.
+  bool WriteToStream(uint64_t offset, const uint8_t* data, size_t length);
+
+  UniqueStreamPtr stream_;
+  uint64_t puff_size_;
+  // The segments in the order of their location in the puff stream. They cover
+  // the whole puff stream.
+  std::vector<Segment> segments_;
+  size_t num_threads_;
+
+  // The current offset in the puff stream for |Write|.
+  uint64_t offset_;
+
+  // Protects the bookkeeping of |segments_| and |huffers_|.
+  std::mutex mutex_;
+  // Protects |stream_|.
+  std::mutex stream_mutex_;
+
+  // The |Huffer|s that are not used by any thread at the moment.
+  std::vector<std::shared_ptr<Huffer>> huffers_;
+
+  DISALLOW_COPY_AND_ASSIGN(RandomAccessHuffStream);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_RANDOM_ACCESS_HUFF_STREAM_H_
@@ -0,0 +1,126 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/sha256.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace puffin {
+
+namespace {
+
+constexpr uint32_t kRoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+inline uint32_t RotateRight(uint32_t value, int count) {
+  return (value >> count) | (value << (32 - count));
+}
+
+}  // namespace
+
+Sha256::Sha256()
+    : state_{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f,
+             0x9b05688c, 0x1f83d9ab, 0x5be0cd19},
+      block_size_(0),
+      total_size_(0) {}
+
+void Sha256::Update(const void* data, size_t size) {
+  auto bytes = static_cast<const uint8_t*>(data);
+  total_size_ += size;
+  if (block_size_ > 0) {
+    auto count = std::min(size, sizeof(block_) - block_size_);
+    memcpy(block_ + block_size_, bytes, count);
+    block_size_ += count;
+    bytes += count;
+    size -= count;
+    if (block_size_ < sizeof(block_)) {
+      return;
+    }
+    Transform(block_);
+    block_size_ = 0;
+  }
+  for (; size >= sizeof(block_); size -= sizeof(block_)) {
+    Transform(bytes);
+    bytes += sizeof(block_);
+  }
+  memcpy(block_, bytes, size);
+  block_size_ = size;
+}
+
+Sha256::Digest Sha256::Finish() {
+  // The data is padded with a one bit, zeros and its size in bits, so that it
+  // ends at a block boundary.
+  uint64_t total_bits = total_size_ * 8;
+  uint8_t padding[72] = {0x80};
+  auto padding_size = (block_size_ < 56 ? 56 : 120) - block_size_;
+  for (size_t idx = 0; idx < 8; idx++) {
+    padding[padding_size + idx] = total_bits >> (56 - idx * 8);
+  }
+  Update(padding, padding_size + 8);
+
+  Digest digest;
+  for (size_t idx = 0; idx < 8; idx++) {
+    for (size_t byte = 0; byte < 4; byte++) {
+      digest[idx * 4 + byte] = state_[idx] >> (24 - byte * 8);
+    }
+  }
+  return digest;
+}
+
+void Sha256::Transform(const uint8_t* block) {
+  uint32_t words[64];
+  for (size_t idx = 0; idx < 16; idx++) {
+    words[idx] = (static_cast<uint32_t>(block[idx * 4]) << 24) |
+                 (block[idx * 4 + 1] << 16) | (block[idx * 4 + 2] << 8) |
+                 block[idx * 4 + 3];
+  }
+  for (size_t idx = 16; idx < 64; idx++) {
+    auto s0 = RotateRight(words[idx - 15], 7) ^
+              RotateRight(words[idx - 15], 18) ^ (words[idx - 15] >> 3);
+    auto s1 = RotateRight(words[idx - 2], 17) ^
+              RotateRight(words[idx - 2], 19) ^ (words[idx - 2] >> 10);
+    words[idx] = words[idx - 16] + s0 + words[idx - 7] + s1;
+  }
+
+  uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+  uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+  for (size_t idx = 0; idx < 64; idx++) {
+    auto s1 = RotateRight(e, 6) ^ RotateRight(e, 11) ^ RotateRight(e, 25);
+    auto choice = (e & f) ^ (~e & g);
+    auto temp1 = h + s1 + choice + kRoundConstants[idx] + words[idx];
+    auto s0 = RotateRight(a, 2) ^ RotateRight(a, 13) ^ RotateRight(a, 22);
+    auto majority = (a & b) ^ (a & c) ^ (b & c);
+    auto temp2 = s0 + majority;
+    h = g;
+    g = f;
+    f = e;
+    e = d + temp1;
+    d = c;
+    c = b;
+    b = a;
+    a = temp1 + temp2;
+  }
+  state_[0] += a;
+  state_[1] += b;
+  state_[2] += c;
+  state_[3] += d;
+  state_[4] += e;
+  state_[5] += f;
+  state_[6] += g;
+  state_[7] += h;
+}
+
+}  // namespace puffin
@@ -0,0 +1,45 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_SHA256_H_
+#define SRC_SHA256_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "puffin/src/include/puffin/common.h"
+
+namespace puffin {
+
+// Computes the SHA-256 digest (FIPS 180-4) of the data passed to |Update|.
+class Sha256 {
+ public:
+  using Digest = std::array<uint8_t, 32>;
+
+  Sha256();
+  ~Sha256() = default;
+
+  // Adds |size| bytes at |data| to the hashed data.
+  void Update(const void* data, size_t size);
+
+  // Returns the digest of all the data added so far. |Update| cannot be called
+  // afterwards.
+  Digest Finish();
+
+ private:
+  // Hashes the 64 byte block at |block| into |state_|.
+  void Transform(const uint8_t* block);
+
+  uint32_t state_[8];
+  uint8_t block_[64];
+  size_t block_size_;
+  uint64_t total_size_;
+
+  DISALLOW_COPY_AND_ASSIGN(Sha256);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_SHA256_H_
@@ -0,0 +1,62 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "puffin/src/sha256.h"
+
+using std::string;
+
+namespace puffin {
+
+namespace {
+
+string ToHex(const Sha256::Digest& digest) {
+  static const char kHexDigits[] = "0123456789abcdef";
+  string hex;
+  for (auto byte : digest) {
+    hex += kHexDigits[byte >> 4];
+    hex += kHexDigits[byte & 0xF];
+  }
+  return hex;
+}
+
+string Hash(const string& data) {
+  Sha256 sha256;
+  sha256.Update(data.data(), data.size());
+  return ToHex(sha256.Finish());
+}
+
+}  // namespace
+
+// The test vectors of FIPS 180-4.
+TEST(Sha256Test, KnownDigestsTest) {
+  EXPECT_EQ(Hash(""),
+            "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+  EXPECT_EQ(Hash("abc"),
+            "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  EXPECT_EQ(Hash("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"),
+            "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+  EXPECT_EQ(Hash(string(1000000, 'a')),
+            "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+TEST(Sha256Test, UpdateInPiecesTest) {
+  string data;
+  for (size_t idx = 0; idx < 1000; idx++) {
+    data += static_cast<char>(idx * 7);
+  }
+  // Pieces that end anywhere in a block give the same digest.
+  for (size_t piece_size : {1, 3, 55, 56, 63, 64, 65, 200}) {
+    Sha256 sha256;
+    for (size_t pos = 0; pos < data.size(); pos += piece_size) {
+      sha256.Update(data.data() + pos, std::min(piece_size, data.size() - pos));
+    }
+    EXPECT_EQ(ToHex(sha256.Finish()), Hash(data));
+  }
+}
+
+}  // namespace puffin
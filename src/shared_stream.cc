@@ -0,0 +1,48 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/shared_stream.h"
+
+#include <utility>
+
+#include "puffin/src/logging.h"
+
+namespace puffin {
+
+SharedStreamReader::SharedStreamReader(std::shared_ptr<SharedStream> shared)
+    : shared_(std::move(shared)), offset_(0) {}
+
+bool SharedStreamReader::GetSize(uint64_t* size) const {
+  std::lock_guard<std::mutex> lock(shared_->mutex);
+  return shared_->stream->GetSize(size);
+}
+
+bool SharedStreamReader::GetOffset(uint64_t* offset) const {
+  *offset = offset_;
+  return true;
+}
+
+bool SharedStreamReader::Seek(uint64_t offset) {
+  offset_ = offset;
+  return true;
+}
+
+bool SharedStreamReader::Read(void* buffer, size_t length) {
+  std::lock_guard<std::mutex> lock(shared_->mutex);
+  TEST_AND_RETURN_FALSE(shared_->stream->Seek(offset_));
+  TEST_AND_RETURN_FALSE(shared_->stream->Read(buffer, length));
+  offset_ += length;
+  return true;
+}
+
+bool SharedStreamReader::Write(const void* /* buffer */,
+                               size_t /* length */) {
+  return false;
+}
+
+bool SharedStreamReader::Close() {
+  return true;
+}
+
+}  // namespace puffin
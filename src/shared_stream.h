@@ -0,0 +1,47 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_SHARED_STREAM_H_
+#define SRC_SHARED_STREAM_H_
+
+#include <memory>
+#include <mutex>
+
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/stream.h"
+
+namespace puffin {
+
+// A stream to read from, shared by several threads.
+struct SharedStream {
+  UniqueStreamPtr stream;
+  std::mutex mutex;
+};
+
+// A reader of a |SharedStream| with its own offset. Each read seeks and reads
+// the shared stream under its lock, so only one thread accesses it at a time.
+class SharedStreamReader : public StreamInterface {
+ public:
+  explicit SharedStreamReader(std::shared_ptr<SharedStream> shared);
+  ~SharedStreamReader() override = default;
+
+  bool GetSize(uint64_t* size) const override;
+  bool GetOffset(uint64_t* offset) const override;
+  bool Seek(uint64_t offset) override;
+  bool Read(void* buffer, size_t length) override;
+  bool Write(const void* buffer, size_t length) override;
+
+  // The shared stream stays open for the other readers.
+  bool Close() override;
+
+ private:
+  std::shared_ptr<SharedStream> shared_;
+  uint64_t offset_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedStreamReader);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_SHARED_STREAM_H_
@@ -2,16 +2,21 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <algorithm>
 #include <numeric>
 
 #include "gtest/gtest.h"
 
 #include "puffin/file_stream.h"
 #include "puffin/memory_stream.h"
+#include "puffin/src/direct_file_stream.h"
 #include "puffin/src/extent_stream.h"
 #include "puffin/src/include/puffin/huffer.h"
 #include "puffin/src/include/puffin/puffer.h"
+#include "puffin/src/include/puffin/utils.h"
+#include "puffin/src/parallel.h"
 #include "puffin/src/puffin_stream.h"
+#include "puffin/src/random_access_huff_stream.h"
 #include "puffin/src/unittest_common.h"
 
 using std::string;
@@ -194,6 +199,52 @@ TEST_F(StreamTest, FileStreamTest) {
   TestClose(stream.get());
 }
 
+TEST_F(StreamTest, DirectFileStreamTest) {
+  string filepath;
+  ASSERT_TRUE(MakeTempFile(&filepath, nullptr));
+  ScopedPathUnlinker scoped_unlinker(filepath);
+
+  // Use small buffers so the data spans multiple buffers and the writer has to
+  // recycle them.
+  auto stream = DirectFileStream::Open(filepath, DirectFileStream::kAlignment,
+                                       2 /* queue_depth */);
+  ASSERT_TRUE(stream.get() != nullptr);
+  Buffer tmp(1);
+  ASSERT_FALSE(stream->Read(tmp.data(), tmp.size()));
+
+  Buffer buf(5 * DirectFileStream::kAlignment + 123);
+  std::iota(buf.begin(), buf.end(), 0);
+  // Out of order, unaligned and aligned runs.
+  vector<ByteExtent> extents = {
+      {4096, 8192}, {100, 3996}, {12288, 7}, {12295, 8308}};
+  uint64_t offset = 0;
+  for (const auto& extent : extents) {
+    ASSERT_TRUE(stream->Seek(extent.offset));
+    // Write each run in pieces to test the aggregation.
+    uint64_t bytes_wrote = 0;
+    while (bytes_wrote < extent.length) {
+      auto write_size = std::min(extent.length - bytes_wrote, uint64_t{1000});
+      ASSERT_TRUE(stream->Write(buf.data() + extent.offset + bytes_wrote,
+                                write_size));
+      bytes_wrote += write_size;
+    }
+    ASSERT_TRUE(stream->GetOffset(&offset));
+    ASSERT_EQ(offset, extent.offset + extent.length);
+  }
+  uint64_t size;
+  ASSERT_TRUE(stream->GetSize(&size));
+  ASSERT_EQ(size, buf.size());
+  ASSERT_TRUE(stream->Close());
+  ASSERT_FALSE(stream->Write(buf.data(), 1));
+
+  // The first 100 bytes were never written.
+  std::fill(buf.begin(), buf.begin() + 100, 0);
+  auto read_stream = FileStream::Open(filepath, true, false);
+  ASSERT_TRUE(read_stream.get() != nullptr);
+  TestRead(read_stream.get(), buf);
+  TestClose(read_stream.get());
+}
+
 TEST_F(StreamTest, PuffinStreamTest) {
   auto puffer = std::make_shared<Puffer>();
   auto read_stream = PuffinStream::CreateForPuff(
@@ -246,6 +297,192 @@ TEST_F(StreamTest, PuffinStreamTest) {
   TestClose(write_stream.get());
 }
 
+TEST_F(StreamTest, PuffinStreamSharedCacheTest) {
+  // The same deflates twice, with the second ones cached as the first ones.
+  Buffer deflates_buf = kDeflatesSample1;
+  deflates_buf.insert(deflates_buf.end(), kDeflatesSample1.begin(),
+                      kDeflatesSample1.end());
+  Buffer puffs_buf = kPuffsSample1;
+  puffs_buf.insert(puffs_buf.end(), kPuffsSample1.begin(), kPuffsSample1.end());
+  auto deflates = kSubblockDeflateExtentsSample1;
+  auto puffs = kPuffExtentsSample1;
+  vector<size_t> puff_ids(deflates.size() * 2);
+  for (size_t idx = 0; idx < kSubblockDeflateExtentsSample1.size(); idx++) {
+    const auto& deflate = kSubblockDeflateExtentsSample1[idx];
+    const auto& puff = kPuffExtentsSample1[idx];
+    deflates.emplace_back(deflate.offset + kDeflatesSample1.size() * 8,
+                          deflate.length);
+    puffs.emplace_back(puff.offset + kPuffsSample1.size(), puff.length);
+    puff_ids[idx] = puff_ids[kSubblockDeflateExtentsSample1.size() + idx] =
+        idx;
+  }
+
+  auto puffer = std::make_shared<Puffer>();
+  auto read_stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(deflates_buf), puffer, puffs_buf.size(),
+      deflates, puffs, 16 /* max_cache_size */, puff_ids);
+  TestRead(read_stream.get(), puffs_buf);
+  TestSeek(read_stream.get(), false);
+  TestClose(read_stream.get());
+
+  // The same deflates in another stream find the puffs of the first stream in
+  // a shared cache. The stream is read twice.
+  auto shared_cache = std::make_shared<PuffCache>(1024);
+  PuffCacheStats stats1, stats2;
+  read_stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(kDeflatesSample1), puffer,
+      kPuffsSample1.size(), kSubblockDeflateExtentsSample1, kPuffExtentsSample1,
+      0, {}, shared_cache, &stats1);
+  TestRead(read_stream.get(), kPuffsSample1);
+  EXPECT_EQ(stats1.misses, kPuffExtentsSample1.size());
+  EXPECT_EQ(stats1.insertions, kPuffExtentsSample1.size());
+  read_stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(deflates_buf), puffer, puffs_buf.size(),
+      deflates, puffs, 0, {}, shared_cache, &stats2);
+  Buffer buf(puffs_buf.size());
+  ASSERT_TRUE(read_stream->Read(buf.data(), buf.size()));
+  EXPECT_EQ(buf, puffs_buf);
+  EXPECT_EQ(stats2.hits, puffs.size());
+  EXPECT_EQ(stats2.misses, 0u);
+  EXPECT_EQ(shared_cache->stats().hits, stats1.hits + stats2.hits);
+  EXPECT_EQ(shared_cache->stats().evictions, 0u);
+
+  // A cache that fits only one puff evicts the others.
+  shared_cache = std::make_shared<PuffCache>(20);
+  read_stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(deflates_buf), puffer, puffs_buf.size(),
+      deflates, puffs, 0, {}, shared_cache, nullptr);
+  ASSERT_TRUE(read_stream->Read(buf.data(), buf.size()));
+  EXPECT_EQ(buf, puffs_buf);
+  EXPECT_LE(shared_cache->size(), 20u);
+  EXPECT_GT(shared_cache->stats().evictions, 0u);
+
+  // A puff can only share the cache of an earlier puff of the same size.
+  std::swap(puff_ids[0], puff_ids[1]);
+  EXPECT_FALSE(PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(deflates_buf), puffer, puffs_buf.size(),
+      deflates, puffs, 16 /* max_cache_size */, puff_ids));
+}
+
+TEST_F(StreamTest, PuffinStreamWrongPuffIdsTest) {
+  // Two stored blocks of the same size that only differ in their data. The
+  // second one claims to be a duplicate of the first one.
+  const Buffer deflates_buf = {0x01, 0x01, 0x00, 0xFE, 0xFF, 'a',
+                               0x01, 0x01, 0x00, 0xFE, 0xFF, 'b'};
+  const vector<BitExtent> deflates = {{0, 48}, {48, 48}};
+  vector<ByteExtent> puffs;
+  uint64_t puff_size;
+  ASSERT_TRUE(FindPuffLocations(MemoryStream::CreateForRead(deflates_buf),
+                                deflates, &puffs, &puff_size));
+  auto puffer = std::make_shared<Puffer>();
+  Buffer expected_puffs(puff_size);
+  auto read_stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(deflates_buf), puffer, puff_size, deflates,
+      puffs);
+  ASSERT_TRUE(read_stream->Read(expected_puffs.data(), puff_size));
+
+  // The second deflate is puffed again instead of using the wrong puff.
+  read_stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(deflates_buf), puffer, puff_size, deflates,
+      puffs, 1024 /* max_cache_size */, {0, 0});
+  ASSERT_TRUE(read_stream);
+  TestRead(read_stream.get(), expected_puffs);
+}
+
+TEST_F(StreamTest, RandomAccessHuffStreamTest) {
+  Buffer buf(kDeflatesSample1.size());
+  auto stream = RandomAccessHuffStream::Create(
+      MemoryStream::CreateForWrite(&buf), kPuffsSample1.size(),
+      kSubblockDeflateExtentsSample1, kPuffExtentsSample1, {}, {}, 1);
+  ASSERT_TRUE(stream);
+  // Write the puff stream backwards, one byte at a time.
+  for (size_t idx = kPuffsSample1.size(); idx > 0; idx--) {
+    ASSERT_TRUE(stream->WriteAt(idx - 1, &kPuffsSample1[idx - 1], 1));
+  }
+  ASSERT_TRUE(stream->Close());
+  EXPECT_EQ(buf, kDeflatesSample1);
+
+  // Write it in pieces from several threads.
+  std::fill(buf.begin(), buf.end(), 0);
+  stream = RandomAccessHuffStream::Create(
+      MemoryStream::CreateForWrite(&buf), kPuffsSample1.size(),
+      kSubblockDeflateExtentsSample1, kPuffExtentsSample1, {}, {}, 1);
+  ASSERT_TRUE(stream);
+  constexpr size_t kPieceSize = 3;
+  size_t num_pieces = (kPuffsSample1.size() + kPieceSize - 1) / kPieceSize;
+  ASSERT_TRUE(ParallelFor(num_pieces, 4, [&](size_t piece_idx) {
+    auto offset = piece_idx * kPieceSize;
+    auto length = std::min(kPieceSize, kPuffsSample1.size() - offset);
+    return stream->WriteAt(offset, &kPuffsSample1[offset], length);
+  }));
+  ASSERT_TRUE(stream->Close());
+  EXPECT_EQ(buf, kDeflatesSample1);
+
+  // It fails to close if a part of the puff stream is missing.
+  stream = RandomAccessHuffStream::Create(
+      MemoryStream::CreateForWrite(&buf), kPuffsSample1.size(),
+      kSubblockDeflateExtentsSample1, kPuffExtentsSample1, {}, {}, 1);
+  ASSERT_TRUE(stream);
+  ASSERT_TRUE(stream->Seek(1));
+  ASSERT_TRUE(
+      stream->Write(kPuffsSample1.data() + 1, kPuffsSample1.size() - 1));
+  EXPECT_FALSE(stream->Close());
+}
+
+TEST_F(StreamTest, HuffRunsOfBlocksInParallelTest) {
+  // The deflate between some raw bytes.
+  Buffer deflate_stream = {0x11, 0x22};
+  deflate_stream.insert(deflate_stream.end(), kMultiBlockDeflate.begin(),
+                        kMultiBlockDeflate.end());
+  deflate_stream.push_back(0x33);
+  vector<BitExtent> deflates = {{16, kMultiBlockDeflate.size() * 8}};
+  vector<ByteExtent> puffs, sub_puffs;
+  vector<BitExtent> sub_blocks;
+  uint64_t puff_size;
+  ASSERT_TRUE(FindPuffLocations(MemoryStream::CreateForRead(deflate_stream),
+                                deflates, &puffs, &puff_size, &sub_blocks,
+                                &sub_puffs));
+  ASSERT_GT(sub_blocks.size(), 3u);
+  Buffer puff(puff_size);
+  auto read_stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(deflate_stream), std::make_shared<Puffer>(),
+      puff_size, deflates, puffs);
+  ASSERT_TRUE(read_stream->Read(puff.data(), puff.size()));
+
+  // Also try runs of two blocks.
+  vector<BitExtent> runs;
+  vector<ByteExtent> run_puffs;
+  for (size_t idx = 0; idx < sub_blocks.size(); idx += 2) {
+    runs.push_back(sub_blocks[idx]);
+    run_puffs.push_back(sub_puffs[idx]);
+    if (idx + 1 < sub_blocks.size()) {
+      runs.back().length += sub_blocks[idx + 1].length;
+      run_puffs.back().length += sub_puffs[idx + 1].length;
+    }
+  }
+
+  for (const auto& index : {std::make_pair(sub_blocks, sub_puffs),
+                            std::make_pair(runs, run_puffs)}) {
+    for (size_t num_threads : {1, 2, 4}) {
+      Buffer buf(deflate_stream.size());
+      auto write_stream = PuffinStream::CreateForHuff(
+          MemoryStream::CreateForWrite(&buf), std::make_shared<Huffer>(),
+          puff_size, deflates, puffs, index.first, index.second, num_threads);
+      ASSERT_TRUE(write_stream);
+      ASSERT_TRUE(write_stream->Write(puff.data(), puff.size()));
+      EXPECT_EQ(buf, deflate_stream);
+    }
+  }
+
+  // Runs that do not cover the whole deflate are rejected.
+  sub_blocks.pop_back();
+  sub_puffs.pop_back();
+  Buffer buf(deflate_stream.size());
+  EXPECT_FALSE(PuffinStream::CreateForHuff(
+      MemoryStream::CreateForWrite(&buf), std::make_shared<Huffer>(),
+      puff_size, deflates, puffs, sub_blocks, sub_puffs, 2));
+}
+
 TEST_F(StreamTest, ExtentStreamTest) {
   Buffer buf(100);
   std::iota(buf.begin(), buf.end(), 0);
@@ -276,4 +513,24 @@ TEST_F(StreamTest, ExtentStreamTest) {
   TestClose(write_stream.get());
 }
 
+TEST_F(StreamTest, ExtentStreamMergedExtentsTest) {
+  Buffer buf(100);
+  std::iota(buf.begin(), buf.end(), 0);
+
+  // Contiguous and empty extents are merged into {{10, 10}, {30, 10}}.
+  vector<ByteExtent> extents = {{10, 4}, {14, 0}, {14, 6},
+                                {30, 1}, {31, 9}, {90, 0}};
+  Buffer data = {10, 11, 12, 13, 14, 15, 16, 17, 18, 19,
+                 30, 31, 32, 33, 34, 35, 36, 37, 38, 39};
+
+  auto read_stream =
+      ExtentStream::CreateForRead(MemoryStream::CreateForRead(buf), extents);
+  uint64_t size;
+  ASSERT_TRUE(read_stream->GetSize(&size));
+  ASSERT_EQ(size, data.size());
+  TestSeek(read_stream.get(), false);
+  TestRead(read_stream.get(), data);
+  TestClose(read_stream.get());
+}
+
 }  // namespace puffin
@@ -4,8 +4,15 @@
 
 #include "puffin/src/unittest_common.h"
 
+#include <string.h>
 #include <unistd.h>
 
+#include "puffin/src/bit_writer.h"
+#include "puffin/src/include/puffin/huffer.h"
+#include "puffin/src/puff_data.h"
+#include "puffin/src/puff_reader.h"
+#include "puffin/src/puff_writer.h"
+
 using std::string;
 using std::vector;
 
@@ -30,6 +37,40 @@ bool MakeTempFile(string* filename, int* fd) {
   return true;
 }
 
+bool FixedHuffmanDeflate(const Buffer& data, Buffer* deflate) {
+  // The puff of the block, then huffed.
+  Buffer puff(data.size() + 16);
+  BufferPuffWriter puff_writer(puff.data(), puff.size());
+  PuffData pd;
+  pd.type = PuffData::Type::kBlockMetadata;
+  pd.block_metadata[0] = 0xA0;  // Final fixed Huffman block.
+  pd.length = 1;
+  TEST_AND_RETURN_FALSE(puff_writer.Insert(pd));
+  if (!data.empty()) {
+    pd.type = PuffData::Type::kLiterals;
+    pd.length = data.size();
+    auto literals = data.data();
+    pd.read_fn = [&literals](uint8_t* buffer, size_t count) {
+      memcpy(buffer, literals, count);
+      literals += count;
+      return true;
+    };
+    TEST_AND_RETURN_FALSE(puff_writer.Insert(pd));
+  }
+  pd.type = PuffData::Type::kEndOfBlock;
+  TEST_AND_RETURN_FALSE(puff_writer.Insert(pd));
+  TEST_AND_RETURN_FALSE(puff_writer.Flush());
+  puff.resize(puff_writer.Size());
+
+  // A literal takes up to 9 bits.
+  deflate->resize(data.size() * 9 / 8 + 8);
+  BufferPuffReader puff_reader(puff.data(), puff.size());
+  BufferBitWriter bit_writer(deflate->data(), deflate->size());
+  TEST_AND_RETURN_FALSE(Huffer().HuffDeflate(&puff_reader, &bit_writer));
+  deflate->resize(bit_writer.Size());
+  return true;
+}
+
 // clang-format off
 const Buffer kDeflatesSample1 = {
     /* raw   0 */ 0x11, 0x22,
@@ -91,4 +132,16 @@ const Buffer kProblematicCache = {
 const vector<BitExtent> kProblematicCacheDeflateExtents = {{2, 606}};
 const vector<BitExtent> kProblematicCachePuffExtents = {{1, 185}};
 
+// A raw deflate with several blocks, written by zlib with a partial flush and
+// a full flush in the middle. The full flush adds an empty stored block, and
+// the partial flush an empty fixed block that does not end on a byte boundary.
+const Buffer kMultiBlockDeflate = {
+    0x2a, 0x28, 0x4d, 0x4b, 0xcb, 0xcc, 0x53, 0x28, 0x00, 0x52, 0xc5, 0x0a,
+    0x29, 0xa9, 0x69, 0x39, 0x89, 0x25, 0xa9, 0x0a, 0x49, 0x39, 0xf9, 0xc9,
+    0xd9, 0xc5, 0x3a, 0x60, 0x51, 0x9c, 0x92, 0x00, 0x01, 0x94, 0x9f, 0x07,
+    0x65, 0x2b, 0x24, 0x96, 0x28, 0x24, 0x2a, 0x94, 0x64, 0xe6, 0xa6, 0xea,
+    0x29, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0x33, 0x30, 0x34, 0x32, 0x36,
+    0x31, 0x35, 0x33, 0xb7, 0xb0, 0x4c, 0x4c, 0x4a, 0x4e, 0x49, 0x4d, 0x33,
+    0x20, 0xc0, 0x07, 0x00};
+
 }  // namespace puffin
@@ -36,6 +36,10 @@ class ScopedPathUnlinker {
 // values.
 bool MakeTempFile(std::string* filename, int* fd);
 
+// Compresses |data| into |deflate|, a deflate stream of one final fixed Huffman
+// block of literals.
+bool FixedHuffmanDeflate(const Buffer& data, Buffer* deflate);
+
 extern const Buffer kDeflatesSample1;
 extern const Buffer kPuffsSample1;
 extern const std::vector<ByteExtent> kDeflateExtentsSample1;
@@ -52,6 +56,8 @@ extern const Buffer kProblematicCache;
 extern const std::vector<BitExtent> kProblematicCacheDeflateExtents;
 extern const std::vector<BitExtent> kProblematicCachePuffExtents;
 
+extern const Buffer kMultiBlockDeflate;
+
 }  // namespace puffin
 
 #endif  // SRC_UNITTEST_COMMON_H_
@@ -4,23 +4,33 @@
 
 #include "puffin/src/include/puffin/utils.h"
 
+#include <ctype.h>
 #include <inttypes.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif  // __SSE2__
+
 #include <algorithm>
 #include <iterator>
-#include <set>
 #include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "puffin/file_stream.h"
 #include "puffin/memory_stream.h"
 #include "puffin/src/bit_reader.h"
+#include "puffin/src/huffman_table.h"
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/puffer.h"
 #include "puffin/src/logging.h"
+#include "puffin/src/nested_deflate.h"
+#include "puffin/src/parallel.h"
+#include "puffin/src/puff_data.h"
 #include "puffin/src/puff_writer.h"
 
-using std::set;
 using std::string;
 using std::vector;
 
@@ -65,8 +75,50 @@ struct ExtentData {
   }
   bool operator<(const ExtentData& other) const { return Compare(other) < 0; }
   bool operator==(const ExtentData& other) const { return Compare(other) == 0; }
+
+  // Returns a hash that is equal for extents that compare equal. Extents of
+  // the same bit length can have one byte less inside of them depending on
+  // their bit alignment, so only the bytes that every extent of this length
+  // has are hashed.
+  uint64_t Hash() const {
+    constexpr uint64_t kMultiplier = 0x9E3779B97F4A7C15;
+    auto mix = [](uint64_t hash, uint64_t word) {
+      hash = (hash ^ word) * kMultiplier;
+      return hash ^ (hash >> 29);
+    };
+    uint64_t length = extent.length >= 8 ? extent.length / 8 - 1 : 0;
+    const uint8_t* bytes = data.data() + byte_offset;
+    uint64_t hash = mix(0, extent.length);
+    for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t)) {
+      hash = mix(hash, get_unaligned<uint64_t>(bytes));
+      bytes += sizeof(uint64_t);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, bytes, length);
+    return mix(hash, tail);
+  }
 };
 
+// The number of extents hashed by one task of |HashExtents|.
+constexpr size_t kExtentsPerHashTask = 64;
+
+// Returns the hashes of the data of |extents| in |data|, computed in parallel.
+vector<uint64_t> HashExtents(const puffin::Buffer& data,
+                             const vector<puffin::BitExtent>& extents) {
+  vector<uint64_t> hashes(extents.size());
+  auto num_tasks =
+      (extents.size() + kExtentsPerHashTask - 1) / kExtentsPerHashTask;
+  auto hash_task = [&](size_t idx) {
+    auto end = std::min(extents.size(), (idx + 1) * kExtentsPerHashTask);
+    for (auto i = idx * kExtentsPerHashTask; i < end; i++) {
+      hashes[i] = ExtentData(extents[i], data).Hash();
+    }
+    return true;
+  };
+  puffin::ParallelFor(num_tasks, puffin::GetDefaultNumThreads(), hash_task);
+  return hashes;
+}
+
 }  // namespace
 
 namespace puffin {
@@ -91,19 +143,431 @@ bool LocateDeflatesInDeflateStream(const uint8_t* data,
   return true;
 }
 
+namespace {
+
+// Deflates of at least twice this size are split into chunks of at least this
+// size to search for their blocks in parallel.
+constexpr uint64_t kMinSpeculativeChunkSize = 1024 * 1024;  // 1MB
+
+// Returns true if the code lengths in |counts| (the number of codes of each
+// length up to |max_bits|) form a complete prefix code.
+bool IsCompletePrefixCode(const uint16_t* counts, size_t max_bits) {
+  uint32_t kraft_sum = 0;
+  for (size_t len = 1; len <= max_bits; len++) {
+    kraft_sum += static_cast<uint32_t>(counts[len]) << (max_bits - len);
+  }
+  return kraft_sum == (1U << max_bits);
+}
+
+// Returns true if a deflate block with dynamic Huffman codes could start at
+// bit |offset| of |data|. The block must not be the final one unless
+// |allow_final| is true. The code length code and the literal/length code must
+// be complete prefix codes, and the distance code must be complete or have at
+// most one code, which is what encoders write. Random bits almost never pass
+// this, and unlike |HuffmanTable| the failures are not logged.
+bool IsPlausibleDynamicBlock(const uint8_t* data,
+                             uint64_t size,
+                             uint64_t offset,
+                             bool allow_final = false) {
+  const uint32_t header_mask = allow_final ? 6 : 7;
+  // Most positions are rejected by the block header alone.
+  if (size - offset / 8 < 2 ||
+      ((data[offset / 8] | (data[offset / 8 + 1] << 8)) >> (offset % 8) &
+       header_mask) != 4) {
+    return false;
+  }
+  BufferBitReader br(data + offset / 8, size - offset / 8);
+  auto read_bits = [&br](size_t nbits, uint32_t* value) {
+    if (!br.CacheBits(nbits)) {
+      return false;
+    }
+    *value = br.ReadBits(nbits);
+    br.DropBits(nbits);
+    return true;
+  };
+
+  // BFINAL is 0 (unless |allow_final|) and BTYPE is 2.
+  uint32_t value;
+  if (!read_bits(offset % 8 + 3, &value) ||
+      ((value >> (offset % 8)) & header_mask) != 4) {
+    return false;
+  }
+  uint32_t num_lit_len, num_distance, num_code_lens;
+  if (!read_bits(5, &num_lit_len) || !read_bits(5, &num_distance) ||
+      !read_bits(4, &num_code_lens) || num_lit_len > 29 || num_distance > 29) {
+    return false;
+  }
+  num_lit_len += 257;
+  num_distance += 1;
+  num_code_lens += 4;
+
+  uint8_t code_lens[19] = {0};
+  for (size_t idx = 0; idx < num_code_lens; idx++) {
+    if (!read_bits(3, &value)) {
+      return false;
+    }
+    code_lens[kPermutations[idx]] = value;
+  }
+  uint16_t counts[8] = {0};
+  for (auto len : code_lens) {
+    counts[len]++;
+  }
+  if (!IsCompletePrefixCode(counts, 7)) {
+    return false;
+  }
+  // The symbols ordered by their canonical codes.
+  uint8_t symbols[19];
+  uint16_t next_symbol[8] = {0};
+  for (size_t len = 2; len < 8; len++) {
+    next_symbol[len] = next_symbol[len - 1] + counts[len - 1];
+  }
+  for (uint8_t symbol = 0; symbol < 19; symbol++) {
+    if (code_lens[symbol] > 0) {
+      symbols[next_symbol[code_lens[symbol]]++] = symbol;
+    }
+  }
+  // Decodes one code length symbol a bit at a time. The codes of each length
+  // are consecutive, starting at |first|.
+  auto decode = [&](uint32_t* symbol) {
+    uint32_t code = 0, first = 0, index = 0;
+    for (size_t len = 1; len < 8; len++) {
+      if (!read_bits(1, &value)) {
+        return false;
+      }
+      code |= value;
+      if (code - first < counts[len]) {
+        *symbol = symbols[index + code - first];
+        return true;
+      }
+      index += counts[len];
+      first = (first + counts[len]) << 1;
+      code <<= 1;
+    }
+    return false;
+  };
+
+  uint8_t lens[286 + 30];
+  size_t num_lens = num_lit_len + num_distance;
+  for (size_t idx = 0; idx < num_lens;) {
+    uint32_t symbol, repeat;
+    if (!decode(&symbol)) {
+      return false;
+    }
+    if (symbol < 16) {
+      lens[idx++] = symbol;
+      continue;
+    }
+    uint8_t len = 0;
+    if (symbol == 16) {
+      if (idx == 0 || !read_bits(2, &repeat)) {
+        return false;
+      }
+      len = lens[idx - 1];
+      repeat += 3;
+    } else if (symbol == 17) {
+      if (!read_bits(3, &repeat)) {
+        return false;
+      }
+      repeat += 3;
+    } else {
+      if (!read_bits(7, &repeat)) {
+        return false;
+      }
+      repeat += 11;
+    }
+    if (repeat > num_lens - idx) {
+      return false;
+    }
+    std::fill(lens + idx, lens + idx + repeat, len);
+    idx += repeat;
+  }
+
+  // The end of block code must exist.
+  if (lens[256] == 0) {
+    return false;
+  }
+  uint16_t lit_len_counts[16] = {0};
+  uint16_t distance_counts[16] = {0};
+  for (size_t idx = 0; idx < num_lit_len; idx++) {
+    lit_len_counts[lens[idx]]++;
+  }
+  for (size_t idx = num_lit_len; idx < num_lens; idx++) {
+    distance_counts[lens[idx]]++;
+  }
+  return IsCompletePrefixCode(lit_len_counts, 15) &&
+         (num_distance - distance_counts[0] <= 1 ||
+          IsCompletePrefixCode(distance_counts, 15));
+}
+
+// A bit reader that does not give out any more bits once |Stop| is called. It
+// is used to stop the puffer between two deflate blocks.
+class StoppableBitReader : public BitReaderInterface {
+ public:
+  StoppableBitReader(const uint8_t* data, size_t size)
+      : br_(data, size), stopped_(false) {}
+  ~StoppableBitReader() override = default;
+
+  bool CacheBits(size_t nbits) override {
+    return !stopped_ && br_.CacheBits(nbits);
+  }
+  uint32_t ReadBits(size_t nbits) override { return br_.ReadBits(nbits); }
+  void DropBits(size_t nbits) override { br_.DropBits(nbits); }
+  uint8_t ReadBoundaryBits() override { return br_.ReadBoundaryBits(); }
+  size_t SkipBoundaryBits() override { return br_.SkipBoundaryBits(); }
+  bool GetByteReaderFn(
+      size_t length,
+      std::function<bool(uint8_t*, size_t)>* read_fn) override {
+    return br_.GetByteReaderFn(length, read_fn);
+  }
+  size_t Offset() const override { return br_.Offset(); }
+  uint64_t OffsetInBits() const override { return br_.OffsetInBits(); }
+  uint64_t BitsRemaining() const override { return br_.BitsRemaining(); }
+
+  void Stop() { stopped_ = true; }
+  bool stopped() const { return stopped_; }
+
+ private:
+  BufferBitReader br_;
+  bool stopped_;
+
+  DISALLOW_COPY_AND_ASSIGN(StoppableBitReader);
+};
+
+// A chain of consecutive deflate blocks.
+struct DeflateBlockChain {
+  // Whether the chain was decoded. Only used for speculative chains.
+  bool valid = false;
+  // Whether the chain reaches the end of the deflate.
+  bool complete = false;
+  // The bit offset of the start of the first block, followed by the bit
+  // offsets of the ends of all the blocks.
+  vector<uint64_t> boundaries;
+  // Whether each block is an uncompressed one.
+  vector<bool> stored;
+};
+
+// A puff writer that does not write the puff, but records the blocks of a
+// |chain| read by |br| starting at bit |bit_offset|. It stops |br| at the end
+// of the first block that ends at or after bit |limit|.
+class BlockChainPuffWriter : public PuffWriterInterface {
+ public:
+  BlockChainPuffWriter(StoppableBitReader* br,
+                       uint64_t bit_offset,
+                       uint64_t limit,
+                       DeflateBlockChain* chain)
+      : br_(br),
+        bit_offset_(bit_offset),
+        limit_(limit),
+        chain_(chain),
+        stored_(false),
+        final_(false) {}
+  ~BlockChainPuffWriter() override = default;
+
+  bool Insert(const PuffData& pd) override {
+    switch (pd.type) {
+      case PuffData::Type::kBlockMetadata:
+        stored_ = ((pd.block_metadata[0] >> 5) & 3) == 0;
+        final_ = pd.block_metadata[0] >> 7;
+        break;
+      case PuffData::Type::kLiterals:
+        if (pd.length > 0) {
+          TEST_AND_RETURN_FALSE(pd.read_fn(nullptr, pd.length));
+        }
+        break;
+      case PuffData::Type::kEndOfBlock: {
+        auto end = bit_offset_ + br_->OffsetInBits();
+        chain_->boundaries.push_back(end);
+        chain_->stored.push_back(stored_);
+        if (final_) {
+          chain_->complete = true;
+        }
+        if (end >= limit_) {
+          br_->Stop();
+        }
+        break;
+      }
+      default:
+        break;
+    }
+    return true;
+  }
+  bool Flush() override { return true; }
+  size_t Size() override { return 0; }
+
+ private:
+  StoppableBitReader* br_;
+  uint64_t bit_offset_;
+  uint64_t limit_;
+  DeflateBlockChain* chain_;
+  bool stored_;
+  bool final_;
+
+  DISALLOW_COPY_AND_ASSIGN(BlockChainPuffWriter);
+};
+
+// Decodes the blocks of the deflate in |data| into |chain|, starting with the
+// block at bit |start|. It stops at the end of the first block that ends at or
+// after bit |limit|, at the end of the final block, or at the end of |data|.
+bool DecodeDeflateBlockChain(const Puffer& puffer,
+                             const uint8_t* data,
+                             uint64_t size,
+                             uint64_t start,
+                             uint64_t limit,
+                             DeflateBlockChain* chain) {
+  chain->complete = false;
+  chain->boundaries = {start};
+  chain->stored.clear();
+  StoppableBitReader bit_reader(data + start / 8, size - start / 8);
+  TEST_AND_RETURN_FALSE(bit_reader.CacheBits(start % 8));
+  bit_reader.DropBits(start % 8);
+  BlockChainPuffWriter puff_writer(&bit_reader, start / 8 * 8, limit, chain);
+  // Passing a list of deflates makes the puffer stop after the final block.
+  vector<BitExtent> deflates;
+  TEST_AND_RETURN_FALSE(
+      puffer.PuffDeflate(&bit_reader, &puff_writer, &deflates));
+  if (!bit_reader.stopped()) {
+    chain->complete = true;
+  }
+  return true;
+}
+
+}  // namespace
+
+bool LocateDeflatesInDeflateStream(const uint8_t* data,
+                                   uint64_t size,
+                                   uint64_t virtual_offset,
+                                   vector<BitExtent>* deflates,
+                                   uint64_t* compressed_size,
+                                   size_t num_threads) {
+  auto num_chunks = std::min<uint64_t>(num_threads * 4,
+                                       size / kMinSpeculativeChunkSize);
+  if (num_threads <= 1 || num_chunks <= 1) {
+    return LocateDeflatesInDeflateStream(data, size, virtual_offset, deflates,
+                                         compressed_size);
+  }
+  auto chunk_size = size / num_chunks;
+  auto chunk_end = [&](size_t idx) {
+    return idx + 1 == num_chunks ? size * 8 : (idx + 1) * chunk_size * 8;
+  };
+
+  // Where a block starts is only known after decoding the blocks before it.
+  // The first chunk is decoded from the start of the deflate. Each of the other
+  // chunks guesses where its first block starts by looking for a valid dynamic
+  // block header, and decodes the blocks from there until it passes the end of
+  // the chunk. Puffing does not need the window of the previous 32KB, so any
+  // block can be decoded on its own.
+  vector<DeflateBlockChain> chains(num_chunks);
+  TEST_AND_RETURN_FALSE(ParallelFor(num_chunks, num_threads, [&](size_t idx) {
+    Puffer puffer;
+    auto limit = chunk_end(idx);
+    if (idx == 0) {
+      chains[idx].valid = true;
+      return DecodeDeflateBlockChain(puffer, data, size, 0, limit,
+                                     &chains[idx]);
+    }
+    HuffmanTable huffman_table;
+    uint8_t block_metadata[sizeof(PuffData::block_metadata)];
+    for (auto pos = idx * chunk_size * 8; pos < limit; pos++) {
+      if (!IsPlausibleDynamicBlock(data, size, pos)) {
+        continue;
+      }
+      // Double check the header with the Huffman table the puffer uses.
+      BufferBitReader bit_reader(data + pos / 8, size - pos / 8);
+      bit_reader.CacheBits(pos % 8 + 3);
+      bit_reader.DropBits(pos % 8 + 3);
+      size_t length = sizeof(block_metadata);
+      if (huffman_table.BuildDynamicHuffmanTable(&bit_reader, block_metadata,
+                                                 &length) &&
+          DecodeDeflateBlockChain(puffer, data, size, pos, limit,
+                                  &chains[idx])) {
+        chains[idx].valid = true;
+        break;
+      }
+    }
+    // A chunk without a valid guess is decoded later.
+    return true;
+  }));
+
+  // Chain the chunks starting from the first one. If the previous chunk ends
+  // at a block start of the next chunk, the next chunk guessed right and its
+  // blocks from there on are the real ones. Otherwise, it is decoded again
+  // from the end of the previous chunk.
+  Puffer puffer;
+  auto& result = chains[0];
+  // Appends the blocks of |chain| after the boundary |first_block| to |result|.
+  auto append_blocks = [&result](const DeflateBlockChain& chain,
+                                 size_t first_block) {
+    result.boundaries.insert(result.boundaries.end(),
+                             chain.boundaries.begin() + first_block + 1,
+                             chain.boundaries.end());
+    result.stored.insert(result.stored.end(),
+                         chain.stored.begin() + first_block,
+                         chain.stored.end());
+    result.complete = chain.complete;
+  };
+  for (size_t idx = 1; idx < num_chunks && !result.complete; idx++) {
+    auto limit = chunk_end(idx);
+    if (result.boundaries.back() >= limit) {
+      continue;
+    }
+    const auto& chain = chains[idx];
+    DeflateBlockChain redecoded_chain;
+    if (chain.valid && result.boundaries.back() < chain.boundaries.front()) {
+      // The guess skipped the blocks that are not dynamic Huffman blocks, so
+      // the previous chunk may end before it. Decode up to the guess first.
+      TEST_AND_RETURN_FALSE(DecodeDeflateBlockChain(
+          puffer, data, size, result.boundaries.back(),
+          chain.boundaries.front(), &redecoded_chain));
+      append_blocks(redecoded_chain, 0);
+      if (result.complete) {
+        break;
+      }
+    }
+    auto pos = result.boundaries.back();
+    auto boundary =
+        std::lower_bound(chain.boundaries.begin(), chain.boundaries.end(), pos);
+    if (chain.valid && boundary != chain.boundaries.end() && *boundary == pos) {
+      append_blocks(chain, boundary - chain.boundaries.begin());
+    } else if (pos < limit) {
+      TEST_AND_RETURN_FALSE(DecodeDeflateBlockChain(puffer, data, size, pos,
+                                                    limit, &redecoded_chain));
+      append_blocks(redecoded_chain, 0);
+    }
+  }
+
+  // Uncompressed blocks are not deflates, the same as in the function above.
+  for (size_t idx = 0; idx < result.stored.size(); idx++) {
+    if (!result.stored[idx]) {
+      deflates->emplace_back(result.boundaries[idx] + virtual_offset * 8,
+                             result.boundaries[idx + 1] -
+                                 result.boundaries[idx]);
+    }
+  }
+  if (compressed_size) {
+    *compressed_size = (result.boundaries.back() + 7) / 8;
+  }
+  return true;
+}
+
 // This function uses RFC1950 (https://www.ietf.org/rfc/rfc1950.txt) for the
 // definition of a zlib stream.  For finding the deflate blocks, we relying on
 // the proper size of the zlib stream in |data|. Basically the size of the zlib
 // stream should be known before hand. Otherwise we need to parse the stream and
 // find the location of compressed blocks using CalculateSizeOfDeflateBlock().
 bool LocateDeflatesInZlib(const Buffer& data, vector<BitExtent>* deflates) {
+  return LocateDeflatesInZlib(data.data(), data.size(), deflates);
+}
+
+bool LocateDeflatesInZlib(const uint8_t* data,
+                          uint64_t size,
+                          vector<BitExtent>* deflates) {
   // A zlib stream has the following format:
   // 0           1     compression method and flag
   // 1           1     flag
   // 2           4     preset dictionary (optional)
   // 2 or 6      n     compressed data
   // n+(2 or 6)  4     Adler-32 checksum
-  TEST_AND_RETURN_FALSE(data.size() >= 6 + 4);  // Header + Footer
+  TEST_AND_RETURN_FALSE(size >= 6 + 4);  // Header + Footer
   uint16_t cmf = data[0];
   auto compression_method = cmf & 0x0F;
   // For deflate compression_method should be 8.
@@ -123,15 +587,20 @@ bool LocateDeflatesInZlib(const Buffer& data, vector<BitExtent>* deflates) {
 
   // 4 is for ADLER32.
   TEST_AND_RETURN_FALSE(LocateDeflatesInDeflateStream(
-      data.data() + header_len, data.size() - header_len - 4, header_len,
-      deflates, nullptr));
+      data + header_len, size - header_len - 4, header_len, deflates, nullptr));
   return true;
 }
 
 bool FindDeflateSubBlocks(const UniqueStreamPtr& src,
                           const vector<ByteExtent>& deflates,
                           vector<BitExtent>* subblock_deflates) {
-  Puffer puffer;
+  return FindDeflateSubBlocks(src, deflates, subblock_deflates, 1);
+}
+
+bool FindDeflateSubBlocks(const UniqueStreamPtr& src,
+                          const vector<ByteExtent>& deflates,
+                          vector<BitExtent>* subblock_deflates,
+                          size_t num_threads) {
   Buffer deflate_buffer;
   for (const auto& deflate : deflates) {
     TEST_AND_RETURN_FALSE(src->Seek(deflate.offset));
@@ -139,20 +608,12 @@ bool FindDeflateSubBlocks(const UniqueStreamPtr& src,
     deflate_buffer.resize(deflate.length);
     TEST_AND_RETURN_FALSE(src->Read(deflate_buffer.data(), deflate.length));
 
-    // Find all the subblocks.
-    BufferBitReader bit_reader(deflate_buffer.data(), deflate.length);
-    // The uncompressed blocks will be ignored since we are passing a null
-    // buffered puff writer and a valid deflate locations output array. This
-    // should not happen in the puffdiff or anywhere else by default.
-    BufferPuffWriter puff_writer(nullptr, 0);
-    vector<BitExtent> subblocks;
-    TEST_AND_RETURN_FALSE(
-        puffer.PuffDeflate(&bit_reader, &puff_writer, &subblocks));
-    TEST_AND_RETURN_FALSE(deflate.length == bit_reader.Offset());
-    for (const auto& subblock : subblocks) {
-      subblock_deflates->emplace_back(subblock.offset + deflate.offset * 8,
-                                      subblock.length);
-    }
+    // Find all the subblocks. The uncompressed blocks are ignored.
+    uint64_t compressed_size;
+    TEST_AND_RETURN_FALSE(LocateDeflatesInDeflateStream(
+        deflate_buffer.data(), deflate.length, deflate.offset,
+        subblock_deflates, &compressed_size, num_threads));
+    TEST_AND_RETURN_FALSE(deflate.length == compressed_size);
   }
   return true;
 }
@@ -160,19 +621,45 @@ bool FindDeflateSubBlocks(const UniqueStreamPtr& src,
 bool LocateDeflatesInZlibBlocks(const string& file_path,
                                 const vector<ByteExtent>& zlibs,
                                 vector<BitExtent>* deflates) {
-  auto src = FileStream::Open(file_path, true, false);
-  TEST_AND_RETURN_FALSE(src);
+  return LocateDeflatesInZlibBlocks(file_path, zlibs, deflates, 1);
+}
+
+bool LocateDeflatesInZlibBlocks(const string& file_path,
+                                const vector<ByteExtent>& zlibs,
+                                vector<BitExtent>* deflates,
+                                size_t num_threads) {
+  // The zlib blocks are independent. Each thread reads and parses blocks with
+  // its own file stream, and the results are appended in the original order.
+  vector<vector<BitExtent>> block_deflates(zlibs.size());
+  TaskQueue queue(zlibs.size());
+  num_threads = std::min(num_threads, zlibs.size());
+  TEST_AND_RETURN_FALSE(RunInParallel(num_threads, [&](size_t) {
+    auto src = FileStream::Open(file_path, true, false);
+    TEST_AND_RETURN_FALSE(src);
 
-  Buffer buffer;
-  for (const auto& zlib : zlibs) {
-    buffer.resize(zlib.length);
-    TEST_AND_RETURN_FALSE(src->Seek(zlib.offset));
-    TEST_AND_RETURN_FALSE(src->Read(buffer.data(), buffer.size()));
-    vector<BitExtent> tmp_deflates;
-    TEST_AND_RETURN_FALSE(LocateDeflatesInZlib(buffer, &tmp_deflates));
-    for (const auto& deflate : tmp_deflates) {
-      deflates->emplace_back(deflate.offset + zlib.offset * 8, deflate.length);
+    Buffer buffer;
+    size_t idx;
+    while (queue.Next(&idx)) {
+      const auto& zlib = zlibs[idx];
+      buffer.resize(zlib.length);
+      vector<BitExtent> tmp_deflates;
+      if (!src->Seek(zlib.offset) ||
+          !src->Read(buffer.data(), buffer.size()) ||
+          !LocateDeflatesInZlib(buffer, &tmp_deflates)) {
+        LOG(ERROR) << "Failed to locate the deflates in zlib block " << idx;
+        queue.Cancel();
+        return false;
+      }
+      for (const auto& deflate : tmp_deflates) {
+        block_deflates[idx].emplace_back(deflate.offset + zlib.offset * 8,
+                                         deflate.length);
+      }
     }
+    return true;
+  }));
+
+  for (const auto& block : block_deflates) {
+    deflates->insert(deflates->end(), block.begin(), block.end());
   }
   return true;
 }
@@ -188,198 +675,2387 @@ bool IsValidGzipHeader(const uint8_t* header, size_t size) {
   static constexpr uint8_t magic[] = {0x1F, 0x8B, 8};
   return size >= 10 && std::equal(std::begin(magic), std::end(magic), header);
 }
-}  // namespace
 
-bool LocateDeflatesInGzip(const Buffer& data, vector<BitExtent>* deflates) {
-  TEST_AND_RETURN_FALSE(IsValidGzipHeader(data.data(), data.size()));
-  uint64_t member_start = 0;
-  do {
-    // After the magic header, the gzip contains:
-    // 3      1     set of flags
-    // 4      4     modification time
-    // 8      1     extra flags
-    // 9      1     operating system
-
-    uint64_t offset = member_start + 10;
-    int flag = data[member_start + 3];
-    // Extra field
-    if (flag & 4) {
-      TEST_AND_RETURN_FALSE(offset + 2 <= data.size());
-      uint16_t extra_length = data[offset++];
-      extra_length |= static_cast<uint16_t>(data[offset++]) << 8;
-      TEST_AND_RETURN_FALSE(offset + extra_length <= data.size());
-      offset += extra_length;
-    }
-    // File name field
-    if (flag & 8) {
-      while (true) {
-        TEST_AND_RETURN_FALSE(offset + 1 <= data.size());
-        if (data[offset++] == 0) {
-          break;
-        }
+// Parses the header of the gzip member starting at |member_start| and sets
+// |data_offset| to the start of its compressed data.
+bool ReadGzipMemberHeader(const uint8_t* data,
+                          uint64_t size,
+                          uint64_t member_start,
+                          uint64_t* data_offset) {
+  // After the magic header, the gzip contains:
+  // 3      1     set of flags
+  // 4      4     modification time
+  // 8      1     extra flags
+  // 9      1     operating system
+
+  uint64_t offset = member_start + 10;
+  int flag = data[member_start + 3];
+  // Extra field
+  if (flag & 4) {
+    TEST_AND_RETURN_FALSE(offset + 2 <= size);
+    uint16_t extra_length = data[offset++];
+    extra_length |= static_cast<uint16_t>(data[offset++]) << 8;
+    TEST_AND_RETURN_FALSE(offset + extra_length <= size);
+    offset += extra_length;
+  }
+  // File name field
+  if (flag & 8) {
+    while (true) {
+      TEST_AND_RETURN_FALSE(offset + 1 <= size);
+      if (data[offset++] == 0) {
+        break;
       }
     }
-    // File comment field
-    if (flag & 16) {
-      while (true) {
-        TEST_AND_RETURN_FALSE(offset + 1 <= data.size());
-        if (data[offset++] == 0) {
-          break;
-        }
+  }
+  // File comment field
+  if (flag & 16) {
+    while (true) {
+      TEST_AND_RETURN_FALSE(offset + 1 <= size);
+      if (data[offset++] == 0) {
+        break;
       }
     }
-    // CRC16 field
-    if (flag & 2) {
-      offset += 2;
-    }
+  }
+  // CRC16 field
+  if (flag & 2) {
+    offset += 2;
+  }
+  TEST_AND_RETURN_FALSE(offset <= size);
+  *data_offset = offset;
+  return true;
+}
 
-    uint64_t compressed_size = 0;
-    TEST_AND_RETURN_FALSE(LocateDeflatesInDeflateStream(
-        data.data() + offset, data.size() - offset, offset, deflates,
-        &compressed_size));
-    offset += compressed_size;
-
-    // Ignore CRC32 and uncompressed size.
-    offset += 8;
-    member_start = offset;
-  } while (member_start < data.size() &&
-           IsValidGzipHeader(&data[member_start], data.size() - member_start));
+// Locates the deflates of the gzip member starting at |member_start| using up
+// to |num_threads| threads and appends them to |deflates|. |member_end| is set
+// to the offset right after the member.
+bool LocateDeflatesInGzipMember(const uint8_t* data,
+                                uint64_t size,
+                                uint64_t member_start,
+                                vector<BitExtent>* deflates,
+                                uint64_t* member_end,
+                                size_t num_threads) {
+  uint64_t offset;
+  TEST_AND_RETURN_FALSE(
+      ReadGzipMemberHeader(data, size, member_start, &offset));
+
+  uint64_t compressed_size = 0;
+  TEST_AND_RETURN_FALSE(LocateDeflatesInDeflateStream(
+      data + offset, size - offset, offset, deflates, &compressed_size,
+      num_threads));
+  offset += compressed_size;
+
+  // Ignore CRC32 and uncompressed size.
+  offset += 8;
+  *member_end = offset;
   return true;
 }
 
-// For more information about the zip format, refer to
-// https://support.pkware.com/display/PKZIP/APPNOTE
-bool LocateDeflatesInZipArchive(const Buffer& data,
-                                vector<BitExtent>* deflates) {
-  uint64_t pos = 0;
-  while (pos + 30 <= data.size()) {
-    // TODO(xunchang) add support for big endian system when searching for
-    // magic numbers.
-    if (get_unaligned<uint32_t>(data.data() + pos) != 0x04034b50) {
-      pos++;
-      continue;
+// BGZF (blocked gzip, see the SAM/BAM format specification) is a series of
+// gzip members, each with the size of the member in the BC subfield of its
+// extra field. Returns the size of the member at |member_start| from this
+// subfield, or zero if it does not have one.
+uint64_t GetBgzfMemberSize(const uint8_t* data,
+                           uint64_t size,
+                           uint64_t member_start) {
+  constexpr uint8_t kFlagExtra = 4;
+  auto header = data + member_start;
+  if (!(header[3] & kFlagExtra) || size - member_start < 12) {
+    return 0;
+  }
+  uint64_t extra_length = header[10] | (header[11] << 8);
+  if (size - member_start - 12 < extra_length) {
+    return 0;
+  }
+  // Each subfield has two ID bytes, a 2 byte length and the data.
+  auto extra = header + 12;
+  for (uint64_t offset = 0; offset + 4 <= extra_length;) {
+    uint64_t length = extra[offset + 2] | (extra[offset + 3] << 8);
+    if (extra[offset] == 'B' && extra[offset + 1] == 'C' && length == 2 &&
+        offset + 6 <= extra_length) {
+      // The stored value is the member size minus one.
+      return (extra[offset + 4] | (extra[offset + 5] << 8)) + 1;
     }
+    offset += 4 + length;
+  }
+  return 0;
+}
 
-    // local file header format
-    // 0      4     0x04034b50
-    // 4      2     minimum version needed to extract
-    // 6      2     general purpose bit flag
-    // 8      2     compression method
-    // 10     4     file last modification date & time
-    // 14     4     CRC-32
-    // 18     4     compressed size
-    // 22     4     uncompressed size
-    // 26     2     file name length
-    // 28     2     extra field length
-    // 30     n     file name
-    // 30+n   m     extra field
-    auto compression_method = get_unaligned<uint16_t>(data.data() + pos + 8);
-    if (compression_method != 8) {  // non-deflate type
-      pos += 4;
-      continue;
+// Finds the members of |data| if it is a BGZF file, without decompressing
+// them. Returns false if any of the members is not a BGZF member.
+bool FindBgzfMembers(const uint8_t* data,
+                     uint64_t size,
+                     vector<ByteExtent>* members) {
+  uint64_t member_start = 0;
+  do {
+    auto member_size = GetBgzfMemberSize(data, size, member_start);
+    if (member_size == 0 || member_size > size - member_start) {
+      return false;
     }
+    members->emplace_back(member_start, member_size);
+    member_start += member_size;
+  } while (member_start < size &&
+           IsValidGzipHeader(data + member_start, size - member_start));
+  return true;
+}
 
-    auto compressed_size = get_unaligned<uint32_t>(data.data() + pos + 18);
-    auto file_name_length = get_unaligned<uint16_t>(data.data() + pos + 26);
-    auto extra_field_length = get_unaligned<uint16_t>(data.data() + pos + 28);
-    uint64_t header_size = 30 + file_name_length + extra_field_length;
+// Locates the deflates of the members of a BGZF file in parallel.
+bool LocateDeflatesInBgzfMembers(const uint8_t* data,
+                                 const vector<ByteExtent>& members,
+                                 vector<BitExtent>* deflates,
+                                 size_t num_threads) {
+  vector<vector<BitExtent>> member_deflates(members.size());
+  TEST_AND_RETURN_FALSE(
+      ParallelFor(members.size(), num_threads, [&](size_t idx) {
+        const auto& member = members[idx];
+        // Parse each member as if the data ended with it, and check its size.
+        uint64_t member_end;
+        return LocateDeflatesInGzipMember(data, member.offset + member.length,
+                                          member.offset, &member_deflates[idx],
+                                          &member_end, 1) &&
+               member_end == member.offset + member.length;
+      }));
+  for (const auto& member : member_deflates) {
+    deflates->insert(deflates->end(), member.begin(), member.end());
+  }
+  return true;
+}
 
-    // sanity check
-    if (static_cast<uint64_t>(header_size) + compressed_size > data.size() ||
-        pos > data.size() - header_size - compressed_size) {
-      pos += 4;
-      continue;
+bool LocateDeflatesInGzipData(const uint8_t* data,
+                              uint64_t size,
+                              vector<BitExtent>* deflates,
+                              size_t num_threads) {
+  TEST_AND_RETURN_FALSE(IsValidGzipHeader(data, size));
+  // The members of a BGZF file are found from their headers alone, so they
+  // can be parsed in parallel right away.
+  vector<ByteExtent> bgzf_members;
+  if (FindBgzfMembers(data, size, &bgzf_members)) {
+    auto deflates_size = deflates->size();
+    if (LocateDeflatesInBgzfMembers(data, bgzf_members, deflates,
+                                    num_threads)) {
+      return true;
     }
+    LOG(WARNING) << "The member sizes of the BGZF file are wrong, parsing it "
+                 << "as a regular gzip file.";
+    deflates->erase(deflates->begin() + deflates_size, deflates->end());
+  }
 
-    vector<BitExtent> tmp_deflates;
-    uint64_t offset = pos + header_size;
-    uint64_t calculated_compressed_size = 0;
-    if (!LocateDeflatesInDeflateStream(
-            data.data() + offset, data.size() - offset, offset, &tmp_deflates,
-            &calculated_compressed_size)) {
-      LOG(ERROR) << "Failed to decompress the zip entry starting from: " << pos
-                 << ", skip adding deflates for this entry.";
-      pos += 4;
-      continue;
-    }
+  if (num_threads <= 1) {
+    uint64_t member_start = 0;
+    do {
+      TEST_AND_RETURN_FALSE(LocateDeflatesInGzipMember(
+          data, size, member_start, deflates, &member_start, 1));
+    } while (member_start < size &&
+             IsValidGzipHeader(data + member_start, size - member_start));
+    return true;
+  }
 
-    // Double check the compressed size if it is available in the file header.
-    if (compressed_size > 0 && compressed_size != calculated_compressed_size) {
-      LOG(WARNING) << "Compressed size in the file header: " << compressed_size
-                   << " doesn't equal the real size: "
-                   << calculated_compressed_size;
-    }
+  // Many gzip files have a single large member, so the first member is parsed
+  // on its own using all the threads.
+  uint64_t member_start;
+  TEST_AND_RETURN_FALSE(LocateDeflatesInGzipMember(
+      data, size, 0, deflates, &member_start, num_threads));
+  if (member_start >= size ||
+      !IsValidGzipHeader(data + member_start, size - member_start)) {
+    return true;
+  }
 
-    deflates->insert(deflates->end(), tmp_deflates.begin(), tmp_deflates.end());
-    pos += header_size + calculated_compressed_size;
+  // Where a member ends (and hence the next one starts) is only known after
+  // parsing it. So every offset that looks like a gzip header is parsed
+  // speculatively in parallel, and then the members are chained starting from
+  // the second one, exactly the same way as the sequential parsing does.
+  // Candidates that are not reached by the chain are dropped.
+  vector<uint64_t> candidates;
+  for (uint64_t pos = member_start; pos < size; pos++) {
+    if (IsValidGzipHeader(data + pos, size - pos)) {
+      candidates.push_back(pos);
+    }
   }
+  struct Member {
+    bool valid = false;
+    vector<BitExtent> deflates;
+    uint64_t end = 0;
+  };
+  // A member normally ends where the next candidate starts, so each candidate
+  // is only parsed up to there. This way the speculative parsing reads every
+  // byte once, however many candidates the data has. A member that contains a
+  // candidate by chance fails here and is parsed again in the chain.
+  vector<Member> members(candidates.size());
+  TEST_AND_RETURN_FALSE(
+      ParallelFor(candidates.size(), num_threads, [&](size_t idx) {
+        auto& member = members[idx];
+        auto limit =
+            idx + 1 < candidates.size() ? candidates[idx + 1] : size;
+        member.valid =
+            LocateDeflatesInGzipMember(data, limit, candidates[idx],
+                                       &member.deflates, &member.end, 1) &&
+            member.end <= limit;
+        // A failure here is not an error unless the member is in the chain.
+        return true;
+      }));
 
+  // The members of the chain do not overlap, so parsing them again reads
+  // every byte at most once more.
+  auto candidate = candidates.begin();
+  do {
+    candidate = std::lower_bound(candidate, candidates.end(), member_start);
+    TEST_AND_RETURN_FALSE(candidate != candidates.end() &&
+                          *candidate == member_start);
+    const auto& member = members[candidate - candidates.begin()];
+    if (member.valid) {
+      deflates->insert(deflates->end(), member.deflates.begin(),
+                       member.deflates.end());
+      member_start = member.end;
+    } else {
+      TEST_AND_RETURN_FALSE(LocateDeflatesInGzipMember(
+          data, size, member_start, deflates, &member_start, num_threads));
+    }
+  } while (member_start < size &&
+           IsValidGzipHeader(data + member_start, size - member_start));
   return true;
 }
 
-bool FindPuffLocations(const UniqueStreamPtr& src,
-                       const vector<BitExtent>& deflates,
-                       vector<ByteExtent>* puffs,
-                       uint64_t* out_puff_size) {
-  Puffer puffer;
-  Buffer deflate_buffer;
+}  // namespace
 
-  // Here accumulate the size difference between each corresponding deflate and
-  // puff. At the end we add this cummulative size difference to the size of the
-  // deflate stream to get the size of the puff stream. We use signed size
-  // because puff size could be smaller than deflate size.
-  int64_t total_size_difference = 0;
-  for (auto deflate = deflates.begin(); deflate != deflates.end(); ++deflate) {
-    // Read from src into deflate_buffer.
-    auto start_byte = deflate->offset / 8;
-    auto end_byte = (deflate->offset + deflate->length + 7) / 8;
-    deflate_buffer.resize(end_byte - start_byte);
-    TEST_AND_RETURN_FALSE(src->Seek(start_byte));
-    TEST_AND_RETURN_FALSE(
-        src->Read(deflate_buffer.data(), deflate_buffer.size()));
-    // Find the size of the puff.
-    BufferBitReader bit_reader(deflate_buffer.data(), deflate_buffer.size());
-    uint64_t bits_to_skip = deflate->offset % 8;
-    TEST_AND_RETURN_FALSE(bit_reader.CacheBits(bits_to_skip));
-    bit_reader.DropBits(bits_to_skip);
+bool LocateDeflatesInGzip(const Buffer& data, vector<BitExtent>* deflates) {
+  return LocateDeflatesInGzip(data, deflates, 1);
+}
 
-    BufferPuffWriter puff_writer(nullptr, 0);
-    TEST_AND_RETURN_FALSE(
-        puffer.PuffDeflate(&bit_reader, &puff_writer, nullptr));
-    TEST_AND_RETURN_FALSE(deflate_buffer.size() == bit_reader.Offset());
+bool LocateDeflatesInGzip(const Buffer& data,
+                          vector<BitExtent>* deflates,
+                          size_t num_threads) {
+  return LocateDeflatesInGzipData(data.data(), data.size(), deflates,
+                                  num_threads);
+}
 
-    // 1 if a deflate ends at the same byte that the next deflate starts and
-    // there is a few bits gap between them. In practice this may never happen,
-    // but it is a good idea to support it anyways. If there is a gap, the value
-    // of the gap will be saved as an integer byte to the puff stream. The parts
-    // of the byte that belogs to the deflates are shifted out.
-    int gap = 0;
-    if (deflate != deflates.begin()) {
-      auto prev_deflate = std::prev(deflate);
-      if ((prev_deflate->offset + prev_deflate->length == deflate->offset)
-          // If deflates are on byte boundary the gap will not be counted later,
-          // so we won't worry about it.
-          && (deflate->offset % 8 != 0)) {
-        gap = 1;
-      }
-    }
+bool LocateDeflatesInGzip(const uint8_t* data,
+                          uint64_t size,
+                          vector<BitExtent>* deflates,
+                          size_t num_threads) {
+  return LocateDeflatesInGzipData(data, size, deflates, num_threads);
+}
 
-    start_byte = ((deflate->offset + 7) / 8);
-    end_byte = (deflate->offset + deflate->length) / 8;
-    int64_t deflate_length_in_bytes = end_byte - start_byte;
+namespace {
+// For more information about the PNG format, refer to
+// https://www.w3.org/TR/png/
+constexpr uint8_t kPngSignature[] = {0x89, 'P',  'N',  'G',
+                                     '\r', '\n', 0x1A, '\n'};
+constexpr uint32_t kPngIdatChunkType = 0x49444154;  // "IDAT"
+constexpr uint32_t kPngIendChunkType = 0x49454E44;  // "IEND"
 
-    // If there was no gap bits between the current and previous deflates, there
-    // will be no extra gap byte, so the offset will be shifted one byte back.
-    auto puff_offset = start_byte - gap + total_size_difference;
-    auto puff_size = puff_writer.Size();
-    // Add the location into puff.
-    puffs->emplace_back(puff_offset, puff_size);
-    total_size_difference +=
-        static_cast<int64_t>(puff_size) - deflate_length_in_bytes - gap;
+inline uint32_t ReadBigEndian32(const uint8_t* data) {
+  return (static_cast<uint32_t>(data[0]) << 24) | (data[1] << 16) |
+         (data[2] << 8) | data[3];
+}
+
+bool IsPngSignature(const uint8_t* data, uint64_t size) {
+  return size >= sizeof(kPngSignature) &&
+         memcmp(data, kPngSignature, sizeof(kPngSignature)) == 0;
+}
+
+bool LocateDeflatesInPngData(const uint8_t* data,
+                             uint64_t size,
+                             vector<BitExtent>* deflates) {
+  TEST_AND_RETURN_FALSE(IsPngSignature(data, size));
+  // The image data is one zlib stream split across the data of the IDAT
+  // chunks. Collect the chunks and concatenate their data.
+  vector<ByteExtent> chunks;
+  Buffer stream;
+  for (uint64_t offset = sizeof(kPngSignature);;) {
+    // Length, type, data and CRC.
+    TEST_AND_RETURN_FALSE(size - offset >= 12);
+    uint64_t length = ReadBigEndian32(data + offset);
+    auto type = ReadBigEndian32(data + offset + 4);
+    TEST_AND_RETURN_FALSE(length <= size - offset - 12);
+    if (type == kPngIdatChunkType) {
+      chunks.emplace_back(offset + 8, length);
+      stream.insert(stream.end(), data + offset + 8,
+                    data + offset + 8 + length);
+    } else if (type == kPngIendChunkType) {
+      break;
+    }
+    offset += 12 + length;
   }
 
-  uint64_t src_size;
-  TEST_AND_RETURN_FALSE(src->GetSize(&src_size));
+  vector<BitExtent> stream_deflates;
+  TEST_AND_RETURN_FALSE(LocateDeflatesInZlib(stream, &stream_deflates));
+  // Map the deflates back to the file. Puffing a deflate does not need the data
+  // before it, but it has to be contiguous in the file, so the ones crossing
+  // the boundary of two chunks are dropped. The image data is usually in a
+  // single chunk, or in chunks much larger than a deflate.
+  auto chunk = chunks.begin();
+  uint64_t chunk_start = 0;
+  for (const auto& deflate : stream_deflates) {
+    while (chunk_start + chunk->length <= deflate.offset / 8) {
+      chunk_start += chunk->length;
+      chunk++;
+    }
+    if (deflate.offset + deflate.length <= (chunk_start + chunk->length) * 8) {
+      deflates->emplace_back(deflate.offset + (chunk->offset - chunk_start) * 8,
+                             deflate.length);
+    }
+  }
+  return true;
+}
+
+// For more information about the PDF format, refer to ISO 32000-1, section
+// 7.3.8 "Stream Objects".
+constexpr char kPdfSignature[] = "%PDF-";
+// Dictionaries longer than this are not searched for, as they are only
+// expected to have a few entries.
+constexpr uint64_t kMaxPdfDictionarySize = 64 * 1024;
+
+bool IsPdfSignature(const uint8_t* data, uint64_t size) {
+  return size >= 5 && memcmp(data, kPdfSignature, 5) == 0;
+}
+
+inline bool IsPdfWhitespace(uint8_t byte) {
+  return byte == ' ' || byte == '\n' || byte == '\r' || byte == '\t' ||
+         byte == '\f' || byte == '\0';
+}
+
+inline bool IsPdfDigit(uint8_t byte) {
+  return byte >= '0' && byte <= '9';
+}
+
+// Returns the offset of the first |keyword| in [|begin|, |end|) of |data|, or
+// |end| if there is none.
+uint64_t FindPdfKeyword(const uint8_t* data,
+                        uint64_t begin,
+                        uint64_t end,
+                        const char* keyword) {
+  auto length = strlen(keyword);
+  return std::search(data + begin, data + end, keyword, keyword + length) -
+         data;
+}
+
+// Returns the offset of the value of the |key| name in the dictionary at
+// [|begin|, |end|) of |data|, or |end| if it is not there.
+uint64_t FindPdfDictionaryValue(const uint8_t* data,
+                                uint64_t begin,
+                                uint64_t end,
+                                const char* key) {
+  auto length = strlen(key);
+  for (auto pos = FindPdfKeyword(data, begin, end, key); pos < end;
+       pos = FindPdfKeyword(data, pos + 1, end, key)) {
+    // Skip the longer names that start with |key|, e.g. /Length1.
+    auto value = pos + length;
+    if (value < end && (isalnum(data[value]) || data[value] == '_')) {
+      continue;
+    }
+    while (value < end && IsPdfWhitespace(data[value])) {
+      value++;
+    }
+    return value;
+  }
+  return end;
+}
+
+// Checks whether the stream dictionary at [|begin|, |end|) of |data| says the
+// stream is only compressed with FlateDecode, or FlateDecode is applied last
+// when it was encoded. If the stream length is given directly, it is set in
+// |length|, otherwise |length| is zero.
+bool IsPdfFlateStream(const uint8_t* data,
+                      uint64_t begin,
+                      uint64_t end,
+                      uint64_t* length) {
+  static const char kFlateDecode[] = "/FlateDecode";
+  auto filter = FindPdfDictionaryValue(data, begin, end, "/Filter");
+  if (filter < end && data[filter] == '[') {
+    filter++;
+    while (filter < end && IsPdfWhitespace(data[filter])) {
+      filter++;
+    }
+  }
+  auto flate_decode_end = filter + strlen(kFlateDecode);
+  if (flate_decode_end > end ||
+      memcmp(data + filter, kFlateDecode, strlen(kFlateDecode)) != 0 ||
+      isalnum(data[flate_decode_end])) {
+    return false;
+  }
+
+  // The length can be an indirect reference to an object, "<n> <g> R", which
+  // is not resolved.
+  *length = 0;
+  auto pos = FindPdfDictionaryValue(data, begin, end, "/Length");
+  uint64_t value = 0;
+  for (; pos < end && IsPdfDigit(data[pos]) && value < (1ULL << 48); pos++) {
+    value = value * 10 + (data[pos] - '0');
+  }
+  while (pos < end && IsPdfWhitespace(data[pos])) {
+    pos++;
+  }
+  if (pos < end && !IsPdfDigit(data[pos])) {
+    *length = value;
+  }
+  return true;
+}
+
+// Finds the data of the streams of |data| that are compressed with
+// FlateDecode and puts them in |streams|.
+void FindPdfFlateStreams(const uint8_t* data,
+                         uint64_t size,
+                         vector<ByteExtent>* streams) {
+  static const char kStream[] = "stream";
+  static const char kEndStream[] = "endstream";
+  for (auto pos = FindPdfKeyword(data, 0, size, kStream); pos < size;
+       pos = FindPdfKeyword(data, pos, size, kStream)) {
+    auto keyword = pos;
+    pos += strlen(kStream);
+    // The keyword is followed by CRLF or LF, and preceded by the stream
+    // dictionary. The "stream" in "endstream" fails this check as well.
+    uint64_t start;
+    if (pos < size && data[pos] == '\n') {
+      start = pos + 1;
+    } else if (size - pos >= 2 && data[pos] == '\r' && data[pos + 1] == '\n') {
+      start = pos + 2;
+    } else {
+      continue;
+    }
+    auto dict_end = keyword;
+    while (dict_end > 0 && IsPdfWhitespace(data[dict_end - 1])) {
+      dict_end--;
+    }
+    if (dict_end < 2 || data[dict_end - 1] != '>' ||
+        data[dict_end - 2] != '>') {
+      continue;
+    }
+    // Find the matching "<<" of the stream dictionary, as it can have nested
+    // dictionaries.
+    auto limit = dict_end > kMaxPdfDictionarySize
+                     ? dict_end - kMaxPdfDictionarySize
+                     : 0;
+    uint64_t dict_begin = dict_end - 2;
+    size_t depth = 1;
+    while (depth > 0 && dict_begin >= limit + 2) {
+      dict_begin--;
+      if (data[dict_begin] == '>' && data[dict_begin - 1] == '>') {
+        depth++;
+        dict_begin--;
+      } else if (data[dict_begin] == '<' && data[dict_begin - 1] == '<') {
+        depth--;
+        dict_begin--;
+      }
+    }
+    uint64_t length;
+    if (depth > 0 || !IsPdfFlateStream(data, dict_begin, dict_end, &length)) {
+      continue;
+    }
+
+    // Use the "endstream" keyword if the length is not known. Either way, the
+    // stream data is skipped, as it can contain the keywords by chance.
+    if (length == 0 || length > size - start) {
+      length = FindPdfKeyword(data, start, size, kEndStream) - start;
+      if (start + length == size) {
+        continue;
+      }
+    }
+    streams->emplace_back(start, length);
+    pos = start + length;
+  }
+}
+
+// Locates the deflates of the zlib streams at |zlibs| of |data|. The streams
+// are independent, so they are searched in parallel and the results are
+// appended in the original order. Streams that fail to decompress are skipped.
+// |zlibs| must be sorted. Streams that overlap a previous one are skipped as
+// well, so every byte is decoded at most once.
+bool LocateDeflatesInZlibStreams(const uint8_t* data,
+                                 const vector<ByteExtent>& zlibs,
+                                 vector<BitExtent>* deflates,
+                                 size_t num_threads) {
+  vector<uint8_t> overlaps(zlibs.size(), 0);
+  uint64_t end = 0;
+  for (size_t idx = 0; idx < zlibs.size(); idx++) {
+    if (zlibs[idx].offset < end) {
+      LOG(WARNING) << "The zlib stream at offset " << zlibs[idx].offset
+                   << " overlaps a previous one, skipping it.";
+      overlaps[idx] = 1;
+    } else {
+      end = zlibs[idx].offset + zlibs[idx].length;
+    }
+  }
+  vector<vector<BitExtent>> zlib_deflates(zlibs.size());
+  TEST_AND_RETURN_FALSE(
+      ParallelFor(zlibs.size(), num_threads, [&](size_t idx) {
+        const auto& zlib = zlibs[idx];
+        vector<BitExtent> tmp_deflates;
+        if (overlaps[idx]) {
+          return true;
+        }
+        if (!LocateDeflatesInZlib(data + zlib.offset, zlib.length,
+                                  &tmp_deflates)) {
+          LOG(WARNING) << "Failed to locate the deflates in the zlib stream at "
+                       << "offset " << zlib.offset << ", skipping it.";
+          return true;
+        }
+        for (const auto& deflate : tmp_deflates) {
+          zlib_deflates[idx].emplace_back(deflate.offset + zlib.offset * 8,
+                                          deflate.length);
+        }
+        return true;
+      }));
+  for (const auto& zlib : zlib_deflates) {
+    deflates->insert(deflates->end(), zlib.begin(), zlib.end());
+  }
+  return true;
+}
+
+bool LocateDeflatesInPdfData(const uint8_t* data,
+                             uint64_t size,
+                             vector<BitExtent>* deflates,
+                             size_t num_threads) {
+  TEST_AND_RETURN_FALSE(IsPdfSignature(data, size));
+  vector<ByteExtent> streams;
+  FindPdfFlateStreams(data, size, &streams);
+  // The streams of encrypted documents do not decompress.
+  return LocateDeflatesInZlibStreams(data, streams, deflates, num_threads);
+}
+
+// For more information about the ELF format, refer to
+// https://refspecs.linuxfoundation.org/elf/gabi4+/ch4.sheader.html
+constexpr uint8_t kElfMagic[] = {0x7F, 'E', 'L', 'F'};
+constexpr uint8_t kElfClass32 = 1;
+constexpr uint8_t kElfClass64 = 2;
+constexpr uint8_t kElfDataLittleEndian = 1;
+constexpr uint8_t kElfDataBigEndian = 2;
+constexpr uint32_t kElfSectionNoBits = 8;
+constexpr uint64_t kElfSectionCompressed = 0x800;
+constexpr uint32_t kElfCompressZlib = 1;
+constexpr uint64_t kElfExtendedSectionIndex = 0xFFFF;
+// The legacy compressed debug sections start with "ZLIB" and the big endian
+// 64 bit uncompressed size.
+constexpr char kElfZdebugPrefix[] = ".zdebug";
+constexpr char kElfZdebugMagic[] = "ZLIB";
+constexpr uint64_t kElfZdebugHeaderSize = 12;
+
+bool IsElfSignature(const uint8_t* data, uint64_t size) {
+  return size >= sizeof(kElfMagic) &&
+         memcmp(data, kElfMagic, sizeof(kElfMagic)) == 0;
+}
+
+// Reads the unsigned field of |length| bytes at |data| in the given byte
+// order.
+uint64_t ReadElfField(const uint8_t* data, size_t length, bool big_endian) {
+  uint64_t value = 0;
+  for (size_t idx = 0; idx < length; idx++) {
+    value = (value << 8) | data[big_endian ? idx : length - 1 - idx];
+  }
+  return value;
+}
+
+// Finds the zlib streams in the sections of the ELF file in |data| and puts
+// them in |zlibs|, sorted by their offset. These are the sections compressed
+// with ELFCOMPRESS_ZLIB, and the legacy .zdebug sections.
+bool FindElfZlibSections(const uint8_t* data,
+                         uint64_t size,
+                         vector<ByteExtent>* zlibs) {
+  TEST_AND_RETURN_FALSE(IsElfSignature(data, size) && size >= 6);
+  auto elf_class = data[4];
+  auto encoding = data[5];
+  TEST_AND_RETURN_FALSE(elf_class == kElfClass32 || elf_class == kElfClass64);
+  TEST_AND_RETURN_FALSE(encoding == kElfDataLittleEndian ||
+                        encoding == kElfDataBigEndian);
+  bool is_64 = elf_class == kElfClass64;
+  auto read = [data, encoding](uint64_t offset, size_t length) {
+    return ReadElfField(data + offset, length, encoding == kElfDataBigEndian);
+  };
+  // The word size dependent fields of the file header and the section header.
+  size_t word_size = is_64 ? 8 : 4;
+  uint64_t header_size = is_64 ? 64 : 52;
+  uint64_t min_section_header_size = is_64 ? 64 : 40;
+  uint64_t compression_header_size = is_64 ? 24 : 12;
+  TEST_AND_RETURN_FALSE(size >= header_size);
+  auto section_headers = read(is_64 ? 40 : 32, word_size);
+  auto section_header_size = read(is_64 ? 58 : 46, 2);
+  uint64_t num_sections = read(is_64 ? 60 : 48, 2);
+  uint64_t names_index = read(is_64 ? 62 : 50, 2);
+  if (section_headers == 0) {
+    // There are no sections.
+    return true;
+  }
+  TEST_AND_RETURN_FALSE(section_header_size >= min_section_header_size);
+  TEST_AND_RETURN_FALSE(section_headers <= size &&
+                        size - section_headers >= section_header_size);
+
+  struct Section {
+    uint64_t name;
+    uint64_t type;
+    uint64_t flags;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t link;
+  };
+  auto read_section = [&](uint64_t idx) {
+    auto header = section_headers + idx * section_header_size;
+    Section section;
+    section.name = read(header, 4);
+    section.type = read(header + 4, 4);
+    section.flags = read(header + 8, word_size);
+    section.offset = read(header + 8 + 2 * word_size, word_size);
+    section.size = read(header + 8 + 3 * word_size, word_size);
+    section.link = read(header + 8 + 4 * word_size, 4);
+    return section;
+  };
+  // With too many sections, the number of sections and the index of the
+  // section name table are in the first section header instead.
+  auto first_section = read_section(0);
+  if (num_sections == 0) {
+    num_sections = first_section.size;
+  }
+  if (names_index == kElfExtendedSectionIndex) {
+    names_index = first_section.link;
+  }
+  TEST_AND_RETURN_FALSE((size - section_headers) / section_header_size >=
+                        num_sections);
+  TEST_AND_RETURN_FALSE(names_index < num_sections);
+  auto names = read_section(names_index);
+  TEST_AND_RETURN_FALSE(names.offset <= size &&
+                        names.size <= size - names.offset);
+
+  auto prefix_length = strlen(kElfZdebugPrefix);
+  for (uint64_t idx = 1; idx < num_sections; idx++) {
+    auto section = read_section(idx);
+    if (section.type == kElfSectionNoBits || section.size == 0) {
+      continue;
+    }
+    TEST_AND_RETURN_FALSE(section.offset <= size &&
+                          section.size <= size - section.offset);
+    auto section_data = data + section.offset;
+    if (section.flags & kElfSectionCompressed) {
+      // Other compression types (e.g. zstd) are ignored.
+      if (section.size > compression_header_size &&
+          read(section.offset, 4) == kElfCompressZlib) {
+        zlibs->emplace_back(section.offset + compression_header_size,
+                            section.size - compression_header_size);
+      }
+    } else if (section.name < names.size &&
+               names.size - section.name >= prefix_length &&
+               memcmp(data + names.offset + section.name, kElfZdebugPrefix,
+                      prefix_length) == 0 &&
+               section.size > kElfZdebugHeaderSize &&
+               memcmp(section_data, kElfZdebugMagic, 4) == 0) {
+      zlibs->emplace_back(section.offset + kElfZdebugHeaderSize,
+                          section.size - kElfZdebugHeaderSize);
+    }
+  }
+  std::sort(zlibs->begin(), zlibs->end());
+  return true;
+}
+
+bool LocateDeflatesInElfData(const uint8_t* data,
+                             uint64_t size,
+                             vector<BitExtent>* deflates,
+                             size_t num_threads) {
+  vector<ByteExtent> zlibs;
+  TEST_AND_RETURN_FALSE(FindElfZlibSections(data, size, &zlibs));
+  return LocateDeflatesInZlibStreams(data, zlibs, deflates, num_threads);
+}
+
+}  // namespace
+
+bool LocateDeflatesInPng(const Buffer& data, vector<BitExtent>* deflates) {
+  return LocateDeflatesInPngData(data.data(), data.size(), deflates);
+}
+
+bool LocateDeflatesInPng(const uint8_t* data,
+                         uint64_t size,
+                         vector<BitExtent>* deflates) {
+  return LocateDeflatesInPngData(data, size, deflates);
+}
+
+bool LocateDeflatesInPdf(const Buffer& data,
+                         vector<BitExtent>* deflates,
+                         size_t num_threads) {
+  return LocateDeflatesInPdfData(data.data(), data.size(), deflates,
+                                 num_threads);
+}
+
+bool LocateDeflatesInPdf(const uint8_t* data,
+                         uint64_t size,
+                         vector<BitExtent>* deflates,
+                         size_t num_threads) {
+  return LocateDeflatesInPdfData(data, size, deflates, num_threads);
+}
+
+bool LocateDeflatesInElf(const Buffer& data,
+                         vector<BitExtent>* deflates,
+                         size_t num_threads) {
+  return LocateDeflatesInElfData(data.data(), data.size(), deflates,
+                                 num_threads);
+}
+
+bool LocateDeflatesInElf(const uint8_t* data,
+                         uint64_t size,
+                         vector<BitExtent>* deflates,
+                         size_t num_threads) {
+  return LocateDeflatesInElfData(data, size, deflates, num_threads);
+}
+
+namespace {
+// For more information about the zip format, refer to
+// https://support.pkware.com/display/PKZIP/APPNOTE
+constexpr uint32_t kLocalFileHeaderSignature = 0x04034b50;
+constexpr uint32_t kCentralDirectorySignature = 0x02014b50;
+constexpr uint32_t kEndOfCentralDirectorySignature = 0x06054b50;
+constexpr uint32_t kZip64EndOfCentralDirectorySignature = 0x06064b50;
+constexpr uint32_t kZip64EndOfCentralDirectoryLocatorSignature = 0x07064b50;
+constexpr uint64_t kLocalFileHeaderSize = 30;
+constexpr uint64_t kCentralDirectoryHeaderSize = 46;
+constexpr uint64_t kEndOfCentralDirectorySize = 22;
+constexpr uint64_t kZip64EndOfCentralDirectorySize = 56;
+constexpr uint64_t kZip64EndOfCentralDirectoryLocatorSize = 20;
+constexpr uint16_t kZip64ExtraFieldId = 0x0001;
+
+// A deflate compressed zip entry, and the result of decompressing its data.
+struct ZipEntry {
+  // The offset of the local file header.
+  uint64_t pos;
+  uint64_t header_size;
+  // The compressed size in the header, or zero if it is not known.
+  uint64_t compressed_size;
+  // The end of the data that the entry can use. For the entries found in the
+  // central directory, the compressed data ends exactly here.
+  uint64_t limit;
+  bool decoded = false;
+  bool valid = false;
+  vector<BitExtent> deflates;
+  uint64_t calculated_compressed_size = 0;
+};
+
+// Searches [|begin|, |end|) of |data| for anything that looks like a local
+// file header of a deflate compressed entry and appends them to |entries|.
+void ScanZipLocalFileHeaders(const uint8_t* data,
+                             uint64_t begin,
+                             uint64_t end,
+                             vector<ZipEntry>* entries) {
+  for (uint64_t pos = begin; pos + kLocalFileHeaderSize <= end; pos++) {
+    // TODO(xunchang) add support for big endian system when searching for
+    // magic numbers.
+    if (get_unaligned<uint32_t>(data + pos) !=
+        kLocalFileHeaderSignature) {
+      continue;
+    }
+
+    // local file header format
+    // 0      4     0x04034b50
+    // 4      2     minimum version needed to extract
+    // 6      2     general purpose bit flag
+    // 8      2     compression method
+    // 10     4     file last modification date & time
+    // 14     4     CRC-32
+    // 18     4     compressed size
+    // 22     4     uncompressed size
+    // 26     2     file name length
+    // 28     2     extra field length
+    // 30     n     file name
+    // 30+n   m     extra field
+    auto compression_method = get_unaligned<uint16_t>(data + pos + 8);
+    if (compression_method != 8) {  // non-deflate type
+      continue;
+    }
+
+    auto compressed_size = get_unaligned<uint32_t>(data + pos + 18);
+    auto file_name_length = get_unaligned<uint16_t>(data + pos + 26);
+    auto extra_field_length = get_unaligned<uint16_t>(data + pos + 28);
+    uint64_t header_size =
+        kLocalFileHeaderSize + file_name_length + extra_field_length;
+
+    // sanity check
+    if (header_size + compressed_size > end ||
+        pos > end - header_size - compressed_size) {
+      continue;
+    }
+    ZipEntry entry;
+    entry.pos = pos;
+    entry.header_size = header_size;
+    entry.compressed_size = compressed_size;
+    entry.limit = end;
+    entries->push_back(std::move(entry));
+  }
+}
+
+// Reads the 64 bit values of the ZIP64 extended information extra field in
+// [|extra|, |extra_end|) for the fields of the central directory header that
+// are set to 0xFFFFFFFF. The values appear in the same order as the fields
+// |uncompressed_size|, |compressed_size| and |local_header_offset|.
+bool ReadZip64ExtraField(const uint8_t* extra,
+                         const uint8_t* extra_end,
+                         uint64_t* uncompressed_size,
+                         uint64_t* compressed_size,
+                         uint64_t* local_header_offset) {
+  while (extra_end - extra >= 4) {
+    auto id = get_unaligned<uint16_t>(extra);
+    auto size = get_unaligned<uint16_t>(extra + 2);
+    extra += 4;
+    TEST_AND_RETURN_FALSE(extra_end - extra >= size);
+    if (id != kZip64ExtraFieldId) {
+      extra += size;
+      continue;
+    }
+    auto field_end = extra + size;
+    for (auto value : {uncompressed_size, compressed_size,
+                       local_header_offset}) {
+      if (*value != 0xFFFFFFFF) {
+        continue;
+      }
+      TEST_AND_RETURN_FALSE(field_end - extra >= 8);
+      *value = get_unaligned<uint64_t>(extra);
+      extra += 8;
+    }
+    return true;
+  }
+  return true;
+}
+
+// Finds the entries of the zip archive in |data| using its central directory.
+// The deflate compressed entries are put in |entries| and the data of the
+// stored (not compressed) entries in |stored_entries|. Returns false if the
+// archive has no central directory, or if it is not consistent with the rest
+// of the archive.
+bool ReadZipCentralDirectory(const uint8_t* data,
+                             uint64_t size,
+                             vector<ZipEntry>* entries,
+                             vector<ByteExtent>* stored_entries) {
+  TEST_AND_RETURN_FALSE(size >= kEndOfCentralDirectorySize);
+  // The end of central directory record is at the end of the archive, followed
+  // only by a comment of at most 64K. Requiring the comment to end exactly at
+  // the end of |data| avoids picking the record of a zip archive stored in the
+  // last entry.
+  // 0      4     0x06054b50
+  // 4      2     number of this disk
+  // 6      2     disk where the central directory starts
+  // 8      2     number of central directory records on this disk
+  // 10     2     total number of central directory records
+  // 12     4     size of the central directory
+  // 16     4     offset of the central directory
+  // 20     2     comment length
+  uint64_t eocd_pos = size - kEndOfCentralDirectorySize;
+  uint64_t min_eocd_pos = eocd_pos > 0xFFFF ? eocd_pos - 0xFFFF : 0;
+  while (get_unaligned<uint32_t>(data + eocd_pos) !=
+             kEndOfCentralDirectorySignature ||
+         eocd_pos + kEndOfCentralDirectorySize +
+                 get_unaligned<uint16_t>(data + eocd_pos + 20) !=
+             size) {
+    TEST_AND_RETURN_FALSE(eocd_pos > min_eocd_pos);
+    eocd_pos--;
+  }
+  const uint8_t* eocd = data + eocd_pos;
+  auto disk = get_unaligned<uint16_t>(eocd + 4);
+  auto cd_disk = get_unaligned<uint16_t>(eocd + 6);
+  uint64_t num_records = get_unaligned<uint16_t>(eocd + 10);
+  uint64_t cd_size = get_unaligned<uint32_t>(eocd + 12);
+  uint64_t cd_offset = get_unaligned<uint32_t>(eocd + 16);
+  uint64_t cd_end = eocd_pos;
+  bool zip64 = false;
+
+  // A ZIP64 archive has a ZIP64 end of central directory locator right before
+  // the end of central directory record.
+  // 0      4     0x07064b50
+  // 4      4     disk where the ZIP64 end of central directory record starts
+  // 8      8     offset of the ZIP64 end of central directory record
+  // 16     4     total number of disks
+  if (eocd_pos >= kZip64EndOfCentralDirectoryLocatorSize &&
+      get_unaligned<uint32_t>(eocd - kZip64EndOfCentralDirectoryLocatorSize) ==
+          kZip64EndOfCentralDirectoryLocatorSignature) {
+    auto locator = eocd - kZip64EndOfCentralDirectoryLocatorSize;
+    auto record_pos = get_unaligned<uint64_t>(locator + 8);
+    // ZIP64 end of central directory record format
+    // 0      4     0x06064b50
+    // 4      8     size of the rest of this record
+    // 12     2     version made by
+    // 14     2     minimum version needed to extract
+    // 16     4     number of this disk
+    // 20     4     disk where the central directory starts
+    // 24     8     number of central directory records on this disk
+    // 32     8     total number of central directory records
+    // 40     8     size of the central directory
+    // 48     8     offset of the central directory
+    TEST_AND_RETURN_FALSE(
+        record_pos <= eocd_pos - kZip64EndOfCentralDirectoryLocatorSize &&
+        eocd_pos - kZip64EndOfCentralDirectoryLocatorSize - record_pos >=
+            kZip64EndOfCentralDirectorySize);
+    const uint8_t* record = data + record_pos;
+    TEST_AND_RETURN_FALSE(get_unaligned<uint32_t>(record) ==
+                          kZip64EndOfCentralDirectorySignature);
+    TEST_AND_RETURN_FALSE(get_unaligned<uint32_t>(record + 16) == 0 &&
+                          get_unaligned<uint32_t>(record + 20) == 0);
+    disk = cd_disk = 0;
+    num_records = get_unaligned<uint64_t>(record + 32);
+    cd_size = get_unaligned<uint64_t>(record + 40);
+    cd_offset = get_unaligned<uint64_t>(record + 48);
+    cd_end = record_pos;
+    zip64 = true;
+  }
+  // Multi-disk archives are not supported.
+  TEST_AND_RETURN_FALSE(disk == 0 && cd_disk == 0);
+
+  // The offsets in the archive are relative to its start, but there may be
+  // other data (e.g. a self extracting stub) prepended to it. The central
+  // directory ends right before the end of central directory record, so the
+  // difference is the size of the prepended data.
+  TEST_AND_RETURN_FALSE(cd_size <= cd_end && cd_offset <= cd_end - cd_size);
+  uint64_t base = cd_end - cd_size - cd_offset;
+
+  uint64_t pos = base + cd_offset;
+  uint64_t count = 0;
+  for (; pos < cd_end; count++) {
+    // central directory file header format
+    // 0      4     0x02014b50
+    // 4      2     version made by
+    // 6      2     minimum version needed to extract
+    // 8      2     general purpose bit flag
+    // 10     2     compression method
+    // 12     4     file last modification date & time
+    // 16     4     CRC-32
+    // 20     4     compressed size
+    // 24     4     uncompressed size
+    // 28     2     file name length
+    // 30     2     extra field length
+    // 32     2     file comment length
+    // 34     2     disk where the file starts
+    // 36     2     internal file attributes
+    // 38     4     external file attributes
+    // 42     4     offset of the local file header
+    // 46     n     file name
+    // 46+n   m     extra field
+    // 46+n+m k     file comment
+    TEST_AND_RETURN_FALSE(cd_end - pos >= kCentralDirectoryHeaderSize);
+    const uint8_t* header = data + pos;
+    TEST_AND_RETURN_FALSE(get_unaligned<uint32_t>(header) ==
+                          kCentralDirectorySignature);
+    auto flags = get_unaligned<uint16_t>(header + 8);
+    auto compression_method = get_unaligned<uint16_t>(header + 10);
+    uint64_t compressed_size = get_unaligned<uint32_t>(header + 20);
+    uint64_t uncompressed_size = get_unaligned<uint32_t>(header + 24);
+    auto file_name_length = get_unaligned<uint16_t>(header + 28);
+    auto extra_field_length = get_unaligned<uint16_t>(header + 30);
+    auto comment_length = get_unaligned<uint16_t>(header + 32);
+    uint64_t local_header_offset = get_unaligned<uint32_t>(header + 42);
+    uint64_t header_size = kCentralDirectoryHeaderSize + file_name_length +
+                           extra_field_length + comment_length;
+    TEST_AND_RETURN_FALSE(cd_end - pos >= header_size);
+    auto extra = header + kCentralDirectoryHeaderSize + file_name_length;
+    TEST_AND_RETURN_FALSE(ReadZip64ExtraField(
+        extra, extra + extra_field_length, &uncompressed_size,
+        &compressed_size, &local_header_offset));
+    pos += header_size;
+
+    // Jump to the local file header, as its file name and extra field can be
+    // different from the ones in the central directory.
+    TEST_AND_RETURN_FALSE(local_header_offset <= cd_end - base &&
+                          cd_end - base - local_header_offset >=
+                              kLocalFileHeaderSize);
+    auto local_header_pos = base + local_header_offset;
+    const uint8_t* local_header = data + local_header_pos;
+    TEST_AND_RETURN_FALSE(get_unaligned<uint32_t>(local_header) ==
+                          kLocalFileHeaderSignature);
+    uint64_t local_header_size =
+        kLocalFileHeaderSize + get_unaligned<uint16_t>(local_header + 26) +
+        get_unaligned<uint16_t>(local_header + 28);
+    auto data_pos = local_header_pos + local_header_size;
+    TEST_AND_RETURN_FALSE(data_pos <= cd_end &&
+                          cd_end - data_pos >= compressed_size);
+
+    // The data of the encrypted entries is not a deflate stream.
+    if (flags & 1) {
+      continue;
+    }
+    if (compression_method == 8) {
+      ZipEntry entry;
+      entry.pos = local_header_pos;
+      entry.header_size = local_header_size;
+      entry.compressed_size = compressed_size;
+      entry.limit = data_pos + compressed_size;
+      entries->push_back(std::move(entry));
+    } else if (compression_method == 0) {
+      stored_entries->emplace_back(data_pos, compressed_size);
+    }
+  }
+  // Without ZIP64, the number of records wraps around at 64K.
+  TEST_AND_RETURN_FALSE(pos == cd_end &&
+                        (zip64 ? count == num_records
+                               : (count & 0xFFFF) == num_records));
+  return true;
+}
+
+// Searches the data of the stored zip entries or tar members at |extents| of
+// |data| for nested containers, and appends their deflates to |deflates|.
+bool LocateDeflatesInNestedContainers(const uint8_t* data,
+                                      const vector<ByteExtent>& extents,
+                                      vector<BitExtent>* deflates,
+                                      size_t num_threads,
+                                      size_t max_depth);
+
+bool LocateDeflatesInZipData(const uint8_t* data,
+                             uint64_t size,
+                             vector<BitExtent>* deflates,
+                             size_t num_threads,
+                             size_t max_depth) {
+  auto deflates_begin = deflates->size();
+  // The central directory gives the exact location and size of all the
+  // entries. If it cannot be used, fall back to scanning the whole archive for
+  // local file headers.
+  vector<ZipEntry> entries;
+  vector<ByteExtent> stored_entries;
+  if (ReadZipCentralDirectory(data, size, &entries, &stored_entries)) {
+    // A stored entry can be a zip archive itself (e.g. an APK in an OTA
+    // package). Unless the nested containers are searched separately, its
+    // data is scanned for local file headers, as if the whole archive was
+    // scanned.
+    if (max_depth == 0) {
+      for (const auto& stored_entry : stored_entries) {
+        ScanZipLocalFileHeaders(data, stored_entry.offset,
+                                stored_entry.offset + stored_entry.length,
+                                &entries);
+      }
+      stored_entries.clear();
+    }
+    std::sort(stored_entries.begin(), stored_entries.end());
+    std::stable_sort(entries.begin(), entries.end(),
+                     [](const ZipEntry& a, const ZipEntry& b) {
+                       return a.pos < b.pos;
+                     });
+  } else {
+    LOG(WARNING) << "Failed to read the central directory of the zip archive,"
+                 << " searching for the local file headers instead.";
+    entries.clear();
+    stored_entries.clear();
+    ScanZipLocalFileHeaders(data, 0, size, &entries);
+  }
+
+  auto decode = [&data](ZipEntry* entry, uint64_t limit) {
+    uint64_t offset = entry->pos + entry->header_size;
+    if (limit < offset) {
+      return;
+    }
+    entry->deflates.clear();
+    entry->valid = LocateDeflatesInDeflateStream(
+        data + offset, limit - offset, offset, &entry->deflates,
+        &entry->calculated_compressed_size);
+    entry->decoded = true;
+  };
+  // The entries are independent, but which of the scanned ones are real
+  // entries is only known once the preceding ones are decoded, because an
+  // entry can contain a signature by chance. With multiple threads, all the
+  // candidates are decoded speculatively in parallel. Then, the same way the
+  // sequential scan does, the ones that fall inside a previously accepted
+  // entry are dropped. The data of an entry ends before the next header, so
+  // each candidate is only decoded up to the next one, and the speculative
+  // decoding reads every byte once. An entry that contains a signature by
+  // chance fails here and is decoded again if it is reached.
+  if (num_threads > 1) {
+    TEST_AND_RETURN_FALSE(
+        ParallelFor(entries.size(), num_threads, [&](size_t idx) {
+          auto& entry = entries[idx];
+          auto limit = entry.limit;
+          for (auto next = idx + 1; next < entries.size(); next++) {
+            if (entries[next].pos > entry.pos) {
+              limit = std::min(limit, entries[next].pos);
+              break;
+            }
+          }
+          decode(&entry, limit);
+          if (!entry.valid) {
+            entry.decoded = false;
+          }
+          return true;
+        }));
+  }
+
+  // The signature cannot overlap itself, so skipping the failed candidates is
+  // the same as skipping 4 bytes past them.
+  uint64_t pos = 0;
+  for (auto& entry : entries) {
+    if (entry.pos < pos) {
+      continue;
+    }
+    if (!entry.decoded) {
+      decode(&entry, entry.limit);
+    }
+    if (!entry.valid) {
+      LOG(ERROR) << "Failed to decompress the zip entry starting from: "
+                 << entry.pos << ", skip adding deflates for this entry.";
+      continue;
+    }
+
+    // Double check the compressed size if it is available in the file header.
+    if (entry.compressed_size > 0 &&
+        entry.compressed_size != entry.calculated_compressed_size) {
+      LOG(WARNING) << "Compressed size in the file header: "
+                   << entry.compressed_size << " doesn't equal the real size: "
+                   << entry.calculated_compressed_size;
+    }
+
+    deflates->insert(deflates->end(), entry.deflates.begin(),
+                     entry.deflates.end());
+    pos = entry.pos + entry.header_size + entry.calculated_compressed_size;
+  }
+
+  if (!stored_entries.empty()) {
+    auto deflates_end = deflates->size();
+    TEST_AND_RETURN_FALSE(LocateDeflatesInNestedContainers(
+        data, stored_entries, deflates, num_threads, max_depth - 1));
+    std::inplace_merge(deflates->begin() + deflates_begin,
+                       deflates->begin() + deflates_end, deflates->end());
+  }
+  return true;
+}
+
+// For more information about the tar format, refer to
+// https://www.gnu.org/software/tar/manual/html_node/Standard.html
+constexpr uint64_t kTarBlockSize = 512;
+
+// Reads the numeric field of a tar header at |field|. It is either an octal
+// number, or a big endian base-256 number if the highest bit of the first byte
+// is set.
+bool ReadTarNumber(const uint8_t* field, size_t length, uint64_t* value) {
+  *value = 0;
+  if (field[0] & 0x80) {
+    *value = field[0] & 0x7F;
+    for (size_t idx = 1; idx < length; idx++) {
+      TEST_AND_RETURN_FALSE((*value >> 56) == 0);
+      *value = (*value << 8) | field[idx];
+    }
+    return true;
+  }
+  size_t idx = 0;
+  while (idx < length && field[idx] == ' ') {
+    idx++;
+  }
+  for (; idx < length && field[idx] >= '0' && field[idx] <= '7'; idx++) {
+    TEST_AND_RETURN_FALSE((*value >> 61) == 0);
+    *value = (*value << 3) | (field[idx] - '0');
+  }
+  return idx == length || field[idx] == ' ' || field[idx] == '\0';
+}
+
+bool IsValidTarHeader(const uint8_t* header, uint64_t size) {
+  // tar header format (only the fields used here)
+  // 0      100   file name
+  // 124    12    file size
+  // 148    8     checksum of the header, assuming the checksum is 8 spaces
+  // 156    1     type flag
+  // 257    6     "ustar" magic
+  static constexpr char magic[] = "ustar";
+  if (size < kTarBlockSize || !std::equal(magic, magic + 5, header + 257)) {
+    return false;
+  }
+  uint64_t checksum;
+  if (!ReadTarNumber(header + 148, 8, &checksum)) {
+    return false;
+  }
+  uint64_t sum = 8 * ' ';
+  for (size_t idx = 0; idx < kTarBlockSize; idx++) {
+    if (idx < 148 || idx >= 156) {
+      sum += header[idx];
+    }
+  }
+  return sum == checksum;
+}
+
+// Finds the data of the regular files in the tar archive in |data|.
+bool ReadTarFiles(const uint8_t* data,
+                  uint64_t size,
+                  vector<ByteExtent>* files) {
+  uint64_t pos = 0;
+  // The archive ends with two zero blocks, but some writers omit them.
+  while (size - pos >= kTarBlockSize &&
+         std::any_of(data + pos, data + pos + kTarBlockSize,
+                     [](uint8_t byte) { return byte != 0; })) {
+    TEST_AND_RETURN_FALSE(IsValidTarHeader(data + pos, size - pos));
+    uint64_t file_size;
+    TEST_AND_RETURN_FALSE(ReadTarNumber(data + pos + 124, 12, &file_size));
+    auto type_flag = data[pos + 156];
+    pos += kTarBlockSize;
+    TEST_AND_RETURN_FALSE(file_size <= size - pos);
+    // Regular files. The other types (e.g. the extended headers) are skipped.
+    if (type_flag == '0' || type_flag == '\0' || type_flag == '7') {
+      files->emplace_back(pos, file_size);
+    }
+    // The data is padded to a multiple of the block size.
+    pos += std::min((file_size + kTarBlockSize - 1) / kTarBlockSize *
+                        kTarBlockSize,
+                    size - pos);
+  }
+  return true;
+}
+
+bool LocateDeflatesInTarData(const uint8_t* data,
+                             uint64_t size,
+                             vector<BitExtent>* deflates,
+                             size_t num_threads,
+                             size_t max_depth) {
+  TEST_AND_RETURN_FALSE(IsValidTarHeader(data, size));
+  vector<ByteExtent> files;
+  TEST_AND_RETURN_FALSE(ReadTarFiles(data, size, &files));
+  // The files themselves are not compressed, so only the nested containers
+  // can have deflates.
+  if (max_depth == 0) {
+    return true;
+  }
+  return LocateDeflatesInNestedContainers(data, files, deflates, num_threads,
+                                          max_depth - 1);
+}
+
+bool LocateDeflatesInNestedContainers(const uint8_t* data,
+                                      const vector<ByteExtent>& extents,
+                                      vector<BitExtent>* deflates,
+                                      size_t num_threads,
+                                      size_t max_depth) {
+  for (const auto& extent : extents) {
+    auto container = data + extent.offset;
+    vector<BitExtent> container_deflates;
+    bool success;
+    if (IsValidGzipHeader(container, extent.length)) {
+      success = LocateDeflatesInGzipData(container, extent.length,
+                                         &container_deflates, num_threads);
+    } else if (extent.length >= kLocalFileHeaderSize &&
+               get_unaligned<uint32_t>(container) ==
+                   kLocalFileHeaderSignature) {
+      success = LocateDeflatesInZipData(container, extent.length,
+                                        &container_deflates, num_threads,
+                                        max_depth);
+    } else if (IsValidTarHeader(container, extent.length)) {
+      success = LocateDeflatesInTarData(container, extent.length,
+                                        &container_deflates, num_threads,
+                                        max_depth);
+    } else if (IsPngSignature(container, extent.length)) {
+      success = LocateDeflatesInPngData(container, extent.length,
+                                        &container_deflates);
+    } else if (IsPdfSignature(container, extent.length)) {
+      success = LocateDeflatesInPdfData(container, extent.length,
+                                        &container_deflates, num_threads);
+    } else if (IsElfSignature(container, extent.length)) {
+      success = LocateDeflatesInElfData(container, extent.length,
+                                        &container_deflates, num_threads);
+    } else {
+      continue;
+    }
+    // Something that only looks like a container is not an error.
+    if (!success) {
+      LOG(WARNING) << "Failed to locate the deflates in the nested container "
+                   << "at offset " << extent.offset << ", skipping it.";
+      continue;
+    }
+    for (const auto& deflate : container_deflates) {
+      deflates->emplace_back(deflate.offset + extent.offset * 8,
+                             deflate.length);
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+bool LocateDeflatesInZipArchive(const Buffer& data,
+                                vector<BitExtent>* deflates) {
+  return LocateDeflatesInZipArchive(data, deflates, 1);
+}
+
+bool LocateDeflatesInZipArchive(const Buffer& data,
+                                vector<BitExtent>* deflates,
+                                size_t num_threads) {
+  return LocateDeflatesInZipArchive(data, deflates, num_threads, 0);
+}
+
+bool LocateDeflatesInZipArchive(const Buffer& data,
+                                vector<BitExtent>* deflates,
+                                size_t num_threads,
+                                size_t max_depth) {
+  return LocateDeflatesInZipData(data.data(), data.size(), deflates,
+                                 num_threads, max_depth);
+}
+
+bool LocateDeflatesInZipArchive(const uint8_t* data,
+                                uint64_t size,
+                                vector<BitExtent>* deflates,
+                                size_t num_threads,
+                                size_t max_depth) {
+  return LocateDeflatesInZipData(data, size, deflates, num_threads, max_depth);
+}
+
+bool LocateDeflatesInTar(const Buffer& data,
+                         vector<BitExtent>* deflates,
+                         size_t num_threads,
+                         size_t max_depth) {
+  return LocateDeflatesInTarData(data.data(), data.size(), deflates,
+                                 num_threads, max_depth);
+}
+
+bool LocateDeflatesInTar(const uint8_t* data,
+                         uint64_t size,
+                         vector<BitExtent>* deflates,
+                         size_t num_threads,
+                         size_t max_depth) {
+  return LocateDeflatesInTarData(data, size, deflates, num_threads, max_depth);
+}
+
+bool LocateDeflatesInContainer(const uint8_t* data,
+                               uint64_t size,
+                               vector<BitExtent>* deflates,
+                               size_t num_threads,
+                               size_t max_depth) {
+  return LocateDeflatesInNestedContainers(data, {ByteExtent(0, size)},
+                                          deflates, num_threads, max_depth);
+}
+
+bool LocateNestedDeflateStreams(const uint8_t* data,
+                                uint64_t size,
+                                const vector<BitExtent>& deflates,
+                                size_t num_threads,
+                                size_t max_depth,
+                                vector<BitExtent>* streams) {
+  if (max_depth == 0) {
+    return true;
+  }
+  // A stream starts at the first deflate, at a deflate that does not follow
+  // the previous one right away, or after a final block. Streams that do not
+  // start at a byte boundary are left out, as they are rebuilt in whole bytes.
+  vector<uint64_t> starts;
+  for (size_t idx = 0; idx < deflates.size(); idx++) {
+    const auto& deflate = deflates[idx];
+    if (deflate.offset % 8 != 0) {
+      continue;
+    }
+    if (idx > 0) {
+      const auto& previous = deflates[idx - 1];
+      bool final_block =
+          (data[previous.offset / 8] >> (previous.offset % 8)) & 1;
+      if (previous.offset + previous.length == deflate.offset && !final_block) {
+        continue;
+      }
+    }
+    starts.push_back(deflate.offset);
+  }
+
+  vector<BitExtent> found(starts.size(), BitExtent(0, 0));
+  TEST_AND_RETURN_FALSE(
+      ParallelFor(starts.size(), num_threads, [&](size_t idx) {
+        // Most of the deflate streams only have data without any deflates.
+        Buffer uncompressed;
+        uint64_t length;
+        if (!InflateDeflateStream(data, size, starts[idx], &length,
+                                  &uncompressed)) {
+          return true;
+        }
+        vector<BitExtent> inner_deflates;
+        if (LocateDeflatesInContainer(uncompressed.data(), uncompressed.size(),
+                                      &inner_deflates, 1, max_depth - 1) &&
+            !inner_deflates.empty()) {
+          found[idx] = BitExtent(starts[idx], length);
+        }
+        return true;
+      }));
+  uint64_t end = 0;
+  for (const auto& stream : found) {
+    if (stream.length > 0 && stream.offset >= end) {
+      streams->push_back(stream);
+      end = stream.offset + stream.length;
+    }
+  }
+  return true;
+}
+
+namespace {
+// Streams carved from raw data that are shorter than this are ignored. Random
+// bytes can look like a short valid deflate stream, but rarely like a long one.
+constexpr uint64_t kMinCarvedStreamSize = 64;
+
+// Returns true if |data| could be the first byte of a gzip member (0x1F) or of
+// a zlib stream (the compression method is 8 and the window size is valid).
+inline bool IsCarvingCandidateByte(uint8_t byte) {
+  return byte == 0x1F || (byte & 0x8F) == 0x08;
+}
+
+// Returns the offset of the first byte in [|begin|, |end|) of |data| that can
+// start a gzip member or a zlib stream, or |end| if there is none. Most of the
+// bytes of a raw image are rejected here, so this is vectorized when possible.
+uint64_t FindCarvingCandidate(const uint8_t* data,
+                              uint64_t begin,
+                              uint64_t end) {
+  uint64_t pos = begin;
+#if defined(__SSE2__)
+  const __m128i gzip_magic = _mm_set1_epi8(0x1F);
+  const __m128i zlib_mask = _mm_set1_epi8(static_cast<char>(0x8F));
+  const __m128i zlib_method = _mm_set1_epi8(0x08);
+  for (; end - pos >= 16; pos += 16) {
+    auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+    auto matches = _mm_or_si128(
+        _mm_cmpeq_epi8(bytes, gzip_magic),
+        _mm_cmpeq_epi8(_mm_and_si128(bytes, zlib_mask), zlib_method));
+    auto mask = _mm_movemask_epi8(matches);
+    if (mask != 0) {
+      return pos + __builtin_ctz(mask);
+    }
+  }
+#endif  // __SSE2__
+  for (; pos < end; pos++) {
+    if (IsCarvingCandidateByte(data[pos])) {
+      return pos;
+    }
+  }
+  return end;
+}
+
+// Returns true if the header of the first deflate block at |data| is
+// plausible. This cheaply rejects most of the candidates that are random data,
+// without decoding (and logging the errors of) them.
+bool IsPlausibleDeflateStart(const uint8_t* data, uint64_t size) {
+  if (size < 1) {
+    return false;
+  }
+  switch ((data[0] >> 1) & 3) {
+    case 0: {
+      // An uncompressed block has its length and its one's complement at the
+      // next byte boundary.
+      if (size < 5) {
+        return false;
+      }
+      auto length = get_unaligned<uint16_t>(data + 1);
+      auto length_complement = get_unaligned<uint16_t>(data + 3);
+      return length == static_cast<uint16_t>(~length_complement);
+    }
+    case 1:
+      // Fixed Huffman codes have no header.
+      return true;
+    case 2:
+      return IsPlausibleDynamicBlock(data, size, 0, true);
+    default:
+      return false;
+  }
+}
+
+// Returns the table of the CRC-32 of each byte value, with the polynomial gzip
+// uses.
+const uint32_t* Crc32Table() {
+  static const auto* table = [] {
+    auto* table = new uint32_t[256];
+    for (uint32_t byte = 0; byte < 256; byte++) {
+      uint32_t crc = byte;
+      for (size_t bit = 0; bit < 8; bit++) {
+        crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+      }
+      table[byte] = crc;
+    }
+    return table;
+  }();
+  return table;
+}
+
+// A puff writer that decompresses the data only to validate it. It fails if a
+// length/distance pair refers to data before the start of the stream, and
+// keeps the size and the checksums of the decompressed data: Adler-32 for zlib
+// streams and CRC-32 for gzip members. Random data that happens to decode as a
+// deflate stream almost always fails the distance check early, and the
+// checksums catch the rest.
+class ValidatingPuffWriter : public PuffWriterInterface {
+ public:
+  explicit ValidatingPuffWriter(bool crc32)
+      : window_(kWindowSize), crc32_table_(crc32 ? Crc32Table() : nullptr) {}
+  ~ValidatingPuffWriter() override = default;
+
+  bool Insert(const PuffData& pd) override {
+    switch (pd.type) {
+      case PuffData::Type::kLiteral:
+        Append(pd.byte);
+        break;
+      case PuffData::Type::kLiterals: {
+        uint8_t buffer[4096];
+        for (size_t length = pd.length; length > 0;) {
+          auto count = std::min(length, sizeof(buffer));
+          TEST_AND_RETURN_FALSE(pd.read_fn(buffer, count));
+          for (size_t idx = 0; idx < count; idx++) {
+            Append(buffer[idx]);
+          }
+          length -= count;
+        }
+        break;
+      }
+      case PuffData::Type::kLenDist:
+        if (pd.distance > size_ || pd.distance > kWindowSize) {
+          return false;
+        }
+        for (size_t idx = 0; idx < pd.length; idx++) {
+          Append(window_[(size_ - pd.distance) % kWindowSize]);
+        }
+        break;
+      default:
+        break;
+    }
+    return true;
+  }
+  bool Flush() override { return true; }
+  size_t Size() override { return 0; }
+
+  // The size of the decompressed data.
+  uint64_t size() const { return size_; }
+
+  uint32_t adler32() const {
+    return ((adler_b_ % kAdlerBase) << 16) | (adler_a_ % kAdlerBase);
+  }
+
+  // Only kept if the writer was created with |crc32|.
+  uint32_t crc32() const { return ~crc32_; }
+
+ private:
+  static constexpr size_t kWindowSize = 32 * 1024;
+  static constexpr uint32_t kAdlerBase = 65521;
+
+  void Append(uint8_t byte) {
+    window_[size_++ % kWindowSize] = byte;
+    adler_a_ += byte;
+    adler_b_ += adler_a_;
+    // Reduce well before |adler_b_| can overflow.
+    if (adler_b_ >= 0xFF000000) {
+      adler_a_ %= kAdlerBase;
+      adler_b_ %= kAdlerBase;
+    }
+    if (crc32_table_) {
+      crc32_ = (crc32_ >> 8) ^ crc32_table_[(crc32_ ^ byte) & 0xFF];
+    }
+  }
+
+  // The last |kWindowSize| bytes of the decompressed data.
+  vector<uint8_t> window_;
+  uint64_t size_ = 0;
+  uint32_t adler_a_ = 1;
+  uint32_t adler_b_ = 0;
+  const uint32_t* crc32_table_;
+  uint32_t crc32_ = 0xFFFFFFFF;
+
+  DISALLOW_COPY_AND_ASSIGN(ValidatingPuffWriter);
+};
+
+// A gzip member or zlib stream carved from raw data.
+struct CarvedStream {
+  uint64_t start;
+  uint64_t end;
+  vector<BitExtent> deflates;
+};
+
+// Checks whether a complete gzip member or zlib stream starts at |pos| of
+// |data|, and if so, sets |stream| to it. The CRC-32 and the uncompressed size
+// of a gzip member, or the Adler-32 checksum of a zlib stream, must match.
+// At most |*budget| bytes are decoded, and if the stream is not carved, the
+// bytes that were decoded are taken from |*budget|.
+bool CarveStream(const uint8_t* data,
+                 uint64_t size,
+                 uint64_t pos,
+                 CarvedStream* stream,
+                 uint64_t* budget) {
+  if (!IsCarvingCandidateByte(data[pos]) || size - pos < 2) {
+    return false;
+  }
+  uint64_t data_offset;
+  bool is_gzip = data[pos] == 0x1F;
+  if (is_gzip) {
+    // Reserved flags must be zero.
+    if (!IsValidGzipHeader(data + pos, size - pos) ||
+        (data[pos + 3] & 0xE0) != 0 ||
+        !ReadGzipMemberHeader(data, size, pos, &data_offset)) {
+      return false;
+    }
+  } else {
+    // The header check value must be valid, and a preset dictionary is not
+    // supported because the deflates would refer to data outside the stream.
+    uint16_t header = (data[pos] << 8) | data[pos + 1];
+    if (header % 31 != 0 || (data[pos + 1] & 0x20) != 0) {
+      return false;
+    }
+    data_offset = pos + 2;
+  }
+  if (!IsPlausibleDeflateStart(data + data_offset, size - data_offset)) {
+    return false;
+  }
+
+  Puffer puffer;
+  BufferBitReader bit_reader(data + data_offset,
+                             std::min(size - data_offset, *budget));
+  ValidatingPuffWriter puff_writer(is_gzip);
+  stream->deflates.clear();
+  auto carved = [&] {
+    if (!puffer.PuffDeflate(&bit_reader, &puff_writer, &stream->deflates) ||
+        stream->deflates.empty()) {
+      return false;
+    }
+    stream->start = pos;
+    // A gzip member ends with the CRC-32 and the size of the decompressed
+    // data, and a zlib stream with the Adler-32 checksum, both 4 bytes.
+    auto trailer = data_offset + bit_reader.Offset();
+    stream->end = trailer + (is_gzip ? 8 : 4);
+    if (stream->end > size ||
+        stream->end - stream->start < kMinCarvedStreamSize) {
+      return false;
+    }
+    if (is_gzip) {
+      return get_unaligned<uint32_t>(data + trailer) == puff_writer.crc32() &&
+             get_unaligned<uint32_t>(data + trailer + 4) ==
+                 static_cast<uint32_t>(puff_writer.size());
+    }
+    return ReadBigEndian32(data + trailer) == puff_writer.adler32();
+  }();
+  if (!carved) {
+    *budget -= std::min<uint64_t>(*budget, bit_reader.Offset());
+    return false;
+  }
+  for (auto& deflate : stream->deflates) {
+    deflate.offset += data_offset * 8;
+  }
+  return true;
+}
+
+// Returns how many bytes the candidates in [|begin|, |end|) that are not
+// carved can decode in total. A candidate can decode a long way before it
+// fails, e.g. if its stream has the wrong checksum, and without a limit, data
+// made of such candidates would take time quadratic in its size. Real data
+// uses a tiny part of this.
+uint64_t GetCarvingBudget(uint64_t begin, uint64_t end) {
+  constexpr uint64_t kCarvingBudgetPerByte = 4;
+  constexpr uint64_t kMinCarvingBudget = 64 * 1024 * 1024;  // 64MB
+  return kMinCarvingBudget + (end - begin) * kCarvingBudgetPerByte;
+}
+
+// Carves the streams that start in [|begin|, |end|) of |data|, the same way a
+// sequential scan of the whole data would if it reached |begin| outside of any
+// stream. The last stream can extend beyond |end|.
+void CarveStreams(const uint8_t* data,
+                  uint64_t size,
+                  uint64_t begin,
+                  uint64_t end,
+                  vector<CarvedStream>* streams) {
+  CarvedStream stream;
+  auto budget = GetCarvingBudget(begin, end);
+  auto pos = FindCarvingCandidate(data, begin, end);
+  while (pos < end && budget > 0) {
+    if (CarveStream(data, size, pos, &stream, &budget)) {
+      pos = stream.end;
+      streams->push_back(std::move(stream));
+    } else {
+      pos++;
+    }
+    pos = FindCarvingCandidate(data, std::min(pos, end), end);
+  }
+  if (budget == 0) {
+    LOG(WARNING) << "Stopped carving at offset " << pos << " after too many "
+                 << "candidates failed late.";
+  }
+}
+
+}  // namespace
+
+bool LocateDeflatesByCarving(const Buffer& data,
+                             vector<BitExtent>* deflates,
+                             size_t num_threads) {
+  return LocateDeflatesByCarving(data.data(), data.size(), deflates,
+                                 num_threads);
+}
+
+bool LocateDeflatesByCarving(const uint8_t* data,
+                             uint64_t size,
+                             vector<BitExtent>* deflates,
+                             size_t num_threads) {
+  // The data is split into chunks that are carved in parallel. Each chunk is
+  // carved as if the previous one ended outside of any stream.
+  constexpr uint64_t kMinChunkSize = 1024 * 1024;  // 1MB
+  num_threads = std::max(num_threads, static_cast<size_t>(1));
+  auto chunk_size = std::max(kMinChunkSize, size / (num_threads * 8) + 1);
+  auto num_chunks = (size + chunk_size - 1) / chunk_size;
+  vector<vector<CarvedStream>> chunk_streams(num_chunks);
+  TEST_AND_RETURN_FALSE(ParallelFor(num_chunks, num_threads, [&](size_t idx) {
+    auto begin = idx * chunk_size;
+    CarveStreams(data, size, begin, std::min(begin + chunk_size, size),
+                 &chunk_streams[idx]);
+    return true;
+  }));
+
+  // If a stream of the previous chunks ends at |pos| inside the current chunk,
+  // the chunk was carved from the wrong state until the sequential scan and
+  // the chunk agree again. That is the first position that is not inside one
+  // of the streams of the chunk. Until then the positions are carved again
+  // sequentially.
+  uint64_t pos = 0;
+  CarvedStream stream;
+  for (size_t idx = 0; idx < num_chunks; idx++) {
+    auto chunk_end = std::min((idx + 1) * chunk_size, size);
+    const auto& streams = chunk_streams[idx];
+    auto iter = streams.begin();
+    bool synced = false;
+    auto budget = GetCarvingBudget(idx * chunk_size, chunk_end);
+    while (pos < chunk_end && budget > 0) {
+      while (iter != streams.end() && iter->end <= pos) {
+        iter++;
+      }
+      if (iter == streams.end() || iter->start >= pos) {
+        synced = true;
+        break;
+      }
+      if (CarveStream(data, size, pos, &stream, &budget)) {
+        pos = stream.end;
+        deflates->insert(deflates->end(), stream.deflates.begin(),
+                         stream.deflates.end());
+      } else {
+        pos = FindCarvingCandidate(data, pos + 1, chunk_end);
+      }
+    }
+    // Otherwise all the streams of the chunk start inside a previous stream.
+    if (!synced) {
+      continue;
+    }
+    for (; iter != streams.end(); iter++) {
+      deflates->insert(deflates->end(), iter->deflates.begin(),
+                       iter->deflates.end());
+      pos = iter->end;
+    }
+  }
+  return true;
+}
+
+namespace {
+// For more information about the squashfs format, refer to
+// https://dr-emann.github.io/squashfs/
+constexpr uint32_t kSquashfsMagic = 0x73717368;
+constexpr uint64_t kSquashfsSuperblockSize = 96;
+constexpr uint16_t kSquashfsGzipCompression = 1;
+constexpr uint16_t kSquashfsMajorVersion = 4;
+constexpr uint64_t kSquashfsMetadataSize = 8192;
+constexpr uint16_t kSquashfsMetadataUncompressed = 0x8000;
+constexpr uint32_t kSquashfsDataUncompressed = 1 << 24;
+constexpr uint32_t kSquashfsNoFragment = 0xFFFFFFFF;
+constexpr uint64_t kSquashfsNoTable = ~static_cast<uint64_t>(0);
+constexpr uint64_t kSquashfsFragmentEntrySize = 16;
+constexpr uint64_t kSquashfsXattrIdEntrySize = 16;
+
+// The fields of the squashfs superblock that are needed to find the blocks.
+struct SquashfsSuperblock {
+  uint32_t inode_count;
+  uint32_t block_size;
+  uint32_t fragment_count;
+  uint16_t compression;
+  uint16_t id_count;
+  uint64_t bytes_used;
+  uint64_t id_table_start;
+  uint64_t xattr_id_table_start;
+  uint64_t inode_table_start;
+  uint64_t directory_table_start;
+  uint64_t fragment_table_start;
+  uint64_t export_table_start;
+};
+
+// A puff writer that decompresses the data into |output|.
+class InflatingPuffWriter : public PuffWriterInterface {
+ public:
+  explicit InflatingPuffWriter(Buffer* output) : output_(output) {}
+  ~InflatingPuffWriter() override = default;
+
+  bool Insert(const PuffData& pd) override {
+    switch (pd.type) {
+      case PuffData::Type::kLiteral:
+        output_->push_back(pd.byte);
+        break;
+      case PuffData::Type::kLiterals: {
+        auto offset = output_->size();
+        output_->resize(offset + pd.length);
+        TEST_AND_RETURN_FALSE(pd.read_fn(output_->data() + offset, pd.length));
+        break;
+      }
+      case PuffData::Type::kLenDist:
+        TEST_AND_RETURN_FALSE(pd.distance <= output_->size());
+        for (size_t idx = 0; idx < pd.length; idx++) {
+          uint8_t byte = (*output_)[output_->size() - pd.distance];
+          output_->push_back(byte);
+        }
+        break;
+      default:
+        break;
+    }
+    return true;
+  }
+  bool Flush() override { return true; }
+  size_t Size() override { return output_->size(); }
+
+ private:
+  Buffer* output_;
+
+  DISALLOW_COPY_AND_ASSIGN(InflatingPuffWriter);
+};
+
+// Finds the compressed blocks of a squashfs image. The data and fragment blocks
+// are found from the inode and fragment tables, which are stored in metadata
+// blocks themselves, so those are decompressed along the way.
+class SquashfsParser {
+ public:
+  SquashfsParser(const uint8_t* data, uint64_t size)
+      : data_(data), size_(size) {}
+
+  // Puts the extents of all the compressed blocks in |zlibs|, sorted by their
+  // offset.
+  bool Parse(vector<ByteExtent>* zlibs) {
+    TEST_AND_RETURN_FALSE(ReadSuperblock());
+    TEST_AND_RETURN_FALSE(sb_.compression == kSquashfsGzipCompression);
+
+    // The lookup tables are arrays of entries stored in metadata blocks,
+    // followed by an index with the location of each block.
+    Buffer fragments;
+    TEST_AND_RETURN_FALSE(ReadLookupTable(
+        sb_.fragment_table_start,
+        sb_.fragment_count * kSquashfsFragmentEntrySize, &fragments));
+    Buffer unused;
+    TEST_AND_RETURN_FALSE(
+        ReadLookupTable(sb_.id_table_start, sb_.id_count * 4, &unused));
+    if (sb_.export_table_start != kSquashfsNoTable) {
+      TEST_AND_RETURN_FALSE(ReadLookupTable(
+          sb_.export_table_start, sb_.inode_count * 8ULL, &unused));
+    }
+    if (sb_.xattr_id_table_start != kSquashfsNoTable) {
+      TEST_AND_RETURN_FALSE(ReadXattrTables());
+    }
+
+    // The inode and directory tables are plain sequences of metadata blocks,
+    // each ending where the next table starts.
+    Buffer inodes;
+    TEST_AND_RETURN_FALSE(ReadMetadata(sb_.inode_table_start,
+                                       sb_.directory_table_start, &inodes));
+    TEST_AND_RETURN_FALSE(ReadMetadata(sb_.directory_table_start,
+                                       GetTableEnd(sb_.directory_table_start),
+                                       &unused));
+
+    TEST_AND_RETURN_FALSE(ReadFragments(fragments));
+    TEST_AND_RETURN_FALSE(ReadInodes(inodes));
+
+    // Files with the same content share their blocks.
+    std::sort(zlibs_.begin(), zlibs_.end());
+    zlibs_.erase(std::unique(zlibs_.begin(), zlibs_.end()), zlibs_.end());
+    for (size_t idx = 1; idx < zlibs_.size(); idx++) {
+      TEST_AND_RETURN_FALSE(zlibs_[idx - 1].offset + zlibs_[idx - 1].length <=
+                            zlibs_[idx].offset);
+    }
+    *zlibs = std::move(zlibs_);
+    return true;
+  }
+
+ private:
+  bool ReadSuperblock() {
+    TEST_AND_RETURN_FALSE(size_ >= kSquashfsSuperblockSize);
+    TEST_AND_RETURN_FALSE(get_unaligned<uint32_t>(data_) == kSquashfsMagic);
+    TEST_AND_RETURN_FALSE(get_unaligned<uint16_t>(data_ + 28) ==
+                          kSquashfsMajorVersion);
+    sb_.inode_count = get_unaligned<uint32_t>(data_ + 4);
+    sb_.block_size = get_unaligned<uint32_t>(data_ + 12);
+    sb_.fragment_count = get_unaligned<uint32_t>(data_ + 16);
+    sb_.compression = get_unaligned<uint16_t>(data_ + 20);
+    sb_.id_count = get_unaligned<uint16_t>(data_ + 26);
+    sb_.bytes_used = get_unaligned<uint64_t>(data_ + 40);
+    sb_.id_table_start = get_unaligned<uint64_t>(data_ + 48);
+    sb_.xattr_id_table_start = get_unaligned<uint64_t>(data_ + 56);
+    sb_.inode_table_start = get_unaligned<uint64_t>(data_ + 64);
+    sb_.directory_table_start = get_unaligned<uint64_t>(data_ + 72);
+    sb_.fragment_table_start = get_unaligned<uint64_t>(data_ + 80);
+    sb_.export_table_start = get_unaligned<uint64_t>(data_ + 88);
+    TEST_AND_RETURN_FALSE(sb_.bytes_used <= size_);
+    TEST_AND_RETURN_FALSE(sb_.block_size > 0);
+    TEST_AND_RETURN_FALSE(sb_.inode_table_start <= sb_.directory_table_start);
+    table_starts_ = {sb_.bytes_used,           sb_.id_table_start,
+                     sb_.xattr_id_table_start, sb_.inode_table_start,
+                     sb_.directory_table_start, sb_.fragment_table_start,
+                     sb_.export_table_start};
+    return true;
+  }
+
+  // Returns the start of the first table after |offset|, or the end of the
+  // image. This is where the metadata blocks of a table starting at |offset|
+  // end.
+  uint64_t GetTableEnd(uint64_t offset) const {
+    uint64_t end = sb_.bytes_used;
+    for (auto start : table_starts_) {
+      if (start > offset && start < end) {
+        end = start;
+      }
+    }
+    return end;
+  }
+
+  // Reads the metadata block at |*offset|, appends its decompressed data to
+  // |output| and advances |*offset| to the next block.
+  bool ReadMetadataBlock(uint64_t* offset, Buffer* output) {
+    TEST_AND_RETURN_FALSE(*offset <= sb_.bytes_used &&
+                          sb_.bytes_used - *offset >= 2);
+    auto header = get_unaligned<uint16_t>(data_ + *offset);
+    uint64_t length = header & ~kSquashfsMetadataUncompressed;
+    uint64_t start = *offset + 2;
+    TEST_AND_RETURN_FALSE(length <= sb_.bytes_used - start);
+    if (header & kSquashfsMetadataUncompressed) {
+      output->insert(output->end(), data_ + start, data_ + start + length);
+    } else {
+      TEST_AND_RETURN_FALSE(Inflate(start, length, output));
+      zlibs_.emplace_back(start, length);
+    }
+    *offset = start + length;
+    return true;
+  }
+
+  // Reads all the metadata blocks in [|begin|, |end|).
+  bool ReadMetadata(uint64_t begin, uint64_t end, Buffer* output) {
+    for (auto offset = begin; offset < end;) {
+      TEST_AND_RETURN_FALSE(ReadMetadataBlock(&offset, output));
+    }
+    return true;
+  }
+
+  // Reads the metadata blocks of the lookup table with its index at
+  // |table_start|. The table is |length| bytes long.
+  bool ReadLookupTable(uint64_t table_start, uint64_t length, Buffer* output) {
+    auto num_blocks = (length + kSquashfsMetadataSize - 1) /
+                      kSquashfsMetadataSize;
+    TEST_AND_RETURN_FALSE(table_start <= sb_.bytes_used &&
+                          (sb_.bytes_used - table_start) / 8 >= num_blocks);
+    output->clear();
+    for (uint64_t idx = 0; idx < num_blocks; idx++) {
+      auto offset = get_unaligned<uint64_t>(data_ + table_start + idx * 8);
+      TEST_AND_RETURN_FALSE(ReadMetadataBlock(&offset, output));
+    }
+    TEST_AND_RETURN_FALSE(output->size() >= length);
+    return true;
+  }
+
+  // The extended attributes are stored as the key/value pairs in metadata
+  // blocks, followed by a lookup table of their ids.
+  bool ReadXattrTables() {
+    auto table_start = sb_.xattr_id_table_start;
+    TEST_AND_RETURN_FALSE(table_start <= sb_.bytes_used &&
+                          sb_.bytes_used - table_start >= 16);
+    auto xattr_table_start = get_unaligned<uint64_t>(data_ + table_start);
+    auto num_ids = get_unaligned<uint32_t>(data_ + table_start + 8);
+    Buffer unused;
+    TEST_AND_RETURN_FALSE(ReadLookupTable(
+        table_start + 16, num_ids * kSquashfsXattrIdEntrySize, &unused));
+    // The key/value pairs end where the first block of the ids starts.
+    uint64_t end = table_start;
+    if (num_ids > 0) {
+      end = get_unaligned<uint64_t>(data_ + table_start + 16);
+    }
+    return ReadMetadata(xattr_table_start, end, &unused);
+  }
+
+  bool ReadFragments(const Buffer& fragments) {
+    for (uint64_t idx = 0; idx < sb_.fragment_count; idx++) {
+      auto entry = fragments.data() + idx * kSquashfsFragmentEntrySize;
+      TEST_AND_RETURN_FALSE(AddDataBlock(get_unaligned<uint64_t>(entry),
+                                         get_unaligned<uint32_t>(entry + 8)));
+    }
+    return true;
+  }
+
+  // Adds the data block at |offset| with the on-disk size field |size|. If
+  // given, |length| is set to the size of the block in the image.
+  bool AddDataBlock(uint64_t offset,
+                    uint32_t size,
+                    uint64_t* length = nullptr) {
+    uint64_t block_length = size & (kSquashfsDataUncompressed - 1);
+    TEST_AND_RETURN_FALSE(offset <= sb_.bytes_used &&
+                          block_length <= sb_.bytes_used - offset);
+    // A zero size is a sparse block, which is not stored at all.
+    if (block_length > 0 && !(size & kSquashfsDataUncompressed)) {
+      zlibs_.emplace_back(offset, block_length);
+    }
+    if (length) {
+      *length = block_length;
+    }
+    return true;
+  }
+
+  bool ReadInodes(const Buffer& inodes) {
+    uint64_t pos = 0;
+    // Reads the next |sizeof(T)| bytes of the inode table.
+    auto read = [&inodes, &pos](auto* value) {
+      TEST_AND_RETURN_FALSE(inodes.size() - pos >= sizeof(*value));
+      *value = get_unaligned<std::remove_pointer_t<decltype(value)>>(
+          inodes.data() + pos);
+      pos += sizeof(*value);
+      return true;
+    };
+    auto skip = [&inodes, &pos](uint64_t length) {
+      TEST_AND_RETURN_FALSE(inodes.size() - pos >= length);
+      pos += length;
+      return true;
+    };
+
+    for (uint32_t idx = 0; idx < sb_.inode_count; idx++) {
+      uint16_t type;
+      TEST_AND_RETURN_FALSE(read(&type) && skip(14));
+      uint32_t blocks_start32, fragment, file_size32, link_size, index_count;
+      uint64_t blocks_start, file_size;
+      switch (type) {
+        case 1:  // Directory.
+          TEST_AND_RETURN_FALSE(skip(16));
+          break;
+        case 8: {  // Extended directory.
+          uint16_t count;
+          TEST_AND_RETURN_FALSE(skip(16) && read(&count) && skip(6));
+          index_count = count;
+          for (uint32_t entry = 0; entry < index_count; entry++) {
+            uint32_t name_size;
+            TEST_AND_RETURN_FALSE(skip(8) && read(&name_size) &&
+                                  skip(name_size + 1ULL));
+          }
+          break;
+        }
+        case 2:  // File.
+          TEST_AND_RETURN_FALSE(read(&blocks_start32) && read(&fragment) &&
+                                skip(4) && read(&file_size32));
+          TEST_AND_RETURN_FALSE(
+              ReadFileBlocks(inodes, &pos, blocks_start32, file_size32,
+                             fragment));
+          break;
+        case 9:  // Extended file.
+          TEST_AND_RETURN_FALSE(read(&blocks_start) && read(&file_size) &&
+                                skip(12) && read(&fragment) && skip(8));
+          TEST_AND_RETURN_FALSE(
+              ReadFileBlocks(inodes, &pos, blocks_start, file_size, fragment));
+          break;
+        case 3:   // Symbolic link.
+        case 10:  // Extended symbolic link.
+          TEST_AND_RETURN_FALSE(skip(4) && read(&link_size) &&
+                                skip(link_size + (type == 10 ? 4ULL : 0)));
+          break;
+        case 4:  // Block device.
+        case 5:  // Character device.
+          TEST_AND_RETURN_FALSE(skip(8));
+          break;
+        case 11:  // Extended block device.
+        case 12:  // Extended character device.
+          TEST_AND_RETURN_FALSE(skip(12));
+          break;
+        case 6:  // FIFO.
+        case 7:  // Socket.
+          TEST_AND_RETURN_FALSE(skip(4));
+          break;
+        case 13:  // Extended FIFO.
+        case 14:  // Extended socket.
+          TEST_AND_RETURN_FALSE(skip(8));
+          break;
+        default:
+          LOG(ERROR) << "Invalid squashfs inode type: " << type;
+          return false;
+      }
+    }
+    return true;
+  }
+
+  // Adds the data blocks of a file. Their sizes follow the inode at |*pos| of
+  // |inodes|. The tail of the file is in a fragment block, unless |fragment| is
+  // |kSquashfsNoFragment|.
+  bool ReadFileBlocks(const Buffer& inodes,
+                      uint64_t* pos,
+                      uint64_t blocks_start,
+                      uint64_t file_size,
+                      uint32_t fragment) {
+    auto num_blocks = file_size / sb_.block_size;
+    if (fragment == kSquashfsNoFragment && file_size % sb_.block_size != 0) {
+      num_blocks++;
+    }
+    TEST_AND_RETURN_FALSE((inodes.size() - *pos) / 4 >= num_blocks);
+    auto offset = blocks_start;
+    for (uint64_t idx = 0; idx < num_blocks; idx++, *pos += 4) {
+      uint64_t length;
+      TEST_AND_RETURN_FALSE(AddDataBlock(
+          offset, get_unaligned<uint32_t>(inodes.data() + *pos), &length));
+      offset += length;
+    }
+    return true;
+  }
+
+  // Decompresses the zlib stream of |length| bytes at |offset|.
+  bool Inflate(uint64_t offset, uint64_t length, Buffer* output) {
+    // Skip the 2 bytes of zlib header. The Adler-32 checksum at the end is not
+    // needed. Passing a list of deflates makes the puffer stop after the final
+    // deflate block.
+    TEST_AND_RETURN_FALSE(length >= 6);
+    Puffer puffer;
+    BufferBitReader bit_reader(data_ + offset + 2, length - 2);
+    InflatingPuffWriter puff_writer(output);
+    vector<BitExtent> deflates;
+    return puffer.PuffDeflate(&bit_reader, &puff_writer, &deflates);
+  }
+
+  const uint8_t* data_;
+  uint64_t size_;
+  SquashfsSuperblock sb_;
+  vector<uint64_t> table_starts_;
+  vector<ByteExtent> zlibs_;
+
+  DISALLOW_COPY_AND_ASSIGN(SquashfsParser);
+};
+
+}  // namespace
+
+bool LocateDeflatesInSquashfs(const Buffer& data,
+                              vector<BitExtent>* deflates,
+                              size_t num_threads) {
+  return LocateDeflatesInSquashfs(data.data(), data.size(), deflates,
+                                  num_threads);
+}
+
+bool LocateDeflatesInSquashfs(const uint8_t* data,
+                              uint64_t size,
+                              vector<BitExtent>* deflates,
+                              size_t num_threads) {
+  vector<ByteExtent> zlibs;
+  SquashfsParser parser(data, size);
+  TEST_AND_RETURN_FALSE(parser.Parse(&zlibs));
+
+  // The blocks are independent, so they are searched in parallel and the
+  // results are appended in the original order.
+  vector<vector<BitExtent>> block_deflates(zlibs.size());
+  TEST_AND_RETURN_FALSE(
+      ParallelFor(zlibs.size(), num_threads, [&](size_t idx) {
+        const auto& zlib = zlibs[idx];
+        vector<BitExtent> tmp_deflates;
+        if (!LocateDeflatesInZlib(data + zlib.offset, zlib.length,
+                                  &tmp_deflates)) {
+          LOG(ERROR) << "Failed to locate the deflates in the squashfs block"
+                     << " at: " << zlib.offset;
+          return false;
+        }
+        for (const auto& deflate : tmp_deflates) {
+          block_deflates[idx].emplace_back(deflate.offset + zlib.offset * 8,
+                                           deflate.length);
+        }
+        return true;
+      }));
+  for (const auto& block : block_deflates) {
+    deflates->insert(deflates->end(), block.begin(), block.end());
+  }
+  return true;
+}
+
+namespace {
+
+// A puff writer that passes the puff data on to |pw| and records where each
+// deflate block after the first one starts, both in bits in the deflate stream
+// read by |br| and in bytes in the puff written so far. A block is only
+// recorded once its header is read, so trailing bits after the last block are
+// not mistaken for another block.
+class BlockIndexPuffWriter : public PuffWriterInterface {
+ public:
+  BlockIndexPuffWriter(BitReaderInterface* br,
+                       PuffWriterInterface* pw,
+                       vector<std::pair<uint64_t, uint64_t>>* block_starts)
+      : br_(br), pw_(pw), block_starts_(block_starts), has_block_end_(false) {}
+  ~BlockIndexPuffWriter() override = default;
+
+  bool Insert(const PuffData& pd) override {
+    if (pd.type == PuffData::Type::kBlockMetadata && has_block_end_) {
+      block_starts_->push_back(block_end_);
+      has_block_end_ = false;
+    }
+    TEST_AND_RETURN_FALSE(pw_->Insert(pd));
+    if (pd.type == PuffData::Type::kEndOfBlock) {
+      block_end_ = {br_->OffsetInBits(), pw_->Size()};
+      has_block_end_ = true;
+    }
+    return true;
+  }
+  bool Flush() override { return pw_->Flush(); }
+  size_t Size() override { return pw_->Size(); }
+
+ private:
+  BitReaderInterface* br_;
+  PuffWriterInterface* pw_;
+  vector<std::pair<uint64_t, uint64_t>>* block_starts_;
+  std::pair<uint64_t, uint64_t> block_end_;
+  bool has_block_end_;
+
+  DISALLOW_COPY_AND_ASSIGN(BlockIndexPuffWriter);
+};
+
+// Puffs the bits in |extent| of |data| into |puff| of |puff_size| bytes, or
+// only finds the size of their puff if |puff| is null. The size of the puff is
+// returned in |out_puff_size|.
+bool PuffBits(const Puffer& puffer,
+              const uint8_t* data,
+              uint64_t size,
+              const BitExtent& extent,
+              uint8_t* puff,
+              uint64_t puff_size,
+              uint64_t* out_puff_size) {
+  auto start_byte = extent.offset / 8;
+  auto end_byte = (extent.offset + extent.length + 7) / 8;
+  TEST_AND_RETURN_FALSE(end_byte <= size);
+  BufferBitReader bit_reader(data + start_byte, end_byte - start_byte);
+  uint64_t bits_to_skip = extent.offset % 8;
+  TEST_AND_RETURN_FALSE(bit_reader.CacheBits(bits_to_skip));
+  bit_reader.DropBits(bits_to_skip);
+
+  BufferPuffWriter puff_writer(puff, puff_size);
+  TEST_AND_RETURN_FALSE(puffer.PuffDeflate(&bit_reader, &puff_writer, nullptr));
+  TEST_AND_RETURN_FALSE(end_byte - start_byte == bit_reader.Offset());
+  *out_puff_size = puff_writer.Size();
+  return true;
+}
+
+}  // namespace
+
+bool PuffDeflateBlocks(const Puffer& puffer,
+                       const uint8_t* data,
+                       uint64_t size,
+                       const BitExtent& blocks,
+                       uint8_t* puff,
+                       uint64_t puff_size) {
+  uint64_t out_puff_size;
+  TEST_AND_RETURN_FALSE(
+      PuffBits(puffer, data, size, blocks, puff, puff_size, &out_puff_size));
+  TEST_AND_RETURN_FALSE(out_puff_size == puff_size);
+  return true;
+}
+
+bool PuffDeflateInParallel(const Buffer& data,
+                           const vector<BitExtent>& sub_blocks,
+                           Buffer* puff,
+                           size_t num_threads) {
+  TEST_AND_RETURN_FALSE(!sub_blocks.empty());
+  for (size_t idx = 1; idx < sub_blocks.size(); idx++) {
+    TEST_AND_RETURN_FALSE(sub_blocks[idx].offset >=
+                          sub_blocks[idx - 1].offset +
+                              sub_blocks[idx - 1].length);
+  }
+  auto start = sub_blocks.front().offset;
+  auto end = sub_blocks.back().offset + sub_blocks.back().length;
+
+  // Split the deflate at the block starts into a few ranges per thread, so
+  // threads that finish early can pick up more. A range reaches up to the start
+  // of the next one, which covers any stored blocks missing from |sub_blocks|.
+  auto num_ranges = std::min<uint64_t>(sub_blocks.size(), num_threads * 4);
+  auto min_range_length = (end - start) / std::max<uint64_t>(num_ranges, 1);
+  vector<BitExtent> ranges;
+  for (const auto& block : sub_blocks) {
+    if (ranges.empty() ||
+        block.offset - ranges.back().offset >= min_range_length) {
+      if (!ranges.empty()) {
+        ranges.back().length = block.offset - ranges.back().offset;
+      }
+      ranges.emplace_back(block.offset, 0);
+    }
+  }
+  ranges.back().length = end - ranges.back().offset;
+
+  // The puffs of the ranges are stitched in order, so their sizes are found
+  // first to know where each one goes.
+  vector<uint64_t> puff_offsets(ranges.size() + 1, 0);
+  TEST_AND_RETURN_FALSE(
+      ParallelFor(ranges.size(), num_threads, [&](size_t idx) {
+        Puffer puffer;
+        return PuffBits(puffer, data.data(), data.size(), ranges[idx], nullptr,
+                        0, &puff_offsets[idx + 1]);
+      }));
+  for (size_t idx = 0; idx < ranges.size(); idx++) {
+    puff_offsets[idx + 1] += puff_offsets[idx];
+  }
+
+  puff->resize(puff_offsets.back());
+  return ParallelFor(ranges.size(), num_threads, [&](size_t idx) {
+    Puffer puffer;
+    return PuffDeflateBlocks(puffer, data.data(), data.size(), ranges[idx],
+                             puff->data() + puff_offsets[idx],
+                             puff_offsets[idx + 1] - puff_offsets[idx]);
+  });
+}
+
+bool FindPuffLocations(const UniqueStreamPtr& src,
+                       const vector<BitExtent>& deflates,
+                       vector<ByteExtent>* puffs,
+                       uint64_t* out_puff_size) {
+  return FindPuffLocations(src, deflates, puffs, out_puff_size, nullptr,
+                           nullptr);
+}
+
+bool FindPuffLocations(const UniqueStreamPtr& src,
+                       const vector<BitExtent>& deflates,
+                       vector<ByteExtent>* puffs,
+                       uint64_t* out_puff_size,
+                       vector<BitExtent>* sub_blocks,
+                       vector<ByteExtent>* sub_puffs) {
+  Puffer puffer;
+  Buffer deflate_buffer;
+
+  // Here accumulate the size difference between each corresponding deflate and
+  // puff. At the end we add this cummulative size difference to the size of the
+  // deflate stream to get the size of the puff stream. We use signed size
+  // because puff size could be smaller than deflate size.
+  int64_t total_size_difference = 0;
+  for (auto deflate = deflates.begin(); deflate != deflates.end(); ++deflate) {
+    // Read from src into deflate_buffer.
+    auto start_byte = deflate->offset / 8;
+    auto end_byte = (deflate->offset + deflate->length + 7) / 8;
+    deflate_buffer.resize(end_byte - start_byte);
+    TEST_AND_RETURN_FALSE(src->Seek(start_byte));
+    TEST_AND_RETURN_FALSE(
+        src->Read(deflate_buffer.data(), deflate_buffer.size()));
+    // Find the size of the puff.
+    BufferBitReader bit_reader(deflate_buffer.data(), deflate_buffer.size());
+    uint64_t bits_to_skip = deflate->offset % 8;
+    TEST_AND_RETURN_FALSE(bit_reader.CacheBits(bits_to_skip));
+    bit_reader.DropBits(bits_to_skip);
+
+    BufferPuffWriter puff_writer(nullptr, 0);
+    vector<std::pair<uint64_t, uint64_t>> block_starts;
+    BlockIndexPuffWriter index_writer(&bit_reader, &puff_writer,
+                                      &block_starts);
+    TEST_AND_RETURN_FALSE(
+        puffer.PuffDeflate(&bit_reader, &index_writer, nullptr));
+    TEST_AND_RETURN_FALSE(deflate_buffer.size() == bit_reader.Offset());
+    auto deflate_start_bit = (deflate->offset / 8) * 8;
+
+    // 1 if a deflate ends at the same byte that the next deflate starts and
+    // there is a few bits gap between them. In practice this may never happen,
+    // but it is a good idea to support it anyways. If there is a gap, the value
+    // of the gap will be saved as an integer byte to the puff stream. The parts
+    // of the byte that belogs to the deflates are shifted out.
+    int gap = 0;
+    if (deflate != deflates.begin()) {
+      auto prev_deflate = std::prev(deflate);
+      if ((prev_deflate->offset + prev_deflate->length == deflate->offset)
+          // If deflates are on byte boundary the gap will not be counted later,
+          // so we won't worry about it.
+          && (deflate->offset % 8 != 0)) {
+        gap = 1;
+      }
+    }
+
+    start_byte = ((deflate->offset + 7) / 8);
+    end_byte = (deflate->offset + deflate->length) / 8;
+    int64_t deflate_length_in_bytes = end_byte - start_byte;
+
+    // If there was no gap bits between the current and previous deflates, there
+    // will be no extra gap byte, so the offset will be shifted one byte back.
+    auto puff_offset = start_byte - gap + total_size_difference;
+    auto puff_size = puff_writer.Size();
+    // Add the location into puff.
+    puffs->emplace_back(puff_offset, puff_size);
+    if (sub_blocks != nullptr && sub_puffs != nullptr) {
+      // Each block reaches up to the start of the next one.
+      BitExtent block(deflate->offset, 0);
+      ByteExtent block_puff(puff_offset, 0);
+      for (const auto& block_start : block_starts) {
+        auto block_end = deflate_start_bit + block_start.first;
+        auto block_puff_end = puff_offset + block_start.second;
+        block.length = block_end - block.offset;
+        block_puff.length = block_puff_end - block_puff.offset;
+        sub_blocks->push_back(block);
+        sub_puffs->push_back(block_puff);
+        block = BitExtent(block_end, 0);
+        block_puff = ByteExtent(block_puff_end, 0);
+      }
+      block.length = deflate->offset + deflate->length - block.offset;
+      block_puff.length = puff_offset + puff_size - block_puff.offset;
+      sub_blocks->push_back(block);
+      sub_puffs->push_back(block_puff);
+    }
+    total_size_difference +=
+        static_cast<int64_t>(puff_size) - deflate_length_in_bytes - gap;
+  }
+
+  uint64_t src_size;
+  TEST_AND_RETURN_FALSE(src->GetSize(&src_size));
   auto final_size = static_cast<int64_t>(src_size) + total_size_difference;
   TEST_AND_RETURN_FALSE(final_size >= 0);
   *out_puff_size = final_size;
@@ -390,28 +3066,47 @@ void RemoveEqualBitExtents(const Buffer& data1,
                            const Buffer& data2,
                            vector<BitExtent>* extents1,
                            vector<BitExtent>* extents2) {
-  set<ExtentData> extent1_set, equal_extents;
-  for (const BitExtent& ext : *extents1) {
-    extent1_set.emplace(ext, data1);
+  // The extents are indexed by the hashes of their data, and extents with
+  // equal hashes are compared to rule out collisions.
+  using ExtentIndex = std::unordered_multimap<uint64_t, BitExtent>;
+  auto find = [](const ExtentIndex& index, const Buffer& index_data,
+                 uint64_t hash, const ExtentData& extent_data) {
+    auto range = index.equal_range(hash);
+    return std::any_of(range.first, range.second, [&](const auto& entry) {
+      return ExtentData(entry.second, index_data) == extent_data;
+    });
+  };
+
+  auto hashes1 = HashExtents(data1, *extents1);
+  auto hashes2 = HashExtents(data2, *extents2);
+  ExtentIndex extents1_index, equal_extents;
+  extents1_index.reserve(extents1->size());
+  for (size_t idx = 0; idx < extents1->size(); idx++) {
+    extents1_index.emplace(hashes1[idx], (*extents1)[idx]);
   }
 
   auto new_extents2_end = extents2->begin();
-  for (const BitExtent& ext : *extents2) {
-    ExtentData extent_data(ext, data2);
-    if (extent1_set.find(extent_data) != extent1_set.end()) {
-      equal_extents.insert(extent_data);
+  for (size_t idx = 0; idx < hashes2.size(); idx++) {
+    const auto ext = (*extents2)[idx];
+    if (find(extents1_index, data1, hashes2[idx], ExtentData(ext, data2))) {
+      equal_extents.emplace(hashes2[idx], ext);
     } else {
       *new_extents2_end++ = ext;
     }
   }
   extents2->erase(new_extents2_end, extents2->end());
-  extents1->erase(
-      std::remove_if(extents1->begin(), extents1->end(),
-                     [&equal_extents, &data1](const BitExtent& ext) {
-                       return equal_extents.find(ExtentData(ext, data1)) !=
-                              equal_extents.end();
-                     }),
-      extents1->end());
+  // |extents1| has changed if it is the same as |extents2|.
+  if (extents1 == extents2) {
+    hashes1 = HashExtents(data1, *extents1);
+  }
+  auto new_extents1_end = extents1->begin();
+  for (size_t idx = 0; idx < hashes1.size(); idx++) {
+    const auto ext = (*extents1)[idx];
+    if (!find(equal_extents, data2, hashes1[idx], ExtentData(ext, data1))) {
+      *new_extents1_end++ = ext;
+    }
+  }
+  extents1->erase(new_extents1_end, extents1->end());
 }
 
 bool RemoveDeflatesWithBadDistanceCaches(const Buffer& data,
@@ -2,8 +2,11 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <stdio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <vector>
 
 #include "gtest/gtest.h"
@@ -11,7 +14,12 @@
 #include "puffin/file_stream.h"
 #include "puffin/memory_stream.h"
 #include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/huffer.h"
+#include "puffin/src/include/puffin/puffer.h"
 #include "puffin/src/include/puffin/utils.h"
+#include "puffin/src/nested_deflate.h"
+#include "puffin/src/parallel.h"
+#include "puffin/src/puffin_stream.h"
 #include "puffin/src/unittest_common.h"
 
 using std::string;
@@ -77,12 +85,262 @@ const uint8_t kGzipEntryWithExtraField[] = {
     0x34, 0x32, 0x36, 0x31, 0x35, 0x33, 0xb7, 0xb0, 0xe4, 0x02, 0x00, 0xd1,
     0xe5, 0x76, 0x40, 0x0b, 0x00, 0x00, 0x00};
 
+// A non-final deflate block with dynamic Huffman codes followed by the empty
+// stored block of a zlib full flush, so it can be repeated to make a long
+// deflate stream.
+const uint8_t kDynamicBlockAndFlush[] = {
+    0x0c, 0xc9, 0x4b, 0x0e, 0x82, 0x30, 0x14, 0x05, 0xd0, 0xad, 0x5c, 0xe7,
+    0x0e, 0x50, 0x41, 0xd1, 0xb9, 0x0b, 0xe0, 0x93, 0x18, 0x87, 0xa5, 0xef,
+    0x56, 0x5e, 0x2c, 0xad, 0xa1, 0x85, 0x18, 0x57, 0x2f, 0xc3, 0x93, 0xd3,
+    0x7d, 0x68, 0x17, 0x6f, 0xb2, 0xae, 0x84, 0xd0, 0x46, 0xd1, 0xf0, 0x82,
+    0xd3, 0x20, 0x69, 0xa3, 0xdb, 0x82, 0x18, 0x7c, 0xb4, 0x6f, 0x8c, 0x34,
+    0xc2, 0x39, 0x41, 0x03, 0xf2, 0x48, 0x4c, 0x2a, 0xe2, 0x89, 0xe8, 0x60,
+    0x90, 0xf2, 0x4c, 0x33, 0xdd, 0x50, 0x1c, 0x8e, 0xa7, 0xb2, 0x3a, 0x5f,
+    0xea, 0xeb, 0x1e, 0xcd, 0xe3, 0xde, 0xf6, 0x4f, 0xfc, 0xbe, 0x76, 0x1d,
+    0x76, 0x7f, 0x00, 0x00, 0x00, 0xff, 0xff};
+
+// A BGZF file with two members and the empty end of file member. The BC
+// subfield of the extra field of each member has its size minus one.
+const uint8_t kBgzfFile[] = {
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00,
+    0x42, 0x43, 0x02, 0x00, 0x2f, 0x00, 0x4b, 0xcb, 0x2c, 0x2a, 0x2e, 0x51,
+    0x48, 0x4a, 0xaf, 0x4a, 0x53, 0x48, 0xca, 0xc9, 0x4f, 0xce, 0xe6, 0x4a,
+    0x23, 0x28, 0x00, 0x00, 0xa9, 0x4a, 0x97, 0x7f, 0x33, 0x00, 0x00, 0x00,
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00,
+    0x42, 0x43, 0x02, 0x00, 0x30, 0x00, 0x2b, 0x4e, 0x4d, 0xce, 0xcf, 0x4b,
+    0x51, 0x48, 0x4a, 0xaf, 0x4a, 0x53, 0x48, 0xca, 0xc9, 0x4f, 0xce, 0xe6,
+    0x2a, 0x26, 0x42, 0x04, 0x00, 0xb9, 0x78, 0x38, 0x06, 0x36, 0x00, 0x00,
+    0x00, 0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06,
+    0x00, 0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00};
+
+// A zip archive written by python's zipfile with two entries. "a" is deflated
+// and written with |force_zip64|, so the sizes in its local file header are
+// 0xFFFFFFFF. "b" is stored and is a zip archive itself with one deflated
+// entry.
+const uint8_t kZipArchive[] = {
+    0x50, 0x4b, 0x03, 0x04, 0x2d, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00,
+    0x21, 0x58, 0x8d, 0xb3, 0xfd, 0x21, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0x01, 0x00, 0x14, 0x00, 0x61, 0x01, 0x00, 0x10, 0x00, 0x0a,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x4b, 0x4c, 0x4a, 0x4e, 0x04, 0x23, 0x2e, 0x00, 0x50,
+    0x4b, 0x03, 0x04, 0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x21,
+    0x58, 0xd2, 0x8b, 0xe0, 0xba, 0x73, 0x00, 0x00, 0x00, 0x73, 0x00, 0x00,
+    0x00, 0x01, 0x00, 0x00, 0x00, 0x62, 0x50, 0x4b, 0x03, 0x04, 0x14, 0x00,
+    0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x21, 0x58, 0x94, 0x07, 0x5c, 0x2d,
+    0x0f, 0x00, 0x00, 0x00, 0x1e, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+    0x69, 0x33, 0x30, 0x34, 0x32, 0x36, 0x31, 0x35, 0x33, 0xb7, 0xb0, 0x34,
+    0xc0, 0xc2, 0x02, 0x00, 0x50, 0x4b, 0x01, 0x02, 0x14, 0x03, 0x14, 0x00,
+    0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x21, 0x58, 0x94, 0x07, 0x5c, 0x2d,
+    0x0f, 0x00, 0x00, 0x00, 0x1e, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x01, 0x00, 0x00,
+    0x00, 0x00, 0x69, 0x50, 0x4b, 0x05, 0x06, 0x00, 0x00, 0x00, 0x00, 0x01,
+    0x00, 0x01, 0x00, 0x2f, 0x00, 0x00, 0x00, 0x2e, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x50, 0x4b, 0x01, 0x02, 0x2d, 0x03, 0x2d, 0x00, 0x00, 0x00, 0x08,
+    0x00, 0x00, 0x00, 0x21, 0x58, 0x8d, 0xb3, 0xfd, 0x21, 0x08, 0x00, 0x00,
+    0x00, 0x0a, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x01, 0x00, 0x00, 0x00, 0x00, 0x61,
+    0x50, 0x4b, 0x01, 0x02, 0x14, 0x03, 0x14, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x21, 0x58, 0xd2, 0x8b, 0xe0, 0xba, 0x73, 0x00, 0x00, 0x00,
+    0x73, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x80, 0x01, 0x3b, 0x00, 0x00, 0x00, 0x62, 0x50,
+    0x4b, 0x05, 0x06, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x02, 0x00, 0x5e,
+    0x00, 0x00, 0x00, 0xcd, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+// |kZipArchive| with ZIP64 central directory headers and end of central
+// directory records.
+const uint8_t kZip64Archive[] = {
+    0x50, 0x4b, 0x03, 0x04, 0x2d, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00,
+    0x21, 0x58, 0x8d, 0xb3, 0xfd, 0x21, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0x01, 0x00, 0x14, 0x00, 0x61, 0x01, 0x00, 0x10, 0x00, 0x0a,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x4b, 0x4c, 0x4a, 0x4e, 0x04, 0x23, 0x2e, 0x00, 0x50,
+    0x4b, 0x03, 0x04, 0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x21,
+    0x58, 0xd2, 0x8b, 0xe0, 0xba, 0x73, 0x00, 0x00, 0x00, 0x73, 0x00, 0x00,
+    0x00, 0x01, 0x00, 0x00, 0x00, 0x62, 0x50, 0x4b, 0x03, 0x04, 0x14, 0x00,
+    0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x21, 0x58, 0x94, 0x07, 0x5c, 0x2d,
+    0x0f, 0x00, 0x00, 0x00, 0x1e, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+    0x69, 0x33, 0x30, 0x34, 0x32, 0x36, 0x31, 0x35, 0x33, 0xb7, 0xb0, 0x34,
+    0xc0, 0xc2, 0x02, 0x00, 0x50, 0x4b, 0x01, 0x02, 0x14, 0x03, 0x14, 0x00,
+    0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x21, 0x58, 0x94, 0x07, 0x5c, 0x2d,
+    0x0f, 0x00, 0x00, 0x00, 0x1e, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x01, 0x00, 0x00,
+    0x00, 0x00, 0x69, 0x50, 0x4b, 0x05, 0x06, 0x00, 0x00, 0x00, 0x00, 0x01,
+    0x00, 0x01, 0x00, 0x2f, 0x00, 0x00, 0x00, 0x2e, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x50, 0x4b, 0x01, 0x02, 0x2d, 0x03, 0x2d, 0x00, 0x00, 0x00, 0x08,
+    0x00, 0x00, 0x00, 0x21, 0x58, 0x8d, 0xb3, 0xfd, 0x21, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0x01, 0x00, 0x1c, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x01, 0xff, 0xff, 0xff, 0xff, 0x61,
+    0x01, 0x00, 0x18, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x50, 0x4b, 0x01, 0x02, 0x14, 0x03, 0x14, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x21, 0x58, 0xd2, 0x8b, 0xe0, 0xba,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01, 0x00, 0x1c, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x01, 0xff, 0xff,
+    0xff, 0xff, 0x62, 0x01, 0x00, 0x18, 0x00, 0x73, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x73, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3b,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x50, 0x4b, 0x06, 0x06, 0x2c,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x2d, 0x00, 0x2d, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x96,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xcd, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x50, 0x4b, 0x06, 0x07, 0x00, 0x00, 0x00, 0x00, 0x63,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x50,
+    0x4b, 0x05, 0x06, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x00};
+
 // echo "0123456789" | zlib-flate -compress |
 // hexdump -v -e '12/1 "0x%02x, " "\n"'
 const uint8_t kZlibEntry[] = {0x78, 0x9c, 0x33, 0x30, 0x34, 0x32, 0x36,
                               0x31, 0x35, 0x33, 0xb7, 0xb0, 0xe4, 0x02,
                               0x00, 0x0d, 0x17, 0x02, 0x18};
 
+// Streams that are long enough to be carved from raw data, written by python's
+// gzip.compress() and zlib.compress().
+const uint8_t kCarvingGzip[] = {
+    0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x0b, 0x28,
+    0x4d, 0x4b, 0xcb, 0xcc, 0x53, 0xc8, 0x2c, 0x56, 0x48, 0x54, 0x48, 0x49,
+    0x2d, 0x49, 0x2d, 0xca, 0xcd, 0xcc, 0xcb, 0x2c, 0x2e, 0xc9, 0x4c, 0x06,
+    0xf2, 0xd2, 0x72, 0x12, 0x4b, 0x52, 0x15, 0x8a, 0x52, 0x93, 0xf3, 0x73,
+    0x0b, 0x8a, 0x52, 0x8b, 0x8b, 0xf3, 0x8b, 0xf4, 0x14, 0x02, 0x68, 0xac,
+    0xde, 0xb3, 0x44, 0xa1, 0x00, 0xa8, 0x05, 0xa8, 0x3c, 0x2f, 0x45, 0x21,
+    0x03, 0xcc, 0x82, 0x29, 0x2c, 0x2e, 0x29, 0x4a, 0x4d, 0xcc, 0x2d, 0xd6,
+    0xe3, 0x02, 0x00, 0x99, 0xb4, 0xd3, 0xd2, 0xb4, 0x00, 0x00, 0x00};
+
+const uint8_t kCarvingZlib[] = {
+    0x78, 0x9c, 0x0b, 0xc9, 0x48, 0x55, 0x28, 0x2c, 0xcd, 0x4c, 0xce, 0x56,
+    0x48, 0x2a, 0xca, 0x2f, 0xcf, 0x53, 0x48, 0xcb, 0xaf, 0x50, 0xc8, 0x2a,
+    0xcd, 0x2d, 0x28, 0x56, 0xc8, 0x2f, 0x4b, 0x2d, 0x52, 0x28, 0x01, 0x4a,
+    0xe7, 0x24, 0x56, 0x55, 0x2a, 0xa4, 0xe4, 0xa7, 0xeb, 0x29, 0x18, 0x18,
+    0x1a, 0x19, 0x9b, 0x98, 0x9a, 0x99, 0x5b, 0x58, 0x2a, 0x84, 0x0c, 0x11,
+    0x7d, 0x89, 0x49, 0xc9, 0x29, 0xa9, 0x69, 0xe9, 0x19, 0x99, 0x59, 0xd9,
+    0x39, 0xb9, 0x79, 0xf9, 0x05, 0x85, 0x45, 0xc5, 0x25, 0xa5, 0x65, 0xe5,
+    0x15, 0x95, 0x55, 0x5c, 0x00, 0x53, 0x23, 0x54, 0x7a};
+
+// A 24x6 grayscale PNG image with its image data split in two IDAT chunks. The
+// zlib stream has three deflate blocks, and the second one crosses the
+// boundary of the chunks.
+const uint8_t kPngImage[] = {
+    0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d,
+    0x49, 0x48, 0x44, 0x52, 0x00, 0x00, 0x00, 0x18, 0x00, 0x00, 0x00, 0x06,
+    0x08, 0x00, 0x00, 0x00, 0x00, 0xfc, 0xc0, 0x01, 0xcf, 0x00, 0x00, 0x00,
+    0x35, 0x49, 0x44, 0x41, 0x54, 0x78, 0xda, 0x62, 0x48, 0xcb, 0x2c, 0x2a,
+    0x2e, 0x51, 0x28, 0xca, 0x2f, 0x57, 0xc8, 0x4f, 0x53, 0x28, 0xc9, 0x48,
+    0x55, 0xc8, 0xcc, 0x4d, 0x4c, 0x4f, 0x55, 0x50, 0x60, 0xc0, 0x25, 0x01,
+    0x00, 0x00, 0x00, 0xff, 0xff, 0x62, 0x28, 0x4e, 0x4d, 0xce, 0xcf, 0x4b,
+    0x51, 0x28, 0xca, 0x2f, 0x57, 0xc8, 0x4f, 0x53, 0x28, 0xc9, 0x22, 0xc1,
+    0x6d, 0x99, 0x00, 0x00, 0x00, 0x33, 0x49, 0x44, 0x41, 0x54, 0x48, 0x55,
+    0xc8, 0xcc, 0x4d, 0x4c, 0x4f, 0x55, 0x60, 0xc0, 0x25, 0x01, 0x00, 0x00,
+    0x00, 0xff, 0xff, 0x63, 0x28, 0xc9, 0xc8, 0x2c, 0x4a, 0x51, 0x28, 0xca,
+    0x2f, 0x57, 0xc8, 0x4f, 0x53, 0x28, 0xc9, 0x48, 0x55, 0xc8, 0xcc, 0x4d,
+    0x4c, 0x4f, 0x55, 0x50, 0x60, 0xc0, 0x25, 0x01, 0x00, 0xed, 0x56, 0x32,
+    0x65, 0x91, 0xef, 0x5c, 0x75, 0x00, 0x00, 0x00, 0x00, 0x49, 0x45, 0x4e,
+    0x44, 0xae, 0x42, 0x60, 0x82};
+
+// A 64 bit little endian ELF file. .debug_info is compressed with
+// ELFCOMPRESS_ZLIB, .zdebug_line is a legacy compressed debug section,
+// .debug_str is compressed with ELFCOMPRESS_ZSTD and .bss has no data.
+const uint8_t kElfFile[] = {
+    0x7f, 0x45, 0x4c, 0x46, 0x02, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x3e, 0x00, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x10, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00,
+    0x06, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x78, 0xda, 0x4b, 0x49, 0x4d, 0x2a, 0x4d, 0x57,
+    0xc8, 0xcc, 0x4b, 0xcb, 0x57, 0xc8, 0x4f, 0x53, 0x28, 0xc9, 0x48, 0x55,
+    0x48, 0xcd, 0x49, 0x53, 0x48, 0xcb, 0xcc, 0x49, 0x55, 0x48, 0xc1, 0x2d,
+    0x05, 0x00, 0x0c, 0x28, 0x12, 0xc1, 0x5a, 0x4c, 0x49, 0x42, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x36, 0x78, 0xda, 0x4b, 0x49, 0x4d, 0x2a,
+    0x4d, 0x57, 0xc8, 0xc9, 0xcc, 0x4b, 0x55, 0xc8, 0x4f, 0x53, 0x28, 0xc9,
+    0x48, 0x55, 0x48, 0xcd, 0x49, 0x53, 0x48, 0xcb, 0xcc, 0x49, 0x55, 0x48,
+    0xc1, 0x2d, 0x05, 0x00, 0x0b, 0x3a, 0x12, 0xb9, 0x02, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x2e, 0x64, 0x65, 0x62, 0x75, 0x67, 0x5f, 0x69, 0x6e, 0x66, 0x6f,
+    0x00, 0x2e, 0x7a, 0x64, 0x65, 0x62, 0x75, 0x67, 0x5f, 0x6c, 0x69, 0x6e,
+    0x65, 0x00, 0x2e, 0x64, 0x65, 0x62, 0x75, 0x67, 0x5f, 0x73, 0x74, 0x72,
+    0x00, 0x2e, 0x62, 0x73, 0x73, 0x00, 0x2e, 0x73, 0x68, 0x73, 0x74, 0x72,
+    0x74, 0x61, 0x62, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3e, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x0d, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x7e, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x32, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1a, 0x00, 0x00, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xb0, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x28, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x25, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x2a, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xd8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x34, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+// A gzip compressed squashfs image with four files. "a" has a compressed data
+// block and its tail in the fragment block, "b" is only in the fragment block,
+// "c" is an extended inode with an uncompressed data block and "d" is a
+// symbolic link. The id table is not compressed.
+const uint8_t kSquashfsImage[] = {
+    0x68, 0x73, 0x71, 0x73, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x10, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x0c, 0x00,
+    0x00, 0x00, 0x01, 0x00, 0x04, 0x00, 0x00, 0x00, 0x99, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xc6, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xbe, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0x2b, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x7c, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xb0, 0x01, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0x78, 0xda, 0xed, 0xce, 0xbb, 0x09, 0x80, 0x40, 0x14, 0x00, 0xc1, 0xdc,
+    0x2a, 0xae, 0x04, 0xff, 0xa7, 0xe5, 0xa8, 0x20, 0x82, 0x82, 0x1c, 0x0f,
+    0xfb, 0x37, 0x76, 0x23, 0x0b, 0xd8, 0x74, 0xa2, 0x89, 0xf2, 0x2c, 0x71,
+    0xec, 0x91, 0xd6, 0xeb, 0xde, 0xce, 0x54, 0x57, 0xf1, 0x85, 0x86, 0xd0,
+    0x12, 0x3a, 0x42, 0x4f, 0x18, 0x08, 0x23, 0x21, 0x13, 0x26, 0xc2, 0x4c,
+    0x70, 0xea, 0xd4, 0xa9, 0x53, 0xa7, 0x4e, 0x9d, 0x3a, 0x75, 0xea, 0xd4,
+    0xa9, 0x53, 0xa7, 0x4e, 0x9d, 0xfe, 0x9e, 0xbe, 0xae, 0xbb, 0x9e, 0x3d,
+    0x44, 0x20, 0x82, 0x3c, 0xfd, 0xe6, 0xf1, 0xc2, 0x6b, 0x30, 0xf9, 0x0e,
+    0xc7, 0xdd, 0x01, 0xe4, 0x78, 0xda, 0xed, 0xce, 0x3b, 0x12, 0x40, 0x30,
+    0x18, 0x45, 0xe1, 0x3e, 0xab, 0xb8, 0x2b, 0x30, 0xde, 0x8f, 0xe5, 0x04,
+    0x09, 0x19, 0x11, 0xc3, 0x8f, 0xf5, 0x2b, 0x74, 0xb7, 0x33, 0xda, 0xb4,
+    0xdf, 0x9c, 0xe2, 0x28, 0xd9, 0x2f, 0x2d, 0xb3, 0x15, 0xf4, 0x7e, 0x1b,
+    0x16, 0x64, 0x8a, 0x20, 0x67, 0x28, 0x18, 0x4a, 0x86, 0x8a, 0xa1, 0x66,
+    0x68, 0x18, 0x5a, 0x86, 0x8e, 0x21, 0x55, 0xf1, 0x34, 0x9e, 0xc6, 0xd3,
+    0x1f, 0xa7, 0xd6, 0x79, 0x83, 0x1e, 0x4e, 0x20, 0xf3, 0x76, 0x9c, 0xd0,
+    0x61, 0x84, 0x77, 0xb7, 0x11, 0xb8, 0x00, 0x0d, 0x7b, 0xe8, 0x69, 0x35,
+    0xe1, 0x7c, 0xfb, 0x04, 0x1f, 0xf3, 0x07, 0x9f, 0xe5, 0x80, 0xfb, 0x4f,
+    0x00, 0x78, 0xda, 0x63, 0x62, 0x58, 0xc2, 0xc8, 0x00, 0x05, 0x4c, 0x40,
+    0x9c, 0xc0, 0x80, 0x00, 0x6f, 0x84, 0x19, 0x18, 0x42, 0xc0, 0xe2, 0x08,
+    0x35, 0xcc, 0xc8, 0xf2, 0x40, 0x4e, 0x1c, 0x90, 0xe6, 0x44, 0x92, 0x67,
+    0x01, 0xe2, 0x2d, 0x50, 0xb6, 0x00, 0x03, 0x2a, 0x00, 0x29, 0xfa, 0x0f,
+    0x04, 0x0c, 0x50, 0x1a, 0x28, 0xcf, 0xc8, 0x8c, 0xa4, 0x97, 0x15, 0xaa,
+    0x06, 0x84, 0x13, 0x19, 0x91, 0x24, 0x18, 0x91, 0x1c, 0x68, 0x0c, 0xc4,
+    0x6c, 0x40, 0x0c, 0x00, 0x8c, 0x53, 0x0f, 0xc6, 0x22, 0x00, 0x78, 0xda,
+    0x63, 0x66, 0x80, 0x00, 0x26, 0x24, 0x3a, 0x51, 0x85, 0x81, 0x11, 0xcc,
+    0x48, 0x72, 0x01, 0x52, 0x20, 0x46, 0x72, 0x03, 0x03, 0x33, 0x10, 0x32,
+    0x30, 0xa4, 0x00, 0x00, 0x25, 0x2f, 0x02, 0x87, 0x0e, 0x00, 0x78, 0xda,
+    0x3b, 0xc2, 0x00, 0x01, 0xe9, 0x50, 0x1a, 0x00, 0x0f, 0x88, 0x01, 0x2c,
+    0xa0, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x80, 0x00, 0x00,
+    0x00, 0x00, 0xb8, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
 void FindDeflatesInZlibBlocks(const Buffer& src,
                               const vector<ByteExtent>& zlibs,
                               const vector<BitExtent>& deflates) {
@@ -97,6 +355,10 @@ void FindDeflatesInZlibBlocks(const Buffer& src,
   vector<BitExtent> deflates_out;
   ASSERT_TRUE(LocateDeflatesInZlibBlocks(tmp_file, zlibs, &deflates_out));
   ASSERT_EQ(deflates, deflates_out);
+
+  deflates_out.clear();
+  ASSERT_TRUE(LocateDeflatesInZlibBlocks(tmp_file, zlibs, &deflates_out, 4));
+  ASSERT_EQ(deflates, deflates_out);
 }
 
 void CheckFindPuffLocation(const Buffer& compressed,
@@ -110,6 +372,23 @@ void CheckFindPuffLocation(const Buffer& compressed,
   EXPECT_EQ(puffs, expected_puffs);
   EXPECT_EQ(puff_size, expected_puff_size);
 }
+
+// Appends a ustar header and the padded content of a regular file to |tar|.
+void AppendTarFile(const Buffer& content, Buffer* tar) {
+  Buffer header(512, 0);
+  header[0] = 'f';  // File name
+  snprintf(reinterpret_cast<char*>(&header[124]), 12, "%011zo", content.size());
+  header[156] = '0';  // Regular file
+  memcpy(&header[257], "ustar\00000", 8);
+  unsigned int checksum = 8 * ' ';
+  for (auto byte : header) {
+    checksum += byte;
+  }
+  snprintf(reinterpret_cast<char*>(&header[148]), 8, "%06o", checksum);
+  tar->insert(tar->end(), header.begin(), header.end());
+  tar->insert(tar->end(), content.begin(), content.end());
+  tar->resize((tar->size() + 511) / 512 * 512);
+}
 }  // namespace
 
 // Test Simple Puffing of the source.
@@ -123,6 +402,132 @@ TEST(UtilsTest, FindPuffLocations2Test) {
                         kPuffExtentsSample2, kPuffsSample2.size());
 }
 
+TEST(UtilsTest, FindPuffLocationsBlockIndexTest) {
+  Buffer deflate = kMultiBlockDeflate;
+  vector<BitExtent> deflates = {{0, deflate.size() * 8}};
+  vector<ByteExtent> puffs, sub_puffs;
+  vector<BitExtent> sub_blocks;
+  uint64_t puff_size;
+  ASSERT_TRUE(FindPuffLocations(MemoryStream::CreateForRead(deflate), deflates,
+                                &puffs, &puff_size, &sub_blocks, &sub_puffs));
+  ASSERT_EQ(puffs.size(), 1u);
+  ASSERT_EQ(puff_size, puffs[0].length);
+  Puffer puffer;
+  Buffer puff(puff_size);
+  ASSERT_TRUE(PuffDeflateBlocks(puffer, deflate.data(), deflate.size(),
+                                deflates[0], puff.data(), puff.size()));
+
+  // The blocks cover the deflate and the puffs of the blocks cover its puff.
+  ASSERT_GT(sub_blocks.size(), 3u);
+  ASSERT_EQ(sub_blocks.size(), sub_puffs.size());
+  uint64_t bit_offset = 0, puff_offset = 0;
+  for (size_t idx = 0; idx < sub_blocks.size(); idx++) {
+    EXPECT_EQ(sub_blocks[idx].offset, bit_offset);
+    EXPECT_EQ(sub_puffs[idx].offset, puff_offset);
+    bit_offset += sub_blocks[idx].length;
+    puff_offset += sub_puffs[idx].length;
+
+    // Each block puffs on its own into its part of the puff.
+    Buffer block_puff(sub_puffs[idx].length);
+    ASSERT_TRUE(PuffDeflateBlocks(puffer, deflate.data(), deflate.size(),
+                                  sub_blocks[idx], block_puff.data(),
+                                  block_puff.size()));
+    EXPECT_TRUE(std::equal(block_puff.begin(), block_puff.end(),
+                           puff.begin() + sub_puffs[idx].offset));
+  }
+  EXPECT_EQ(bit_offset, deflates[0].length);
+  EXPECT_EQ(puff_offset, puff_size);
+
+  // Without an index the deflate is a single block.
+  sub_blocks.clear();
+  sub_puffs.clear();
+  ASSERT_TRUE(FindPuffLocations(MemoryStream::CreateForRead(kDeflatesSample1),
+                                kSubblockDeflateExtentsSample1, &puffs,
+                                &puff_size, &sub_blocks, &sub_puffs));
+  EXPECT_EQ(sub_blocks, kSubblockDeflateExtentsSample1);
+  EXPECT_EQ(sub_puffs, kPuffExtentsSample1);
+}
+
+TEST(UtilsTest, PuffDeflateInParallelTest) {
+  Buffer deflate = kMultiBlockDeflate;
+  Puffer puffer;
+  vector<ByteExtent> puffs;
+  uint64_t puff_size;
+  BitExtent extent(0, deflate.size() * 8);
+  ASSERT_TRUE(FindPuffLocations(MemoryStream::CreateForRead(deflate), {extent},
+                                &puffs, &puff_size));
+  Buffer expected_puff(puff_size);
+  ASSERT_TRUE(PuffDeflateBlocks(puffer, deflate.data(), deflate.size(), extent,
+                                expected_puff.data(), expected_puff.size()));
+
+  // The index from |FindDeflateSubBlocks| does not have the stored block.
+  vector<BitExtent> sub_blocks;
+  ASSERT_TRUE(FindDeflateSubBlocks(MemoryStream::CreateForRead(deflate),
+                                   {{0, deflate.size()}}, &sub_blocks));
+  ASSERT_GT(sub_blocks.size(), 2u);
+  for (size_t num_threads : {1, 2, 4}) {
+    Buffer puff;
+    ASSERT_TRUE(
+        PuffDeflateInParallel(deflate, sub_blocks, &puff, num_threads));
+    EXPECT_EQ(puff, expected_puff);
+  }
+
+  // Block boundaries which are not in order are rejected.
+  std::swap(sub_blocks[0], sub_blocks[1]);
+  Buffer puff;
+  EXPECT_FALSE(PuffDeflateInParallel(deflate, sub_blocks, &puff, 2));
+}
+
+TEST(UtilsTest, LocateDeflatesInDeflateStreamInParallelTest) {
+  // Many dynamic blocks, with a large run of stored blocks of zeros in the
+  // middle where no block start can be guessed.
+  Buffer deflate;
+  for (size_t idx = 0; idx < 20000; idx++) {
+    deflate.insert(deflate.end(), std::begin(kDynamicBlockAndFlush),
+                   std::end(kDynamicBlockAndFlush));
+    if (idx == 10000) {
+      for (size_t stored_idx = 0; stored_idx < 20; stored_idx++) {
+        deflate.insert(deflate.end(), {0x00, 0xFF, 0xFF, 0x00, 0x00});
+        deflate.resize(deflate.size() + 0xFFFF);
+      }
+    }
+  }
+  // The final block is an empty fixed Huffman block.
+  deflate.insert(deflate.end(), {0x03, 0x00});
+
+  vector<BitExtent> expected_deflates;
+  uint64_t expected_size;
+  ASSERT_TRUE(LocateDeflatesInDeflateStream(deflate.data(), deflate.size(), 5,
+                                            &expected_deflates,
+                                            &expected_size));
+  EXPECT_EQ(expected_size, deflate.size());
+  for (size_t num_threads : {1, 2, 8}) {
+    vector<BitExtent> deflates;
+    uint64_t compressed_size;
+    ASSERT_TRUE(LocateDeflatesInDeflateStream(deflate.data(), deflate.size(),
+                                              5, &deflates, &compressed_size,
+                                              num_threads));
+    EXPECT_EQ(deflates, expected_deflates);
+    EXPECT_EQ(compressed_size, expected_size);
+  }
+
+  // The same with trailing data after the final block.
+  deflate.resize(deflate.size() + 100000, 0xAB);
+  vector<BitExtent> deflates;
+  uint64_t compressed_size;
+  ASSERT_TRUE(LocateDeflatesInDeflateStream(
+      deflate.data(), deflate.size(), 5, &deflates, &compressed_size, 4));
+  EXPECT_EQ(deflates, expected_deflates);
+  EXPECT_EQ(compressed_size, expected_size);
+
+  // A broken block header fails the same way as without threads.
+  deflate[sizeof(kDynamicBlockAndFlush) * 5000 + 1] ^= 0x55;
+  EXPECT_FALSE(LocateDeflatesInDeflateStream(deflate.data(), deflate.size(), 5,
+                                             &deflates, &compressed_size));
+  EXPECT_FALSE(LocateDeflatesInDeflateStream(
+      deflate.data(), deflate.size(), 5, &deflates, &compressed_size, 4));
+}
+
 TEST(UtilsTest, LocateDeflatesInZlib) {
   Buffer zlib_data(kZlibEntry, std::end(kZlibEntry));
   vector<BitExtent> deflates;
@@ -186,6 +591,232 @@ TEST(UtilsTest, LocateDeflatesInZipArchiveErrorChecks) {
   EXPECT_TRUE(deflates_incomplete.empty());
 }
 
+TEST(UtilsTest, LocateDeflatesInZipArchiveCentralDirectory) {
+  vector<BitExtent> expected_deflates = {{408, 62}, {968, 114}};
+  for (const auto& archive : {Buffer(kZipArchive, std::end(kZipArchive)),
+                              Buffer(kZip64Archive, std::end(kZip64Archive))}) {
+    for (size_t num_threads : {1, 4}) {
+      vector<BitExtent> deflates;
+      EXPECT_TRUE(LocateDeflatesInZipArchive(archive, &deflates, num_threads));
+      EXPECT_EQ(deflates, expected_deflates);
+    }
+  }
+
+  // The offsets in the archive are relative to its start.
+  Buffer prefixed_archive(10, 0);
+  prefixed_archive.insert(prefixed_archive.end(), std::begin(kZipArchive),
+                          std::end(kZipArchive));
+  vector<BitExtent> deflates;
+  EXPECT_TRUE(LocateDeflatesInZipArchive(prefixed_archive, &deflates));
+  expected_deflates = {{488, 62}, {1048, 114}};
+  EXPECT_EQ(deflates, expected_deflates);
+}
+
+TEST(UtilsTest, LocateDeflatesInZipArchiveDamagedCentralDirectory) {
+  Buffer archive(kZipArchive, std::end(kZipArchive));
+  // Break the signature of the first central directory header. Scanning the
+  // archive instead misses the first entry, because the sizes in its local
+  // file header are not valid.
+  archive[205] = 0;
+  vector<BitExtent> deflates;
+  vector<BitExtent> expected_deflates = {{968, 114}};
+  EXPECT_TRUE(LocateDeflatesInZipArchive(archive, &deflates));
+  EXPECT_EQ(deflates, expected_deflates);
+}
+
+TEST(UtilsTest, LocateDeflatesInNestedContainers) {
+  Buffer zip_archive(kZipArchive, std::end(kZipArchive));
+  vector<BitExtent> expected_deflates = {{408, 62}, {968, 114}};
+  for (size_t max_depth : {0, 1, 2}) {
+    vector<BitExtent> deflates;
+    EXPECT_TRUE(
+        LocateDeflatesInZipArchive(zip_archive, &deflates, 4, max_depth));
+    EXPECT_EQ(deflates, expected_deflates);
+  }
+
+  // A tar archive with a gzip file and a zip archive. The files are at 512 and
+  // 1536.
+  Buffer tar;
+  AppendTarFile(Buffer(kGzipEntryWithMultipleMembers,
+                       std::end(kGzipEntryWithMultipleMembers)),
+                &tar);
+  AppendTarFile(zip_archive, &tar);
+  tar.resize(tar.size() + 1024);
+  vector<BitExtent> deflates;
+  EXPECT_TRUE(LocateDeflatesInTar(tar, &deflates, 1, 0));
+  EXPECT_TRUE(deflates.empty());
+  expected_deflates = {{4256, 98}, {4584, 98}, {12696, 62}, {13256, 114}};
+  EXPECT_TRUE(LocateDeflatesInTar(tar, &deflates, 1, 1));
+  EXPECT_EQ(deflates, expected_deflates);
+
+  // A broken nested container is skipped.
+  tar[512 + 61] |= 0x06;
+  expected_deflates = {{12696, 62}, {13256, 114}};
+  deflates.clear();
+  EXPECT_TRUE(LocateDeflatesInTar(tar, &deflates, 1, 1));
+  EXPECT_EQ(deflates, expected_deflates);
+}
+
+TEST(UtilsTest, LocateNestedDeflateStreams) {
+  // A deflate stream of a tar archive with a zip archive, and one of text,
+  // after 16 other bytes.
+  Buffer tar;
+  AppendTarFile(Buffer(kZipArchive, std::end(kZipArchive)), &tar);
+  tar.resize(tar.size() + 1024);
+  Buffer tar_deflate, text_deflate;
+  ASSERT_TRUE(FixedHuffmanDeflate(tar, &tar_deflate));
+  ASSERT_TRUE(FixedHuffmanDeflate(Buffer(100, 'a'), &text_deflate));
+  Buffer data(16, 0);
+  data.insert(data.end(), tar_deflate.begin(), tar_deflate.end());
+  data.insert(data.end(), text_deflate.begin(), text_deflate.end());
+  vector<BitExtent> deflates;
+  ASSERT_TRUE(LocateDeflatesInDeflateStream(
+      tar_deflate.data(), tar_deflate.size(), 16, &deflates, nullptr));
+  ASSERT_TRUE(LocateDeflatesInDeflateStream(text_deflate.data(),
+                                            text_deflate.size(),
+                                            16 + tar_deflate.size(), &deflates,
+                                            nullptr));
+  ASSERT_EQ(deflates.size(), 2);
+
+  // The zip archive is two levels below |data|.
+  for (size_t max_depth : {0, 1}) {
+    vector<BitExtent> streams;
+    EXPECT_TRUE(LocateNestedDeflateStreams(data.data(), data.size(), deflates,
+                                           2, max_depth, &streams));
+    EXPECT_TRUE(streams.empty());
+  }
+  vector<BitExtent> streams;
+  EXPECT_TRUE(LocateNestedDeflateStreams(data.data(), data.size(), deflates, 2,
+                                         2, &streams));
+  ASSERT_EQ(streams, vector<BitExtent>{deflates[0]});
+
+  // The nested image is the puff followed by the tar archive, and is huffed
+  // back into the stream.
+  Buffer image, rebuilt;
+  uint64_t length, puff_size;
+  ASSERT_TRUE(CreateNestedImage(data.data(), data.size(), streams[0].offset,
+                                &length, &image, &puff_size));
+  EXPECT_EQ(length, streams[0].length);
+  EXPECT_EQ(Buffer(image.begin() + puff_size, image.end()), tar);
+  ASSERT_TRUE(
+      HuffNestedImage(image.data(), image.size(), puff_size, length, &rebuilt));
+  EXPECT_EQ(rebuilt, tar_deflate);
+
+  // Any literal in the puff would be read from the uncompressed data.
+  image.pop_back();
+  EXPECT_FALSE(
+      HuffNestedImage(image.data(), image.size(), puff_size, length, &rebuilt));
+}
+
+TEST(UtilsTest, LocateDeflatesByCarving) {
+  // Pseudo random data with the streams at known offsets. The zlib stream
+  // crosses the boundary of the first 1MB chunk, and the gzip member with an
+  // extra field is too short to be carved.
+  Buffer data(3 * 1024 * 1024);
+  uint32_t state = 1;
+  for (auto& byte : data) {
+    state = state * 1103515245 + 12345;
+    byte = state >> 24;
+  }
+  std::copy(std::begin(kCarvingGzip), std::end(kCarvingGzip),
+            data.begin() + 1000);
+  std::copy(std::begin(kCarvingZlib), std::end(kCarvingZlib),
+            data.begin() + 1024 * 1024 - 40);
+  std::copy(std::begin(kGzipEntryWithExtraField),
+            std::end(kGzipEntryWithExtraField), data.begin() + 2 * 1024 * 1024);
+
+  vector<BitExtent> expected_deflates = {{8080, 610}, {8388304, 695}};
+  for (size_t num_threads : {1, 4}) {
+    vector<BitExtent> deflates;
+    EXPECT_TRUE(LocateDeflatesByCarving(data, &deflates, num_threads));
+    EXPECT_EQ(deflates, expected_deflates);
+  }
+
+  // A gzip member with the right size but the wrong CRC-32 is not carved.
+  data[1000 + sizeof(kCarvingGzip) - 8] ^= 1;
+  expected_deflates = {{8388304, 695}};
+  vector<BitExtent> deflates;
+  EXPECT_TRUE(LocateDeflatesByCarving(data, &deflates, 1));
+  EXPECT_EQ(deflates, expected_deflates);
+}
+
+TEST(UtilsTest, LocateDeflatesInPng) {
+  Buffer image(std::begin(kPngImage), std::end(kPngImage));
+  vector<BitExtent> deflates;
+  EXPECT_TRUE(LocateDeflatesInPng(image, &deflates));
+  vector<BitExtent> expected_deflates = {{344, 235}, {984, 235}};
+  EXPECT_EQ(deflates, expected_deflates);
+
+  // Truncated in the middle of a chunk.
+  image.resize(100);
+  EXPECT_FALSE(LocateDeflatesInPng(image, &deflates));
+}
+
+TEST(UtilsTest, LocateDeflatesInPdf) {
+  Buffer pdf;
+  auto append = [&pdf](const string& text) {
+    pdf.insert(pdf.end(), text.begin(), text.end());
+  };
+  append("%PDF-1.7\n1 0 obj\n<< /Length 19 /Filter /FlateDecode >>\nstream\n");
+  pdf.insert(pdf.end(), std::begin(kZlibEntry), std::end(kZlibEntry));
+  // The length is an indirect object, and the stream dictionary has a nested
+  // dictionary.
+  append(
+      "\nendstream\nendobj\n2 0 obj\n<< /Filter [/FlateDecode] /DecodeParms "
+      "<< /Predictor 12 >> /Length 3 0 R >>\r\nstream\r\n");
+  pdf.insert(pdf.end(), std::begin(kCarvingZlib), std::end(kCarvingZlib));
+  // Streams that are not compressed with FlateDecode, or not last.
+  append(
+      "\r\nendstream\nendobj\n3 0 obj\n93\nendobj\n4 0 obj\n<< /Length 19 "
+      "/Filter /FlateDecodeX >>\nstream\n");
+  pdf.insert(pdf.end(), std::begin(kZlibEntry), std::end(kZlibEntry));
+  append(
+      "\nendstream\nendobj\n5 0 obj\n<< /Length 19 /Filter [/ASCII85Decode "
+      "/FlateDecode] >>\nstream\n");
+  pdf.insert(pdf.end(), std::begin(kZlibEntry), std::end(kZlibEntry));
+  append("\nendstream\nendobj\n%%EOF\n");
+
+  vector<BitExtent> expected_deflates = {{512, 98}, {1552, 695}};
+  for (size_t num_threads : {1, 4}) {
+    vector<BitExtent> deflates;
+    EXPECT_TRUE(LocateDeflatesInPdf(pdf, &deflates, num_threads));
+    EXPECT_EQ(deflates, expected_deflates);
+  }
+}
+
+TEST(UtilsTest, LocateDeflatesInElf) {
+  Buffer elf(std::begin(kElfFile), std::end(kElfFile));
+  vector<BitExtent> expected_deflates = {{720, 251}, {1120, 251}};
+  for (size_t num_threads : {1, 4}) {
+    vector<BitExtent> deflates;
+    EXPECT_TRUE(LocateDeflatesInElf(elf, &deflates, num_threads));
+    EXPECT_EQ(deflates, expected_deflates);
+  }
+
+  // The section headers are at the end of the file.
+  elf.resize(elf.size() - 1);
+  vector<BitExtent> deflates;
+  EXPECT_FALSE(LocateDeflatesInElf(elf, &deflates, 1));
+}
+
+TEST(UtilsTest, LocateDeflatesInSquashfs) {
+  Buffer image(std::begin(kSquashfsImage), std::end(kSquashfsImage));
+  // The data block of "a", the fragment block, and the metadata blocks of the
+  // inode, directory and fragment tables.
+  vector<BitExtent> expected_deflates = {
+      {784, 624}, {1584, 773}, {2424, 579}, {3072, 217}, {3360, 60}};
+  for (size_t num_threads : {1, 4}) {
+    vector<BitExtent> deflates;
+    EXPECT_TRUE(LocateDeflatesInSquashfs(image, &deflates, num_threads));
+    EXPECT_EQ(deflates, expected_deflates);
+  }
+
+  // Only gzip compression is supported.
+  image[20] = 2;
+  vector<BitExtent> deflates;
+  EXPECT_FALSE(LocateDeflatesInSquashfs(image, &deflates, 1));
+}
+
 TEST(UtilsTest, LocateDeflatesInGzip) {
   Buffer gzip_data(kGzipEntryWithMultipleMembers,
                    std::end(kGzipEntryWithMultipleMembers));
@@ -213,6 +844,26 @@ TEST(UtilsTest, LocateDeflatesInGzipWithPadding) {
   EXPECT_EQ(deflates, expected_deflates);
 }
 
+TEST(UtilsTest, LocateDeflatesInMemoryRange) {
+  // The offsets are relative to the given pointer, not to the buffer.
+  Buffer data(100, 0);
+  data.insert(data.end(), std::begin(kGzipEntryWithMultipleMembers),
+              std::end(kGzipEntryWithMultipleMembers));
+  vector<BitExtent> deflates;
+  vector<BitExtent> expected_deflates = {{160, 98}, {488, 98}};
+  EXPECT_TRUE(LocateDeflatesInGzip(data.data() + 100, data.size() - 100,
+                                   &deflates, 1));
+  EXPECT_EQ(deflates, expected_deflates);
+
+  data.resize(100);
+  data.insert(data.end(), std::begin(kZipArchive), std::end(kZipArchive));
+  deflates.clear();
+  expected_deflates = {{408, 62}, {968, 114}};
+  EXPECT_TRUE(LocateDeflatesInZipArchive(data.data() + 100, data.size() - 100,
+                                         &deflates, 1, 0));
+  EXPECT_EQ(deflates, expected_deflates);
+}
+
 TEST(UtilsTest, LocateDeflatesInGzipWithExtraField) {
   Buffer gzip_data(kGzipEntryWithExtraField,
                    std::end(kGzipEntryWithExtraField));
@@ -222,6 +873,76 @@ TEST(UtilsTest, LocateDeflatesInGzipWithExtraField) {
   EXPECT_EQ(deflates, expected_deflates);
 }
 
+TEST(UtilsTest, LocateDeflatesInBgzf) {
+  Buffer bgzf(std::begin(kBgzfFile), std::end(kBgzfFile));
+  vector<BitExtent> expected_deflates = {{144, 171}, {528, 180}, {920, 10}};
+  for (size_t num_threads : {1, 4}) {
+    vector<BitExtent> deflates;
+    EXPECT_TRUE(LocateDeflatesInGzip(bgzf, &deflates, num_threads));
+    EXPECT_EQ(deflates, expected_deflates);
+  }
+
+  // With a wrong member size, the members are found by parsing them instead.
+  bgzf[16]++;
+  vector<BitExtent> deflates;
+  EXPECT_TRUE(LocateDeflatesInGzip(bgzf, &deflates, 4));
+  EXPECT_EQ(deflates, expected_deflates);
+}
+
+TEST(UtilsTest, LocateDeflatesInParallel) {
+  // Repeat the samples a few times, so there are more entries and members than
+  // threads.
+  Buffer zip_data, gzip_data;
+  for (int idx = 0; idx < 5; idx++) {
+    zip_data.insert(zip_data.end(), std::begin(kZipEntries),
+                    std::end(kZipEntries));
+    zip_data.insert(zip_data.end(), std::begin(kZipEntryWithDataDescriptor),
+                    std::end(kZipEntryWithDataDescriptor));
+    gzip_data.insert(gzip_data.end(), std::begin(kGzipEntryWithMultipleMembers),
+                     std::end(kGzipEntryWithMultipleMembers));
+    gzip_data.insert(gzip_data.end(), std::begin(kGzipEntryWithExtraField),
+                     std::end(kGzipEntryWithExtraField));
+  }
+  // An invalid entry that is skipped.
+  zip_data[29] = 0xff;
+
+  vector<BitExtent> expected_deflates, deflates;
+  EXPECT_TRUE(LocateDeflatesInZipArchive(zip_data, &expected_deflates));
+  EXPECT_EQ(expected_deflates.size(), 19u);
+  for (size_t num_threads : {2, 4, 16}) {
+    deflates.clear();
+    EXPECT_TRUE(LocateDeflatesInZipArchive(zip_data, &deflates, num_threads));
+    EXPECT_EQ(deflates, expected_deflates);
+  }
+
+  // A member with a stored block that looks like the header of another member.
+  // It is only parsed up to that header speculatively, so it is parsed again.
+  // Its deflate is not located, as it has no compressed blocks.
+  const uint8_t kMemberWithHeader[] = {
+      0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0x01,
+      0x04, 0x00, 0xfb, 0xff, 0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00,
+      0x00, 0x00, 0x00, 0x00, 0x00};
+  gzip_data.insert(gzip_data.end(), std::begin(kMemberWithHeader),
+                   std::end(kMemberWithHeader));
+  gzip_data.insert(gzip_data.end(), std::begin(kGzipEntryWithExtraField),
+                   std::end(kGzipEntryWithExtraField));
+
+  expected_deflates.clear();
+  EXPECT_TRUE(LocateDeflatesInGzip(gzip_data, &expected_deflates));
+  EXPECT_EQ(expected_deflates.size(), 16u);
+  for (size_t num_threads : {2, 4, 16}) {
+    deflates.clear();
+    EXPECT_TRUE(LocateDeflatesInGzip(gzip_data, &deflates, num_threads));
+    EXPECT_EQ(deflates, expected_deflates);
+  }
+
+  // A broken member in the middle fails the whole stream. Set the block type
+  // of the deflate in the second member to the reserved value.
+  gzip_data[61] |= 0x06;
+  EXPECT_FALSE(LocateDeflatesInGzip(gzip_data, &deflates));
+  EXPECT_FALSE(LocateDeflatesInGzip(gzip_data, &deflates, 4));
+}
+
 TEST(UtilsTest, RemoveEqualBitExtents) {
   Buffer data1 = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
   Buffer data2 = {1, 2, 3, 4, 5, 5, 6, 7, 8, 9};
@@ -240,6 +961,34 @@ TEST(UtilsTest, RemoveEqualBitExtents) {
   RemoveEqualBitExtents(data1, data2, &ext1, &ext2);
   EXPECT_EQ(expected_ext1, ext1);
   EXPECT_EQ(expected_ext2, ext2);
+
+  // Extents at a different bit alignment are equal if the bytes inside of
+  // both of them are.
+  data1 = {0xFF, 1, 2, 3, 4, 0xFF, 5, 6, 7, 8, 9, 10, 11, 99, 13};
+  data2 = {1, 2, 3, 4, 0xAA, 5, 6, 7, 8, 9, 10, 11, 12, 14};
+  ext1 = {{4, 40}, {44, 64}, {48, 64}};
+  ext2 = {{0, 40}, {40, 64}, {41, 64}};
+  RemoveEqualBitExtents(data1, data2, &ext1, &ext2);
+  expected_ext1 = {{48, 64}};
+  EXPECT_EQ(expected_ext1, ext1);
+  expected_ext2 = {{41, 64}};
+  EXPECT_EQ(expected_ext2, ext2);
+
+  // Many extents with the same data.
+  Buffer data(1000);
+  for (size_t idx = 0; idx < data.size(); idx++) {
+    data[idx] = idx % 10;
+  }
+  ext1.clear();
+  ext2.clear();
+  for (uint64_t offset = 0; offset + 80 <= data.size() * 8; offset += 80) {
+    ext1.emplace_back(offset, 80);
+    ext2.emplace_back(offset, 79);
+  }
+  ext2.emplace_back(0, 80);
+  RemoveEqualBitExtents(data, data, &ext1, &ext2);
+  EXPECT_TRUE(ext1.empty());
+  EXPECT_EQ(ext2.size(), 100u);
 }
 
 TEST(UtilsTest, RemoveDeflatesWithBadDistanceCaches) {
@@ -278,4 +1027,30 @@ TEST(UtilsTest, RemoveDeflatesWithBadDistanceCaches) {
   EXPECT_EQ(deflates, expected_deflates);
 }
 
+TEST(UtilsTest, ParallelForTest) {
+  EXPECT_GE(GetDefaultNumThreads(), 1u);
+  for (size_t num_threads : {1, 2, 8}) {
+    // Every task runs exactly once.
+    vector<uint8_t> counts(1000, 0);
+    EXPECT_TRUE(ParallelFor(counts.size(), num_threads, [&counts](size_t idx) {
+      counts[idx]++;
+      return true;
+    }));
+    EXPECT_EQ(counts, vector<uint8_t>(counts.size(), 1));
+
+    // No tasks at all.
+    EXPECT_TRUE(ParallelFor(0, num_threads, [](size_t) { return false; }));
+
+    // A failing task fails the whole run and stops handing out new tasks.
+    std::atomic<size_t> num_runs(0);
+    EXPECT_FALSE(ParallelFor(1000, num_threads, [&num_runs](size_t idx) {
+      num_runs++;
+      return idx != 10;
+    }));
+    if (num_threads == 1) {
+      EXPECT_EQ(num_runs.load(), 11u);
+    }
+  }
+}
+
 }  // namespace puffin